@@ -1,26 +1,61 @@
 #pragma once
 
+// sendmmsg(), recvmmsg() and the other Linux extensions
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
 #include <sys/time.h>
 #include <netinet/ip.h>
 #include <float.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/random.h>
 
 #include "icmphdr.h"
+#include "ping_record.h"
+#include "ping_shm.h"
+#include "ping_log.h"
+#include "ping_service.h"
 
-// Buffer to receive ICMP packets
+// Smallest buffer to receive ICMP packets, enlarged to hold a reply to the largest probes
 #define RECV_BUF_SIZE 1024
 
+// Largest IPv4 header, options included
+#define MAX_IP_HEADER_SIZE 60
+
 // A reasonable default TTL could be 64
 // It allows the packet to traverse 64 routers before being discarded
 #define DEFAULT_TTL 64
@@ -29,36 +64,685 @@
 // It's the size of a typical Ethernet packet
 #define DEFAULT_PACKET_SIZE 56
 
-// Simple linked list for storing round trip times
-typedef struct trip_node_s
+// Default interval between two probes, in nanoseconds (1 second)
+#define DEFAULT_INTERVAL_NS 1000000000UL
+
+// Smallest interval accepted by -i, in nanoseconds (1 microsecond)
+#define MIN_INTERVAL_NS 1000UL
+
+// Default time after which an unanswered probe is considered lost (1 second)
+#define DEFAULT_TIMEOUT_NS 1000000000UL
+
+// Number of instructions of the BPF program keeping the replies of an engine
+#define REPLY_FILTER_LENGTH 22
+
+// Memory-mapped receive ring of the --packet-ring backend: blocks are handed back and
+// forth with the kernel, which retires a partially filled block after the timeout
+#define PACKET_RING_BLOCK_SIZE (1 << 18)
+#define PACKET_RING_BLOCK_COUNT 16
+#define PACKET_RING_FRAME_SIZE 2048
+#define PACKET_RING_BLOCK_TIMEOUT_MS 1
+
+// io_uring backend: submission queue entries (a send batch and the receive), completion
+// queue entries (every provided buffer in use and a send batch), and provided receive buffers
+#define URING_SQ_ENTRIES 128
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFER_COUNT 1024
+
+// Output buffer of each engine in the machine-readable formats, flushed when it holds
+// OUTPUT_FLUSH_SIZE bytes or its oldest record waited OUTPUT_FLUSH_NS (100 ms)
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_FLUSH_SIZE (1 << 16)
+#define OUTPUT_FLUSH_NS 100000000UL
+
+// Metrics endpoint of --metrics: address it listens on when only a port is given, clients
+// served at once, largest request accepted, and targets formatted per event loop iteration,
+// so that a scrape never stalls the probes
+#define DEFAULT_METRICS_ADDRESS "127.0.0.1"
+#define METRICS_MAX_CLIENTS 8
+#define METRICS_REQUEST_SIZE 4096
+#define METRICS_CHUNK_TARGETS 64
+
+// Ping service of --serve: clients connected at once, and checks running at once, each one
+// taking the target of the same index
+#define SERVICE_MAX_CLIENTS 256
+#define SERVICE_MAX_CHECKS 16384
+
+// Resolution of the hostnames: name servers read from resolv.conf, queries in flight per
+// resolver, time before a query is sent again and tries per name, shortest lifetime of a
+// cached address, largest DNS message over UDP, queries over TCP at once per resolver, for
+// the answers truncated over UDP, and search domains tried for the names without a dot,
+// as many as the C library reads
+#define DNS_RESOLV_CONF "/etc/resolv.conf"
+#define DNS_HOSTS_FILE "/etc/hosts"
+#define DNS_PORT 53
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_QUERIES 256
+#define DNS_RETRY_NS 1000000000UL
+#define DNS_TRIES 3
+#define DNS_MIN_TTL_NS 5000000000UL
+#define DNS_PACKET_SIZE 512
+#define DNS_MAX_STREAMS 16
+#define DNS_MAX_SEARCH 6
+#define DNS_NAME_SIZE 256
+
+// Live statistics of --shm: longest time between a change of a target and its publication
+#define SHM_PUBLISH_NS 100000000UL
+
+// Round trip time log of --rtt-log: bytes of compressed samples of a block, longest time
+// a block spans (10 minutes), which bounds what a killed run loses, and blocks listed
+// by each index record
+#define RTT_LOG_BLOCK_SIZE 2048
+#define RTT_LOG_BLOCK_US 600000000UL
+#define RTT_LOG_INDEX_BLOCKS 64
+
+// Reply events queued between the receiver and the consumer thread of --pipeline, a power of two
+#define PIPELINE_RING_SIZE 65536
+
+// Number of slots of the in-flight ring, one per 16-bit ICMP sequence number
+#define PROBE_RING_SIZE 65536
+
+// Timing wheel geometry: 4 levels of 256 slots, the first one ticking every 100 microseconds,
+// so that the last level spans about 5 days
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_TICK_NS 100000UL
+
+// Number of messages per sendmmsg() and recvmmsg() call
+#define SEND_BATCH_SIZE 64
+#define RECV_BATCH_SIZE 64
+
+// Period of the pacing timer in rate and flood modes, in nanoseconds (100 microseconds)
+#define PACING_TICK_NS 100000UL
+
+// Adaptive mode: smallest margin added to the smoothed round trip time before the probes
+// of a target are presumed lost (1 millisecond), and default number of probes kept in flight
+#define ADAPTIVE_MIN_MARGIN_NS 1000000UL
+#define DEFAULT_PRELOAD 1
+
+// Precise pacing of --pacing: longest run of probes sent while spinning before going back
+// to the event loop (1 millisecond), time left before a probe below which the replies are
+// not read while spinning (10 microseconds), how far ahead probes are handed to the kernel
+// with their transmit time (500 microseconds), and the sleeps measuring the wake-up
+// lateness the spin covers
+#define PACING_SPIN_BUDGET_NS 1000000UL
+#define PACING_RECEIVE_SLACK_NS 10000UL
+#define PACING_TXTIME_LEAD_NS 500000UL
+#define PACING_CALIBRATION_ROUNDS 32
+#define PACING_CALIBRATION_SLEEP_NS 50000UL
+
+// Low-latency mode: time the receives spin on the device queue (50 microseconds), SCHED_FIFO
+// priority with --realtime, below the threaded interrupt handlers that deliver the replies,
+// and length of the alternating default and low-latency phases of --compare (250 milliseconds)
+#define LOW_LATENCY_BUSY_POLL_US 50
+#define LOW_LATENCY_PRIORITY 49
+#define LOW_LATENCY_PHASE_NS 250000000UL
+
+// Path MTU discovery of --pmtu: sizes probed at once per round, smallest IPv4 MTU, rounds
+// after which a target gives up, and how long a round waits for its other probes once one
+// got through: 4 times its round trip time, at least 10 milliseconds
+#define PMTU_PROBES 16
+#define PMTU_MIN_SIZE 68
+#define PMTU_MAX_ROUNDS 32
+#define PMTU_GRACE_RTTS 4
+#define PMTU_MIN_GRACE_NS 10000000UL
+
+// Default number of probes in flight in flood mode
+#define DEFAULT_FLOOD_WINDOW 1024
+
+// Socket buffer size requested in rate and flood modes
+#define FLOOD_SOCKET_BUFFER (8 * 1024 * 1024)
+
+// Size of a cache line, engines are aligned on it so that their threads do not share one
+#define CACHE_LINE_SIZE 64
+
+// Number of events handled per epoll_wait() call
+#define MAX_EVENTS 8
+
+// Relative precision of the round trip time histogram is 2^-RTT_PRECISION_BITS
+#define RTT_PRECISION_BITS 5
+
+// Number of histogram buckets, covering round trip times up to 2^36 ns (about 68 seconds)
+#define RTT_HISTOGRAM_BUCKETS 1024
+
+// Loss and reordering analytics: the sliding bitmap of the replies received covers the
+// last 1024 sequences of a target, older ones are settled as received or lost, and the
+// histograms of the burst lengths and reorder extents have power-of-two buckets, 1, 2,
+// 3-4, ... 16385-32768, then longer
+#define SEQUENCE_WINDOW_BITS 1024
+#define SEQUENCE_WINDOW_WORDS (SEQUENCE_WINDOW_BITS / 64)
+#define SEQUENCE_HISTOGRAM_BUCKETS 17
+
+// Streaming round trip time statistics, in constant memory
+typedef struct
+{
+    uint64_t count;                            // number of round trip times recorded
+    uint64_t min_ns;                           // minimum round trip time
+    uint64_t max_ns;                           // maximum round trip time
+    double mean_ns;                            // running mean (Welford)
+    double m2_ns;                              // running sum of squared deviations (Welford)
+    uint32_t histogram[RTT_HISTOGRAM_BUCKETS]; // log-linear histogram of the round trip times
+} rtt_stats_t;
+
+// Streaming loss, reordering and jitter analytics of a target, in constant memory
+typedef struct
+{
+    uint64_t window[SEQUENCE_WINDOW_WORDS];           // replies received, bit s % SEQUENCE_WINDOW_BITS for sequence s
+    uint32_t window_start;                            // oldest sequence not settled yet
+    uint32_t highest;                                 // newest sequence received
+    uint64_t replies;                                 // replies accounted
+    uint32_t current_burst;                           // losses in a row settled so far
+    uint32_t max_burst;                               // longest burst of losses
+    uint64_t bursts;                                  // bursts of losses
+    uint64_t burst_losses;                            // losses in the bursts, settled losses
+    uint32_t burst_histogram[SEQUENCE_HISTOGRAM_BUCKETS];
+    uint64_t reordered;                               // replies older than the newest one received
+    uint32_t max_extent;                              // largest distance to the newest sequence received
+    uint64_t extent_sum;                              // distances of the reordered replies, summed
+    uint32_t extent_histogram[SEQUENCE_HISTOGRAM_BUCKETS];
+    uint64_t overruns;                                // replies older than the window, settled as lost
+    double jitter_ns;                                 // interarrival jitter (RFC 3550)
+    uint64_t last_rtt_ns;                             // round trip time of the previous reply
+} sequence_stats_t;
+
+// Timestamp and sequence written at the start of the payload of each echo request,
+// so that a reply can be timed even after its slot in the ring was recycled
+typedef struct
+{
+    uint32_t sequence;        // engine-wide sequence number of the probe
+    uint32_t target;          // index of the probed target
+    uint32_t target_sequence; // rank of the probe among those sent to its target
+    uint32_t nonce;           // random per process, tells our replies from those of a process with our id
+    uint64_t send_time;       // monotonic send time in nanoseconds
+} probe_stamp_t;
+
+// Lifecycle of a probe in the in-flight ring
+typedef enum
+{
+    PROBE_FREE,     // slot never used
+    PROBE_PENDING,  // sent, waiting for its reply
+    PROBE_ANSWERED, // reply or ICMP error received
+    PROBE_EXPIRED   // no reply within the timeout
+} probe_state_t;
+
+// Slot of the in-flight ring, indexed by sequence number
+typedef struct
+{
+    uint64_t send_time;        // monotonic send time in nanoseconds
+    uint64_t kernel_send_time; // kernel transmit timestamp (CLOCK_REALTIME), 0 until reported
+    uint32_t sequence;         // engine-wide sequence number of the probe occupying the slot
+    uint32_t target;           // index of the probed target
+    uint32_t target_sequence;  // rank of the probe among those sent to its target
+    probe_state_t state;       // state of that probe
+} probe_slot_t;
+
+// Classification of a reply against the in-flight ring
+typedef enum
+{
+    REPLY_IN_ORDER,     // first reply to a pending probe, no newer probe answered yet
+    REPLY_OUT_OF_ORDER, // first reply to a pending probe, after a newer one was answered
+    REPLY_LATE,         // the probe already expired or its slot was recycled
+    REPLY_DUPLICATE     // the probe was already answered
+} reply_status_t;
+
+// Verdict of the validation of an echo reply against the request it answers
+typedef enum
+{
+    PACKET_VALID,
+    PACKET_BAD_CHECKSUM, // the checksum does not fold to zero
+    PACKET_BAD_CODE,     // the ICMP code is not 0
+    PACKET_TRUNCATED,    // the payload is shorter than the request's
+    PACKET_MISMATCH      // the payload differs from the request's
+} packet_check_t;
+
+// What a reply event reports
+typedef enum
+{
+    EVENT_REPLY,            // an echo reply, with the status of its probe
+    EVENT_ERROR,            // an ICMP error about a probe
+    EVENT_INVALID,          // an echo reply failing validation
+    EVENT_UNEXPECTED_SOURCE // an echo reply from another address than the one probed
+} reply_event_kind_t;
+
+// A reply once timed, matched to its probe and validated by the receiver. Accounting it
+// in the statistics and writing its output is left to account_event().
+typedef struct
+{
+    uint64_t rtt_ns;              // round trip time, or time from the probe to the error
+    int64_t removed_overhead_ns;  // user-space minus kernel round trip time, when kernel timed
+    uint32_t target;              // index of the target
+    uint32_t target_sequence;     // rank of the probe among those sent to the target
+    uint32_t source;              // address the reply came from, network order
+    uint16_t size;                // size of the datagram received
+    uint8_t kind;                 // reply_event_kind_t
+    uint8_t status;               // reply_status_t of a reply, packet_check_t of an invalid one
+    uint8_t type;                 // ICMP type of the message
+    uint8_t code;                 // ICMP code of the message
+    uint8_t ttl;                  // TTL of the message when it arrived, 0 if unknown
+    bool kernel_timed;            // the round trip time comes from kernel timestamps
+    bool low_latency;             // the reply was read in low latency, for --compare
+} reply_event_t;
+
+// Lock-free single-producer single-consumer ring of --pipeline: the engine thread pushes
+// the reply events, a consumer thread accounts them and writes the output, so that a slow
+// output never delays the next receive. Events are dropped, and counted, when it is full.
+typedef struct
+{
+    reply_event_t *events;                                   // PIPELINE_RING_SIZE events
+    uint64_t tail __attribute__((aligned(CACHE_LINE_SIZE))); // next event pushed, written by the engine
+    uint64_t cached_head;                                    // head last read by the engine
+    unsigned long int dropped;                               // events dropped while the ring was full
+    uint64_t head __attribute__((aligned(CACHE_LINE_SIZE))); // next event accounted, written by the consumer
+    bool sleeping __attribute__((aligned(CACHE_LINE_SIZE))); // the consumer waits for the wake descriptor
+    bool stopping;                                           // the consumer returns once the ring is empty
+    int wake_fd;                                             // event descriptor waking the consumer
+    pthread_t thread;                                        // consumer thread
+} pipeline_t;
+
+// Per-target state, kept small and contiguous since every probe touches it.
+// The round trip time statistics live in a parallel array, only touched by replies.
+typedef struct
+{
+    const char *host;                 // hostname or IP address as given
+    char ip_address[INET_ADDRSTRLEN]; // resolved IPv4 address
+    struct sockaddr_in address;       // destination of the probes
+
+    // The address and the counters are stored with relaxed atomics by the engine of the
+    // target, as --metrics reads them from engine 0 meanwhile; so are the statistics read
+    // by --metrics in the parallel rtt and sequences arrays
+    int packets_sent;             // number of packets sent
+    int packets_received;         // number of packets received
+    int late_replies;             // replies received after their probe expired
+    int duplicate_replies;        // replies received more than once
+    int reordered_replies;        // replies received after the reply of a newer probe
+    int lost_probes;              // probes expired without a reply
+    uint32_t highest_answered;    // newest target sequence answered so far
+    int kernel_timed_replies;     // replies timed with kernel timestamps
+    int64_t removed_overhead_ns;  // user-space minus kernel round trip times, summed
+
+    uint64_t next_send_time;      // monotonic time the next probe is due, in interval and adaptive modes
+    int32_t wheel_next;           // next target in the same timing wheel slot, -1 at the end
+    int32_t wheel_prev;           // previous target in the same timing wheel slot, -1 at the start
+    int32_t *wheel_slot;          // timing wheel slot holding the target, NULL when not scheduled
+
+    uint32_t probes_in_flight;    // probes sent and neither answered nor expired, in adaptive mode
+    uint32_t presumed_lost;       // of which presumed lost, no reply came within the adaptive timeout
+    uint32_t presumed_before;     // target sequence below which the probes in flight are presumed lost
+    bool ready;                   // queued to send its next probes after a reply or an expiry
+    uint64_t last_send_time;      // monotonic time the last probe was queued, in adaptive mode
+    uint64_t srtt_ns;             // smoothed round trip time (RFC 6298), 0 before the first reply
+    uint64_t rttvar_ns;           // round trip time variation (RFC 6298)
+} ping_target_t;
+
+// What became of a probe of --pmtu
+typedef enum
+{
+    PMTU_PENDING, // no answer yet
+    PMTU_PASSED,  // echo reply, the size got through
+    PMTU_TOO_BIG, // Fragmentation Needed, or refused by the kernel
+    PMTU_LOST     // no reply in time, or another ICMP error
+} pmtu_outcome_t;
+
+// Path MTU discovery of a target with --pmtu. Sizes are those of the IP packets; each round
+// probes sizes spread over the range still unknown, and narrows it from their outcomes.
+typedef struct
+{
+    uint16_t low;                  // largest size that got through, PMTU_MIN_SIZE - 1 before any
+    uint16_t high;                 // largest size not known to be too big
+    uint16_t suspect;              // size lost in the last round, too big if lost again, 0 if none
+    uint16_t kernel_mtu;           // path MTU the kernel last gave (IP_MTU), 0 without a route
+    uint16_t reported_mtu;         // smallest next-hop MTU of the Fragmentation Needed errors, 0 if none
+    uint16_t sizes[PMTU_PROBES];   // sizes probed in the current round
+    uint8_t outcomes[PMTU_PROBES]; // pmtu_outcome_t of each of them
+    uint32_t first_sequence;       // target sequence of the first probe of the round
+    uint32_t probe_count;          // probes of the round
+    uint32_t pending;              // probes of the round still PMTU_PENDING
+    uint32_t rounds;               // rounds started
+    bool done;                     // the range is down to one size, or the rounds ran out
+} pmtu_state_t;
+
+// Block being compressed for a target of --rtt-log, see ping_log.h
+typedef struct
+{
+    uint8_t *data;                // RTT_LOG_BLOCK_SIZE bytes, NULL before the first sample
+    uint64_t bit_length;          // bits of compressed samples
+    uint32_t count;               // samples in the block
+    uint64_t min_time_us;         // earliest send time of the block
+    uint64_t max_time_us;         // latest send time of the block
+    uint64_t last_time_us;        // send time of the previous sample
+    int64_t last_delta;           // delta between the two previous send times
+    uint64_t last_rtt_ns;         // round trip time of the previous sample
+    unsigned int leading;         // leading zeros of the window of meaningful XOR bits
+    unsigned int window_length;   // bits of the window, 0 before the first XOR
+} rtt_log_series_t;
+
+// Scheduling of the probes of --pacing
+typedef enum
 {
-    double trip_time; // time in milliseconds
-    struct trip_node_s *next;
-} trip_node_t;
+    PACING_NONE,   // default scheduling, no report of the send gaps
+    PACING_TIMER,  // default scheduling, with the report of the send gaps
+    PACING_SPIN,   // sleep until shortly before each probe, then spin until its time
+    PACING_TXTIME  // hand the probes ahead of time to the kernel with their transmit time (SO_TXTIME)
+} pacing_mode_t;
+
+// Format of the reply lines
+typedef enum
+{
+    FORMAT_TEXT,   // human-readable lines, in the style of ping
+    FORMAT_JSONL,  // one JSON object per line
+    FORMAT_BINARY  // fixed-size records, see ping_record.h
+} output_format_t;
+
+// Hierarchical timing wheel scheduling the targets in interval and adaptive modes.
+// Level l holds the targets due within 256^(l + 1) ticks, in the slot given by
+// the l-th byte of their due tick; slots are cascaded to the level below as time advances.
+// Slots are doubly linked lists, so that a target can be moved to another time.
+typedef struct
+{
+    uint64_t current_tick;                       // last tick processed
+    int32_t slots[WHEEL_LEVELS][WHEEL_SLOTS];    // first target of each slot, -1 when empty
+    uint32_t scheduled;                          // number of targets in the wheel
+} timing_wheel_t;
+
+// An io_uring instance, driven with the raw system calls.
+// Replies are read by a multishot receive into a ring of provided buffers, and send
+// batches are submitted as linked chains, so that a failure stops the rest like sendmmsg().
+typedef struct
+{
+    int fd;                                  // io_uring file descriptor
+    unsigned int *sq_head;                   // submission queue, shared with the kernel
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;                   // completion queue, shared with the kernel
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffer_ring;   // provided buffers, shared with the kernel
+    char *buffers;                           // memory of the provided buffers
+    size_t buffer_size;                      // size of each provided buffer
+    struct msghdr recv_message;              // name and control lengths of the multishot receive
+    bool receiving;                          // the multishot receive is armed
+
+    struct io_uring_cqe pending[URING_BUFFER_COUNT + 1]; // receive completions met while waiting for sends
+    unsigned int pending_count;
+    int send_results[SEND_BATCH_SIZE];       // results of the sends of the last batch
+} io_uring_t;
+
+// A connection to the metrics endpoint: its request is read, then its response is built
+// and written a chunk at a time, as the socket takes it, without blocking the event loop
+typedef struct
+{
+    int fd;                                // connected socket, -1 when the slot is free
+    uint64_t accept_time;                  // monotonic time the connection was accepted
+    char request[METRICS_REQUEST_SIZE];    // request received so far
+    size_t request_length;
+    bool responding;                       // the request is complete, the response is being written
+    char *response;                        // chunk of the response built and not written yet
+    size_t response_length;
+    size_t response_capacity;
+    size_t response_sent;                  // bytes of the chunk written so far
+    unsigned int family;                   // metric family of the next chunk, past the last one once built
+    uint32_t next_target;                  // next target of the family
+} metrics_client_t;
+
+// HTTP endpoint serving the metrics of every target, run by the event loop of the first engine
+typedef struct
+{
+    int listen_fd;                                 // listening TCP socket
+    metrics_client_t clients[METRICS_MAX_CLIENTS]; // connections being served
+} metrics_server_t;
+
+// What is known of a hostname
+typedef enum
+{
+    DNS_QUEUED,   // waiting for a query slot, or for the refresh of an expired address
+    DNS_PENDING,  // query in flight
+    DNS_RESOLVED, // address known until its expiry
+    DNS_FAILED    // unknown host
+} dns_state_t;
+
+// A distinct hostname among the targets of a resolver, cached with the lifetime of its address
+typedef struct
+{
+    const char *name;     // hostname, as given
+    uint32_t address;     // IPv4 address, network order, 0 before the first answer
+    uint64_t expiry;      // monotonic time the address must be resolved again, UINT64_MAX never
+    uint64_t sent_time;   // monotonic time the query was last sent
+    int32_t first_target; // first target named so, the next ones linked in next_targets
+    uint16_t query;       // slot of the query in flight
+    uint8_t tries;        // times the query was sent
+    uint8_t state;        // dns_state_t
+    int8_t stream;        // stream of the query over TCP, -1 over UDP
+    uint8_t search;       // name asked: a search domain appended to a name without a dot, the name as given past them
+} dns_entry_t;
+
+// A query over TCP, after an answer truncated over UDP. The query, then the answer, are
+// preceded by their 2-byte length, as DNS messages over TCP are
+typedef struct
+{
+    int fd;                 // nonblocking connection to the name server, -1 when free
+    uint32_t entry;         // entry of the name
+    unsigned char *message; // the query until it is sent, then the answer
+    uint32_t query_length;  // length of the query, with its length
+    uint32_t sent;          // bytes of the query sent
+    uint32_t received;      // bytes of the answer received
+} dns_stream_t;
+
+// Stub resolver of the targets of an engine, or of every target before the engines start:
+// the queries of the distinct names go out at once over UDP, up to DNS_MAX_QUERIES in flight,
+// and over TCP when their answer does not fit
+typedef struct
+{
+    uint32_t first_target;                       // first target resolved
+    uint32_t target_count;                       // number of targets resolved
+    int socket;                                  // UDP socket of the queries, -1 when every name was known locally
+    struct sockaddr_in servers[DNS_MAX_SERVERS]; // name servers, tried in turn
+    unsigned int server_count;
+    char search[DNS_MAX_SEARCH][DNS_NAME_SIZE];  // search domains, tried in turn for the names without a dot
+    unsigned int search_count;
+    dns_entry_t *entries;                        // one per distinct name
+    uint32_t entry_count;
+    uint32_t *table;                             // open addressing hash table of the entries, UINT32_MAX when empty
+    uint32_t table_mask;
+    int32_t *next_targets;                       // next target of the same name, by target from first_target, -1 at the end
+    uint32_t *queue;                             // names waiting for a query slot, in a ring of entry_count
+    uint32_t queue_head;
+    uint32_t queue_length;
+    uint32_t queries[DNS_MAX_QUERIES];           // entry of each query in flight, UINT32_MAX when free
+    dns_stream_t streams[DNS_MAX_STREAMS];       // queries over TCP
+    uint16_t query_ids[DNS_MAX_QUERIES];         // DNS id of each query in flight
+    uint32_t query_count;
+    uint16_t id_salt;                            // high byte of the next DNS id
+    uint32_t unresolved;                         // names neither resolved nor failed yet
+    uint64_t next_expiry;                        // earliest expiry of a resolved address, UINT64_MAX if none
+    bool refresh;                                // the expired addresses are resolved again, while probing
+    unsigned long int queries_sent;              // queries sent, retries included
+} dns_resolver_t;
+
+// A check of the ping service: probes sent to an address for a client. The target of the
+// same index holds the address and the sequences of the probes.
+typedef struct
+{
+    int32_t client;       // index of the client, -1 once it left or cancelled, the probes in flight drain
+    uint32_t id;          // id given by the client
+    uint32_t count;       // probes to send
+    uint32_t settled;     // probes answered, lost or in error
+    uint64_t interval_ns; // time between two probes
+    size_t length;        // length of the ICMP messages of the probes
+    bool active;          // the slot holds a check
+} service_check_t;
+
+// A client of the ping service, with the results of its next message
+typedef struct
+{
+    int fd;                                                  // connected socket, -1 when the slot is free
+    ping_service_result_t results[PING_SERVICE_MAX_RESULTS]; // results not sent yet
+    unsigned int result_count;
+    bool pending;                                            // in the pending clients, until they are flushed
+} service_client_t;
+
+// Ping service of --serve, run by the event loop of the only engine
+typedef struct
+{
+    int listen_fd;                                 // listening UNIX socket
+    service_client_t clients[SERVICE_MAX_CLIENTS]; // connections being served
+    uint32_t pending_clients[SERVICE_MAX_CLIENTS]; // clients holding results, sent once per iteration
+    uint32_t pending_count;
+    service_check_t *checks;                       // SERVICE_MAX_CHECKS checks
+    uint32_t *free_checks;                         // stack of the free checks
+    uint32_t free_count;
+    unsigned long int clients_served;              // connections accepted
+    unsigned long int checks_started;              // checks accepted
+    unsigned long int checks_rejected;             // checks refused, invalid or beyond SERVICE_MAX_CHECKS
+    unsigned long int results_sent;                // results delivered to the clients
+} service_server_t;
+
+// A probing engine: one socket, its event loop, the probes in flight and the scheduler
+// of the targets it serves. With several threads, each one runs its own engine and
+// only touches the targets of its shard.
+typedef struct
+{
+    unsigned short id;          // ICMP echo id of the engine, distinct for each engine
+    int socket;                 // socket file descriptor
+    int epoll_fd;               // event loop multiplexer
+    int timer_fd;               // CLOCK_MONOTONIC timer driving the probes
+    uint32_t first_target;      // first target served by the engine
+    uint32_t target_count;      // number of targets served by the engine
+    uint32_t active_targets;    // targets with probes left to send
+    bool lingering;             // every probe was sent, waiting for the last replies
+    bool finished;              // the event loop must return
+
+    probe_slot_t *probe_ring;   // probes in flight, indexed by sequence number
+    uint32_t packets_sent;      // engine-wide sequence of the next probe
+    int packets_in_flight;      // probes sent and neither answered nor expired
+    uint32_t oldest_pending;    // sequence from which expired probes are searched
+
+    timing_wheel_t wheel;       // schedule of the targets in interval and adaptive modes
+    uint32_t *due_targets;      // targets the timing wheel found due, one entry per target
+    uint32_t *ready_targets;    // targets to send to after a reply or an expiry, in adaptive mode
+    uint32_t ready_count;       // number of ready targets
+    uint64_t timer_deadline;    // monotonic time the probe timer was last armed at
+    uint32_t next_target;       // round-robin cursor of the rate and flood modes
+    double rate;                // share of the requested rate, in probes per second
+    double tokens;              // probes the token bucket allows to send
+    uint64_t last_refill;       // monotonic time of the last token bucket refill
+
+    char *send_batch;                            // packets of the current sendmmsg() batch, built once from the template
+    char *recv_batch;                            // buffers of the recvmmsg() batches
+    uint32_t batch_targets[SEND_BATCH_SIZE];     // target of each packet of the batch
+    uint32_t batch_sequences[SEND_BATCH_SIZE];   // target sequence of each packet of the batch
+    size_t batch_lengths[SEND_BATCH_SIZE];       // length of each packet of the batch, shorter than data_size with --pmtu
+    unsigned int batch_length;                   // number of packets in the batch
+    uint64_t batch_time;                         // monotonic time stamped in the batch
+    uint64_t batch_txtimes[SEND_BATCH_SIZE];     // CLOCK_TAI transmit time of each packet, with --pacing txtime
+
+    uint64_t probe_period;      // intended time between two probes of the engine, with --pacing
+    uint64_t next_probe_time;   // intended monotonic time of the next probe, with precise pacing
+    uint64_t spin_threshold_ns; // time before a probe the engine stops sleeping and spins
+    int64_t tai_offset_ns;      // CLOCK_TAI minus CLOCK_MONOTONIC, for the transmit times
+    rtt_stats_t *send_gaps;     // achieved time between two consecutive probes, with --pacing
+    rtt_stats_t *gap_errors;    // distance of each achieved gap to the intended one
+    uint32_t last_gap_sequence; // probe the last send time was recorded for
+    uint64_t last_gap_time;     // its send time, 0 before the first one
+    unsigned long int txtime_misses; // probes dropped by the qdisc for missing their transmit time
+
+    int cpu;                    // CPU the engine is pinned to in low latency
+    bool low_latency_active;    // pinned, busy-polling and, with --realtime, SCHED_FIFO
+    uint64_t phase_end;         // monotonic time the current phase of --compare ends
+    cpu_set_t saved_affinity;   // CPUs of the thread out of low latency
+    rtt_stats_t *phase_rtt;     // round trip times read in the default and low-latency phases, with --compare
+
+    unsigned long int send_calls;    // send syscalls issued
+    unsigned long int receive_calls; // receive syscalls issued
+
+    uint32_t *transmit_keys;    // probe sequence of each transmit timestamp key
+    uint32_t next_transmit_key; // key of the next packet handed to the kernel
+
+    io_uring_t *uring;          // io_uring sending and receiving on the socket, NULL without it
+
+    metrics_server_t *metrics;  // metrics endpoint served by the engine, NULL without it
+    service_server_t *service;  // ping service run by the engine, NULL without it
+    dns_resolver_t *resolver;   // resolves the names of the targets while probing, NULL without it
+    pipeline_t *pipeline;       // consumer of the reply events, NULL to account them inline
+
+    char *output;               // records not written yet, in the machine-readable formats
+    size_t output_length;       // bytes in the output buffer
+    uint64_t last_flush;        // monotonic time the output buffer was last written
+
+    uint64_t last_publish;      // monotonic time the live statistics of the shard were last published
+    bool unpublished;           // events were handled since the last publication
+
+    int ring_socket;            // AF_PACKET socket of the receive ring, -1 without it
+    char *ring;                 // blocks of the receive ring, shared with the kernel
+    unsigned int next_block;    // next block to be handed over by the kernel
+} __attribute__((aligned(CACHE_LINE_SIZE))) ping_engine_t;
 
 // Struct for storing ping flags, options and statistics
 typedef struct
 {
     int verbose;                    // enable verbose mode
     int quiet;                      // disable output messages
-    int packet_count;               // number of packets to send
+    int flood;                      // send as fast as the window allows
+    unsigned long int rate;         // probes per second, 0 to follow the interval, a cap in adaptive mode
+    pacing_mode_t pacing;           // scheduling of the probes and report of the send gaps
+    int adaptive;                   // send the next probe as soon as the previous one is answered
+    unsigned long int preload;      // probes kept in flight per target in adaptive mode
+    int pmtu;                       // discover the path MTU of the targets rather than ping them
+    int low_latency;                // pin the engines, busy-poll their sockets and lock the memory
+    int cpu;                        // CPU the first engine is pinned to, -1 for the one it starts on
+    int realtime;                   // run the engines SCHED_FIFO in low latency
+    int compare_latency;            // alternate default and low-latency phases and compare them
+    bool memory_locked;             // the memory of the process is locked
+    int kernel_timestamps;          // time probes with kernel timestamps
+    int datagram;                   // use unprivileged ICMP datagram sockets instead of raw ones
+    uint32_t nonce;                 // random per process, written in the probe stamps
+    const char *ring_interface;     // interface the replies are read from through a packet ring, NULL for the socket
+    int io_uring;                   // send and receive through io_uring when the kernel supports it
+    output_format_t format;         // format of the reply lines
+    FILE *report;                   // stream of the header, the summary and the errors
+    int metrics;                    // serve the metrics of the targets over HTTP
+    int pipeline;                   // account the replies and write the output on a consumer thread
+    const char *shm_name;           // shared memory segment of the live statistics, NULL without it
+    ping_shm_entry_t *shared_stats; // live statistics of each target, in the segment
+    const char *rtt_log_path;       // compressed round trip time log, NULL without it
+    const char *service_path;       // UNIX socket of the ping service, NULL to ping the targets
+    struct sockaddr_in dns_server;  // name server of --dns, port 0 to read those of resolv.conf
+    bool resolve_in_engines;        // the engines resolve the names of their targets while probing
+    rtt_log_series_t *rtt_series;   // block being compressed for each target
+    struct sockaddr_in metrics_address; // address the metrics endpoint listens on
+    int packet_count;               // number of packets to send to each target
     unsigned long int time_to_live; // TTL (Time to Live) for packets
     unsigned long int packet_size;  // size of the packets to send
-    unsigned long int interval;     // time between sending packets
+    uint64_t interval_ns;           // time between two probes to a target (nanoseconds)
+    uint64_t timeout_ns;            // time after which a probe is lost (nanoseconds)
+    unsigned long int window;       // maximum number of probes in flight per thread, set after parsing
+    unsigned int thread_count;      // number of threads sharing the targets
+    unsigned long int data_size;    // size of the data in packets
+    size_t batch_stride;            // distance between two packets of a send batch, data_size rounded up to 8
+    size_t recv_buffer_size;        // size of each receive buffer
+    char *packet;                   // reference echo request the replies are compared with
 
-    char *host; // hostname or IP address to ping
+    const char **hosts;             // hosts given on the command line
+    unsigned int host_count;        // number of hosts given on the command line
+    const char *targets_file;       // file listing more targets, "-" for stdin
+    bool multi_target;              // report per target, as several were requested
 
-    int packets_sent;       // number of packets sent
-    int packets_received;   // number of packets received
-    double min_rtt;         // minimum round trip time
-    double max_rtt;         // maximum round trip time
-    double total_rtt;       // total round trip time
-    trip_node_t *trip_list; // list of round trip times
+    ping_target_t *targets;         // targets to ping
+    rtt_stats_t *rtt;               // round trip time statistics of each target
+    sequence_stats_t *sequences;    // loss, reordering and jitter analytics of each target
+    pmtu_state_t *pmtu_states;      // path MTU discovery of each target, with --pmtu
+    uint32_t target_count;          // number of targets
 
-    int socket;                        // socket file descriptor
-    struct addrinfo *address;          // resolved address of the host
-    char ip_address[INET6_ADDRSTRLEN]; // IP address of the host
-    unsigned long int data_size;       // size of the data in packets
+    ping_engine_t *engines;         // the probing engines, one per thread
+    unsigned int engine_count;      // number of engines
+    int signal_fd;                  // SIGINT delivered as a readable event
+    int stop_fd;                    // readable once the engines must stop
+    int done_fd;                    // counts the engine threads that are done
+    uint64_t start_time;            // monotonic time of the first probe
 } ping_state_t;
 
 extern ping_state_t global_ping;
@@ -66,9 +750,162 @@ extern ping_state_t global_ping;
 // Ping functions
 int print_usage(void);
 void parse_args(int argc, const char **argv);
-void initialize_network();
+void load_targets(void);
+void allocate_engine_ids(void);
+void initialize_network(ping_engine_t *engine);
 void statistics_signal_handler();
-void ping_signal_handler();
+void initialize_packet(void);
+void create_packet(const ping_engine_t *engine, icmphdr_t *packet);
+void stamp_packet(icmphdr_t *packet, uint32_t sequence, uint32_t target, uint32_t target_sequence, uint64_t send_time);
+void initialize_engines(void);
+void run_engines(void);
+void run_event_loop(ping_engine_t *engine);
+void watch_fd(ping_engine_t *engine, int fd, uint32_t events);
+void queue_probe(ping_engine_t *engine, uint32_t target);
+void resize_queued_probe(ping_engine_t *engine, size_t ip_size);
+unsigned int flush_probes(ping_engine_t *engine);
+void receive_replies(ping_engine_t *engine);
+void process_reply(ping_engine_t *engine, icmphdr_t *received_packet, ssize_t icmp_length, ssize_t recv_size,
+                   struct in_addr source, uint8_t ttl, uint64_t recv_time, uint64_t kernel_recv_time);
+void process_message(ping_engine_t *engine, char *recv_buffer, ssize_t recv_size, struct in_addr source,
+                     uint64_t recv_time, uint64_t kernel_recv_time);
+void build_reply_filter(struct sock_filter *code, unsigned short id);
+
+// io_uring backend
+void open_io_uring(ping_engine_t *engine);
+void start_io_uring(ping_engine_t *engine);
+int send_io_uring(ping_engine_t *engine, struct mmsghdr *messages, unsigned int count);
+void receive_io_uring(ping_engine_t *engine);
+
+// Machine-readable output
+void start_output(void);
+void write_summary_records(void);
+void initialize_output(ping_engine_t *engine);
+void write_record(ping_engine_t *engine, uint32_t target, uint32_t sequence, uint64_t rtt_ns,
+                  uint8_t type, uint8_t code, uint8_t ttl, record_status_t status);
+void flush_output(ping_engine_t *engine, uint64_t now, bool force);
+
+// Reply pipeline
+void account_event(ping_engine_t *engine, const reply_event_t *event);
+void dispatch_event(ping_engine_t *engine, const reply_event_t *event);
+void start_pipeline(ping_engine_t *engine);
+void wake_pipeline(ping_engine_t *engine);
+void stop_pipeline(ping_engine_t *engine);
+
+// Live statistics in shared memory
+void open_shared_stats(void);
+void publish_shared_stats(ping_engine_t *engine, uint64_t now);
+void close_shared_stats(void);
+
+// Compressed round trip time log
+void open_rtt_log(void);
+void log_sample(uint32_t index, uint64_t time_us, uint64_t rtt_ns);
+void log_round_trip(uint32_t index, uint64_t rtt_ns);
+void close_rtt_log(void);
+
+// Metrics endpoint
+metrics_server_t *open_metrics_server(void);
+bool handle_metrics_event(ping_engine_t *engine, int fd, uint32_t events);
+
+// Packet ring backend
+void open_packet_ring(ping_engine_t *engine);
+void receive_packet_ring(ping_engine_t *engine);
+
+// In-flight ring
+void initialize_probe_ring(ping_engine_t *engine);
+void track_probe(ping_engine_t *engine, uint32_t sequence, uint32_t target, uint32_t target_sequence, uint64_t send_time);
+void expire_probes(ping_engine_t *engine, uint64_t now);
+probe_slot_t *find_probe(ping_engine_t *engine, unsigned short icmp_seq);
+reply_status_t resolve_probe(ping_engine_t *engine, uint32_t sequence, uint64_t recv_time);
+
+// Timing wheel and interval mode
+void initialize_timing_wheel(timing_wheel_t *wheel, uint64_t now);
+void schedule_target(timing_wheel_t *wheel, uint32_t target);
+void unschedule_target(timing_wheel_t *wheel, uint32_t target);
+unsigned int advance_timing_wheel(timing_wheel_t *wheel, uint64_t now, uint32_t *due_targets);
+uint64_t next_wheel_deadline(const timing_wheel_t *wheel);
+void initialize_schedule(ping_engine_t *engine, uint64_t now);
+void schedule_probes(ping_engine_t *engine, uint64_t now);
+
+// Rate and flood modes
+void enlarge_socket_buffer(ping_engine_t *engine, int force_option, int option);
+void initialize_flood(ping_engine_t *engine);
+uint64_t pacing_tick(const ping_engine_t *engine);
+void pace_probes(ping_engine_t *engine, uint64_t now);
+uint32_t next_active_target(ping_engine_t *engine);
+
+// Precise pacing and send gaps
+void initialize_pacing(ping_engine_t *engine, uint64_t now);
+uint64_t pace_precisely(ping_engine_t *engine, uint64_t now);
+void record_send_gap(ping_engine_t *engine, uint32_t sequence, uint64_t send_time);
+void report_send_gaps(void);
+
+// Low-latency mode
+void initialize_low_latency(ping_engine_t *engine);
+void set_low_latency(ping_engine_t *engine, bool active);
+void alternate_low_latency(ping_engine_t *engine, uint64_t now);
+void lock_memory(void);
+void report_low_latency(void);
+
+// Adaptive mode
+void initialize_adaptive(ping_engine_t *engine, uint64_t now);
+void release_adaptive_probe(ping_engine_t *engine, const probe_slot_t *slot, uint64_t recv_time);
+void send_ready_probes(ping_engine_t *engine, uint64_t now);
+void fire_adaptive_targets(ping_engine_t *engine, uint64_t now);
+
+// Path MTU discovery
+void initialize_pmtu(void);
+void initialize_pmtu_engine(ping_engine_t *engine, uint64_t now);
+void settle_pmtu_probe(ping_engine_t *engine, uint32_t target, uint32_t target_sequence, pmtu_outcome_t outcome,
+                       unsigned int mtu, uint64_t rtt_ns);
+size_t pmtu_probe_length(uint32_t target, uint32_t target_sequence);
+void end_ready_pmtu_rounds(ping_engine_t *engine, uint64_t now);
+void fire_pmtu_targets(ping_engine_t *engine, uint64_t now);
+void report_pmtu(void);
+
+// Ping service
+void initialize_service(void);
+service_server_t *open_service_server(void);
+void initialize_service_engine(ping_engine_t *engine, uint64_t now);
+void handle_service_event(ping_engine_t *engine, int fd, uint32_t events);
+void fire_service_checks(ping_engine_t *engine, uint64_t now);
+size_t service_probe_length(const ping_engine_t *engine, uint32_t target);
+void answer_service_event(ping_engine_t *engine, const reply_event_t *event);
+void report_service_loss(ping_engine_t *engine, const probe_slot_t *slot);
+void flush_service_results(ping_engine_t *engine);
+void close_service(void);
+
+// Resolution of the hostnames
+bool resolve_literal(ping_target_t *target);
+dns_resolver_t *open_resolver(uint32_t first_target, uint32_t target_count);
+void resolve_all(dns_resolver_t *resolver);
+void start_resolver(ping_engine_t *engine);
+bool resolver_owns_fd(const dns_resolver_t *resolver, int fd);
+void handle_resolver_event(ping_engine_t *engine, int fd);
+void run_resolver(dns_resolver_t *resolver, ping_engine_t *engine, uint64_t now);
+uint64_t resolver_deadline(const dns_resolver_t *resolver);
+void close_resolver(dns_resolver_t *resolver);
+
+// Kernel timestamps and error queue
+void enable_kernel_timestamps(ping_engine_t *engine);
+void record_transmit(ping_engine_t *engine, uint32_t sequence);
+void receive_error_queue(ping_engine_t *engine);
+uint64_t kernel_receive_time(struct msghdr *msg);
+
+// Round trip time statistics
+void initialize_rtt_stats(rtt_stats_t *stats);
+void record_round_trip(rtt_stats_t *stats, uint64_t rtt_ns);
+void merge_rtt_stats(rtt_stats_t *total, const rtt_stats_t *stats);
+double rtt_stddev(const rtt_stats_t *stats);
+double rtt_percentile(const rtt_stats_t *stats, double percentile);
+void rtt_cumulative_counts(const rtt_stats_t *stats, const uint64_t *bounds_ns, unsigned int bound_count, uint64_t *counts);
+
+// Loss, reordering and jitter analytics
+void initialize_sequence_stats(sequence_stats_t *stats);
+void record_sequence(sequence_stats_t *stats, uint32_t sequence, uint64_t rtt_ns);
+void settle_sequences(sequence_stats_t *stats, uint32_t packets_sent);
+uint32_t sequence_bucket_bound(unsigned int bucket);
+void report_sequence_stats(void);
 
 // Utility functions
 
@@ -76,9 +913,12 @@ void ping_signal_handler();
 unsigned long int atoull(const char *str);
 double custom_sqrt(double x);
 unsigned short calculate_checksum(void *data_ptr, size_t data_size);
+uint16_t update_checksum(uint16_t checksum, const void *old_data, const void *new_data, size_t data_size);
 unsigned short swap_endianess_16(unsigned short value);
-void next_packet();
+uint64_t parse_seconds(const char *s);
+uint64_t get_monotonic_time(void);
+struct timespec nanoseconds_to_timespec(uint64_t nanoseconds);
 
 // Print utilities
-void handle_icmp_error(unsigned short icmp_seq, icmphdr_t *received_packet);
-void handle_error(unsigned short icmp_seq, const char *format, ...);
\ No newline at end of file
+void handle_icmp_error(const ping_target_t *target, unsigned short icmp_seq, icmphdr_t *received_packet);
+void handle_error(const ping_target_t *target, unsigned short icmp_seq, const char *format, ...);
\ No newline at end of file
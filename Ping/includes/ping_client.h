@@ -0,0 +1,22 @@
+#ifndef PING_CLIENT_H
+#define PING_CLIENT_H
+
+#include <stddef.h>
+
+#include "ping_service.h"
+
+// Client of the ping service of --serve, in libpingclient.a. A connection submits checks and
+// reads their results as they come, so that a program probing many hosts holds one socket
+// instead of spawning a ping process per probe. The functions never exit: they return -1,
+// or NULL, with errno set.
+
+typedef struct ping_client ping_client_t;
+
+ping_client_t *ping_client_open(const char *path);
+int ping_client_fd(const ping_client_t *client);
+const ping_service_hello_t *ping_client_hello(const ping_client_t *client);
+int ping_client_submit(ping_client_t *client, const ping_service_request_t *requests, size_t count);
+int ping_client_results(ping_client_t *client, ping_service_result_t *results, size_t capacity, int timeout_ms);
+void ping_client_close(ping_client_t *client);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef PING_LOG_H
+#define PING_LOG_H
+
+#include <stdint.h>
+
+// Compressed round trip time log of --rtt-log, appended to across runs, all fields
+// little-endian. The file starts with a header, followed by blocks and index records:
+// - a block holds the samples of one target, compressed as in Gorilla (Pelkonen et al.,
+//   VLDB 2015): each sample is a CLOCK_REALTIME send time in microseconds, delta-of-delta
+//   encoded, and a round trip time in nanoseconds, XOR-ed with the previous one;
+// - an index record lists the blocks written since the previous one and ends with a
+//   footer, so that a reader finds the last index at the end of the file, follows them
+//   backwards, and only decodes the blocks of the targets and times it was asked for.
+
+// "PLOG", "PBLK", "PIDX" and "PEND" read as little-endian 32-bit integers
+#define PING_LOG_MAGIC 0x474f4c50
+#define PING_LOG_BLOCK_MAGIC 0x4b4c4250
+#define PING_LOG_INDEX_MAGIC 0x58444950
+#define PING_LOG_FOOTER_MAGIC 0x444e4550
+#define PING_LOG_VERSION 1
+
+// Encoding of the difference between two consecutive time deltas: a prefix of up to four
+// one bits ended by a zero, then the difference as a signed integer of the given width.
+// A zero difference is the single bit 0, the last prefix 1111 is followed by 64 bits.
+#define PING_LOG_DOD_CLASSES 4
+static const unsigned int ping_log_dod_bits[PING_LOG_DOD_CLASSES + 1] = {0, 7, 9, 12, 64};
+
+// Encoding of a round trip time XOR-ed with the previous one:
+// - 0: same value;
+// - 10: the meaningful bits fit in the window of the previous value, which follow;
+// - 11: 6 bits of leading zeros, 6 bits of meaningful bit count minus one, then the bits.
+// The first sample of a block stores its send time and its round trip time on 64 bits each,
+// the next ones take the delta to the previous send time as the first delta of delta.
+#define PING_LOG_LEADING_BITS 6
+#define PING_LOG_LENGTH_BITS 6
+
+// Largest encoding of a sample, in bits: the longest delta-of-delta and a new XOR window
+#define PING_LOG_MAX_SAMPLE_BITS (PING_LOG_DOD_CLASSES + 64 + 2 + PING_LOG_LEADING_BITS + PING_LOG_LENGTH_BITS + 64)
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;       // PING_LOG_MAGIC
+    uint16_t version;     // PING_LOG_VERSION
+    uint16_t header_size; // sizeof(ping_log_header_t)
+    uint64_t reserved;
+} ping_log_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;         // PING_LOG_BLOCK_MAGIC
+    uint32_t address;       // IPv4 address of the target, network order
+    uint64_t min_time_us;   // earliest send time of the samples
+    uint64_t max_time_us;   // latest send time of the samples
+    uint32_t count;         // number of samples
+    uint32_t length;        // bytes of compressed samples following the block header
+} ping_log_block_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;           // PING_LOG_INDEX_MAGIC
+    uint32_t count;           // number of entries following the index header
+    uint64_t previous_offset; // offset of the previous index record, 0 for the first one
+} ping_log_index_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t offset;        // offset of the block header in the file
+    uint32_t address;       // copied from the block header
+    uint32_t count;
+    uint64_t min_time_us;
+    uint64_t max_time_us;
+} ping_log_index_entry_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t index_offset; // offset of the index record the footer ends
+    uint32_t magic;        // PING_LOG_FOOTER_MAGIC
+    uint32_t reserved;
+} ping_log_footer_t;
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PING_RECORD_H
+#define PING_RECORD_H
+
+#include <stdint.h>
+
+// Binary output of --format=binary, all fields little-endian.
+// The stream starts with a header, followed by the IPv4 address of each target
+// (4 bytes each, in network order), then by one fixed-size record per event.
+
+// "PREC" read as a little-endian 32-bit integer
+#define PING_RECORD_MAGIC 0x43455250
+#define PING_RECORD_VERSION 1
+
+// What a record reports
+typedef enum
+{
+    RECORD_REPLY = 0,     // a reply, accounted in the statistics
+    RECORD_REORDERED = 1, // a reply overtaken by the reply of a newer probe, accounted
+    RECORD_LATE = 2,      // a reply received after its probe expired, not accounted
+    RECORD_DUPLICATE = 3, // a reply received once more, not accounted
+    RECORD_ERROR = 4      // an ICMP error about a probe, given by its type and code
+} record_status_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;        // PING_RECORD_MAGIC
+    uint16_t version;      // PING_RECORD_VERSION
+    uint16_t record_size;  // size of each record, sizeof(ping_record_t)
+    uint32_t target_count; // number of target addresses following the header
+    uint32_t reserved;
+} ping_record_header_t;
+
+typedef struct __attribute__((packed))
+{
+    uint64_t rtt_ns;   // round trip time, or time from the probe to the error, in nanoseconds
+    uint32_t target;   // index of the target in the address table
+    uint32_t sequence; // sequence number of the probe to the target
+    uint8_t type;      // ICMP type of the message
+    uint8_t code;      // ICMP code of the message
+    uint8_t ttl;       // TTL of the message when it arrived, 0 if unknown
+    uint8_t status;    // record_status_t
+    uint32_t reserved;
+} ping_record_t;
+
+#endif
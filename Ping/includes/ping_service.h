@@ -0,0 +1,64 @@
+#ifndef PING_SERVICE_H
+#define PING_SERVICE_H
+
+#include <stdint.h>
+
+// Protocol of the ping service of --serve, over a UNIX SOCK_SEQPACKET socket, in the native
+// byte order since both ends run on the same host. On connection the service sends a hello
+// message. A client then sends messages holding up to PING_SERVICE_MAX_REQUESTS requests,
+// each one starting a check: probes sent to an address at a fixed interval. The service
+// answers with messages holding up to PING_SERVICE_MAX_RESULTS results, one per probe, as
+// the replies arrive, the checks of every client interleaved. A request with a count of 0
+// cancels the checks of the client carrying its id; their probes in flight get no result.
+
+// "PSRV" read as a little-endian 32-bit integer
+#define PING_SERVICE_MAGIC 0x56525350
+#define PING_SERVICE_VERSION 1
+
+// Largest number of requests per message sent to the service, and of results per message
+// sent by the service, so that a client reading into a buffer this large never loses one
+#define PING_SERVICE_MAX_REQUESTS 256
+#define PING_SERVICE_MAX_RESULTS 128
+
+// What a result reports
+typedef enum
+{
+    PING_SERVICE_REPLY,   // echo reply, timed
+    PING_SERVICE_LOST,    // no reply within the timeout of the service
+    PING_SERVICE_ERROR,   // ICMP error about the probe, with its type and code
+    PING_SERVICE_REJECTED // the check could not be started, no probe is sent
+} ping_service_status_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;          // PING_SERVICE_MAGIC
+    uint16_t version;        // PING_SERVICE_VERSION
+    uint16_t max_requests;   // PING_SERVICE_MAX_REQUESTS
+    uint16_t max_results;    // PING_SERVICE_MAX_RESULTS
+    uint16_t max_size;       // largest payload the service sends, in bytes
+    uint32_t timeout_us;     // time after which a probe is lost
+} ping_service_hello_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t id;          // chosen by the client, echoed in the results
+    uint32_t address;     // IPv4 address to probe, network order
+    uint32_t count;       // number of probes, at most 2^31 - 1, 0 to cancel the checks carrying the id
+    uint32_t interval_us; // time between two probes
+    uint16_t size;        // payload size in bytes, 0 for the size of the service
+    uint16_t reserved;    // 0
+} ping_service_request_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t id;       // id of the check
+    uint32_t sequence; // rank of the probe in the check
+    uint64_t rtt_ns;   // round trip time of a reply, time from the probe to an error
+    uint32_t source;   // address the reply or error came from, network order
+    uint8_t status;    // ping_service_status_t
+    uint8_t type;      // ICMP type of an error
+    uint8_t code;      // ICMP code of an error
+    uint8_t ttl;       // TTL of the reply when it arrived, 0 if unknown
+} ping_service_result_t;
+
+#endif
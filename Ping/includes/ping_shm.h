@@ -0,0 +1,43 @@
+#ifndef PING_SHM_H
+#define PING_SHM_H
+
+#include <stdint.h>
+
+// Live statistics of --shm, published in a POSIX shared memory segment: a header, then
+// one entry per target, in the native byte order since they are read on the same host.
+// Each entry is a seqlock: its sequence is odd while the entry is written, a reader copies
+// the entry and retries if the sequence was odd or changed in between.
+
+// "PSHM" read as a little-endian 32-bit integer, written last once the segment is ready
+#define PING_SHM_MAGIC 0x4d485350
+#define PING_SHM_VERSION 1
+
+typedef struct __attribute__((aligned(64)))
+{
+    uint32_t magic;               // PING_SHM_MAGIC
+    uint16_t version;             // PING_SHM_VERSION
+    uint16_t entry_size;          // size of each entry, sizeof(ping_shm_entry_t)
+    uint32_t target_count;        // number of entries following the header
+    uint32_t pid;                 // process publishing the statistics
+    uint64_t start_time_ns;       // CLOCK_MONOTONIC time the segment was created
+    uint64_t publish_interval_ns; // longest time between a change and its publication
+} ping_shm_header_t;
+
+typedef struct __attribute__((aligned(64)))
+{
+    uint32_t sequence;          // seqlock, odd while the entry is written
+    uint32_t address;           // IPv4 address of the target, network order, never changes
+    uint64_t update_time_ns;    // CLOCK_MONOTONIC time of the last publication, 0 before the first
+    uint64_t packets_sent;      // echo requests sent
+    uint64_t packets_received;  // echo replies received in time
+    uint64_t lost_probes;       // echo requests expired without a reply
+    uint64_t late_replies;      // replies received after their probe expired
+    uint64_t duplicate_replies; // replies received more than once
+    uint64_t reordered_replies; // replies received after the reply of a newer probe
+    uint64_t rtt_min_ns;        // round trip times of the replies received in time
+    uint64_t rtt_max_ns;
+    uint64_t rtt_mean_ns;
+    uint64_t rtt_stddev_ns;
+} ping_shm_entry_t;
+
+#endif
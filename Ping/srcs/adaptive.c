@@ -0,0 +1,172 @@
+#include "ping.h"
+
+// Time after which the probes in flight to a target are presumed lost (RFC 6298): the
+// smoothed round trip time plus four times its variation, at least ADAPTIVE_MIN_MARGIN_NS.
+// Before the first reply, the probe timeout.
+// @param target The target.
+// @return The time in nanoseconds, from the last probe sent.
+static uint64_t adaptive_timeout(const ping_target_t *target)
+{
+    if (!target->srtt_ns)
+    {
+        return global_ping.timeout_ns;
+    }
+    uint64_t margin = 4 * target->rttvar_ns;
+    return target->srtt_ns + (margin > ADAPTIVE_MIN_MARGIN_NS ? margin : ADAPTIVE_MIN_MARGIN_NS);
+}
+
+// Smallest time between two probes to a target under --rate, which caps the total rate
+// when every target sends at most once per gap.
+// @return The gap in nanoseconds, 0 without a cap.
+static uint64_t probe_gap(void)
+{
+    return global_ping.rate ? 1000000000UL * global_ping.target_count / global_ping.rate : 0;
+}
+
+// Allocates the lists of the adaptive mode and schedules the first probes of each target
+// of the engine right away.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_adaptive(ping_engine_t *engine, uint64_t now)
+{
+    engine->due_targets = malloc(engine->target_count * sizeof(uint32_t));
+    engine->ready_targets = malloc(engine->target_count * sizeof(uint32_t));
+    if (engine->due_targets == NULL || engine->ready_targets == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    engine->ready_count = 0;
+
+    initialize_timing_wheel(&engine->wheel, now);
+    if (!engine->active_targets)
+    {
+        return;
+    }
+    for (uint32_t target = engine->first_target; target < engine->first_target + engine->target_count; ++target)
+    {
+        global_ping.targets[target].next_send_time = now;
+        schedule_target(&engine->wheel, target);
+    }
+}
+
+// Accounts the end of a probe of a target, answered, expired or recycled, and queues the
+// target to send its next probe. A reply also updates the round trip time estimates.
+// @param engine The engine.
+// @param slot The slot of the probe.
+// @param recv_time The monotonic time the reply was read, 0 without a round trip time sample.
+void release_adaptive_probe(ping_engine_t *engine, const probe_slot_t *slot, uint64_t recv_time)
+{
+    ping_target_t *target = &global_ping.targets[slot->target];
+    --target->probes_in_flight;
+    if (target->presumed_lost && slot->target_sequence < target->presumed_before)
+    {
+        --target->presumed_lost;
+    }
+
+    if (recv_time)
+    {
+        uint64_t rtt = recv_time - slot->send_time;
+        if (!target->srtt_ns)
+        {
+            target->srtt_ns = rtt ? rtt : 1;
+            target->rttvar_ns = rtt / 2;
+        }
+        else
+        {
+            uint64_t deviation = rtt > target->srtt_ns ? rtt - target->srtt_ns : target->srtt_ns - rtt;
+            target->rttvar_ns = (3 * target->rttvar_ns + deviation) / 4;
+            target->srtt_ns = (7 * target->srtt_ns + rtt) / 8;
+        }
+    }
+
+    // The probes are sent once the receive batch is read, not in the middle of it
+    if (!target->ready)
+    {
+        target->ready = true;
+        engine->ready_targets[engine->ready_count++] = slot->target;
+    }
+}
+
+// Tops up the probes in flight of a target to the preload, as far as the count, the window
+// and the rate cap allow, and schedules it again: at the end of the gap if it is still
+// short of probes, otherwise at its adaptive timeout, after which the probes in flight
+// are presumed lost and replaced.
+// @param engine The engine.
+// @param index The index of the target.
+// @param now The current monotonic time, in nanoseconds.
+static void fill_target(ping_engine_t *engine, uint32_t index, uint64_t now)
+{
+    ping_target_t *target = &global_ping.targets[index];
+    uint64_t gap = probe_gap();
+
+    if (target->probes_in_flight > target->presumed_lost && now >= target->last_send_time + adaptive_timeout(target))
+    {
+        target->presumed_lost = target->probes_in_flight;
+        target->presumed_before = target->packets_sent;
+    }
+
+    // Probes queued in the batch are only counted in flight once it is flushed
+    unsigned long int queued = 0;
+    while (target->probes_in_flight + queued - target->presumed_lost < global_ping.preload &&
+           (global_ping.packet_count < 0 || target->packets_sent < global_ping.packet_count) &&
+           engine->packets_in_flight + engine->batch_length < global_ping.window &&
+           (!queued || !gap) && now >= target->last_send_time + gap)
+    {
+        queue_probe(engine, index);
+        target->last_send_time = now;
+        ++queued;
+        if (engine->batch_length == SEND_BATCH_SIZE)
+        {
+            flush_probes(engine);
+        }
+    }
+
+    unschedule_target(&engine->wheel, index);
+    if (global_ping.packet_count >= 0 && target->packets_sent >= global_ping.packet_count)
+    {
+        // The last probe was just sent, the target leaves the wheel
+        if (queued)
+        {
+            --engine->active_targets;
+        }
+        return;
+    }
+
+    bool short_of_probes = target->probes_in_flight + queued - target->presumed_lost < global_ping.preload;
+    if (short_of_probes && gap)
+        target->next_send_time = target->last_send_time + gap;
+    else
+        target->next_send_time = target->last_send_time + adaptive_timeout(target);
+    schedule_target(&engine->wheel, index);
+}
+
+// Sends the next probes of the targets that got a reply or an expiry since the last call.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void send_ready_probes(ping_engine_t *engine, uint64_t now)
+{
+    // Flushing a batch may recycle a slot and push a target again, the list is a stack
+    // so that it never holds a target twice
+    while (engine->ready_count)
+    {
+        uint32_t index = engine->ready_targets[--engine->ready_count];
+        global_ping.targets[index].ready = false;
+        fill_target(engine, index, now);
+    }
+    flush_probes(engine);
+}
+
+// Sends the probes of the targets the timing wheel found due: their first probes, those
+// held back by the rate cap, or the replacements of probes presumed lost.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void fire_adaptive_targets(ping_engine_t *engine, uint64_t now)
+{
+    unsigned int due_count = advance_timing_wheel(&engine->wheel, now, engine->due_targets);
+    for (unsigned int i = 0; i < due_count; ++i)
+    {
+        fill_target(engine, engine->due_targets[i], now);
+    }
+    send_ready_probes(engine, now);
+}
@@ -0,0 +1,162 @@
+#include "ping.h"
+
+// Shares the targets between the engines and opens their sockets.
+// Each engine serves a contiguous shard of the targets, so that the per-target state
+// of a shard is only ever written by the thread running its engine.
+void initialize_engines(void)
+{
+    global_ping.engine_count = global_ping.thread_count < global_ping.target_count ? global_ping.thread_count : global_ping.target_count;
+
+    size_t engines_size = global_ping.engine_count * sizeof(ping_engine_t);
+    global_ping.engines = aligned_alloc(CACHE_LINE_SIZE, engines_size);
+    if (global_ping.engines == NULL)
+    {
+        perror("ping: aligned_alloc");
+        exit(1);
+    }
+    memset(global_ping.engines, 0, engines_size);
+    allocate_engine_ids();
+
+    uint32_t first_target = 0;
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        ping_engine_t *engine = &global_ping.engines[i];
+        engine->first_target = first_target;
+        engine->target_count = (uint64_t)global_ping.target_count * (i + 1) / global_ping.engine_count - first_target;
+        first_target += engine->target_count;
+        initialize_network(engine);
+    }
+
+    // The first engine serves the metrics of every target, and the checks of the service clients
+    global_ping.engines[0].metrics = global_ping.metrics ? open_metrics_server() : NULL;
+    global_ping.engines[0].service = global_ping.service_path ? open_service_server() : NULL;
+}
+
+// Blocks SIGINT and SIGTERM so that they are only delivered through the signal descriptor,
+// the statistics are then printed outside of any signal handler.
+// Must be called before the threads are created, which inherit the signal mask.
+static void initialize_signal_fd(void)
+{
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    sigaddset(&signal_mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &signal_mask, NULL) < 0)
+    {
+        perror("ping: sigprocmask");
+        exit(1);
+    }
+    global_ping.signal_fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (global_ping.signal_fd < 0)
+    {
+        perror("ping: signalfd");
+        exit(1);
+    }
+}
+
+// Creates an event descriptor, readable once written to.
+// @return The file descriptor.
+static int create_event_fd(void)
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("ping: eventfd");
+        exit(1);
+    }
+    return fd;
+}
+
+// Signals an event descriptor.
+// @param fd The file descriptor.
+static void signal_event_fd(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+    {
+        perror("ping: write eventfd");
+        exit(1);
+    }
+}
+
+// Thread running an engine, signals the main thread when the engine is done.
+// @param argument The engine.
+// @return NULL.
+static void *engine_thread(void *argument)
+{
+    run_event_loop(argument);
+    signal_event_fd(global_ping.done_fd);
+    return NULL;
+}
+
+// Runs the engines until SIGINT or until each one has sent its count and got its last replies.
+// A single engine runs on the main thread and is stopped by the signal descriptor itself.
+// Several engines run on their own threads, without any lock: the main thread only waits
+// for SIGINT or for their completion, stops them, and the results are merged once they are joined.
+void run_engines(void)
+{
+    initialize_signal_fd();
+    global_ping.start_time = get_monotonic_time();
+
+    if (global_ping.engine_count == 1)
+    {
+        global_ping.stop_fd = global_ping.signal_fd;
+        run_event_loop(global_ping.engines);
+        return;
+    }
+
+    global_ping.stop_fd = create_event_fd();
+    global_ping.done_fd = create_event_fd();
+
+    pthread_t *threads = malloc(global_ping.engine_count * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        int error = pthread_create(&threads[i], NULL, engine_thread, &global_ping.engines[i]);
+        if (error)
+        {
+            fprintf(stderr, "ping: pthread_create: %s\n", strerror(error));
+            exit(1);
+        }
+    }
+
+    // Wait for SIGINT or for every engine to be done
+    struct pollfd fds[2] = {
+        {.fd = global_ping.signal_fd, .events = POLLIN},
+        {.fd = global_ping.done_fd, .events = POLLIN}};
+    uint64_t engines_done = 0;
+    while (engines_done < global_ping.engine_count)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ping: poll");
+            exit(1);
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            break;
+        }
+
+        uint64_t done = 0;
+        if (read(global_ping.done_fd, &done, sizeof(done)) > 0)
+        {
+            engines_done += done;
+        }
+    }
+
+    // The stop descriptor stays readable, every engine sees it
+    signal_event_fd(global_ping.stop_fd);
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
@@ -0,0 +1,429 @@
+#include "ping.h"
+
+// Registers a file descriptor in the event loop of an engine.
+// @param engine The engine.
+// @param fd The file descriptor to watch.
+// @param events The events to be notified of, EPOLLIN for readability, errors are always notified.
+void watch_fd(ping_engine_t *engine, int fd, uint32_t events)
+{
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        perror("ping: epoll_ctl");
+        exit(1);
+    }
+}
+
+// Arms the probe timer.
+// @param engine The engine.
+// @param first_expiration Delay before the first expiration, in nanoseconds.
+// @param interval Period of the following expirations in nanoseconds, 0 for a single shot.
+static void arm_timer(ping_engine_t *engine, uint64_t first_expiration, uint64_t interval)
+{
+    struct itimerspec timer_spec = {
+        .it_interval = nanoseconds_to_timespec(interval),
+        .it_value = nanoseconds_to_timespec(first_expiration)};
+    if (timerfd_settime(engine->timer_fd, 0, &timer_spec, NULL) < 0)
+    {
+        perror("ping: timerfd_settime");
+        exit(1);
+    }
+}
+
+// Arms the probe timer for a single shot at a monotonic time, right away if it passed.
+// @param engine The engine.
+// @param deadline The monotonic time in nanoseconds, not 0.
+static void arm_timer_at(ping_engine_t *engine, uint64_t deadline)
+{
+    engine->timer_deadline = deadline;
+    struct itimerspec timer_spec = {.it_value = nanoseconds_to_timespec(deadline)};
+    if (timerfd_settime(engine->timer_fd, TFD_TIMER_ABSTIME, &timer_spec, NULL) < 0)
+    {
+        perror("ping: timerfd_settime");
+        exit(1);
+    }
+}
+
+// Arms the probe timer for a single shot at the next deadline of the timing wheel.
+// The timer is left alone when no target is scheduled anymore, or when it is already
+// armed at that deadline.
+// @param engine The engine.
+static void arm_timer_at_next_deadline(ping_engine_t *engine)
+{
+    uint64_t deadline = next_wheel_deadline(&engine->wheel);
+    if (!deadline || deadline == engine->timer_deadline)
+    {
+        return;
+    }
+    arm_timer_at(engine, deadline);
+}
+
+// Creates the epoll instance and the monotonic probe timer, and registers them together
+// with the ICMP socket, the io_uring or the receive ring, the metrics endpoint, the socket of
+// the ping service and the stop descriptor.
+// @param engine The engine.
+static void initialize_event_loop(ping_engine_t *engine)
+{
+    engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine->epoll_fd < 0)
+    {
+        perror("ping: epoll_create1");
+        exit(1);
+    }
+
+    // The timer is not affected by wall-clock changes and has nanosecond resolution
+    engine->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (engine->timer_fd < 0)
+    {
+        perror("ping: timerfd_create");
+        exit(1);
+    }
+
+    // With io_uring, the socket is only watched for its error queue
+    if (global_ping.io_uring)
+    {
+        open_io_uring(engine);
+    }
+    if (engine->uring)
+    {
+        start_io_uring(engine);
+    }
+    watch_fd(engine, engine->socket, engine->uring ? 0 : EPOLLIN);
+    if (engine->uring)
+    {
+        watch_fd(engine, engine->uring->fd, EPOLLIN);
+    }
+    if (engine->ring_socket >= 0)
+    {
+        watch_fd(engine, engine->ring_socket, EPOLLIN);
+    }
+    if (engine->metrics)
+    {
+        watch_fd(engine, engine->metrics->listen_fd, EPOLLIN);
+    }
+    if (engine->service)
+    {
+        watch_fd(engine, engine->service->listen_fd, EPOLLIN);
+    }
+    watch_fd(engine, engine->timer_fd, EPOLLIN);
+    watch_fd(engine, global_ping.stop_fd, EPOLLIN);
+}
+
+// Handles the expiration of the probe timer.
+// In interval mode, sends the probes of the targets the timing wheel found due and
+// arms the timer for the next one.
+// With precise pacing, sends the probes due by the next wake-up at their intended times.
+// In adaptive mode, sends the first probes of the targets and those the rate cap held back
+// or the adaptive timeout presumed lost.
+// With --pmtu, ends the rounds that timed out and sends the next ones.
+// With --serve, sends the probes of the checks that are due.
+// In rate and flood modes, sends the probes allowed by the token bucket in batches.
+// Once every probe is sent, the timer only measures the wait for the last replies.
+// @param engine The engine.
+static void handle_timer(ping_engine_t *engine)
+{
+    uint64_t expirations = 0;
+    if (read(engine->timer_fd, &expirations, sizeof(expirations)) < 0)
+    {
+        if (errno == EAGAIN)
+        {
+            return;
+        }
+        perror("ping: read timerfd");
+        exit(1);
+    }
+
+    // Every probe was sent and the last ones did not get a reply in time
+    if (engine->lingering)
+    {
+        engine->finished = true;
+        return;
+    }
+
+    // Give up the probes that were not answered within the timeout
+    uint64_t now = get_monotonic_time();
+    expire_probes(engine, now);
+
+    if (global_ping.pmtu)
+    {
+        fire_pmtu_targets(engine, now);
+        arm_timer_at_next_deadline(engine);
+        return;
+    }
+    if (engine->service)
+    {
+        fire_service_checks(engine, now);
+        arm_timer_at_next_deadline(engine);
+        return;
+    }
+    if (global_ping.adaptive)
+    {
+        fire_adaptive_targets(engine, now);
+        arm_timer_at_next_deadline(engine);
+        return;
+    }
+    if (global_ping.pacing >= PACING_SPIN)
+    {
+        uint64_t wake_time = pace_precisely(engine, now);
+        if (engine->active_targets)
+        {
+            arm_timer_at(engine, wake_time);
+        }
+        return;
+    }
+    if (global_ping.rate || global_ping.flood)
+    {
+        pace_probes(engine, now);
+        return;
+    }
+
+    schedule_probes(engine, now);
+    arm_timer_at_next_deadline(engine);
+}
+
+// Runs an engine until it is stopped or until every target it serves has sent its count.
+// Probes are sent on timer expirations and replies are read when the socket becomes
+// readable, the process sleeps in epoll_wait() in between.
+// @param engine The engine.
+void run_event_loop(ping_engine_t *engine)
+{
+    initialize_event_loop(engine);
+    initialize_probe_ring(engine);
+
+    // Packets of the sendmmsg() batches, built once, only their stamp changes afterwards
+    engine->send_batch = malloc(SEND_BATCH_SIZE * global_ping.batch_stride);
+    if (engine->send_batch == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    for (int i = 0; i < SEND_BATCH_SIZE; ++i)
+    {
+        create_packet(engine, (icmphdr_t *)(engine->send_batch + i * global_ping.batch_stride));
+    }
+
+    // Buffers of the recvmmsg() batches, large enough for the replies to the largest probes
+    engine->recv_batch = malloc(RECV_BATCH_SIZE * global_ping.recv_buffer_size);
+    if (engine->recv_batch == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
+    if (global_ping.low_latency)
+    {
+        initialize_low_latency(engine);
+        set_low_latency(engine, !global_ping.compare_latency);
+    }
+
+    initialize_output(engine);
+    engine->last_publish = 0;
+    engine->unpublished = global_ping.shared_stats != NULL;
+    start_pipeline(engine);
+    engine->active_targets = global_ping.packet_count ? engine->target_count : 0;
+    start_resolver(engine);
+
+    // Send the first probes right away, then every pacing tick or when the next target is due
+    engine->timer_deadline = 0;
+    if (global_ping.pacing)
+    {
+        initialize_pacing(engine, global_ping.start_time);
+    }
+    if (global_ping.pmtu)
+    {
+        initialize_pmtu_engine(engine, global_ping.start_time);
+        arm_timer_at_next_deadline(engine);
+    }
+    else if (engine->service)
+    {
+        initialize_service_engine(engine, global_ping.start_time);
+    }
+    else if (global_ping.adaptive)
+    {
+        initialize_adaptive(engine, global_ping.start_time);
+        arm_timer(engine, 1, 0);
+    }
+    else if (global_ping.pacing >= PACING_SPIN)
+    {
+        arm_timer(engine, 1, 0);
+    }
+    else if (global_ping.rate || global_ping.flood)
+    {
+        initialize_flood(engine);
+        arm_timer(engine, 1, pacing_tick(engine));
+    }
+    else
+    {
+        initialize_schedule(engine, global_ping.start_time);
+        arm_timer(engine, 1, 0);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!engine->finished)
+    {
+        // Buffered records and live statistics are written at the latest after their
+        // interval, even when idle, and replies reaped while sending are handled right away
+        int wait_ms = !engine->pipeline && (engine->output_length || engine->unpublished) ? (int)(OUTPUT_FLUSH_NS / 1000000) : -1;
+        if (engine->uring && engine->uring->pending_count)
+        {
+            wait_ms = 0;
+        }
+
+        // The resolver retries its queries and refreshes the expired addresses on time
+        uint64_t resolver_time = engine->resolver ? resolver_deadline(engine->resolver) : 0;
+        if (resolver_time)
+        {
+            uint64_t now = get_monotonic_time();
+            uint64_t resolver_ms = resolver_time > now ? (resolver_time - now + 999999) / 1000000 : 0;
+            if (wait_ms < 0 || resolver_ms < (uint64_t)wait_ms)
+                wait_ms = resolver_ms < INT_MAX ? resolver_ms : INT_MAX;
+        }
+
+        // In low latency, the thread keeps its CPU and polls instead of sleeping
+        if (engine->low_latency_active)
+        {
+            wait_ms = 0;
+        }
+        int event_count = epoll_wait(engine->epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (event_count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ping: epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < event_count; ++i)
+        {
+            if (events[i].data.fd == engine->socket || events[i].data.fd == engine->ring_socket ||
+                (engine->uring && events[i].data.fd == engine->uring->fd))
+            {
+                if (events[i].data.fd == engine->ring_socket)
+                    receive_packet_ring(engine);
+                else if (engine->uring)
+                    receive_io_uring(engine);
+                else
+                    receive_replies(engine);
+
+                // A flood is clocked by the replies, which free room in the window
+                if (global_ping.flood)
+                {
+                    pace_probes(engine, get_monotonic_time());
+                }
+            }
+            else if (events[i].data.fd == engine->timer_fd)
+            {
+                handle_timer(engine);
+            }
+            else if (events[i].data.fd == global_ping.stop_fd)
+            {
+                engine->finished = true;
+            }
+            else if (engine->resolver && resolver_owns_fd(engine->resolver, events[i].data.fd))
+            {
+                handle_resolver_event(engine, events[i].data.fd);
+            }
+            else if (engine->service)
+            {
+                handle_service_event(engine, events[i].data.fd, events[i].events);
+            }
+            else if (engine->metrics)
+            {
+                handle_metrics_event(engine, events[i].data.fd, events[i].events);
+            }
+        }
+
+        // Replies completed while a batch was being sent wait for no further event
+        if (engine->uring && engine->uring->pending_count)
+        {
+            receive_io_uring(engine);
+        }
+
+        // The adaptive mode is clocked by the replies, each one lets its target send the next probe,
+        // and so are the rounds of --pmtu
+        if (engine->ready_count)
+        {
+            if (global_ping.pmtu)
+                end_ready_pmtu_rounds(engine, get_monotonic_time());
+            else
+                send_ready_probes(engine, get_monotonic_time());
+            arm_timer_at_next_deadline(engine);
+        }
+
+        // A reply to --pmtu may have brought the end of its round closer
+        else if (global_ping.pmtu)
+        {
+            arm_timer_at_next_deadline(engine);
+        }
+
+        // Targets whose name was just resolved start on the next tick
+        if (engine->resolver)
+        {
+            run_resolver(engine->resolver, engine, get_monotonic_time());
+            arm_timer_at_next_deadline(engine);
+        }
+
+        // The results of the service go out once per iteration, and new checks start on the next tick
+        if (engine->service)
+        {
+            flush_service_results(engine);
+            arm_timer_at_next_deadline(engine);
+        }
+
+        // Stop as soon as every probe is answered, or wait for the last replies
+        // no longer than the timeout. The path MTU is known once the last round ends. The
+        // service runs until it is stopped.
+        if (!engine->active_targets && !engine->service)
+        {
+            if (engine->packets_in_flight == 0 || global_ping.pmtu)
+            {
+                engine->finished = true;
+            }
+            else if (!engine->lingering)
+            {
+                arm_timer(engine, global_ping.timeout_ns, 0);
+                engine->lingering = true;
+            }
+        }
+
+        // The consumer of the pipeline owns the output and the live statistics, it is
+        // woken once per iteration
+        uint64_t now = get_monotonic_time();
+        if (global_ping.compare_latency)
+        {
+            alternate_low_latency(engine, now);
+        }
+        if (engine->pipeline)
+        {
+            wake_pipeline(engine);
+            continue;
+        }
+        if (engine->output)
+        {
+            flush_output(engine, now, engine->finished);
+        }
+        if (global_ping.shared_stats)
+        {
+            engine->unpublished |= event_count > 0;
+            if (engine->unpublished && (engine->finished || now - engine->last_publish >= SHM_PUBLISH_NS))
+            {
+                publish_shared_stats(engine, now);
+            }
+        }
+    }
+
+    stop_pipeline(engine);
+    if (engine->resolver)
+    {
+        close_resolver(engine->resolver);
+        engine->resolver = NULL;
+    }
+
+    // The thread running the first engine goes on to print the summary
+    if (engine->low_latency_active)
+    {
+        set_low_latency(engine, false);
+    }
+}
@@ -0,0 +1,113 @@
+#include "ping.h"
+
+// Enlarges a socket buffer, past the system limit when running privileged.
+// @param engine The engine owning the socket.
+// @param force_option SO_SNDBUFFORCE or SO_RCVBUFFORCE.
+// @param option SO_SNDBUF or SO_RCVBUF, used when the forced variant is not permitted.
+void enlarge_socket_buffer(ping_engine_t *engine, int force_option, int option)
+{
+    int buffer_size = FLOOD_SOCKET_BUFFER;
+    if (setsockopt(engine->socket, SOL_SOCKET, force_option, &buffer_size, sizeof(buffer_size)) < 0)
+    {
+        setsockopt(engine->socket, SOL_SOCKET, option, &buffer_size, sizeof(buffer_size));
+    }
+}
+
+// Prepares the rate and flood modes: enlarges the socket buffers, which must absorb
+// a whole tick worth of probes and replies.
+// @param engine The engine.
+void initialize_flood(ping_engine_t *engine)
+{
+    enlarge_socket_buffer(engine, SO_SNDBUFFORCE, SO_SNDBUF);
+    enlarge_socket_buffer(engine, SO_RCVBUFFORCE, SO_RCVBUF);
+
+    // The requested rate is shared by the engines in proportion to their targets
+    engine->rate = (double)global_ping.rate * engine->target_count / global_ping.target_count;
+    engine->next_target = engine->first_target;
+    engine->tokens = 0;
+    engine->last_refill = get_monotonic_time();
+}
+
+// Period of the timer driving the rate and flood modes.
+// Slow rates tick once per probe, fast rates and floods tick every PACING_TICK_NS
+// and send the accumulated probes in batches.
+// @param engine The engine.
+// @return The period in nanoseconds.
+uint64_t pacing_tick(const ping_engine_t *engine)
+{
+    if (engine->rate && 1000000000 / engine->rate > PACING_TICK_NS)
+    {
+        return 1000000000 / engine->rate;
+    }
+    return PACING_TICK_NS;
+}
+
+// Picks the next target with probes left to send, in round-robin order.
+// @param engine The engine, which must have an active target.
+// @return The index of the target.
+uint32_t next_active_target(ping_engine_t *engine)
+{
+    uint32_t last_target = engine->first_target + engine->target_count - 1;
+    while ("searching")
+    {
+        uint32_t target = engine->next_target;
+        engine->next_target = target == last_target ? engine->first_target : target + 1;
+        if (global_ping.packet_count < 0 || global_ping.targets[target].packets_sent < global_ping.packet_count)
+        {
+            return target;
+        }
+    }
+}
+
+// Sends as many probes as the token bucket, the window and the count allow, in batches,
+// to the targets in turn.
+// The bucket is refilled at the requested rate and holds at most two ticks worth of
+// probes, so that a late wake-up is caught up without bursting.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void pace_probes(ping_engine_t *engine, uint64_t now)
+{
+    unsigned long int budget = global_ping.window;
+
+    // Refill the token bucket
+    if (engine->rate)
+    {
+        double capacity = engine->rate * 2 * pacing_tick(engine) / 1000000000;
+        capacity = capacity > 1 ? capacity : 1;
+        engine->tokens += engine->rate * (now - engine->last_refill) / 1000000000;
+        engine->tokens = engine->tokens < capacity ? engine->tokens : capacity;
+        engine->last_refill = now;
+        budget = engine->tokens;
+    }
+
+    // Stay within the window of probes in flight
+    unsigned long int in_flight = engine->packets_in_flight;
+    unsigned long int window_room = in_flight < global_ping.window ? global_ping.window - in_flight : 0;
+    budget = budget < window_room ? budget : window_room;
+
+    while (budget && engine->active_targets)
+    {
+        uint32_t target = next_active_target(engine);
+        queue_probe(engine, target);
+        --budget;
+
+        // Targets done with their count are no longer picked
+        if (global_ping.packet_count >= 0 && global_ping.targets[target].packets_sent == global_ping.packet_count)
+        {
+            --engine->active_targets;
+        }
+
+        if (engine->batch_length == SEND_BATCH_SIZE || !budget || !engine->active_targets)
+        {
+            unsigned int batch_size = engine->batch_length;
+            unsigned int sent = flush_probes(engine);
+            engine->tokens -= engine->rate ? sent : 0;
+
+            // The socket buffer is full, retry on the next tick
+            if (sent < batch_size)
+            {
+                break;
+            }
+        }
+    }
+}
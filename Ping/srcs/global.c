@@ -7,19 +7,46 @@ ping_state_t global_ping = {
     .packet_size = DEFAULT_PACKET_SIZE,
     .packet_count = -1,
     .quiet = 0,
-    .interval = 1,
+    .flood = 0,
+    .rate = 0,
+    .pacing = PACING_NONE,
+    .adaptive = 0,
+    .preload = DEFAULT_PRELOAD,
+    .cpu = -1,
+    .kernel_timestamps = 0,
+    .datagram = 0,
+    .ring_interface = NULL,
+    .io_uring = 0,
+    .format = FORMAT_TEXT,
+    .report = NULL,
+    .metrics = 0,
+    .service_path = NULL,
+    .resolve_in_engines = false,
+    .pipeline = 0,
+    .shm_name = NULL,
+    .shared_stats = NULL,
+    .interval_ns = DEFAULT_INTERVAL_NS,
+    .timeout_ns = DEFAULT_TIMEOUT_NS,
+    .window = 0,
+    .thread_count = 1,
+    .data_size = 0,
+    .batch_stride = 0,
+    .recv_buffer_size = RECV_BUF_SIZE,
+    .packet = NULL,
 
-    .host = NULL,
+    .hosts = NULL,
+    .host_count = 0,
+    .targets_file = NULL,
+    .multi_target = false,
 
-    .packets_sent = 0,
-    .packets_received = 0,
-    .min_rtt = DBL_MAX,
-    .max_rtt = 0,
-    .total_rtt = 0,
-    .trip_list = NULL,
+    .targets = NULL,
+    .rtt = NULL,
+    .target_count = 0,
 
-    .socket = -1,
-    .address = NULL,
-    .ip_address = {0},
-    .data_size = 0
+    .engines = NULL,
+    .engine_count = 0,
+    .signal_fd = -1,
+    .stop_fd = -1,
+    .done_fd = -1,
+    .start_time = 0
 };
@@ -0,0 +1,379 @@
+#include "ping.h"
+
+// Completion tag of the multishot receive, sends are tagged with their index in the batch
+#define URING_RECEIVE_TAG UINT64_MAX
+
+// Group of the provided receive buffers
+#define URING_BUFFER_GROUP 0
+
+// Maps a region of the io_uring instance.
+// @param fd The io_uring file descriptor.
+// @param size The size of the region.
+// @param offset The offset identifying the region.
+// @return The mapped region.
+static void *map_io_uring(int fd, size_t size, off_t offset)
+{
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (region == MAP_FAILED)
+    {
+        perror("ping: mmap io_uring");
+        exit(1);
+    }
+    return region;
+}
+
+// Submits the queued entries and optionally waits for completions.
+// @param uring The io_uring instance.
+// @param submit The number of entries to submit.
+// @param wait The number of completions to wait for.
+// @return The number of entries submitted, -1 on error.
+static int enter_io_uring(io_uring_t *uring, unsigned int submit, unsigned int wait)
+{
+    return syscall(__NR_io_uring_enter, uring->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+// Gets the next free submission queue entry, cleared.
+// The queue is large enough for a send batch and the receive, it is never full.
+// @param uring The io_uring instance.
+// @return The entry, submitted with the next enter_io_uring().
+static struct io_uring_sqe *get_sqe(io_uring_t *uring)
+{
+    unsigned int tail = *uring->sq_tail;
+    unsigned int index = tail & uring->sq_mask;
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Gives a provided buffer back to the kernel.
+// @param uring The io_uring instance.
+// @param buffer_id The id of the buffer.
+static void recycle_buffer(io_uring_t *uring, unsigned short buffer_id)
+{
+    struct io_uring_buf_ring *ring = uring->buffer_ring;
+    unsigned short tail = ring->tail;
+    struct io_uring_buf *buffer = &ring->bufs[tail & (URING_BUFFER_COUNT - 1)];
+    buffer->addr = (uintptr_t)(uring->buffers + buffer_id * uring->buffer_size);
+    buffer->len = uring->buffer_size;
+    buffer->bid = buffer_id;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Registers the ring of provided buffers the multishot receive picks its buffers from.
+// @param uring The io_uring instance.
+// @return 0 on success, -1 if the kernel does not support provided buffer rings.
+static int register_buffers(io_uring_t *uring)
+{
+    // Each buffer holds the receive header, the source address, the control messages and the reply
+    uring->recv_message.msg_namelen = sizeof(struct sockaddr_in);
+    uring->recv_message.msg_controllen = global_ping.kernel_timestamps ? CMSG_SPACE(sizeof(struct scm_timestamping)) : 0;
+    uring->buffer_size = sizeof(struct io_uring_recvmsg_out) + uring->recv_message.msg_namelen +
+                         uring->recv_message.msg_controllen + global_ping.recv_buffer_size;
+    uring->buffers = malloc(URING_BUFFER_COUNT * uring->buffer_size);
+    if (uring->buffers == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
+    uring->buffer_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->buffer_ring == MAP_FAILED)
+    {
+        perror("ping: mmap");
+        exit(1);
+    }
+
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uintptr_t)uring->buffer_ring,
+        .ring_entries = URING_BUFFER_COUNT,
+        .bgid = URING_BUFFER_GROUP};
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+    {
+        return -1;
+    }
+
+    uring->buffer_ring->tail = 0;
+    for (unsigned short i = 0; i < URING_BUFFER_COUNT; ++i)
+    {
+        recycle_buffer(uring, i);
+    }
+    return 0;
+}
+
+// Sets up the io_uring of an engine, when --io-uring is given and the kernel supports it.
+// The engine otherwise keeps sending with sendmmsg() and receiving with recvmmsg().
+// Must be called from the thread running the engine, the only one submitting to it.
+// @param engine The engine, whose uring stays NULL without io_uring.
+void open_io_uring(ping_engine_t *engine)
+{
+    io_uring_t *uring = calloc(1, sizeof(io_uring_t));
+    if (uring == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+
+    // The receive work is deferred to the io_uring_enter() calls of the engine thread, which
+    // then reaps the replies in batches, older kernels do it from task work on each arrival
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        .cq_entries = URING_CQ_ENTRIES};
+    uring->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    if (uring->fd < 0 && errno == EINVAL)
+    {
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        uring->fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &params);
+    }
+    if (uring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || register_buffers(uring) < 0)
+    {
+        if (global_ping.verbose)
+        {
+            fprintf(stderr, "ping: io_uring not supported, using sendmmsg() and recvmmsg()\n");
+        }
+        if (uring->fd >= 0)
+        {
+            close(uring->fd);
+        }
+        free(uring->buffers);
+        free(uring);
+        return;
+    }
+
+    // The submission and completion queues share one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char *rings = map_io_uring(uring->fd, sq_size > cq_size ? sq_size : cq_size, IORING_OFF_SQ_RING);
+    uring->sq_head = (unsigned int *)(rings + params.sq_off.head);
+    uring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    uring->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned int *)(rings + params.sq_off.array);
+    uring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+    uring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    uring->cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+    uring->sqes = map_io_uring(uring->fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+
+    engine->uring = uring;
+}
+
+// Arms the multishot receive, which keeps completing with the replies until it runs
+// out of provided buffers.
+// @param engine The engine.
+static void arm_receive(ping_engine_t *engine)
+{
+    io_uring_t *uring = engine->uring;
+    struct io_uring_sqe *sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = engine->socket;
+    sqe->addr = (uintptr_t)&uring->recv_message;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECEIVE_TAG;
+
+    if (enter_io_uring(uring, 1, 0) < 0)
+    {
+        perror("ping: io_uring_enter");
+        exit(1);
+    }
+    ++engine->receive_calls;
+    uring->receiving = true;
+}
+
+// Starts receiving through the io_uring of an engine. Must be called from the thread
+// running the engine, which then does the receive work the completions need.
+// A kernel without multishot receive refuses it at once, the engine then goes back
+// to recvmmsg() and sendmmsg().
+// @param engine The engine, whose uring is reset to NULL on fallback.
+void start_io_uring(ping_engine_t *engine)
+{
+    io_uring_t *uring = engine->uring;
+    arm_receive(engine);
+
+    unsigned int head = *uring->cq_head;
+    if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+    if (cqe->user_data == URING_RECEIVE_TAG && cqe->res == -EINVAL)
+    {
+        if (global_ping.verbose)
+        {
+            fprintf(stderr, "ping: io_uring multishot receive not supported, using sendmmsg() and recvmmsg()\n");
+        }
+        close(uring->fd);
+        engine->uring = NULL;
+    }
+}
+
+// Sends a batch of messages as a chain of linked sends, with a single system call.
+// The sends do not wait for room in the socket buffer, and a failed send cancels the
+// following ones, so the outcome is the one of sendmmsg().
+// @param engine The engine.
+// @param messages The messages to send.
+// @param count The number of messages, at most SEND_BATCH_SIZE.
+// @return The number of messages sent, or -1 with errno set if the first one failed.
+int send_io_uring(ping_engine_t *engine, struct mmsghdr *messages, unsigned int count)
+{
+    io_uring_t *uring = engine->uring;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        struct io_uring_sqe *sqe = get_sqe(uring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = engine->socket;
+        sqe->addr = (uintptr_t)&messages[i].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        sqe->user_data = i;
+    }
+
+    // The sends complete before the call returns, as they never wait
+    if (enter_io_uring(uring, count, count) < 0)
+    {
+        perror("ping: io_uring_enter");
+        exit(1);
+    }
+
+    // Collect the send results, the replies are kept for the next receive
+    unsigned int completed = 0;
+    while (completed < count)
+    {
+        unsigned int head = *uring->cq_head;
+        unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            if (enter_io_uring(uring, 0, 1) < 0 && errno != EINTR)
+            {
+                perror("ping: io_uring_enter");
+                exit(1);
+            }
+            continue;
+        }
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+            if (cqe->user_data == URING_RECEIVE_TAG)
+            {
+                uring->pending[uring->pending_count++] = *cqe;
+            }
+            else
+            {
+                uring->send_results[cqe->user_data] = cqe->res;
+                ++completed;
+            }
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    int sent = 0;
+    while (sent < (int)count && uring->send_results[sent] >= 0)
+    {
+        ++sent;
+    }
+    if (sent == 0)
+    {
+        errno = -uring->send_results[0];
+        return -1;
+    }
+    return sent;
+}
+
+// Handles a completion of the multishot receive: the reply is read from its provided
+// buffer, which is given back to the kernel.
+// @param engine The engine.
+// @param cqe The completion.
+// @param recv_time The monotonic time the completions are reaped, in nanoseconds.
+static void complete_receive(ping_engine_t *engine, const struct io_uring_cqe *cqe, uint64_t recv_time)
+{
+    io_uring_t *uring = engine->uring;
+
+    // Without more completions to come, the receive must be armed again
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        uring->receiving = false;
+    }
+    if (cqe->res < 0 && cqe->res != -ENOBUFS)
+    {
+        errno = -cqe->res;
+        perror("ping: io_uring recvmsg");
+        exit(1);
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        return;
+    }
+
+    unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buffer = uring->buffers + buffer_id * uring->buffer_size;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+    char *name = buffer + sizeof(*out);
+    char *control = name + uring->recv_message.msg_namelen;
+    char *payload = control + uring->recv_message.msg_controllen;
+
+    uint64_t kernel_recv_time = 0;
+    if (global_ping.kernel_timestamps)
+    {
+        struct msghdr message = {.msg_control = control, .msg_controllen = out->controllen};
+        kernel_recv_time = kernel_receive_time(&message);
+    }
+    if (out->namelen >= sizeof(struct sockaddr_in) && !(out->flags & MSG_TRUNC))
+    {
+        process_message(engine, payload, out->payloadlen, ((struct sockaddr_in *)name)->sin_addr, recv_time, kernel_recv_time);
+    }
+    recycle_buffer(uring, buffer_id);
+}
+
+// Reads the replies completed by the multishot receive, without any system call.
+// Called by the event loop when the io_uring becomes readable.
+// @param engine The engine.
+void receive_io_uring(ping_engine_t *engine)
+{
+    io_uring_t *uring = engine->uring;
+
+    // Transmit timestamps must be attached to the probes before their replies are timed
+    if (global_ping.kernel_timestamps || global_ping.datagram)
+    {
+        receive_error_queue(engine);
+    }
+
+    // Run the deferred receive work, which posts the completions
+    if (enter_io_uring(uring, 0, 0) < 0 && errno != EINTR)
+    {
+        perror("ping: io_uring_enter");
+        exit(1);
+    }
+    ++engine->receive_calls;
+
+    uint64_t recv_time = get_monotonic_time();
+    expire_probes(engine, recv_time);
+
+    // Replies met while sending come first
+    for (unsigned int i = 0; i < uring->pending_count; ++i)
+    {
+        complete_receive(engine, &uring->pending[i], recv_time);
+    }
+    uring->pending_count = 0;
+
+    unsigned int head = *uring->cq_head;
+    unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+        if (cqe->user_data == URING_RECEIVE_TAG)
+        {
+            complete_receive(engine, cqe, recv_time);
+        }
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    // The buffers are given back, receive again if they had run out
+    if (!uring->receiving)
+    {
+        arm_receive(engine);
+    }
+}
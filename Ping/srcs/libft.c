@@ -35,25 +35,75 @@ unsigned short swap_endianess_16(unsigned short value)
 }
 
 // Calculates the checksum of a given data buffer using the Internet checksum algorithm.
+// The one's complement sum does not depend on the word size it is computed with (RFC 1071),
+// so the data is summed 64 bits at a time, as two 32-bit halves accumulated in 64 bits
+// which cannot overflow, and only folded to 16 bits at the end.
 // @param data_ptr: pointer to the start of the data buffer
 // @param data_size: size of the data buffer
 // @return the calculated checksum as an unsigned short
 uint16_t calculate_checksum(void *data_ptr, size_t data_size)
 {
-    uint16_t *data = data_ptr;
+    const uint8_t *data = data_ptr;
     uint64_t sum = 0;
 
-    // Sum up the uint16_t values in the data block
-    while (data_size >= sizeof(*data))
+    // Sum up the 64-bit words in the data block, with four independent accumulators
+    uint64_t partial_sums[4] = {0};
+    while (data_size >= 4 * sizeof(uint64_t))
     {
-        sum += *data++;
-        data_size -= sizeof(*data);
+        for (int i = 0; i < 4; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, data + i * sizeof(word), sizeof(word));
+            partial_sums[i] += (word & 0xffffffff) + (word >> 32);
+        }
+        data += 4 * sizeof(uint64_t);
+        data_size -= 4 * sizeof(uint64_t);
+    }
+    sum = (partial_sums[0] & 0xffffffff) + (partial_sums[0] >> 32) + (partial_sums[1] & 0xffffffff) + (partial_sums[1] >> 32) +
+          (partial_sums[2] & 0xffffffff) + (partial_sums[2] >> 32) + (partial_sums[3] & 0xffffffff) + (partial_sums[3] >> 32);
+
+    // Sum up the remaining uint16_t values
+    while (data_size >= sizeof(uint16_t))
+    {
+        uint16_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += sizeof(word);
+        data_size -= sizeof(word);
     }
 
     // If there is any remaining data, add it to the sum as a uint8_t value
     if (data_size)
     {
-        sum += *(uint8_t *)data;
+        sum += *data;
+    }
+
+    // Fold the sum into a 16-bit value
+    while (sum & ~0xffff)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (~sum);
+}
+
+// Updates an Internet checksum after some 16-bit words of the data changed, without
+// summing the data again: HC' = ~(~HC + ~m + m') for each old word m and new word m' (RFC 1624).
+// @param checksum: the checksum of the data before the change
+// @param old_data: the words before the change
+// @param new_data: the words after the change
+// @param data_size: size of the changed words, even
+// @return the checksum of the data after the change
+uint16_t update_checksum(uint16_t checksum, const void *old_data, const void *new_data, size_t data_size)
+{
+    uint64_t sum = (uint16_t)~checksum;
+
+    for (size_t i = 0; i < data_size; i += sizeof(uint16_t))
+    {
+        uint16_t old_word;
+        uint16_t new_word;
+        memcpy(&old_word, (const uint8_t *)old_data + i, sizeof(old_word));
+        memcpy(&new_word, (const uint8_t *)new_data + i, sizeof(new_word));
+        sum += (uint16_t)~old_word + new_word;
     }
 
     // Fold the sum into a 16-bit value
@@ -90,15 +140,63 @@ double custom_sqrt(double x)
     return curr;
 }
 
-// Set an alarm for the next packet to be sent, and exit if all packets have been sent.
-// @param None.
-// @return None.
-void next_packet()
+// This function converts a duration in seconds, with an optional fractional part, to nanoseconds.
+// Digits beyond the ninth decimal are ignored.
+// @param s The string to convert, e.g. "2", "0.2" or "0.000050".
+// @return The converted duration in nanoseconds.
+uint64_t parse_seconds(const char *s)
 {
-    if (global_ping.packet_count == global_ping.packets_sent)
+    if (!is_digit(*s) && !(*s == '.' && is_digit(s[1])))
     {
-        statistics_signal_handler();
-        exit(EXIT_SUCCESS);
+        fprintf(stderr, "ping: invalid duration\n");
+        exit(1);
     }
-    alarm(global_ping.interval);
-}
\ No newline at end of file
+    uint64_t seconds = 0;
+    while (is_digit(*s))
+    {
+        seconds = seconds * 10 + *s - '0';
+        ++s;
+    }
+    uint64_t nanoseconds = 0;
+    uint64_t scale = 100000000;
+    if (*s == '.')
+    {
+        ++s;
+        while (is_digit(*s))
+        {
+            nanoseconds += (*s - '0') * scale;
+            scale /= 10;
+            ++s;
+        }
+    }
+    if (*s != '\0')
+    {
+        fprintf(stderr, "ping: invalid duration\n");
+        exit(1);
+    }
+    return seconds * 1000000000UL + nanoseconds;
+}
+
+// Reads the monotonic clock, which is immune to wall-clock adjustments.
+// @return The current monotonic time in nanoseconds.
+uint64_t get_monotonic_time(void)
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("ping: clock_gettime");
+        exit(1);
+    }
+    return (uint64_t)now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+// Converts a duration in nanoseconds to a timespec structure.
+// @param nanoseconds The duration to convert.
+// @return The equivalent timespec.
+struct timespec nanoseconds_to_timespec(uint64_t nanoseconds)
+{
+    struct timespec ts = {
+        .tv_sec = nanoseconds / 1000000000UL,
+        .tv_nsec = nanoseconds % 1000000000UL};
+    return ts;
+}
@@ -0,0 +1,198 @@
+#include "ping.h"
+
+// Features of the low-latency mode the system refused, each one is warned about once
+#define LOW_LATENCY_PINNING (1 << 0)
+#define LOW_LATENCY_BUSY_POLL (1 << 1)
+#define LOW_LATENCY_REALTIME (1 << 2)
+
+static int unavailable_features;
+
+// Warns that a feature of the low-latency mode is not available and disables it, for the
+// other engines and the following phases.
+// @param feature The LOW_LATENCY_* feature.
+// @param call The call that failed, reported with errno.
+static void disable_feature(int feature, const char *call)
+{
+    if (!(__atomic_fetch_or(&unavailable_features, feature, __ATOMIC_RELAXED) & feature))
+    {
+        fprintf(stderr, "ping: warning: %s: %s\n", call, strerror(errno));
+    }
+}
+
+// Tells if a feature of the low-latency mode is still available.
+// @param feature The LOW_LATENCY_* feature.
+static bool feature_available(int feature)
+{
+    return !(__atomic_load_n(&unavailable_features, __ATOMIC_RELAXED) & feature);
+}
+
+// Sets the busy-poll time of a socket: receives spin on the device queue for up to that
+// long instead of sleeping until the interrupt, preferably to the interrupts themselves.
+// @param fd The socket.
+// @param busy_poll_us The busy-poll time in microseconds, 0 to stop busy-polling.
+static void set_busy_poll(int fd, int busy_poll_us)
+{
+    int prefer = busy_poll_us > 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0)
+    {
+        disable_feature(LOW_LATENCY_BUSY_POLL, "setsockopt SO_BUSY_POLL");
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0)
+    {
+        disable_feature(LOW_LATENCY_BUSY_POLL, "setsockopt SO_PREFER_BUSY_POLL");
+    }
+}
+
+// Saves the scheduling of the thread running an engine and picks the CPU it is pinned
+// to in low-latency mode: --cpu, or the CPU it runs on, plus the index of the engine.
+// @param engine The engine, run by the calling thread.
+void initialize_low_latency(ping_engine_t *engine)
+{
+    engine->low_latency_active = false;
+    engine->phase_end = global_ping.start_time + LOW_LATENCY_PHASE_NS;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(engine->saved_affinity), &engine->saved_affinity) != 0)
+    {
+        CPU_ZERO(&engine->saved_affinity);
+    }
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int base = global_ping.cpu >= 0 ? global_ping.cpu : sched_getcpu();
+    engine->cpu = (base + (engine - global_ping.engines)) % (cpu_count > 0 ? cpu_count : 1);
+
+    if (global_ping.compare_latency)
+    {
+        engine->phase_rtt = malloc(2 * sizeof(rtt_stats_t));
+        if (engine->phase_rtt == NULL)
+        {
+            perror("ping: malloc");
+            exit(1);
+        }
+        initialize_rtt_stats(&engine->phase_rtt[0]);
+        initialize_rtt_stats(&engine->phase_rtt[1]);
+    }
+}
+
+// Switches the thread running an engine in or out of low latency: pinned to its CPU,
+// busy-polling its sockets and, with --realtime, scheduled SCHED_FIFO. Out of it, the
+// thread gets back its CPUs and the default scheduling.
+// @param engine The engine, run by the calling thread.
+// @param active Whether to enter low latency.
+void set_low_latency(ping_engine_t *engine, bool active)
+{
+    engine->low_latency_active = active;
+
+    if (feature_available(LOW_LATENCY_PINNING))
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(engine->cpu, &cpus);
+        const cpu_set_t *affinity = active ? &cpus : &engine->saved_affinity;
+        if ((active || CPU_COUNT(affinity)) && (errno = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), affinity)) != 0)
+        {
+            disable_feature(LOW_LATENCY_PINNING, "pthread_setaffinity_np");
+        }
+    }
+
+    if (feature_available(LOW_LATENCY_BUSY_POLL))
+    {
+        set_busy_poll(engine->socket, active ? LOW_LATENCY_BUSY_POLL_US : 0);
+        if (engine->ring_socket >= 0)
+        {
+            set_busy_poll(engine->ring_socket, active ? LOW_LATENCY_BUSY_POLL_US : 0);
+        }
+    }
+
+    if (global_ping.realtime && feature_available(LOW_LATENCY_REALTIME))
+    {
+        struct sched_param param = {.sched_priority = active ? LOW_LATENCY_PRIORITY : 0};
+        if ((errno = pthread_setschedparam(pthread_self(), active ? SCHED_FIFO : SCHED_OTHER, &param)) != 0)
+        {
+            disable_feature(LOW_LATENCY_REALTIME, "pthread_setschedparam");
+        }
+    }
+}
+
+// Alternates the default and the low-latency phases of an engine with --compare, so that
+// both see the same path over the same run.
+// @param engine The engine, run by the calling thread.
+// @param now The current monotonic time, in nanoseconds.
+void alternate_low_latency(ping_engine_t *engine, uint64_t now)
+{
+    if (now < engine->phase_end)
+    {
+        return;
+    }
+    set_low_latency(engine, !engine->low_latency_active);
+    engine->phase_end = now + LOW_LATENCY_PHASE_NS;
+}
+
+// Locks the memory of the process, the buffers allocated up front and those to come,
+// so that no page fault delays a probe or a reply. A failure only costs the guarantee.
+void lock_memory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        perror("ping: warning: mlockall");
+        return;
+    }
+    global_ping.memory_locked = true;
+}
+
+// Prints what the low-latency mode got from the system and, with --compare, the round trip
+// times of the replies read in each phase and how much low latency reduced their variance.
+void report_low_latency(void)
+{
+    if (!global_ping.low_latency)
+    {
+        return;
+    }
+
+    fprintf(global_ping.report, "low latency: %s cpu %d, busy poll %s, %s scheduling, memory %s\n",
+            feature_available(LOW_LATENCY_PINNING) ? "pinned to" : "not pinned to",
+            global_ping.engines[0].cpu,
+            feature_available(LOW_LATENCY_BUSY_POLL) ? "on" : "off",
+            global_ping.realtime && feature_available(LOW_LATENCY_REALTIME) ? "SCHED_FIFO" : "default",
+            global_ping.memory_locked ? "locked" : "not locked");
+    if (!global_ping.compare_latency)
+    {
+        return;
+    }
+
+    rtt_stats_t phases[2];
+    initialize_rtt_stats(&phases[0]);
+    initialize_rtt_stats(&phases[1]);
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        merge_rtt_stats(&phases[0], &global_ping.engines[i].phase_rtt[0]);
+        merge_rtt_stats(&phases[1], &global_ping.engines[i].phase_rtt[1]);
+    }
+
+    const char *names[2] = {"default", "low latency"};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (!phases[i].count)
+        {
+            fprintf(global_ping.report, "%s phase: no replies\n", names[i]);
+            continue;
+        }
+        fprintf(global_ping.report, "%s phase: %lu replies, rtt min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
+                names[i], (unsigned long)phases[i].count,
+                (double)phases[i].min_ns / 1000000, phases[i].mean_ns / 1000000,
+                (double)phases[i].max_ns / 1000000, rtt_stddev(&phases[i]));
+    }
+
+    // The variance needs two replies in each phase
+    if (phases[0].count < 2 || phases[1].count < 2)
+    {
+        return;
+    }
+    double default_variance = rtt_stddev(&phases[0]) * rtt_stddev(&phases[0]);
+    double low_latency_variance = rtt_stddev(&phases[1]) * rtt_stddev(&phases[1]);
+    if (default_variance > 0)
+    {
+        fprintf(global_ping.report, "rtt variance %s by %.1f%% in low latency\n",
+                low_latency_variance <= default_variance ? "reduced" : "increased",
+                fabs(1 - low_latency_variance / default_variance) * 100);
+    }
+}
@@ -5,19 +5,54 @@ int main(const int argc, const char **argv)
     // parse command line arguments
     parse_args(argc, argv);
 
-    // initialize network [address, socket, etc.]
-    initialize_network();
+    // resolve the targets given on the command line or in the targets file, or make room for
+    // the checks of the service
+    if (global_ping.service_path)
+        initialize_service();
+    else
+        load_targets();
+
+    // size the probes for the path MTU discovery, up to the largest MTU of the routes
+    if (global_ping.pmtu)
+        initialize_pmtu();
+
+    // initialize network [reference packet, one socket per engine, etc.]
+    initialize_packet();
+    initialize_engines();
 
     // print ping header
-    printf("PING %s (%s): %lu data bytes\n", global_ping.host, global_ping.ip_address, global_ping.packet_size);
+    if (global_ping.service_path)
+        fprintf(global_ping.report, "PING service on %s: %lu data bytes at most\n", global_ping.service_path, global_ping.packet_size);
+    else if (global_ping.multi_target)
+        fprintf(global_ping.report, "PING %u targets: %lu data bytes\n", global_ping.target_count, global_ping.packet_size);
+    else
+        fprintf(global_ping.report, "PING %s (%s): %lu data bytes\n", global_ping.targets[0].host, global_ping.targets[0].ip_address, global_ping.packet_size);
+
+    // write the header of the binary records, publish the live statistics and open the rtt log
+    start_output();
+    open_shared_stats();
+    open_rtt_log();
+
+    // fault in and lock the buffers, so that no page fault delays a probe or a reply
+    if (global_ping.low_latency)
+        lock_memory();
+
+    // start pinging: probes are driven by timers, replies by socket readiness
+    run_engines();
+
+    // the service has no statistics of its own targets, only of what it served
+    if (global_ping.service_path)
+    {
+        close_service();
+        return 0;
+    }
 
-    // set signal handlers
-    signal(SIGINT, (void (*)())statistics_signal_handler);
-    signal(SIGALRM, (void (*)())ping_signal_handler);
+    // the live statistics are over, readers only see the segment while ping runs
+    close_shared_stats();
 
-    // start pinging
-    ping_signal_handler();
+    // write the blocks of the rtt log still being compressed
+    close_rtt_log();
 
-    while ("pinging")
-        ; // ping
-}
\ No newline at end of file
+    // print the statistics of every target, merged once the engines are stopped
+    statistics_signal_handler();
+}
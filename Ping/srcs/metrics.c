@@ -0,0 +1,468 @@
+#include "ping.h"
+
+// Upper bounds of the round trip time histogram exported to Prometheus, in nanoseconds
+// (100 us to 10 s), summed from the buckets of the statistics at each scrape
+static const uint64_t rtt_bounds_ns[] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000};
+static const char *rtt_bounds_labels[] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "2.5", "5", "10"};
+#define RTT_BOUND_COUNT (sizeof(rtt_bounds_ns) / sizeof(*rtt_bounds_ns))
+
+// Longest labels of a target, its escaped host truncated to fit
+#define MAX_LABELS_SIZE 640
+
+// Counters exported for each target
+#define COUNTER_COUNT 6
+static const char *counter_names[COUNTER_COUNT] = {
+    "ping_probes_sent_total", "ping_replies_received_total", "ping_probes_lost_total",
+    "ping_late_replies_total", "ping_duplicate_replies_total", "ping_reordered_replies_total"};
+static const char *counter_help[COUNTER_COUNT] = {
+    "Echo requests sent to the target.",
+    "Echo replies received from the target in time, accounted in the round trip times.",
+    "Echo requests without a reply within the timeout.",
+    "Echo replies received after their probe expired.",
+    "Echo replies received more than once.",
+    "Echo replies received after the reply of a newer probe."};
+
+// Metric families, each one listed for every target in turn: the counters, then the
+// loss ratio, the round trip time histogram, the loss burst and reorder extent
+// histograms and the jitter
+#define LOSS_FAMILY COUNTER_COUNT
+#define RTT_FAMILY (COUNTER_COUNT + 1)
+#define BURST_FAMILY (COUNTER_COUNT + 2)
+#define EXTENT_FAMILY (COUNTER_COUNT + 3)
+#define JITTER_FAMILY (COUNTER_COUNT + 4)
+#define FAMILY_COUNT (COUNTER_COUNT + 5)
+
+// Appends formatted text to the response chunk of a connection, grown as needed.
+// @param client The connection.
+// @param format The printf() format of the text.
+static void append(metrics_client_t *client, const char *format, ...)
+{
+    va_list args;
+    while (true)
+    {
+        size_t room = client->response_capacity - client->response_length;
+        va_start(args, format);
+        int length = vsnprintf(client->response + client->response_length, room, format, args);
+        va_end(args);
+        if (length < 0)
+        {
+            perror("ping: vsnprintf");
+            exit(1);
+        }
+        if ((size_t)length < room)
+        {
+            client->response_length += length;
+            return;
+        }
+
+        client->response_capacity = client->response_capacity * 2 + length;
+        client->response = realloc(client->response, client->response_capacity);
+        if (client->response == NULL)
+        {
+            perror("ping: realloc");
+            exit(1);
+        }
+    }
+}
+
+// Formats the labels identifying a target, its host escaped as a label value. The address
+// is formatted from the one the engine stores whole, which it may be resolving meanwhile.
+// @param labels Where to write the labels, at least MAX_LABELS_SIZE bytes.
+// @param target The target.
+static void format_labels(char *labels, const ping_target_t *target)
+{
+    struct in_addr address = {.s_addr = __atomic_load_n(&target->address.sin_addr.s_addr, __ATOMIC_RELAXED)};
+    char ip_address[INET_ADDRSTRLEN] = "";
+    if (address.s_addr)
+    {
+        inet_ntop(AF_INET, &address, ip_address, sizeof(ip_address));
+    }
+
+    char *out = labels + sprintf(labels, "target=\"");
+    for (const char *c = target->host; *c && out - labels < MAX_LABELS_SIZE - INET_ADDRSTRLEN - 32; ++c)
+    {
+        if (*c == '\\' || *c == '"' || *c == '\n')
+            *out++ = '\\';
+        *out++ = *c == '\n' ? 'n' : *c;
+    }
+    sprintf(out, "\",address=\"%s\"", ip_address);
+}
+
+// Gives a counter of a target, loaded whole while its engine may update it.
+// @param target The target.
+// @param counter The index of the counter in counter_names.
+// @return The value of the counter.
+static int read_counter(const ping_target_t *target, int counter)
+{
+    const int *values[COUNTER_COUNT] = {
+        &target->packets_sent, &target->packets_received, &target->lost_probes, &target->late_replies,
+        &target->duplicate_replies, &target->reordered_replies};
+    return __atomic_load_n(values[counter], __ATOMIC_RELAXED);
+}
+
+// Appends a histogram of the loss and reordering analytics of a target, its buckets
+// made cumulative as Prometheus expects.
+// @param client The connection.
+// @param name The name of the metric.
+// @param labels The labels of the target.
+// @param histogram The counts of the buckets.
+// @param sum The sum of the lengths.
+static void append_sequence_histogram(metrics_client_t *client, const char *name, const char *labels,
+                                      const uint32_t *histogram, uint64_t sum)
+{
+    uint64_t count = 0;
+    for (unsigned int bucket = 0; bucket < SEQUENCE_HISTOGRAM_BUCKETS; ++bucket)
+    {
+        count += __atomic_load_n(&histogram[bucket], __ATOMIC_RELAXED);
+        uint32_t bound = sequence_bucket_bound(bucket);
+        if (bound)
+            append(client, "%s_bucket{%s,le=\"%u\"} %lu\n", name, labels, bound, count);
+    }
+    append(client, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, count);
+    append(client, "%s_sum{%s} %lu\n", name, labels, sum);
+    append(client, "%s_count{%s} %lu\n", name, labels, count);
+}
+
+// Appends the metrics of a family for one target, preceded by the description of the
+// family before the first target.
+// @param client The connection.
+// @param family The metric family.
+// @param index The index of the target.
+static void append_target_metrics(metrics_client_t *client, unsigned int family, uint32_t index)
+{
+    const ping_target_t *target = &global_ping.targets[index];
+    char labels[MAX_LABELS_SIZE];
+    format_labels(labels, target);
+
+    if (family < COUNTER_COUNT)
+    {
+        if (index == 0)
+            append(client, "# HELP %s %s\n# TYPE %s counter\n", counter_names[family], counter_help[family], counter_names[family]);
+        append(client, "%s{%s} %d\n", counter_names[family], labels, read_counter(target, family));
+        return;
+    }
+
+    if (family == LOSS_FAMILY)
+    {
+        if (index == 0)
+            append(client, "# HELP ping_loss_ratio Share of the settled echo requests without a reply in time, probes in flight excluded.\n"
+                           "# TYPE ping_loss_ratio gauge\n");
+        int lost = __atomic_load_n(&target->lost_probes, __ATOMIC_RELAXED);
+        int settled = lost + __atomic_load_n(&target->packets_received, __ATOMIC_RELAXED);
+        append(client, "ping_loss_ratio{%s} %.6f\n", labels, settled ? (double)lost / settled : 0);
+        return;
+    }
+
+    const sequence_stats_t *sequences = &global_ping.sequences[index];
+    if (family == BURST_FAMILY)
+    {
+        if (index == 0)
+            append(client, "# HELP ping_loss_burst_length Probes lost in a row, settled once %d newer probes were sent.\n"
+                           "# TYPE ping_loss_burst_length histogram\n", SEQUENCE_WINDOW_BITS);
+        append_sequence_histogram(client, "ping_loss_burst_length", labels, sequences->burst_histogram,
+                                  __atomic_load_n(&sequences->burst_losses, __ATOMIC_RELAXED));
+        return;
+    }
+    if (family == EXTENT_FAMILY)
+    {
+        if (index == 0)
+            append(client, "# HELP ping_reorder_extent Sequences between a reordered reply and the newest reply received before it.\n"
+                           "# TYPE ping_reorder_extent histogram\n");
+        append_sequence_histogram(client, "ping_reorder_extent", labels, sequences->extent_histogram,
+                                  __atomic_load_n(&sequences->extent_sum, __ATOMIC_RELAXED));
+        return;
+    }
+    if (family == JITTER_FAMILY)
+    {
+        if (index == 0)
+            append(client, "# HELP ping_jitter_seconds Interarrival jitter of the echo replies (RFC 3550).\n"
+                           "# TYPE ping_jitter_seconds gauge\n");
+        double jitter_ns;
+        __atomic_load(&sequences->jitter_ns, &jitter_ns, __ATOMIC_RELAXED);
+        append(client, "ping_jitter_seconds{%s} %.9f\n", labels, jitter_ns / 1e9);
+        return;
+    }
+
+    if (index == 0)
+        append(client, "# HELP ping_rtt_seconds Round trip times of the echo replies received in time.\n"
+                       "# TYPE ping_rtt_seconds histogram\n");
+    const rtt_stats_t *stats = &global_ping.rtt[index];
+    uint64_t count = __atomic_load_n(&stats->count, __ATOMIC_RELAXED);
+    double mean_ns;
+    __atomic_load(&stats->mean_ns, &mean_ns, __ATOMIC_RELAXED);
+    uint64_t counts[RTT_BOUND_COUNT];
+    rtt_cumulative_counts(stats, rtt_bounds_ns, RTT_BOUND_COUNT, counts);
+    for (unsigned int bound = 0; bound < RTT_BOUND_COUNT; ++bound)
+    {
+        append(client, "ping_rtt_seconds_bucket{%s,le=\"%s\"} %lu\n",
+               labels, rtt_bounds_labels[bound], counts[bound] < count ? counts[bound] : count);
+    }
+    append(client, "ping_rtt_seconds_bucket{%s,le=\"+Inf\"} %lu\n", labels, count);
+    append(client, "ping_rtt_seconds_sum{%s} %.9f\n", labels, mean_ns * count / 1e9);
+    append(client, "ping_rtt_seconds_count{%s} %lu\n", labels, count);
+}
+
+// Builds the next chunk of the metrics, in the Prometheus text exposition format.
+// Only the counters and statistics the engines keep up to date are read, so a scrape
+// costs the same whatever the number of probes sent, and a chunk covers at most
+// METRICS_CHUNK_TARGETS targets, so that probes keep their timing during large scrapes.
+// The targets of the other engines are read while they are updated: each value is loaded
+// with a relaxed atomic, which the engines store the same way, so it is read whole, but a
+// scrape sees the values at slightly different instants, as any scrape racing the updates would.
+// @param client The connection.
+static void build_metrics_chunk(metrics_client_t *client)
+{
+    unsigned int budget = METRICS_CHUNK_TARGETS;
+    while (budget && client->family < FAMILY_COUNT)
+    {
+        for (; budget && client->next_target < global_ping.target_count; --budget)
+        {
+            append_target_metrics(client, client->family, client->next_target++);
+        }
+        if (client->next_target == global_ping.target_count)
+        {
+            ++client->family;
+            client->next_target = 0;
+        }
+    }
+}
+
+// Creates the listening socket of the metrics endpoint, before the engines start,
+// so that an address already in use is reported right away.
+// @return The metrics server, without any client.
+metrics_server_t *open_metrics_server(void)
+{
+    metrics_server_t *server = malloc(sizeof(metrics_server_t));
+    if (server == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+    {
+        server->clients[i].fd = -1;
+    }
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+    {
+        perror("ping: socket metrics");
+        exit(1);
+    }
+    int reuse = 1;
+    if (setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+    {
+        perror("ping: setsockopt SO_REUSEADDR");
+        exit(1);
+    }
+    if (bind(server->listen_fd, (struct sockaddr *)&global_ping.metrics_address, sizeof(global_ping.metrics_address)) < 0)
+    {
+        perror("ping: bind metrics");
+        exit(1);
+    }
+    if (listen(server->listen_fd, SOMAXCONN) < 0)
+    {
+        perror("ping: listen metrics");
+        exit(1);
+    }
+    return server;
+}
+
+// Closes a connection and frees its slot.
+// @param client The connection.
+static void close_client(metrics_client_t *client)
+{
+    close(client->fd);
+    free(client->response);
+    client->fd = -1;
+}
+
+// Accepts the pending connections. When every slot is taken, the oldest connection still
+// sending its request is dropped, and the new one is refused if all are being answered.
+// @param engine The engine serving the endpoint.
+static void accept_clients(ping_engine_t *engine)
+{
+    metrics_server_t *server = engine->metrics;
+    while (true)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)
+                return;
+            perror("ping: accept metrics");
+            return;
+        }
+
+        metrics_client_t *client = NULL;
+        for (int i = 0; i < METRICS_MAX_CLIENTS && (client == NULL || client->fd >= 0); ++i)
+        {
+            metrics_client_t *candidate = &server->clients[i];
+            if (candidate->fd < 0 || (!candidate->responding && (client == NULL || candidate->accept_time < client->accept_time)))
+                client = candidate;
+        }
+        if (client == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        if (client->fd >= 0)
+        {
+            close_client(client);
+        }
+
+        client->fd = fd;
+        client->accept_time = get_monotonic_time();
+        client->request_length = 0;
+        client->responding = false;
+        client->response = NULL;
+        client->response_length = 0;
+        client->response_capacity = 0;
+        client->response_sent = 0;
+        watch_fd(engine, fd, EPOLLIN | EPOLLRDHUP);
+    }
+}
+
+// Starts the response to a complete request: the metrics for GET /metrics, an error otherwise.
+// The metrics are streamed until the connection is closed, their length is not known in advance.
+// @param engine The engine serving the endpoint.
+// @param client The connection.
+static void respond(ping_engine_t *engine, metrics_client_t *client)
+{
+    client->responding = true;
+    client->family = 0;
+    client->next_target = 0;
+
+    if (strncmp(client->request, "GET ", 4) != 0)
+    {
+        append(client, "HTTP/1.1 405 Method Not Allowed\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+                       "Only GET is supported\n");
+        client->family = FAMILY_COUNT;
+    }
+    else if (strncmp(client->request + 4, "/metrics", 8) != 0 || (client->request[12] != ' ' && client->request[12] != '?'))
+    {
+        append(client, "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+                       "Metrics are served on /metrics\n");
+        client->family = FAMILY_COUNT;
+    }
+    else
+    {
+        append(client, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nConnection: close\r\n\r\n");
+    }
+
+    // The response is written each time the socket is writable, a chunk at a time
+    struct epoll_event event = {.events = EPOLLOUT, .data.fd = client->fd};
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, client->fd, &event) < 0)
+    {
+        perror("ping: epoll_ctl");
+        exit(1);
+    }
+}
+
+// Writes as much of the response as the socket takes, building the next chunk once the
+// previous one is written, and closes the connection once the whole response is written.
+// A single chunk is built per call, the event loop calls again while the socket is writable.
+// @param client The connection.
+static void send_response(metrics_client_t *client)
+{
+    if (client->response_sent == client->response_length)
+    {
+        client->response_length = 0;
+        client->response_sent = 0;
+        build_metrics_chunk(client);
+    }
+
+    while (client->response_sent < client->response_length)
+    {
+        ssize_t sent = send(client->fd, client->response + client->response_sent,
+                            client->response_length - client->response_sent, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return;
+            close_client(client);
+            return;
+        }
+        client->response_sent += sent;
+    }
+
+    if (client->family == FAMILY_COUNT)
+    {
+        close_client(client);
+    }
+}
+
+// Reads the request of a connection, and starts the response once its headers are complete.
+// @param engine The engine serving the endpoint.
+// @param client The connection.
+static void read_request(ping_engine_t *engine, metrics_client_t *client)
+{
+    while (true)
+    {
+        ssize_t received = recv(client->fd, client->request + client->request_length,
+                                METRICS_REQUEST_SIZE - 1 - client->request_length, 0);
+        if (received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                close_client(client);
+            return;
+        }
+        if (received == 0)
+        {
+            close_client(client);
+            return;
+        }
+
+        client->request_length += received;
+        client->request[client->request_length] = '\0';
+        if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n"))
+        {
+            respond(engine, client);
+            return;
+        }
+        if (client->request_length == METRICS_REQUEST_SIZE - 1)
+        {
+            close_client(client);
+            return;
+        }
+    }
+}
+
+// Handles an event of the metrics endpoint: new connections, requests and responses.
+// @param engine The engine serving the endpoint.
+// @param fd The file descriptor the event is about.
+// @param events The events notified.
+// @return true if the descriptor belongs to the endpoint.
+bool handle_metrics_event(ping_engine_t *engine, int fd, uint32_t events)
+{
+    metrics_server_t *server = engine->metrics;
+    if (fd == server->listen_fd)
+    {
+        accept_clients(engine);
+        return true;
+    }
+
+    for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+    {
+        metrics_client_t *client = &server->clients[i];
+        if (client->fd != fd)
+            continue;
+
+        if (client->responding)
+            send_response(client);
+        else if (events & (EPOLLERR | EPOLLHUP))
+            close_client(client);
+        else
+            read_request(engine, client);
+        return true;
+    }
+    return false;
+}
@@ -1,57 +1,234 @@
 #include "ping.h"
 
-// The init_network function is responsible for setting up the network connection
-// and socket options needed for sending and receiving ICMP packets.
-void initialize_network()
+// Writes a classic BPF program keeping the echo replies carrying an id and the ICMP errors
+// quoting one of its echo requests. The program reads an IPv4 packet from its IP header.
+// @param code Receives the REPLY_FILTER_LENGTH instructions of the program.
+// @param id The ICMP echo id.
+void build_reply_filter(struct sock_filter *code, unsigned short id)
 {
-    // Create an addrinfo structure with criteria for the address lookup
-    struct addrinfo address_hints = {0};
-    address_hints.ai_family = AF_INET;        // IPv4 addresses only
-    address_hints.ai_socktype = SOCK_RAW;     // raw IP packets
-    address_hints.ai_protocol = IPPROTO_ICMP; // use the ICMP protocol
+    struct sock_filter filter[REPLY_FILTER_LENGTH] = {
+        // X = length of the IP header, A = ICMP type
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
 
-    // Resolve the IP address of the target host
-    int address_lookup_result = getaddrinfo(global_ping.host, NULL, &address_hints, &global_ping.address);
-    if (address_lookup_result < 0)
+        // Echo replies have their id checked, errors the request they quote, the rest is dropped
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 15, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 4, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_SOURCE_QUENCH, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_REDIRECT, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_PARAMETERPROB, 0, 13),
+
+        // The error quotes an IP header carrying ICMP, X = offset of the quoted ICMP header
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, sizeof(icmphdr_t) + offsetof(struct ip, ip_p)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 11),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, sizeof(icmphdr_t)),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, sizeof(icmphdr_t)),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+        // The quoted packet is an echo request
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3),
+
+        // The echo id is ours, loads past the end of the packet drop it too
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(icmphdr_t, un.echo.id)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    memcpy(code, filter, sizeof(filter));
+}
+
+// Attaches the reply filter to a raw socket, so that the kernel only queues the
+// echo replies carrying the id of the engine and the ICMP errors quoting one of its
+// echo requests. The raw socket otherwise receives a copy of every ICMP packet of the
+// host, and every ping running on it would wake up for the replies of the others.
+// When the replies are read from a packet ring, the socket keeps none of them.
+// @param engine The engine owning the socket.
+static void attach_reply_filter(ping_engine_t *engine)
+{
+    // Benchmark builds leave the filter out, to measure the wakeups it saves (make bench_wakeups)
+#ifdef PING_UNFILTERED
+    if (!global_ping.ring_interface)
     {
-        fprintf(stderr, "ping: cannot resolve %s: Unknown host\n", global_ping.host);
-        exit(1);
+        return;
     }
+#endif
+
+    struct sock_filter code[REPLY_FILTER_LENGTH] = {BPF_STMT(BPF_RET | BPF_K, 0)};
+    if (!global_ping.ring_interface)
+    {
+        build_reply_filter(code, engine->id);
+    }
+    struct sock_fprog program = {.len = global_ping.ring_interface ? 1 : REPLY_FILTER_LENGTH, .filter = code};
+
+    // The reply filter only saves work, the replies are checked again in user space,
+    // but the ring would get every reply twice without its filter
+    if (setsockopt(engine->socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+    {
+        perror("ping: setsockopt SO_ATTACH_FILTER");
+        if (global_ping.ring_interface)
+        {
+            exit(1);
+        }
+    }
+}
 
-    // Create a socket for sending and receiving ICMP packets
-    global_ping.socket = socket(global_ping.address->ai_family, SOCK_RAW, IPPROTO_ICMP);
-    if (global_ping.socket < 0)
+// Opens an ICMP datagram socket, which needs no privilege when the group of the process
+// is in net.ipv4.ping_group_range. The kernel rewrites the echo id of the requests with
+// the port the socket is bound to, and only delivers the replies carrying it.
+// ICMP errors are reported on the error queue.
+// @param engine The engine, whose id is set to the one the kernel uses.
+static void open_datagram_socket(ping_engine_t *engine)
+{
+    engine->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_ICMP);
+    if (engine->socket < 0)
     {
         perror("ping: socket");
         exit(1);
     }
 
+    // Ask for our usual id, or let the kernel pick a free one
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(engine->id)};
+    if (bind(engine->socket, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        address.sin_port = 0;
+        if (bind(engine->socket, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            perror("ping: bind");
+            exit(1);
+        }
+    }
+    socklen_t address_length = sizeof(address);
+    if (getsockname(engine->socket, (struct sockaddr *)&address, &address_length) < 0)
+    {
+        perror("ping: getsockname");
+        exit(1);
+    }
+    engine->id = ntohs(address.sin_port);
+
+    // Queue the ICMP errors about our requests
+    int enable = 1;
+    if (setsockopt(engine->socket, IPPROTO_IP, IP_RECVERR, &enable, sizeof(enable)) < 0)
+    {
+        perror("ping: setsockopt IP_RECVERR");
+        exit(1);
+    }
+}
+
+// Gives random bits, from the clock if the kernel has no entropy to spare.
+// @return The random value.
+static uint32_t random_bits(void)
+{
+    uint32_t value;
+    if (getrandom(&value, sizeof(value), GRND_NONBLOCK) != sizeof(value))
+    {
+        value = get_monotonic_time() ^ ((uint64_t)getpid() << 16);
+    }
+    return value;
+}
+
+// Gives the engines the ICMP echo ids that identify our echo requests among every ICMP packet
+// a raw socket receives, so that each engine only accounts the replies to its probes. The
+// engines take a block of consecutive ids from a random base, rather than ids derived from
+// the pid that the next processes started would overlap. Raw sockets cannot hold an id, so
+// two processes may still share one: the random nonce of the probe stamps then tells our
+// replies from theirs.
+void allocate_engine_ids(void)
+{
+    global_ping.nonce = random_bits();
+    uint16_t base = random_bits();
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        global_ping.engines[i].id = (uint16_t)(base + i);
+    }
+}
+
+// The init_network function is responsible for setting up the socket of an engine
+// and the socket options needed for sending and receiving ICMP packets.
+// A raw socket is used when permitted, an unprivileged datagram socket otherwise or on request.
+// @param engine The engine.
+void initialize_network(ping_engine_t *engine)
+{
+    // Create a non-blocking socket for sending and receiving ICMP packets,
+    // replies are read whenever the event loop reports it readable
+    if (!global_ping.datagram)
+    {
+        engine->socket = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_ICMP);
+        if (engine->socket < 0 && (errno == EPERM || errno == EACCES))
+        {
+            if (global_ping.verbose)
+            {
+                fprintf(stderr, "ping: raw sockets not permitted, using ICMP datagram sockets\n");
+            }
+            global_ping.datagram = 1;
+        }
+        else if (engine->socket < 0)
+        {
+            perror("ping: socket");
+            exit(1);
+        }
+        else
+        {
+            attach_reply_filter(engine);
+        }
+    }
+    if (global_ping.datagram)
+    {
+        open_datagram_socket(engine);
+    }
+
     // Set the TTL (time to live) for the packets to the value specified by the user
     int ttl_socket_option = global_ping.time_to_live;
-    int set_ttl_result = setsockopt(global_ping.socket, IPPROTO_IP, IP_TTL, &ttl_socket_option, sizeof(ttl_socket_option));
+    int set_ttl_result = setsockopt(engine->socket, IPPROTO_IP, IP_TTL, &ttl_socket_option, sizeof(ttl_socket_option));
     if (set_ttl_result < 0)
     {
         perror("ping: setsockopt IP_TTL");
         exit(1);
     }
 
-    // Set a timeout for receiving packets
-    struct timeval receive_timeout = {1, 0}; // 1 second timeout
-    int set_receive_timeout_result = setsockopt(global_ping.socket, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
-    if (set_receive_timeout_result < 0)
+    // Time the probes with kernel timestamps rather than around the syscalls
+    if (global_ping.kernel_timestamps)
     {
-        perror("ping: setsockopt SO_RCVTIMEO");
-        exit(1);
+        enable_kernel_timestamps(engine);
     }
 
-    // Convert the IP address of the target host to a string representation
-    const char *ip_address_ptr = inet_ntop(global_ping.address->ai_family, &((struct sockaddr_in *)global_ping.address->ai_addr)->sin_addr, global_ping.ip_address, INET6_ADDRSTRLEN);
-    if (ip_address_ptr == NULL)
+    engine->uring = NULL;
+
+    // Read the replies from a ring shared with the kernel rather than from the socket
+    engine->ring_socket = -1;
+    if (global_ping.ring_interface)
     {
-        perror("ping: inet_ntop");
-        exit(1);
+        open_packet_ring(engine);
     }
+}
 
+// Prepares the reference echo request the replies are compared with.
+void initialize_packet(void)
+{
     // Calculate the total size of the data in each ICMP packet
     global_ping.data_size = global_ping.packet_size + sizeof(icmphdr_t);
+
+    // The packets of a send batch stay aligned for their header, whatever the size
+    global_ping.batch_stride = (global_ping.data_size + 7) & ~(size_t)7;
+
+    // Replies are as large as the probes, behind their IP header, and aligned like the probes
+    if (global_ping.recv_buffer_size < MAX_IP_HEADER_SIZE + global_ping.data_size)
+    {
+        global_ping.recv_buffer_size = (MAX_IP_HEADER_SIZE + global_ping.data_size + 7) & ~(size_t)7;
+    }
+
+    // Allocate the buffer holding the echo request, kept to validate the replies
+    global_ping.packet = malloc(global_ping.data_size);
+    if (global_ping.packet == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
+    // Fill the reference payload the replies are compared with
+    create_packet(NULL, (icmphdr_t *)global_ping.packet);
 }
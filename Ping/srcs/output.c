@@ -0,0 +1,273 @@
+#include "ping.h"
+
+// Longest JSON line of a record, the address and every number at their widest
+#define MAX_JSONL_RECORD_SIZE 192
+
+// Longest JSON line of the summary of a target, its two histograms included
+#define MAX_JSONL_SUMMARY_SIZE 1024
+
+// Serializes the writes of the engines to the standard output, so records stay whole
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Names of the record statuses in JSON lines
+static const char *status_names[] = {"reply", "reordered", "late", "duplicate", "error"};
+
+// Writes a whole buffer to the standard output.
+// @param buffer The bytes to write.
+// @param length The number of bytes.
+static void write_all(const char *buffer, size_t length)
+{
+    while (length)
+    {
+        ssize_t written = write(STDOUT_FILENO, buffer, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ping: write");
+            exit(1);
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+// Writes the header of the binary output: the format, then the address of every target,
+// which the records refer to by index. Called before the engines start.
+void start_output(void)
+{
+    if (global_ping.format != FORMAT_BINARY)
+    {
+        return;
+    }
+
+    ping_record_header_t header = {
+        .magic = htole32(PING_RECORD_MAGIC),
+        .version = htole16(PING_RECORD_VERSION),
+        .record_size = htole16(sizeof(ping_record_t)),
+        .target_count = htole32(global_ping.target_count),
+        .reserved = 0};
+    write_all((const char *)&header, sizeof(header));
+
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        write_all((const char *)&global_ping.targets[i].address.sin_addr.s_addr, sizeof(in_addr_t));
+    }
+}
+
+// Allocates the output buffer of an engine, in the machine-readable formats.
+// @param engine The engine.
+void initialize_output(ping_engine_t *engine)
+{
+    engine->output = NULL;
+    engine->output_length = 0;
+    engine->last_flush = get_monotonic_time();
+    if (global_ping.format == FORMAT_TEXT)
+    {
+        return;
+    }
+
+    engine->output = malloc(OUTPUT_BUFFER_SIZE);
+    if (engine->output == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+}
+
+// Writes the records of an engine when enough of them are buffered, or when they
+// waited long enough, so that slow streams are not held back.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+// @param force Write whatever is buffered.
+void flush_output(ping_engine_t *engine, uint64_t now, bool force)
+{
+    if (!engine->output_length)
+    {
+        engine->last_flush = now;
+        return;
+    }
+    if (!force && engine->output_length < OUTPUT_FLUSH_SIZE && now - engine->last_flush < OUTPUT_FLUSH_NS)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&output_lock);
+    write_all(engine->output, engine->output_length);
+    pthread_mutex_unlock(&output_lock);
+    engine->output_length = 0;
+    engine->last_flush = now;
+}
+
+// Appends the decimal digits of a number.
+// @param out Where to write the digits.
+// @param value The number.
+// @return The position after the digits.
+static char *append_number(char *out, uint64_t value)
+{
+    char digits[20];
+    int length = 0;
+    do
+    {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (length)
+    {
+        *out++ = digits[--length];
+    }
+    return out;
+}
+
+// Appends a string.
+// @param out Where to write the string.
+// @param string The string.
+// @return The position after the string.
+static char *append_string(char *out, const char *string)
+{
+    size_t length = strlen(string);
+    memcpy(out, string, length);
+    return out + length;
+}
+
+// Formats a record as a JSON object on its own line, without going through printf().
+// @param out Where to write the line, at least MAX_JSONL_RECORD_SIZE bytes.
+// @return The position after the line.
+static char *format_jsonl(char *out, uint32_t target, uint32_t sequence, uint64_t rtt_ns,
+                          uint8_t type, uint8_t code, uint8_t ttl, record_status_t status)
+{
+    out = append_string(out, "{\"target\":");
+    out = append_number(out, target);
+    out = append_string(out, ",\"address\":\"");
+    out = append_string(out, global_ping.targets[target].ip_address);
+    out = append_string(out, "\",\"seq\":");
+    out = append_number(out, sequence);
+    out = append_string(out, ",\"rtt_ns\":");
+    out = append_number(out, rtt_ns);
+    out = append_string(out, ",\"type\":");
+    out = append_number(out, type);
+    out = append_string(out, ",\"code\":");
+    out = append_number(out, code);
+    out = append_string(out, ",\"ttl\":");
+    out = append_number(out, ttl);
+    out = append_string(out, ",\"status\":\"");
+    out = append_string(out, status_names[status]);
+    return append_string(out, "\"}\n");
+}
+
+// Buffers the record of a reply or of an ICMP error, in the machine-readable formats.
+// The buffer is written once full, otherwise by flush_output().
+// @param engine The engine that received the message.
+// @param target The index of the target.
+// @param sequence The sequence number of the probe to the target.
+// @param rtt_ns The round trip time, or the time from the probe to the error, in nanoseconds.
+// @param type The ICMP type of the message.
+// @param code The ICMP code of the message.
+// @param ttl The TTL of the message when it arrived, 0 if unknown.
+// @param status What the record reports.
+void write_record(ping_engine_t *engine, uint32_t target, uint32_t sequence, uint64_t rtt_ns,
+                  uint8_t type, uint8_t code, uint8_t ttl, record_status_t status)
+{
+    if (OUTPUT_BUFFER_SIZE - engine->output_length < MAX_JSONL_RECORD_SIZE)
+    {
+        flush_output(engine, engine->last_flush, true);
+    }
+
+    char *out = engine->output + engine->output_length;
+    if (global_ping.format == FORMAT_JSONL)
+    {
+        engine->output_length = format_jsonl(out, target, sequence, rtt_ns, type, code, ttl, status) - engine->output;
+        return;
+    }
+
+    ping_record_t record = {
+        .rtt_ns = htole64(rtt_ns),
+        .target = htole32(target),
+        .sequence = htole32(sequence),
+        .type = type,
+        .code = code,
+        .ttl = ttl,
+        .status = status,
+        .reserved = 0};
+    memcpy(out, &record, sizeof(record));
+    engine->output_length += sizeof(record);
+}
+
+// Appends a histogram of the loss and reordering analytics as a JSON array.
+// @param out Where to write the array.
+// @param histogram The counts of the buckets.
+// @return The position after the array.
+static char *append_histogram(char *out, const uint32_t *histogram)
+{
+    *out++ = '[';
+    for (unsigned int bucket = 0; bucket < SEQUENCE_HISTOGRAM_BUCKETS; ++bucket)
+    {
+        if (bucket)
+            *out++ = ',';
+        out = append_number(out, histogram[bucket]);
+    }
+    *out++ = ']';
+    return out;
+}
+
+// Writes the loss, reordering and jitter analytics of every target as a last JSON line
+// each, with the status "summary", once the analytics are settled. Bucket i of the
+// histograms holds the lengths up to 2^i, the last one everything longer.
+void write_summary_records(void)
+{
+    if (global_ping.format != FORMAT_JSONL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&output_lock);
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        const ping_target_t *target = &global_ping.targets[i];
+        const sequence_stats_t *stats = &global_ping.sequences[i];
+        if (!target->address.sin_family)
+        {
+            continue;
+        }
+        char line[MAX_JSONL_SUMMARY_SIZE];
+        char *out = line;
+        out = append_string(out, "{\"target\":");
+        out = append_number(out, i);
+        out = append_string(out, ",\"address\":\"");
+        out = append_string(out, target->ip_address);
+        out = append_string(out, "\",\"status\":\"summary\",\"sent\":");
+        out = append_number(out, target->packets_sent);
+        out = append_string(out, ",\"received\":");
+        out = append_number(out, target->packets_received);
+        out = append_string(out, ",\"loss_bursts\":");
+        out = append_number(out, stats->bursts);
+        out = append_string(out, ",\"max_loss_burst\":");
+        out = append_number(out, stats->max_burst);
+        out = append_string(out, ",\"loss_burst_histogram\":");
+        out = append_histogram(out, stats->burst_histogram);
+        out = append_string(out, ",\"reordered\":");
+        out = append_number(out, stats->reordered);
+        out = append_string(out, ",\"max_reorder_extent\":");
+        out = append_number(out, stats->max_extent);
+        out = append_string(out, ",\"reorder_extent_histogram\":");
+        out = append_histogram(out, stats->extent_histogram);
+        out = append_string(out, ",\"jitter_ns\":");
+        out = append_number(out, (uint64_t)stats->jitter_ns);
+
+        // The path MTU is found once both bounds meet, a low bound of 0 means no probe got through
+        if (global_ping.pmtu)
+        {
+            const pmtu_state_t *state = &global_ping.pmtu_states[i];
+            out = append_string(out, ",\"path_mtu_low\":");
+            out = append_number(out, state->low >= PMTU_MIN_SIZE ? state->low : 0);
+            out = append_string(out, ",\"path_mtu_high\":");
+            out = append_number(out, state->high);
+        }
+        out = append_string(out, "}\n");
+        write_all(line, out - line);
+    }
+    pthread_mutex_unlock(&output_lock);
+}
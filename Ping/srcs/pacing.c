@@ -0,0 +1,276 @@
+#include "ping.h"
+
+// Lets the sibling hyper-thread run while spinning
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+
+// Upper bounds of the rows of the gap error histogram, in nanoseconds
+static const uint64_t gap_error_bounds[] = {1000, 2000, 5000, 10000, 20000, 50000, 100000, 1000000};
+#define GAP_ERROR_ROWS (sizeof(gap_error_bounds) / sizeof(gap_error_bounds[0]))
+
+// Width of the bar of a row holding every gap
+#define GAP_HISTOGRAM_WIDTH 40
+
+// Measures how late the thread wakes up from a sleep, to know how long before a probe
+// it must stop sleeping and spin. Twice the worst lateness seen is kept, since the
+// sleeps between probes share the thread with the replies.
+// @return The spin threshold in nanoseconds.
+static uint64_t calibrate_spin_threshold(void)
+{
+    uint64_t worst = 0;
+    for (int i = 0; i < PACING_CALIBRATION_ROUNDS; ++i)
+    {
+        uint64_t deadline = get_monotonic_time() + PACING_CALIBRATION_SLEEP_NS;
+        struct timespec wake_time = nanoseconds_to_timespec(deadline);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_time, NULL);
+        uint64_t lateness = get_monotonic_time() - deadline;
+        worst = lateness > worst ? lateness : worst;
+    }
+    return 2 * worst < PACING_SPIN_BUDGET_NS ? 2 * worst : PACING_SPIN_BUDGET_NS;
+}
+
+// Asks the kernel to hold each probe until its transmit time, given on CLOCK_TAI as the
+// etf qdisc expects, and to report the probes it drops for missing it.
+// @param engine The engine owning the socket.
+static void enable_txtime(ping_engine_t *engine)
+{
+    struct sock_txtime txtime = {.clockid = CLOCK_TAI, .flags = SOF_TXTIME_REPORT_ERRORS};
+    if (setsockopt(engine->socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0)
+    {
+        perror("ping: setsockopt SO_TXTIME");
+        exit(1);
+    }
+
+    struct timespec tai;
+    clock_gettime(CLOCK_TAI, &tai);
+    engine->tai_offset_ns = (int64_t)((uint64_t)tai.tv_sec * 1000000000 + tai.tv_nsec) - (int64_t)get_monotonic_time();
+}
+
+// Prepares the report of the send gaps and, with precise pacing, the schedule of the probes.
+// The probes of the engine take turns on its targets, one every period, so that the targets
+// keep their interval or their share of the rate.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_pacing(ping_engine_t *engine, uint64_t now)
+{
+    if (global_ping.rate)
+        engine->probe_period = 1000000000.0 * global_ping.target_count / global_ping.rate / engine->target_count;
+    else
+        engine->probe_period = global_ping.interval_ns / engine->target_count;
+
+    engine->send_gaps = malloc(sizeof(rtt_stats_t));
+    engine->gap_errors = malloc(sizeof(rtt_stats_t));
+    if (engine->send_gaps == NULL || engine->gap_errors == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    initialize_rtt_stats(engine->send_gaps);
+    initialize_rtt_stats(engine->gap_errors);
+    engine->last_gap_time = 0;
+    engine->txtime_misses = 0;
+
+    engine->next_target = engine->first_target;
+    if (global_ping.pacing == PACING_SPIN)
+    {
+        engine->spin_threshold_ns = calibrate_spin_threshold();
+    }
+    else if (global_ping.pacing == PACING_TXTIME)
+    {
+        enable_txtime(engine);
+    }
+
+    // The calibration took a few milliseconds, the schedule starts after it
+    engine->next_probe_time = now > get_monotonic_time() ? now : get_monotonic_time();
+}
+
+// Queues the probe of the next target in turn.
+// @param engine The engine.
+// @param txtime The CLOCK_TAI transmit time of the probe, with --pacing txtime.
+static void queue_next_probe(ping_engine_t *engine, uint64_t txtime)
+{
+    uint32_t target = next_active_target(engine);
+    queue_probe(engine, target);
+    engine->batch_txtimes[engine->batch_length - 1] = txtime;
+
+    // Targets done with their count are no longer picked
+    if (global_ping.packet_count >= 0 && global_ping.targets[target].packets_sent == global_ping.packet_count)
+    {
+        --engine->active_targets;
+    }
+}
+
+// Reads the replies that arrived, from the socket, the io_uring or the packet ring, as the
+// event loop does when they become readable.
+// @param engine The engine.
+static void receive_available(ping_engine_t *engine)
+{
+    if (engine->ring_socket >= 0)
+        receive_packet_ring(engine);
+    else if (engine->uring)
+        receive_io_uring(engine);
+    else
+        receive_replies(engine);
+}
+
+// Sends each probe alone, spinning from the spin threshold until its exact time.
+// Probes closer than the threshold are sent in the same run, which stops after
+// PACING_SPIN_BUDGET_NS to go back to the event loop. The replies are read once per
+// wait, when it leaves enough time, so that they are not delayed by the run.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+// @return The monotonic time to wake up at for the next probe.
+static uint64_t spin_probes(ping_engine_t *engine, uint64_t now)
+{
+    uint64_t run_end = now + PACING_SPIN_BUDGET_NS;
+    while (engine->active_targets && engine->next_probe_time < now + engine->spin_threshold_ns && now < run_end)
+    {
+        bool received = false;
+        while (now < engine->next_probe_time)
+        {
+            if (!received && engine->next_probe_time - now > PACING_RECEIVE_SLACK_NS)
+            {
+                receive_available(engine);
+                received = true;
+            }
+            else
+            {
+                CPU_RELAX();
+            }
+            now = get_monotonic_time();
+        }
+        queue_next_probe(engine, 0);
+        flush_probes(engine);
+        engine->next_probe_time += engine->probe_period;
+        now = get_monotonic_time();
+    }
+    return engine->next_probe_time - engine->spin_threshold_ns;
+}
+
+// Hands the probes due within PACING_TXTIME_LEAD_NS to the kernel in batches, each
+// carrying its transmit time, so that the qdisc rather than the thread spaces them.
+// The engine wakes up again once half of the lead is left, to hand over the next half.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+// @return The monotonic time to wake up at for the next probes.
+static uint64_t send_ahead(ping_engine_t *engine, uint64_t now)
+{
+    while (engine->active_targets && engine->next_probe_time < now + PACING_TXTIME_LEAD_NS)
+    {
+        queue_next_probe(engine, engine->next_probe_time + engine->tai_offset_ns);
+        engine->next_probe_time += engine->probe_period;
+        if (engine->batch_length == SEND_BATCH_SIZE)
+        {
+            flush_probes(engine);
+        }
+    }
+    flush_probes(engine);
+    return engine->next_probe_time - PACING_TXTIME_LEAD_NS / 2;
+}
+
+// Sends the probes of the engine at their intended times, with --pacing spin or txtime.
+// Slots missed by more than a period are skipped rather than caught up with a burst,
+// which would defeat the pacing.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+// @return The monotonic time the probe timer must fire at next.
+uint64_t pace_precisely(ping_engine_t *engine, uint64_t now)
+{
+    if (global_ping.pacing == PACING_TXTIME)
+    {
+        if (engine->next_probe_time < now)
+        {
+            engine->next_probe_time = now + PACING_TXTIME_LEAD_NS / 2;
+        }
+        return send_ahead(engine, now);
+    }
+
+    if (now > engine->next_probe_time + engine->probe_period)
+    {
+        engine->next_probe_time = now;
+    }
+    return spin_probes(engine, now);
+}
+
+// Accounts the time between a probe and the previous one of the engine, against the period.
+// Called in send order, with the user-space send times, or the kernel transmit timestamps
+// with --kernel-timestamps.
+// @param engine The engine.
+// @param sequence The engine-wide sequence number of the probe.
+// @param send_time The time the probe was sent, in nanoseconds.
+void record_send_gap(ping_engine_t *engine, uint32_t sequence, uint64_t send_time)
+{
+    if (engine->last_gap_time && sequence == engine->last_gap_sequence + 1 && send_time >= engine->last_gap_time)
+    {
+        uint64_t gap = send_time - engine->last_gap_time;
+        record_round_trip(engine->send_gaps, gap);
+        record_round_trip(engine->gap_errors, gap > engine->probe_period ? gap - engine->probe_period : engine->probe_period - gap);
+    }
+    engine->last_gap_sequence = sequence;
+    engine->last_gap_time = send_time;
+}
+
+// Prints the achieved gaps between consecutive probes against the intended one, and the
+// histogram of their distance to it, with --pacing.
+void report_send_gaps(void)
+{
+    if (!global_ping.pacing)
+    {
+        return;
+    }
+
+    rtt_stats_t gaps;
+    rtt_stats_t errors;
+    initialize_rtt_stats(&gaps);
+    initialize_rtt_stats(&errors);
+    unsigned long int txtime_misses = 0;
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        merge_rtt_stats(&gaps, global_ping.engines[i].send_gaps);
+        merge_rtt_stats(&errors, global_ping.engines[i].gap_errors);
+        txtime_misses += global_ping.engines[i].txtime_misses;
+    }
+
+    if (txtime_misses)
+    {
+        fprintf(global_ping.report, "%lu probes dropped by the qdisc past their transmit time\n", txtime_misses);
+    }
+    if (!gaps.count)
+    {
+        return;
+    }
+
+    fprintf(global_ping.report, "send gaps: intended %.3f us, achieved min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f us\n",
+            (double)global_ping.engines[0].probe_period / 1000,
+            (double)gaps.min_ns / 1000,
+            gaps.mean_ns / 1000,
+            (double)gaps.max_ns / 1000,
+            rtt_stddev(&gaps) * 1000);
+    fprintf(global_ping.report, "send gaps p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f us\n",
+            rtt_percentile(&gaps, 50) * 1000,
+            rtt_percentile(&gaps, 90) * 1000,
+            rtt_percentile(&gaps, 99) * 1000,
+            rtt_percentile(&gaps, 99.9) * 1000);
+
+    // One row per range of distance to the intended gap
+    uint64_t counts[GAP_ERROR_ROWS];
+    rtt_cumulative_counts(&errors, gap_error_bounds, GAP_ERROR_ROWS, counts);
+    fprintf(global_ping.report, "send gap error:\n");
+    for (unsigned int i = 0; i <= GAP_ERROR_ROWS; ++i)
+    {
+        uint64_t below = i ? counts[i - 1] : 0;
+        uint64_t count = (i < GAP_ERROR_ROWS ? counts[i] : errors.count) - below;
+        double share = (double)count / errors.count;
+
+        char bar[GAP_HISTOGRAM_WIDTH + 1];
+        int length = share * GAP_HISTOGRAM_WIDTH + 0.5;
+        memset(bar, '#', length);
+        bar[length] = '\0';
+        uint64_t bound = gap_error_bounds[i < GAP_ERROR_ROWS ? i : GAP_ERROR_ROWS - 1];
+        fprintf(global_ping.report, "  %s %7.0f us %7.2f%% %s\n", i < GAP_ERROR_ROWS ? "<=" : "> ",
+                (double)bound / 1000, share * 100, bar);
+    }
+}
@@ -0,0 +1,181 @@
+#include "ping.h"
+
+// Instructions of the ring filter before the reply filter
+#define RING_FILTER_PRELUDE_LENGTH 4
+
+// Attaches the BPF program of the ring: packets leaving the host and packets other than
+// ICMP over IPv4 are dropped, then the reply filter of the engine applies. Packets
+// reach the filter from their IP header, as the socket does not keep link-layer headers.
+// @param engine The engine owning the ring socket.
+static void attach_ring_filter(ping_engine_t *engine)
+{
+    struct sock_filter code[RING_FILTER_PRELUDE_LENGTH + REPLY_FILTER_LENGTH] = {
+        // Loopback devices show each packet once leaving and once arriving, keep the arrivals
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, REPLY_FILTER_LENGTH + 1, 0),
+
+        // The packet carries ICMP
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(struct ip, ip_p)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, REPLY_FILTER_LENGTH - 1),
+    };
+    build_reply_filter(code + RING_FILTER_PRELUDE_LENGTH, engine->id);
+    struct sock_fprog program = {.len = RING_FILTER_PRELUDE_LENGTH + REPLY_FILTER_LENGTH, .filter = code};
+
+    if (setsockopt(engine->ring_socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0)
+    {
+        perror("ping: setsockopt SO_ATTACH_FILTER");
+        exit(1);
+    }
+}
+
+// Opens the receive ring of an engine: an AF_PACKET socket bound to the interface the
+// replies arrive on, with a TPACKET_V3 ring mapped in the process. The kernel writes the
+// replies in place in the blocks of the ring with their receive timestamp, and the engine
+// reads them there without any copy nor syscall per packet. Works on any interface,
+// loopback and veth pairs included. The raw socket is then only used to send.
+// @param engine The engine.
+void open_packet_ring(ping_engine_t *engine)
+{
+    if (global_ping.datagram)
+    {
+        fprintf(stderr, "ping: --packet-ring needs raw sockets\n");
+        exit(1);
+    }
+
+    unsigned int interface_index = if_nametoindex(global_ping.ring_interface);
+    if (interface_index == 0)
+    {
+        fprintf(stderr, "ping: unknown interface %s\n", global_ping.ring_interface);
+        exit(1);
+    }
+
+    // Datagram packet sockets strip the link-layer header, frames start at the IP header
+    engine->ring_socket = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (engine->ring_socket < 0)
+    {
+        perror("ping: socket AF_PACKET");
+        exit(1);
+    }
+
+    // The filter is in place before any packet can be queued
+    attach_ring_filter(engine);
+
+    int version = TPACKET_V3;
+    if (setsockopt(engine->ring_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+    {
+        perror("ping: setsockopt PACKET_VERSION");
+        exit(1);
+    }
+
+    struct tpacket_req3 request = {
+        .tp_block_size = PACKET_RING_BLOCK_SIZE,
+        .tp_block_nr = PACKET_RING_BLOCK_COUNT,
+        .tp_frame_size = PACKET_RING_FRAME_SIZE,
+        .tp_frame_nr = PACKET_RING_BLOCK_SIZE / PACKET_RING_FRAME_SIZE * PACKET_RING_BLOCK_COUNT,
+        .tp_retire_blk_tov = PACKET_RING_BLOCK_TIMEOUT_MS,
+        .tp_feature_req_word = 0};
+    if (setsockopt(engine->ring_socket, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) < 0)
+    {
+        perror("ping: setsockopt PACKET_RX_RING");
+        exit(1);
+    }
+
+    engine->ring = mmap(NULL, (size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_BLOCK_COUNT, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, engine->ring_socket, 0);
+    if (engine->ring == MAP_FAILED)
+    {
+        perror("ping: mmap");
+        exit(1);
+    }
+    engine->next_block = 0;
+
+    // Only take the IPv4 packets of the interface, once the ring is ready for them
+    struct sockaddr_ll address = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_IP),
+        .sll_ifindex = interface_index};
+    if (bind(engine->ring_socket, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("ping: bind AF_PACKET");
+        exit(1);
+    }
+}
+
+// Converts a frame timestamp to nanoseconds.
+// @param seconds The seconds of the timestamp.
+// @param nanoseconds The nanoseconds of the timestamp.
+// @return The timestamp in nanoseconds.
+static uint64_t frame_time(uint32_t seconds, uint32_t nanoseconds)
+{
+    return (uint64_t)seconds * 1000000000UL + nanoseconds;
+}
+
+// Gives the offset from CLOCK_REALTIME, the clock of the frame timestamps, to CLOCK_MONOTONIC.
+// @return The offset to add to a real time to get a monotonic one, in nanoseconds.
+static int64_t realtime_to_monotonic(void)
+{
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    return (int64_t)get_monotonic_time() - (int64_t)frame_time(realtime.tv_sec, realtime.tv_nsec);
+}
+
+// Parses the replies of a block handed over by the kernel, in place.
+// Each reply is timed by its frame timestamp, brought back to the monotonic clock
+// of the send times, and also given as kernel receive time with --kernel-timestamps.
+// @param engine The engine.
+// @param block The block descriptor, at the start of the block.
+// @param clock_offset The offset from the real time clock to the monotonic one.
+static void process_block(ping_engine_t *engine, struct tpacket_block_desc *block, int64_t clock_offset)
+{
+    struct tpacket_hdr_v1 *header = &block->hdr.bh1;
+
+    // Probes lost before the block started are lost even if their reply is in it
+    expire_probes(engine, frame_time(header->ts_first_pkt.ts_sec, header->ts_first_pkt.ts_nsec) + clock_offset);
+
+    struct tpacket3_hdr *frame = (struct tpacket3_hdr *)((char *)block + header->offset_to_first_pkt);
+    for (uint32_t i = 0; i < header->num_pkts; ++i)
+    {
+        char *data = (char *)frame + frame->tp_net;
+        uint64_t kernel_recv_time = frame_time(frame->tp_sec, frame->tp_nsec);
+
+        // The filter checked the IP header length, the snapshot holds the whole datagram
+        struct ip *ip_header = (struct ip *)data;
+        size_t ip_header_length = ip_header->ip_hl << 2;
+        ssize_t recv_size = frame->tp_snaplen;
+        process_reply(engine, (icmphdr_t *)(data + ip_header_length), recv_size - (ssize_t)ip_header_length, recv_size,
+                      ip_header->ip_src, ip_header->ip_ttl, kernel_recv_time + clock_offset, global_ping.kernel_timestamps ? kernel_recv_time : 0);
+
+        frame = (struct tpacket3_hdr *)((char *)frame + frame->tp_next_offset);
+    }
+}
+
+// Reads every block the kernel handed over, in ring order, and gives them back.
+// Called by the event loop when the ring socket becomes readable, which happens when a
+// block is retired, because it is full or after PACKET_RING_BLOCK_TIMEOUT_MS.
+// @param engine The engine owning the ring.
+void receive_packet_ring(ping_engine_t *engine)
+{
+    // Transmit timestamps must be attached to the probes before their replies are timed
+    if (global_ping.kernel_timestamps)
+    {
+        receive_error_queue(engine);
+    }
+
+    int64_t clock_offset = realtime_to_monotonic();
+    while ("draining")
+    {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(engine->ring + (size_t)engine->next_block * PACKET_RING_BLOCK_SIZE);
+
+        // The status is written last by the kernel, the frames are only read after it
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        {
+            return;
+        }
+
+        process_block(engine, block, clock_offset);
+
+        // Hand the block back, once every frame is read
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        engine->next_block = (engine->next_block + 1) % PACKET_RING_BLOCK_COUNT;
+    }
+}
@@ -12,14 +12,234 @@ static void check_next_arg(const int argc, int *i)
     }
 }
 
+// Matches a long option taking a value, given either as "--name value" or "--name=value".
+// @param name The name of the option, without the leading dashes.
+// @param argc An integer representing the number of arguments passed to the program.
+// @param argv An array of strings representing the arguments passed to the program.
+// @param i A pointer to the current index, moved past the value when it is a separate argument.
+// @return The value of the option, or NULL if the current argument is another option.
+static const char *match_long_option(const char *name, const int argc, const char **argv, int *i)
+{
+    size_t name_length = strlen(name);
+    const char *arg = argv[*i] + 2;
+
+    if (strncmp(arg, name, name_length) != 0)
+        return NULL;
+    if (arg[name_length] == '=')
+        return arg + name_length + 1;
+    if (arg[name_length] != '\0')
+        return NULL;
+    check_next_arg(argc, i);
+    return argv[*i];
+}
+
+// Matches a long option without value.
+// @param name The name of the option, without the leading dashes.
+// @param arg The current command-line argument.
+// @return true if the argument is this option.
+static bool match_long_flag(const char *name, const char *arg)
+{
+    return strcmp(arg + 2, name) == 0;
+}
+
+// Parses the address of the metrics endpoint, a port optionally preceded by an IPv4 address.
+// @param value The address, as [ADDR:]PORT.
+static void parse_metrics_address(const char *value)
+{
+    const char *port = strrchr(value, ':');
+    char address[INET_ADDRSTRLEN] = DEFAULT_METRICS_ADDRESS;
+    if (port != NULL)
+    {
+        if ((size_t)(port - value) >= sizeof(address))
+        {
+            fprintf(stderr, "ping: invalid metrics address '%s'\n", value);
+            exit(1);
+        }
+        memcpy(address, value, port - value);
+        address[port - value] = '\0';
+        ++port;
+    }
+    else
+        port = value;
+
+    unsigned long int port_number = atoull(port);
+    global_ping.metrics_address.sin_family = AF_INET;
+    global_ping.metrics_address.sin_port = htons(port_number);
+    if (port_number == 0 || port_number > 65535 || inet_pton(AF_INET, address, &global_ping.metrics_address.sin_addr) != 1)
+    {
+        fprintf(stderr, "ping: invalid metrics address '%s'\n", value);
+        exit(1);
+    }
+    global_ping.metrics = 1;
+}
+
+// Parses the address of the name server of --dns, an IPv4 address optionally followed by a port.
+// @param value The address, as ADDR[:PORT].
+static void parse_dns_server(const char *value)
+{
+    const char *port = strchr(value, ':');
+    char address[INET_ADDRSTRLEN] = {0};
+    size_t address_length = port ? (size_t)(port - value) : strlen(value);
+    unsigned long int port_number = port ? atoull(port + 1) : DNS_PORT;
+
+    global_ping.dns_server.sin_family = AF_INET;
+    global_ping.dns_server.sin_port = htons(port_number);
+    if (address_length >= sizeof(address) || port_number == 0 || port_number > 65535)
+    {
+        fprintf(stderr, "ping: invalid name server '%s'\n", value);
+        exit(1);
+    }
+    memcpy(address, value, address_length);
+    if (inet_pton(AF_INET, address, &global_ping.dns_server.sin_addr) != 1)
+    {
+        fprintf(stderr, "ping: invalid name server '%s'\n", value);
+        exit(1);
+    }
+}
+
+// Parses a long option and sets the corresponding option in the global_ping struct.
+// Exits the program with the usage if the option is unknown.
+// @param argc An integer representing the number of arguments passed to the program.
+// @param argv An array of strings representing the arguments passed to the program.
+// @param i A pointer to the index of the option in the command-line arguments.
+static void parse_long_option(const int argc, const char **argv, int *i)
+{
+    const char *value;
+
+    if (match_long_flag("kernel-timestamps", argv[*i]))
+        global_ping.kernel_timestamps = 1;
+    else if (match_long_flag("datagram", argv[*i]))
+        global_ping.datagram = 1;
+    else if ((value = match_long_option("packet-ring", argc, argv, i)))
+        global_ping.ring_interface = value;
+    else if (match_long_flag("io-uring", argv[*i]))
+        global_ping.io_uring = 1;
+    else if ((value = match_long_option("metrics", argc, argv, i)))
+        parse_metrics_address(value);
+    else if (match_long_flag("pipeline", argv[*i]))
+        global_ping.pipeline = 1;
+    else if ((value = match_long_option("shm", argc, argv, i)))
+    {
+        if (!*value || strchr(value, '/') || strlen(value) >= NAME_MAX)
+        {
+            fprintf(stderr, "ping: invalid shared memory name '%s'\n", value);
+            exit(1);
+        }
+        global_ping.shm_name = value;
+    }
+    else if ((value = match_long_option("rtt-log", argc, argv, i)))
+        global_ping.rtt_log_path = value;
+    else if ((value = match_long_option("format", argc, argv, i)))
+    {
+        if (strcmp(value, "text") == 0)
+            global_ping.format = FORMAT_TEXT;
+        else if (strcmp(value, "jsonl") == 0)
+            global_ping.format = FORMAT_JSONL;
+        else if (strcmp(value, "binary") == 0)
+            global_ping.format = FORMAT_BINARY;
+        else
+        {
+            fprintf(stderr, "ping: unknown format '%s', expected text, jsonl or binary\n", value);
+            exit(1);
+        }
+    }
+    else if ((value = match_long_option("pacing", argc, argv, i)))
+    {
+        if (strcmp(value, "timer") == 0)
+            global_ping.pacing = PACING_TIMER;
+        else if (strcmp(value, "spin") == 0)
+            global_ping.pacing = PACING_SPIN;
+        else if (strcmp(value, "txtime") == 0)
+            global_ping.pacing = PACING_TXTIME;
+        else
+        {
+            fprintf(stderr, "ping: unknown pacing '%s', expected timer, spin or txtime\n", value);
+            exit(1);
+        }
+    }
+    else if (match_long_flag("pmtu", argv[*i]))
+        global_ping.pmtu = 1;
+    else if ((value = match_long_option("serve", argc, argv, i)))
+        global_ping.service_path = value;
+    else if (match_long_flag("low-latency", argv[*i]))
+        global_ping.low_latency = 1;
+    else if ((value = match_long_option("cpu", argc, argv, i)))
+    {
+        unsigned long int cpu = atoull(value);
+        if (cpu >= CPU_SETSIZE)
+        {
+            fprintf(stderr, "ping: cpu must be below %d\n", CPU_SETSIZE);
+            exit(1);
+        }
+        global_ping.cpu = cpu;
+        global_ping.low_latency = 1;
+    }
+    else if (match_long_flag("realtime", argv[*i]))
+        global_ping.realtime = global_ping.low_latency = 1;
+    else if (match_long_flag("compare", argv[*i]))
+        global_ping.compare_latency = global_ping.low_latency = 1;
+    else if ((value = match_long_option("window", argc, argv, i)))
+    {
+        global_ping.window = atoull(value);
+        if (global_ping.window == 0 || global_ping.window > PROBE_RING_SIZE)
+        {
+            fprintf(stderr, "ping: window must be between 1 and %d\n", PROBE_RING_SIZE);
+            exit(1);
+        }
+    }
+    else if ((value = match_long_option("rate", argc, argv, i)))
+    {
+        global_ping.rate = atoull(value);
+        if (global_ping.rate == 0)
+        {
+            fprintf(stderr, "ping: rate must be greater than 0\n");
+            exit(1);
+        }
+    }
+    else if ((value = match_long_option("threads", argc, argv, i)))
+    {
+        global_ping.thread_count = atoull(value);
+        if (global_ping.thread_count == 0)
+        {
+            fprintf(stderr, "ping: threads must be greater than 0\n");
+            exit(1);
+        }
+    }
+    else if ((value = match_long_option("targets", argc, argv, i)))
+        global_ping.targets_file = value;
+    else if ((value = match_long_option("dns", argc, argv, i)))
+        parse_dns_server(value);
+    else if ((value = match_long_option("timeout", argc, argv, i)))
+    {
+        global_ping.timeout_ns = parse_seconds(value);
+        if (global_ping.timeout_ns == 0)
+        {
+            fprintf(stderr, "ping: timeout must be greater than 0\n");
+            exit(1);
+        }
+    }
+    else
+        exit(print_usage());
+}
+
 // Parses command-line arguments and sets the corresponding options in the global_ping struct.
 // @param argc An integer representing the number of arguments passed to the program.
 // @param argv An array of strings representing the arguments passed to the program.
 void parse_args(int argc, const char **argv)
 {
+    // Every remaining argument may be a host
+    global_ping.hosts = malloc(argc * sizeof(char *));
+    if (global_ping.hosts == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
     for (int i = 1; i < argc; ++i)
     {
-        if (argv[i][0] == '-')
+        if (argv[i][0] == '-' && argv[i][1] == '-')
+            parse_long_option(argc, argv, &i);
+        else if (argv[i][0] == '-')
         {
             if (argv[i][1] == '\0' || argv[i][2] != '\0')
                 exit(print_usage());
@@ -27,6 +247,20 @@ void parse_args(int argc, const char **argv)
                 global_ping.verbose = 1;
             else if (argv[i][1] == 'q')
                 global_ping.quiet = 1;
+            else if (argv[i][1] == 'f')
+                global_ping.flood = 1;
+            else if (argv[i][1] == 'A')
+                global_ping.adaptive = 1;
+            else if (argv[i][1] == 'l')
+            {
+                check_next_arg(argc, &i);
+                global_ping.preload = atoull(argv[i]);
+                if (global_ping.preload == 0 || global_ping.preload > PROBE_RING_SIZE)
+                {
+                    fprintf(stderr, "ping: preload must be between 1 and %d\n", PROBE_RING_SIZE);
+                    exit(1);
+                }
+            }
             else if (argv[i][1] == 't')
             {
                 check_next_arg(argc, &i);
@@ -45,16 +279,69 @@ void parse_args(int argc, const char **argv)
             else if (argv[i][1] == 'i')
             {
                 check_next_arg(argc, &i);
-                global_ping.interval = atoull(argv[i]);
+                global_ping.interval_ns = parse_seconds(argv[i]);
+                if (global_ping.interval_ns < MIN_INTERVAL_NS)
+                {
+                    fprintf(stderr, "ping: interval must be at least 0.000001 seconds\n");
+                    exit(1);
+                }
             }
             else
                 exit(print_usage());
         }
-        else if (global_ping.host)
-            exit(print_usage());
         else
-            global_ping.host = (char *)argv[i];
+            global_ping.hosts[global_ping.host_count++] = argv[i];
     }
-    if (!global_ping.host)
+    if (!global_ping.host_count && !global_ping.targets_file && !global_ping.service_path)
         exit(print_usage());
+    if (global_ping.adaptive && global_ping.flood)
+    {
+        fprintf(stderr, "ping: -A and -f cannot be used together\n");
+        exit(1);
+    }
+    if (global_ping.pacing && (global_ping.flood || global_ping.adaptive))
+    {
+        fprintf(stderr, "ping: --pacing cannot be used with -f or -A\n");
+        exit(1);
+    }
+    if (global_ping.pmtu && (global_ping.flood || global_ping.adaptive || global_ping.rate || global_ping.pacing))
+    {
+        fprintf(stderr, "ping: --pmtu cannot be used with -f, -A, --rate or --pacing\n");
+        exit(1);
+    }
+
+    // The service probes the addresses its clients ask for, from a single engine
+    if (global_ping.service_path)
+    {
+        if (global_ping.host_count || global_ping.targets_file)
+        {
+            fprintf(stderr, "ping: --serve takes no host, the clients give the addresses\n");
+            exit(1);
+        }
+        if (global_ping.flood || global_ping.adaptive || global_ping.rate || global_ping.pacing || global_ping.pmtu ||
+            global_ping.metrics || global_ping.shm_name || global_ping.rtt_log_path || global_ping.pipeline ||
+            global_ping.format != FORMAT_TEXT)
+        {
+            fprintf(stderr, "ping: --serve cannot be used with -f, -A, --rate, --pacing, --pmtu, --metrics, --shm, "
+                            "--rtt-log, --pipeline or --format\n");
+            exit(1);
+        }
+        global_ping.thread_count = 1;
+    }
+
+    // The qdisc spaces the probes, only their transmit timestamps tell how well
+    if (global_ping.pacing == PACING_TXTIME)
+        global_ping.kernel_timestamps = 1;
+    if (global_ping.io_uring && global_ping.ring_interface)
+    {
+        fprintf(stderr, "ping: --io-uring and --packet-ring cannot be used together\n");
+        exit(1);
+    }
+
+    // Flooding is clocked by the replies, bound it to a window that fits in the socket buffers
+    if (!global_ping.window)
+        global_ping.window = global_ping.flood ? DEFAULT_FLOOD_WINDOW : PROBE_RING_SIZE;
+
+    // The records own the standard output, the human-readable report moves to the error output
+    global_ping.report = global_ping.format == FORMAT_TEXT ? stdout : stderr;
 }
\ No newline at end of file
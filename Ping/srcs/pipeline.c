@@ -0,0 +1,182 @@
+#include "ping.h"
+
+// Hands a reply event to its consumer: pushed into the ring with --pipeline, accounted
+// right away otherwise. The engine never waits for the consumer, an event that does not
+// fit in the ring is dropped and counted.
+// @param engine The engine that received the reply.
+// @param event The reply event.
+void dispatch_event(ping_engine_t *engine, const reply_event_t *event)
+{
+    // The events of the ping service are results for its clients, not statistics
+    if (engine->service)
+    {
+        answer_service_event(engine, event);
+        return;
+    }
+
+    pipeline_t *pipeline = engine->pipeline;
+    if (pipeline == NULL)
+    {
+        account_event(engine, event);
+        return;
+    }
+
+    // The head is only read again when the ring looks full
+    if (pipeline->tail - pipeline->cached_head == PIPELINE_RING_SIZE)
+    {
+        pipeline->cached_head = __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE);
+        if (pipeline->tail - pipeline->cached_head == PIPELINE_RING_SIZE)
+        {
+            ++pipeline->dropped;
+            return;
+        }
+    }
+    pipeline->events[pipeline->tail & (PIPELINE_RING_SIZE - 1)] = *event;
+    __atomic_store_n(&pipeline->tail, pipeline->tail + 1, __ATOMIC_RELEASE);
+}
+
+// Wakes the consumer if it waits for events, once per batch of replies rather than per reply.
+// @param engine The engine.
+void wake_pipeline(ping_engine_t *engine)
+{
+    pipeline_t *pipeline = engine->pipeline;
+    if (__atomic_load_n(&pipeline->head, __ATOMIC_RELAXED) == pipeline->tail && !__atomic_load_n(&pipeline->stopping, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+    if (__atomic_exchange_n(&pipeline->sleeping, false, __ATOMIC_SEQ_CST))
+    {
+        uint64_t one = 1;
+        if (write(pipeline->wake_fd, &one, sizeof(one)) < 0)
+        {
+            perror("ping: write eventfd");
+            exit(1);
+        }
+    }
+}
+
+// Consumer thread: accounts the events of the ring, writes the output and publishes the
+// live statistics, then sleeps on the wake descriptor once the ring is empty. Buffered
+// records and statistics are still written after their interval while it sleeps.
+// @param argument The engine.
+// @return NULL.
+static void *consume_events(void *argument)
+{
+    ping_engine_t *engine = argument;
+    pipeline_t *pipeline = engine->pipeline;
+    uint64_t head = pipeline->head;
+
+    while (true)
+    {
+        uint64_t tail = __atomic_load_n(&pipeline->tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            account_event(engine, &pipeline->events[head & (PIPELINE_RING_SIZE - 1)]);
+            ++head;
+            __atomic_store_n(&pipeline->head, head, __ATOMIC_RELEASE);
+        }
+        uint64_t now = get_monotonic_time();
+        if (engine->output)
+        {
+            flush_output(engine, now, false);
+        }
+        if (global_ping.shared_stats && now - engine->last_publish >= SHM_PUBLISH_NS)
+        {
+            publish_shared_stats(engine, now);
+        }
+
+        // The engine wakes the consumer only if it sees it sleeping, so the ring is checked
+        // once more after saying so, to not miss the events pushed in between
+        __atomic_store_n(&pipeline->sleeping, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pipeline->tail, __ATOMIC_SEQ_CST) != head)
+        {
+            __atomic_store_n(&pipeline->sleeping, false, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_load_n(&pipeline->stopping, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+
+        struct pollfd fd = {.fd = pipeline->wake_fd, .events = POLLIN};
+        if (poll(&fd, 1, engine->output_length || global_ping.shared_stats ? (int)(OUTPUT_FLUSH_NS / 1000000) : -1) < 0 && errno != EINTR)
+        {
+            perror("ping: poll");
+            exit(1);
+        }
+        uint64_t wakes;
+        if (read(pipeline->wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+        {
+            perror("ping: read eventfd");
+            exit(1);
+        }
+        __atomic_store_n(&pipeline->sleeping, false, __ATOMIC_RELAXED);
+    }
+
+    if (engine->output)
+    {
+        flush_output(engine, get_monotonic_time(), true);
+    }
+    if (global_ping.shared_stats)
+    {
+        publish_shared_stats(engine, get_monotonic_time());
+    }
+    return NULL;
+}
+
+// Creates the ring of an engine and starts its consumer thread, with --pipeline.
+// @param engine The engine.
+void start_pipeline(ping_engine_t *engine)
+{
+    engine->pipeline = NULL;
+    if (!global_ping.pipeline)
+    {
+        return;
+    }
+
+    pipeline_t *pipeline = aligned_alloc(CACHE_LINE_SIZE, sizeof(pipeline_t));
+    if (pipeline == NULL)
+    {
+        perror("ping: aligned_alloc");
+        exit(1);
+    }
+    memset(pipeline, 0, sizeof(pipeline_t));
+    pipeline->events = malloc(PIPELINE_RING_SIZE * sizeof(reply_event_t));
+    if (pipeline->events == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    pipeline->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pipeline->wake_fd < 0)
+    {
+        perror("ping: eventfd");
+        exit(1);
+    }
+
+    engine->pipeline = pipeline;
+    int error = pthread_create(&pipeline->thread, NULL, consume_events, engine);
+    if (error)
+    {
+        fprintf(stderr, "ping: pthread_create: %s\n", strerror(error));
+        exit(1);
+    }
+}
+
+// Lets the consumer of an engine account the events left in the ring, and waits for it.
+// The engine must not push events anymore.
+// @param engine The engine.
+void stop_pipeline(ping_engine_t *engine)
+{
+    pipeline_t *pipeline = engine->pipeline;
+    if (pipeline == NULL)
+    {
+        return;
+    }
+
+    __atomic_store_n(&pipeline->stopping, true, __ATOMIC_SEQ_CST);
+    wake_pipeline(engine);
+    pthread_join(pipeline->thread, NULL);
+    close(pipeline->wake_fd);
+    free(pipeline->events);
+}
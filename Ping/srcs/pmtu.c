@@ -0,0 +1,320 @@
+#include "ping.h"
+
+// Largest IPv4 packet, above the MTU of the loopback interface
+#define PMTU_MAX_SIZE 65535
+
+// Asks the kernel for the path MTU to a target: the MTU of its route, lowered by the
+// Fragmentation Needed errors it learnt from, as a connected UDP socket reports it.
+// Nothing is sent on the socket.
+// @param address The address of the target.
+// @return The path MTU, 0 if the target has no route.
+static uint16_t route_mtu(const struct sockaddr_in *address)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("ping: socket");
+        exit(1);
+    }
+
+    // Any port does, the route only depends on the address
+    struct sockaddr_in destination = *address;
+    destination.sin_port = htons(9);
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    if (connect(fd, (struct sockaddr *)&destination, sizeof(destination)) < 0 ||
+        getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &length) < 0)
+    {
+        mtu = 0;
+    }
+    close(fd);
+    return mtu < PMTU_MAX_SIZE ? mtu : PMTU_MAX_SIZE;
+}
+
+// Starts the path MTU discovery of every target between the smallest IPv4 MTU and the MTU
+// of its route, and enlarges the probes to the largest of those, so that the send and
+// receive buffers hold them. The payload keeps the size given by -s when it is larger.
+void initialize_pmtu(void)
+{
+    global_ping.pmtu_states = calloc(global_ping.target_count, sizeof(pmtu_state_t));
+    if (global_ping.pmtu_states == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+
+    uint16_t largest = PMTU_MIN_SIZE;
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        pmtu_state_t *state = &global_ping.pmtu_states[i];
+        state->kernel_mtu = route_mtu(&global_ping.targets[i].address);
+        state->low = PMTU_MIN_SIZE - 1;
+        state->high = state->kernel_mtu;
+        state->done = state->high < PMTU_MIN_SIZE;
+        largest = state->high > largest ? state->high : largest;
+    }
+
+    size_t payload_size = largest - sizeof(struct ip) - sizeof(icmphdr_t);
+    if (global_ping.packet_size < payload_size)
+    {
+        global_ping.packet_size = payload_size;
+    }
+}
+
+// Gives the length of a probe of the current round of a target, to validate its reply.
+// @param target The index of the target.
+// @param target_sequence The rank of the probe among those sent to the target.
+// @return The length of its ICMP message, 0 if the probe is not part of the current round.
+size_t pmtu_probe_length(uint32_t target, uint32_t target_sequence)
+{
+    const pmtu_state_t *state = &global_ping.pmtu_states[target];
+    uint32_t i = target_sequence - state->first_sequence;
+    return i < state->probe_count ? state->sizes[i] - sizeof(struct ip) : 0;
+}
+
+// Sends the next round of a target: up to PMTU_PROBES sizes spread evenly over the range
+// still unknown, the largest one at its top. A size lost in the last round is the top of
+// the range until it gets through or is lost again. The round ends once every probe is
+// settled, or at the timeout.
+// @param engine The engine.
+// @param index The index of the target.
+// @param now The current monotonic time, in nanoseconds.
+static void start_pmtu_round(ping_engine_t *engine, uint32_t index, uint64_t now)
+{
+    ping_target_t *target = &global_ping.targets[index];
+    pmtu_state_t *state = &global_ping.pmtu_states[index];
+    uint32_t range = (state->suspect ? state->suspect : state->high) - state->low;
+
+    state->probe_count = range < PMTU_PROBES ? range : PMTU_PROBES;
+    state->pending = state->probe_count;
+    state->first_sequence = target->packets_sent;
+    ++state->rounds;
+    for (uint32_t i = 0; i < state->probe_count; ++i)
+    {
+        state->sizes[i] = state->low + (range * (i + 1) + state->probe_count - 1) / state->probe_count;
+        state->outcomes[i] = PMTU_PENDING;
+        queue_probe(engine, index);
+        resize_queued_probe(engine, state->sizes[i]);
+        if (engine->batch_length == SEND_BATCH_SIZE)
+        {
+            flush_probes(engine);
+        }
+    }
+
+    target->next_send_time = now + global_ping.timeout_ns;
+    schedule_target(&engine->wheel, index);
+}
+
+// Narrows the range of a target from the outcomes of its round, then starts the next round
+// or, once the range is down to one size, ends the discovery of the target:
+// - a size that got through raises the bottom of the range;
+// - a Fragmentation Needed error lowers its top below the size, or to the next-hop MTU it
+//   reports, and so does the path MTU the kernel learnt from those errors;
+// - the smallest size lost above the bottom becomes the suspect, which only lowers the top
+//   when lost twice in a row, so that a lost probe is not mistaken for a black hole.
+// @param engine The engine.
+// @param index The index of the target.
+// @param now The current monotonic time, in nanoseconds.
+static void end_pmtu_round(ping_engine_t *engine, uint32_t index, uint64_t now)
+{
+    ping_target_t *target = &global_ping.targets[index];
+    pmtu_state_t *state = &global_ping.pmtu_states[index];
+    unschedule_target(&engine->wheel, index);
+
+    for (uint32_t i = 0; i < state->probe_count; ++i)
+    {
+        if (state->outcomes[i] == PMTU_PASSED && state->sizes[i] > state->low)
+            state->low = state->sizes[i];
+        else if (state->outcomes[i] == PMTU_TOO_BIG && state->sizes[i] <= state->high)
+            state->high = state->sizes[i] - 1;
+    }
+    if (state->reported_mtu > state->low && state->reported_mtu < state->high)
+    {
+        state->high = state->reported_mtu;
+    }
+    state->kernel_mtu = route_mtu(&target->address);
+    if (state->kernel_mtu > state->low && state->kernel_mtu < state->high)
+    {
+        state->high = state->kernel_mtu;
+    }
+
+    // Probes still pending when the round times out are lost
+    uint16_t smallest_lost = 0;
+    for (uint32_t i = 0; i < state->probe_count; ++i)
+    {
+        if ((state->outcomes[i] == PMTU_LOST || state->outcomes[i] == PMTU_PENDING) && state->sizes[i] > state->low &&
+            state->sizes[i] <= state->high && (!smallest_lost || state->sizes[i] < smallest_lost))
+        {
+            smallest_lost = state->sizes[i];
+        }
+    }
+    if (smallest_lost && smallest_lost == state->suspect)
+    {
+        state->high = smallest_lost - 1;
+        smallest_lost = 0;
+    }
+    state->suspect = smallest_lost;
+
+    // Sizes that got through are kept over a top that contradicts them, after a route change
+    if (state->high < state->low)
+    {
+        state->high = state->low;
+    }
+    state->probe_count = 0;
+    if (state->low == state->high || state->rounds == PMTU_MAX_ROUNDS)
+    {
+        state->done = true;
+        --engine->active_targets;
+        return;
+    }
+    start_pmtu_round(engine, index, now);
+}
+
+// Turns the sockets of an engine to path MTU probing, sends the first round of each of
+// its targets right away, and allocates the lists of the targets due or done with a round.
+// The probes have the Don't Fragment bit set and may be larger than the path MTU the kernel
+// knows, only the MTU of the interface limits them (IP_PMTUDISC_PROBE).
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_pmtu_engine(ping_engine_t *engine, uint64_t now)
+{
+    int discover = IP_PMTUDISC_PROBE;
+    if (setsockopt(engine->socket, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover)) < 0)
+    {
+        perror("ping: setsockopt IP_MTU_DISCOVER");
+        exit(1);
+    }
+
+    // A round of large probes to every target is sent at once
+    enlarge_socket_buffer(engine, SO_SNDBUFFORCE, SO_SNDBUF);
+    enlarge_socket_buffer(engine, SO_RCVBUFFORCE, SO_RCVBUF);
+
+    engine->due_targets = malloc(engine->target_count * sizeof(uint32_t));
+    engine->ready_targets = malloc(engine->target_count * sizeof(uint32_t));
+    if (engine->due_targets == NULL || engine->ready_targets == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    engine->ready_count = 0;
+
+    // Every target runs until its path MTU is found, whatever the count
+    initialize_timing_wheel(&engine->wheel, now);
+    engine->active_targets = engine->target_count;
+    for (uint32_t target = engine->first_target; target < engine->first_target + engine->target_count; ++target)
+    {
+        if (global_ping.pmtu_states[target].done)
+            --engine->active_targets;
+        else
+            start_pmtu_round(engine, target, now);
+    }
+    flush_probes(engine);
+}
+
+// Records the outcome of a probe of the current round of a target. The first size to get
+// through shortens the wait for the others to a few round trip times, a larger size could
+// be slower but not by much. A target whose probes are all settled ends its round once
+// the batch of replies is read.
+// @param engine The engine.
+// @param target The index of the target.
+// @param target_sequence The rank of the probe among those sent to the target.
+// @param outcome The outcome of the probe.
+// @param mtu The next-hop MTU of a Fragmentation Needed error, 0 if it does not tell.
+// @param rtt_ns The round trip time of a reply, 0 otherwise.
+void settle_pmtu_probe(ping_engine_t *engine, uint32_t target, uint32_t target_sequence, pmtu_outcome_t outcome,
+                       unsigned int mtu, uint64_t rtt_ns)
+{
+    pmtu_state_t *state = &global_ping.pmtu_states[target];
+    uint32_t i = target_sequence - state->first_sequence;
+    if (state->done || i >= state->probe_count || state->outcomes[i] != PMTU_PENDING)
+    {
+        return;
+    }
+    state->outcomes[i] = outcome;
+
+    if (outcome == PMTU_TOO_BIG && mtu >= PMTU_MIN_SIZE && mtu < state->sizes[i] &&
+        (!state->reported_mtu || mtu < state->reported_mtu))
+    {
+        state->reported_mtu = mtu;
+    }
+
+    ping_target_t *ping_target = &global_ping.targets[target];
+    if (outcome == PMTU_PASSED)
+    {
+        uint64_t grace = PMTU_GRACE_RTTS * rtt_ns;
+        uint64_t deadline = get_monotonic_time() + (grace > PMTU_MIN_GRACE_NS ? grace : PMTU_MIN_GRACE_NS);
+        if (deadline < ping_target->next_send_time)
+        {
+            unschedule_target(&engine->wheel, target);
+            ping_target->next_send_time = deadline;
+            schedule_target(&engine->wheel, target);
+        }
+    }
+
+    if (--state->pending == 0 && !ping_target->ready)
+    {
+        ping_target->ready = true;
+        engine->ready_targets[engine->ready_count++] = target;
+    }
+}
+
+// Ends the rounds of the targets whose probes were all settled since the last call, and
+// sends their next rounds.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void end_ready_pmtu_rounds(ping_engine_t *engine, uint64_t now)
+{
+    while (engine->ready_count)
+    {
+        uint32_t index = engine->ready_targets[--engine->ready_count];
+        global_ping.targets[index].ready = false;
+        end_pmtu_round(engine, index, now);
+    }
+    flush_probes(engine);
+}
+
+// Ends the rounds the timing wheel found past their deadline, their pending probes lost,
+// and sends the next rounds.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void fire_pmtu_targets(ping_engine_t *engine, uint64_t now)
+{
+    unsigned int due_count = advance_timing_wheel(&engine->wheel, now, engine->due_targets);
+    for (unsigned int i = 0; i < due_count; ++i)
+    {
+        uint32_t index = engine->due_targets[i];
+        if (!global_ping.targets[index].ready)
+        {
+            end_pmtu_round(engine, index, now);
+        }
+    }
+    end_ready_pmtu_rounds(engine, now);
+}
+
+// Prints the path MTU found for each target, or the range it was narrowed to when the
+// discovery was interrupted or ran out of rounds.
+void report_pmtu(void)
+{
+    if (!global_ping.pmtu)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        const pmtu_state_t *state = &global_ping.pmtu_states[i];
+        fprintf(global_ping.report, "%s : ", global_ping.targets[i].host);
+        if (!state->kernel_mtu)
+            fprintf(global_ping.report, "no route");
+        else if (state->low < PMTU_MIN_SIZE)
+            fprintf(global_ping.report, "no probe got through");
+        else if (state->low == state->high)
+            fprintf(global_ping.report, "path mtu %u", state->low);
+        else
+            fprintf(global_ping.report, "path mtu between %u and %u", state->low, state->high);
+        fprintf(global_ping.report, " after %u round%s", state->rounds, state->rounds == 1 ? "" : "s");
+        if (state->reported_mtu)
+            fprintf(global_ping.report, ", next-hop mtu %u reported", state->reported_mtu);
+        fprintf(global_ping.report, ", kernel path mtu %u\n", state->kernel_mtu);
+    }
+}
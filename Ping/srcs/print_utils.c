@@ -5,7 +5,7 @@
 // @return EXIT_FAILURE
 int print_usage(void)
 {
-	fprintf(stderr, "Usage: ft_ping [OPTIONS] HOST\n");
+	fprintf(stderr, "Usage: ft_ping [OPTIONS] HOST...\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Mandatory:\n");
 	fprintf(stderr, "    -v             Verbose output\n");
@@ -13,38 +13,69 @@ int print_usage(void)
 
 	fprintf(stderr, "Bonuses:\n");
 	fprintf(stderr, "    -q             Quiet, only display output at start/finish\n");
-	fprintf(stderr, "    -c COUNT       Send only COUNT pings\n");
+	fprintf(stderr, "    -c COUNT       Send only COUNT pings to each host\n");
 	fprintf(stderr, "    -t TTL         Set Time To Live (default %d)\n", DEFAULT_TTL);
 	fprintf(stderr, "    -s SIZE        Send SIZE data bytes in packets (default %d)\n", DEFAULT_PACKET_SIZE);
-	fprintf(stderr, "    -i SECS        Interval (default 1)\n");
+	fprintf(stderr, "    -i SECS        Interval between two pings to a host, fractional values allowed (default 1)\n");
+	fprintf(stderr, "    -f             Flood, send as fast as the window allows\n");
+	fprintf(stderr, "    -A             Adaptive, send the next probe as soon as the previous one is answered\n");
+	fprintf(stderr, "    -l PRELOAD     Keep PRELOAD probes in flight per host with -A (default %d)\n", DEFAULT_PRELOAD);
+	fprintf(stderr, "    --rate PPS     Send PPS probes per second, in batches, at most PPS with -A\n");
+	fprintf(stderr, "    --pacing MODE  Space the probes with the timer, spin or txtime, and report the gaps\n");
+	fprintf(stderr, "    --pmtu         Find the path MTU of the hosts, probing many sizes at once with DF set\n");
+	fprintf(stderr, "    --serve PATH   Run as a service probing for the clients of the UNIX socket PATH\n");
+	fprintf(stderr, "    --low-latency  Pin the threads, busy-poll the sockets and lock the memory\n");
+	fprintf(stderr, "    --cpu N        Pin the first thread to CPU N in low latency, the next ones after it\n");
+	fprintf(stderr, "    --realtime     Run the threads SCHED_FIFO in low latency\n");
+	fprintf(stderr, "    --compare      Alternate default and low-latency phases and compare their round trip times\n");
+	fprintf(stderr, "    --window N     Keep at most N probes in flight per thread (default %d, %d with -f)\n", PROBE_RING_SIZE, DEFAULT_FLOOD_WINDOW);
+	fprintf(stderr, "    --timeout SECS Time after which an unanswered probe is lost (default 1)\n");
+	fprintf(stderr, "    --targets FILE Also ping the hosts listed in FILE, one per line, - for stdin\n");
+	fprintf(stderr, "    --dns ADDR[:PORT]\n");
+	fprintf(stderr, "                   Resolve the hosts with the name server ADDR instead of those of resolv.conf\n");
+	fprintf(stderr, "    --threads N    Share the hosts between N threads, each with its own socket\n");
+	fprintf(stderr, "    --kernel-timestamps\n");
+	fprintf(stderr, "                   Time probes with kernel software TX/RX timestamps\n");
+	fprintf(stderr, "    --datagram     Use unprivileged ICMP datagram sockets instead of raw ones\n");
+	fprintf(stderr, "    --io-uring     Send and receive through io_uring when the kernel supports it\n");
+	fprintf(stderr, "    --metrics [ADDR:]PORT\n");
+	fprintf(stderr, "                   Serve the metrics of the targets on http://ADDR:PORT/metrics\n");
+	fprintf(stderr, "    --pipeline     Account the replies and write the output on a separate thread\n");
+	fprintf(stderr, "    --shm NAME     Publish live statistics in the shared memory segment NAME, see pingstat\n");
+	fprintf(stderr, "    --rtt-log FILE Append the round trip times to the compressed log FILE, see pinglog\n");
+	fprintf(stderr, "    --format FORMAT\n");
+	fprintf(stderr, "                   Write records as text, jsonl or binary, the report going to stderr\n");
+	fprintf(stderr, "    --packet-ring IFACE\n");
+	fprintf(stderr, "                   Read the replies arriving on IFACE from a memory-mapped packet ring\n");
 	return (EXIT_FAILURE);
 }
 
 // This function handles the errors
+// @param target The target the error is about
 // @param icmp_seq The icmp sequence number
 // @param fmt The format of the error
 // @param ... The arguments
 // @return void
-void handle_error(unsigned short icmp_seq, const char *format, ...)
+void handle_error(const ping_target_t *target, unsigned short icmp_seq, const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
 	if (!global_ping.quiet && global_ping.verbose)
 	{
-		printf("From %s: icmp_seq=%d ", global_ping.ip_address, icmp_seq);
-		vprintf(format, args);
-		printf("\n");
+		fprintf(global_ping.report, "From %s: icmp_seq=%d ", target->ip_address, icmp_seq);
+		vfprintf(global_ping.report, format, args);
+		fprintf(global_ping.report, "\n");
 	}
 	va_end(args);
-	next_packet();
 	return;
 }
 
 // Print the icmp error
+// @param target The target the error is about
 // @param icmp_seq The icmp sequence number
 // @param received_packet The received packet
 // @return void
-void handle_icmp_error(unsigned short icmp_seq, icmphdr_t *received_packet)
+void handle_icmp_error(const ping_target_t *target, unsigned short icmp_seq, icmphdr_t *received_packet)
 {
 	switch (received_packet->type)
 	{
@@ -52,80 +83,80 @@ void handle_icmp_error(unsigned short icmp_seq, icmphdr_t *received_packet)
 		switch (received_packet->code)
 		{
 		case ICMP_NET_UNREACH:
-			handle_error(icmp_seq, "Net Unreachable");
+			handle_error(target, icmp_seq, "Net Unreachable");
 			break;
 		case ICMP_HOST_UNREACH:
-			handle_error(icmp_seq, "Host Unreachable");
+			handle_error(target, icmp_seq, "Host Unreachable");
 			break;
 		case ICMP_PROT_UNREACH:
-			handle_error(icmp_seq, "Protocol Unreachable");
+			handle_error(target, icmp_seq, "Protocol Unreachable");
 			break;
 		case ICMP_PORT_UNREACH:
-			handle_error(icmp_seq, "Port Unreachable");
+			handle_error(target, icmp_seq, "Port Unreachable");
 			break;
 		case ICMP_FRAG_NEEDED:
-			handle_error(icmp_seq, "Fragmentation Needed and Don't Fragment was Set");
+			handle_error(target, icmp_seq, "Fragmentation Needed and Don't Fragment was Set");
 			break;
 		case ICMP_SR_FAILED:
-			handle_error(icmp_seq, "Source Route Failed");
+			handle_error(target, icmp_seq, "Source Route Failed");
 			break;
 		case ICMP_NET_UNKNOWN:
-			handle_error(icmp_seq, "Destination Network Unknown");
+			handle_error(target, icmp_seq, "Destination Network Unknown");
 			break;
 		case ICMP_HOST_UNKNOWN:
-			handle_error(icmp_seq, "Destination Host Unknown");
+			handle_error(target, icmp_seq, "Destination Host Unknown");
 			break;
 		case ICMP_HOST_ISOLATED:
-			handle_error(icmp_seq, "Source Host Isolated");
+			handle_error(target, icmp_seq, "Source Host Isolated");
 			break;
 		case ICMP_NET_ANO:
-			handle_error(icmp_seq, "Communication with Destination Network is Administratively Prohibited");
+			handle_error(target, icmp_seq, "Communication with Destination Network is Administratively Prohibited");
 			break;
 		case ICMP_HOST_ANO:
-			handle_error(icmp_seq, "Communication with Destination Host is Administratively Prohibited");
+			handle_error(target, icmp_seq, "Communication with Destination Host is Administratively Prohibited");
 			break;
 		case ICMP_NET_UNR_TOS:
-			handle_error(icmp_seq, "Destination Network Unreachable for Type of Service");
+			handle_error(target, icmp_seq, "Destination Network Unreachable for Type of Service");
 			break;
 		case ICMP_HOST_UNR_TOS:
-			handle_error(icmp_seq, "Destination Host Unreachable for Type of Service");
+			handle_error(target, icmp_seq, "Destination Host Unreachable for Type of Service");
 			break;
 		case ICMP_PKT_FILTERED:
-			handle_error(icmp_seq, "Communication Administratively Prohibited");
+			handle_error(target, icmp_seq, "Communication Administratively Prohibited");
 			break;
 		case ICMP_PREC_VIOLATION:
-			handle_error(icmp_seq, "Host Precedence Violation");
+			handle_error(target, icmp_seq, "Host Precedence Violation");
 			break;
 		case ICMP_PREC_CUTOFF:
-			handle_error(icmp_seq, "Precedence cutoff in effect");
+			handle_error(target, icmp_seq, "Precedence cutoff in effect");
 			break;
 		default:
-			handle_error(icmp_seq, "Destination unreachable");
+			handle_error(target, icmp_seq, "Destination unreachable");
 			break;
 		}
 		break;
 
 	case ICMP_SOURCE_QUENCH:
-		handle_error(icmp_seq, "Source Quench");
+		handle_error(target, icmp_seq, "Source Quench");
 		break;
 
 	case ICMP_REDIRECT:
 		switch (received_packet->code)
 		{
 		case ICMP_REDIR_NET:
-			handle_error(icmp_seq, "Redirect for Destination Network");
+			handle_error(target, icmp_seq, "Redirect for Destination Network");
 			break;
 		case ICMP_REDIR_HOST:
-			handle_error(icmp_seq, "Redirect for Destination Host");
+			handle_error(target, icmp_seq, "Redirect for Destination Host");
 			break;
 		case ICMP_REDIR_NETTOS:
-			handle_error(icmp_seq, "Redirect for Destination Network Based on Type-of-Service");
+			handle_error(target, icmp_seq, "Redirect for Destination Network Based on Type-of-Service");
 			break;
 		case ICMP_REDIR_HOSTTOS:
-			handle_error(icmp_seq, "Redirect for Destination Host Based on Type-of-Service");
+			handle_error(target, icmp_seq, "Redirect for Destination Host Based on Type-of-Service");
 			break;
 		default:
-			handle_error(icmp_seq, "Redirect");
+			handle_error(target, icmp_seq, "Redirect");
 			break;
 		}
 		break;
@@ -134,13 +165,13 @@ void handle_icmp_error(unsigned short icmp_seq, icmphdr_t *received_packet)
 		switch (received_packet->code)
 		{
 		case ICMP_EXC_TTL:
-			handle_error(icmp_seq, "Time-to-Live Exceeded in Transit");
+			handle_error(target, icmp_seq, "Time-to-Live Exceeded in Transit");
 			break;
 		case ICMP_EXC_FRAGTIME:
-			handle_error(icmp_seq, "Fragment Reassembly Time Exceeded");
+			handle_error(target, icmp_seq, "Fragment Reassembly Time Exceeded");
 			break;
 		default:
-			handle_error(icmp_seq, "Time Exceeded");
+			handle_error(target, icmp_seq, "Time Exceeded");
 			break;
 		}
 		break;
@@ -149,22 +180,22 @@ void handle_icmp_error(unsigned short icmp_seq, icmphdr_t *received_packet)
 		switch (received_packet->code)
 		{
 		case ICMP_ERRATPTR:
-			handle_error(icmp_seq, "Pointer indicates the error");
+			handle_error(target, icmp_seq, "Pointer indicates the error");
 			break;
 		case ICMP_OPTABSENT:
-			handle_error(icmp_seq, "Missing a Required Option");
+			handle_error(target, icmp_seq, "Missing a Required Option");
 			break;
 		case ICMP_BAD_LENGTH:
-			handle_error(icmp_seq, "Bad Length");
+			handle_error(target, icmp_seq, "Bad Length");
 			break;
 		default:
-			handle_error(icmp_seq, "Parameter Problem");
+			handle_error(target, icmp_seq, "Parameter Problem");
 			break;
 		}
 		break;
 
 	default:
-		handle_error(icmp_seq, "Unknown Error");
+		handle_error(target, icmp_seq, "Unknown Error");
 		break;
 	}
 }
\ No newline at end of file
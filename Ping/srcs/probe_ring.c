@@ -0,0 +1,138 @@
+#include "ping.h"
+
+// Allocates the in-flight ring of an engine.
+// It has one slot per 16-bit ICMP sequence number, so a reply is matched with a single lookup.
+// @param engine The engine.
+void initialize_probe_ring(ping_engine_t *engine)
+{
+    engine->probe_ring = calloc(PROBE_RING_SIZE, sizeof(probe_slot_t));
+    if (engine->probe_ring == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+}
+
+// Records a probe that was just sent.
+// A probe still pending in the recycled slot is given up, as if it had expired.
+// @param engine The engine.
+// @param sequence The engine-wide sequence number of the probe.
+// @param target The index of the probed target.
+// @param target_sequence The rank of the probe among those sent to its target.
+// @param send_time The monotonic send time of the probe, in nanoseconds.
+void track_probe(ping_engine_t *engine, uint32_t sequence, uint32_t target, uint32_t target_sequence, uint64_t send_time)
+{
+    probe_slot_t *slot = &engine->probe_ring[sequence & (PROBE_RING_SIZE - 1)];
+    if (slot->state == PROBE_PENDING)
+    {
+        --engine->packets_in_flight;
+        if (global_ping.adaptive)
+        {
+            release_adaptive_probe(engine, slot, 0);
+        }
+        if (global_ping.pmtu)
+        {
+            settle_pmtu_probe(engine, slot->target, slot->target_sequence, PMTU_LOST, 0, 0);
+        }
+        if (engine->service)
+        {
+            report_service_loss(engine, slot);
+        }
+    }
+    slot->send_time = send_time;
+    slot->kernel_send_time = 0;
+    slot->sequence = sequence;
+    slot->target = target;
+    slot->target_sequence = target_sequence;
+    slot->state = PROBE_PENDING;
+    ++engine->packets_in_flight;
+    if (global_ping.adaptive)
+    {
+        ++global_ping.targets[target].probes_in_flight;
+    }
+}
+
+// Marks as expired every probe that has been waiting for longer than the timeout.
+// Probes are sent in sequence order, so the scan stops at the first one still in time
+// and resumes from there on the next call.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void expire_probes(ping_engine_t *engine, uint64_t now)
+{
+    uint32_t next_sequence = engine->packets_sent;
+    while (engine->oldest_pending != next_sequence)
+    {
+        probe_slot_t *slot = &engine->probe_ring[engine->oldest_pending & (PROBE_RING_SIZE - 1)];
+        if (slot->sequence == engine->oldest_pending && slot->state == PROBE_PENDING)
+        {
+            if (slot->send_time + global_ping.timeout_ns > now)
+            {
+                return;
+            }
+            slot->state = PROBE_EXPIRED;
+            --engine->packets_in_flight;
+            ping_target_t *target = &global_ping.targets[slot->target];
+            __atomic_store_n(&target->lost_probes, target->lost_probes + 1, __ATOMIC_RELAXED);
+            if (global_ping.adaptive)
+            {
+                release_adaptive_probe(engine, slot, 0);
+            }
+            if (global_ping.pmtu)
+            {
+                settle_pmtu_probe(engine, slot->target, slot->target_sequence, PMTU_LOST, 0, 0);
+            }
+            if (engine->service)
+            {
+                report_service_loss(engine, slot);
+            }
+        }
+        ++engine->oldest_pending;
+    }
+}
+
+// Finds the slot of the most recent probe sent with the given ICMP sequence number.
+// @param engine The engine.
+// @param icmp_seq The 16-bit sequence number carried in the ICMP header.
+// @return The slot, or NULL if no probe was ever sent with this sequence number.
+probe_slot_t *find_probe(ping_engine_t *engine, unsigned short icmp_seq)
+{
+    probe_slot_t *slot = &engine->probe_ring[icmp_seq & (PROBE_RING_SIZE - 1)];
+    return slot->state == PROBE_FREE ? NULL : slot;
+}
+
+// Settles the probe a reply or an ICMP error refers to.
+// Reordering is judged per target, probes to different targets are not ordered.
+// @param engine The engine.
+// @param sequence The engine-wide sequence number of the probe.
+// @param recv_time The monotonic time the reply was read, 0 for an ICMP error, which gives
+// the adaptive mode no round trip time sample.
+// @return How the reply relates to the probes in flight.
+reply_status_t resolve_probe(ping_engine_t *engine, uint32_t sequence, uint64_t recv_time)
+{
+    probe_slot_t *slot = &engine->probe_ring[sequence & (PROBE_RING_SIZE - 1)];
+
+    // The slot now belongs to a newer probe, or the probe timed out
+    if (slot->sequence != sequence || slot->state == PROBE_EXPIRED)
+    {
+        return REPLY_LATE;
+    }
+    if (slot->state == PROBE_ANSWERED)
+    {
+        return REPLY_DUPLICATE;
+    }
+
+    slot->state = PROBE_ANSWERED;
+    --engine->packets_in_flight;
+    if (global_ping.adaptive)
+    {
+        release_adaptive_probe(engine, slot, recv_time);
+    }
+
+    ping_target_t *target = &global_ping.targets[slot->target];
+    if (slot->target_sequence < target->highest_answered)
+    {
+        return REPLY_OUT_OF_ORDER;
+    }
+    target->highest_answered = slot->target_sequence;
+    return REPLY_IN_ORDER;
+}
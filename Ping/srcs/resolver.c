@@ -0,0 +1,921 @@
+#include "ping.h"
+
+// Sets the address of a target given as an IPv4 address, which needs no resolution.
+// Accepts the forms getaddrinfo() does, such as 127.1.
+// @param target The target, whose address and ip_address are filled.
+// @return true if the host is an address.
+bool resolve_literal(ping_target_t *target)
+{
+    struct in_addr address;
+    if (!inet_aton(target->host, &address))
+    {
+        return false;
+    }
+    target->address.sin_family = AF_INET;
+    target->address.sin_addr = address;
+    inet_ntop(AF_INET, &address, target->ip_address, sizeof(target->ip_address));
+    return true;
+}
+
+// Hashes a hostname, ignoring the case (FNV-1a).
+// @param name The hostname.
+// @return The hash.
+static uint32_t hash_name(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name)
+    {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)*name)) * 16777619u;
+    }
+    return hash;
+}
+
+// Finds the entry of a hostname, or the empty bucket of the table where it belongs.
+// @param resolver The resolver.
+// @param name The hostname.
+// @return The bucket of the table.
+static uint32_t *find_bucket(dns_resolver_t *resolver, const char *name)
+{
+    uint32_t bucket = hash_name(name) & resolver->table_mask;
+    while (resolver->table[bucket] != UINT32_MAX && strcasecmp(resolver->entries[resolver->table[bucket]].name, name) != 0)
+    {
+        bucket = (bucket + 1) & resolver->table_mask;
+    }
+    return &resolver->table[bucket];
+}
+
+// Writes a query for the A records of a name.
+// @param name The hostname, optionally ending with a dot.
+// @param domain The search domain appended to the name, NULL for none.
+// @param id The DNS id of the query.
+// @param packet Filled with the query, DNS_PACKET_SIZE bytes at most.
+// @return The length of the query, 0 if the name cannot be queried.
+static size_t build_query(const char *name, const char *domain, uint16_t id, unsigned char *packet)
+{
+    static const unsigned char header[10] = {0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0}; // recursion desired, 1 question
+    packet[0] = id >> 8;
+    packet[1] = id & 0xff;
+    memcpy(packet + 2, header, sizeof(header));
+
+    size_t length = 12;
+    for (; name != NULL; name = domain, domain = NULL)
+    {
+        while (*name)
+        {
+            size_t label = strcspn(name, ".");
+            if (label == 0 || label > 63 || length + label + 6 > 12 + 255)
+            {
+                return 0;
+            }
+            packet[length++] = label;
+            memcpy(packet + length, name, label);
+            length += label;
+            name += label + (name[label] == '.');
+        }
+    }
+    if (length == 12)
+    {
+        return 0;
+    }
+    static const unsigned char question_end[5] = {0, 0, 1, 0, 1}; // root, type A, class IN
+    memcpy(packet + length, question_end, sizeof(question_end));
+    return length + sizeof(question_end);
+}
+
+// Skips a possibly compressed name in a DNS message.
+// @param cursor The start of the name.
+// @param end The end of the message.
+// @return The byte following the name, NULL if it overruns the message.
+static const unsigned char *skip_name(const unsigned char *cursor, const unsigned char *end)
+{
+    while (cursor < end)
+    {
+        if (*cursor == 0)
+            return cursor + 1;
+        if ((*cursor & 0xc0) == 0xc0)
+            return cursor + 2 <= end ? cursor + 2 : NULL;
+        if (*cursor & 0xc0)
+            return NULL;
+        cursor += *cursor + 1;
+    }
+    return NULL;
+}
+
+// Takes a target of each name and links the next ones to it, then sets the addresses known
+// without a query, those of the hosts file.
+// @param resolver The resolver, whose table and entries are empty.
+static void collect_names(dns_resolver_t *resolver)
+{
+    for (uint32_t i = 0; i < resolver->target_count; ++i)
+    {
+        ping_target_t *target = &global_ping.targets[resolver->first_target + i];
+        if (target->address.sin_family)
+        {
+            continue;
+        }
+        uint32_t *bucket = find_bucket(resolver, target->host);
+        if (*bucket == UINT32_MAX)
+        {
+            *bucket = resolver->entry_count++;
+            resolver->entries[*bucket] = (dns_entry_t){.name = target->host, .first_target = -1, .state = DNS_QUEUED, .stream = -1};
+        }
+        dns_entry_t *entry = &resolver->entries[*bucket];
+        resolver->next_targets[i] = entry->first_target;
+        entry->first_target = resolver->first_target + i;
+    }
+
+    // The first line naming a host gives its address, as for the C library
+    FILE *hosts = fopen(DNS_HOSTS_FILE, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (hosts != NULL && getline(&line, &line_size, hosts) >= 0)
+    {
+        line[strcspn(line, "#")] = '\0';
+        char *save = NULL;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        struct in_addr address;
+        if (token == NULL || !inet_aton(token, &address))
+        {
+            continue;
+        }
+        while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            uint32_t index = *find_bucket(resolver, token);
+            if (index != UINT32_MAX && !resolver->entries[index].address)
+            {
+                resolver->entries[index].address = address.s_addr;
+                resolver->entries[index].expiry = UINT64_MAX;
+                resolver->entries[index].state = DNS_RESOLVED;
+            }
+        }
+    }
+    free(line);
+    if (hosts != NULL)
+    {
+        fclose(hosts);
+    }
+}
+
+// Reads the name servers of resolv.conf, or takes the one of --dns. Without any, the
+// local host is asked, as by the C library.
+// @param resolver The resolver.
+static void read_name_servers(dns_resolver_t *resolver)
+{
+    resolver->server_count = 0;
+    if (global_ping.dns_server.sin_port)
+    {
+        resolver->servers[resolver->server_count++] = global_ping.dns_server;
+        return;
+    }
+
+    FILE *file = fopen(DNS_RESOLV_CONF, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (file != NULL && resolver->server_count < DNS_MAX_SERVERS && getline(&line, &line_size, file) >= 0)
+    {
+        char *save = NULL;
+        char *keyword = strtok_r(line, " \t\r\n", &save);
+        char *value = strtok_r(NULL, " \t\r\n", &save);
+        struct sockaddr_in *server = &resolver->servers[resolver->server_count];
+        if (keyword != NULL && value != NULL && strcmp(keyword, "nameserver") == 0 && inet_pton(AF_INET, value, &server->sin_addr) == 1)
+        {
+            server->sin_family = AF_INET;
+            server->sin_port = htons(DNS_PORT);
+            ++resolver->server_count;
+        }
+    }
+    free(line);
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+
+    if (!resolver->server_count)
+    {
+        resolver->servers[0] = (struct sockaddr_in){.sin_family = AF_INET, .sin_port = htons(DNS_PORT), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        resolver->server_count = 1;
+    }
+}
+
+// Reads the search domains of resolv.conf, as the C library does: the last search or domain
+// line gives them, and without any, the domain of the host name is searched.
+// @param resolver The resolver.
+static void read_search_domains(dns_resolver_t *resolver)
+{
+    resolver->search_count = 0;
+    bool listed = false;
+    FILE *file = fopen(DNS_RESOLV_CONF, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    while (file != NULL && getline(&line, &line_size, file) >= 0)
+    {
+        char *save = NULL;
+        char *keyword = strtok_r(line, " \t\r\n", &save);
+        if (keyword == NULL || (strcmp(keyword, "search") != 0 && strcmp(keyword, "domain") != 0))
+        {
+            continue;
+        }
+        listed = true;
+        resolver->search_count = 0;
+        char *domain;
+        while (resolver->search_count < DNS_MAX_SEARCH && (domain = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            if (strlen(domain) < DNS_NAME_SIZE && strcmp(domain, ".") != 0)
+                strcpy(resolver->search[resolver->search_count++], domain);
+            if (strcmp(keyword, "domain") == 0)
+                break;
+        }
+    }
+    free(line);
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+
+    char host_name[DNS_NAME_SIZE];
+    if (!listed && gethostname(host_name, sizeof(host_name)) == 0 && strchr(host_name, '.') && strchr(host_name, '.')[1])
+    {
+        strcpy(resolver->search[resolver->search_count++], strchr(host_name, '.') + 1);
+    }
+}
+
+// Writes the query of the name an entry is asking for: a name without a dot is asked with
+// each search domain in turn, then as given.
+// @param resolver The resolver.
+// @param entry The entry.
+// @param id The DNS id of the query.
+// @param packet Filled with the query, DNS_PACKET_SIZE bytes at most.
+// @return The length of the query, 0 if the name cannot be queried.
+static size_t build_entry_query(const dns_resolver_t *resolver, const dns_entry_t *entry, uint16_t id, unsigned char *packet)
+{
+    bool searched = !strchr(entry->name, '.') && entry->search < resolver->search_count;
+    return build_query(entry->name, searched ? resolver->search[entry->search] : NULL, id, packet);
+}
+
+// Sets the address of the targets of a settled name. With an engine, the targets that had
+// none start probing right away; an unknown host is reported once and leaves the targets
+// without an address.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param index The entry of the name.
+// @param now The current monotonic time, in nanoseconds.
+static void settle_name(dns_resolver_t *resolver, ping_engine_t *engine, uint32_t index, uint64_t now)
+{
+    dns_entry_t *entry = &resolver->entries[index];
+    if (entry->state == DNS_FAILED)
+    {
+        fprintf(stderr, "ping: cannot resolve %s: Unknown host\n", entry->name);
+    }
+    for (int32_t i = entry->first_target; i >= 0; i = resolver->next_targets[i - resolver->first_target])
+    {
+        ping_target_t *target = &global_ping.targets[i];
+        if (entry->state == DNS_FAILED)
+        {
+            if (engine && global_ping.packet_count)
+                --engine->active_targets;
+            continue;
+        }
+
+        bool starting = !target->address.sin_family;
+        target->address.sin_family = AF_INET;
+        __atomic_store_n(&target->address.sin_addr.s_addr, entry->address, __ATOMIC_RELAXED);
+        inet_ntop(AF_INET, &target->address.sin_addr, target->ip_address, sizeof(target->ip_address));
+        if (starting && engine)
+        {
+            target->next_send_time = now;
+            schedule_target(&engine->wheel, i);
+        }
+    }
+}
+
+// Creates the resolver of a range of targets: the targets whose host is not an address are
+// grouped by name, the names known locally are settled, the others queued for a query.
+// @param first_target The first target of the range.
+// @param target_count The number of targets of the range.
+// @return The resolver.
+dns_resolver_t *open_resolver(uint32_t first_target, uint32_t target_count)
+{
+    dns_resolver_t *resolver = malloc(sizeof(dns_resolver_t));
+    if (resolver == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    resolver->first_target = first_target;
+    resolver->target_count = target_count;
+    resolver->socket = -1;
+    resolver->entry_count = 0;
+    resolver->queue_head = resolver->queue_length = 0;
+    resolver->query_count = 0;
+    resolver->id_salt = get_monotonic_time();
+    resolver->unresolved = 0;
+    resolver->next_expiry = UINT64_MAX;
+    resolver->refresh = false;
+    resolver->queries_sent = 0;
+    for (int i = 0; i < DNS_MAX_QUERIES; ++i)
+    {
+        resolver->queries[i] = UINT32_MAX;
+    }
+    for (int i = 0; i < DNS_MAX_STREAMS; ++i)
+    {
+        resolver->streams[i].fd = -1;
+    }
+
+    // At most half full, the probes of the table stay short
+    uint32_t table_size = 2;
+    while (table_size < 2 * target_count)
+    {
+        table_size *= 2;
+    }
+    resolver->table_mask = table_size - 1;
+    resolver->table = malloc(table_size * sizeof(uint32_t));
+    resolver->entries = malloc(target_count * sizeof(dns_entry_t));
+    resolver->next_targets = malloc(target_count * sizeof(int32_t));
+    resolver->queue = malloc(target_count * sizeof(uint32_t));
+    if (resolver->table == NULL || resolver->entries == NULL || resolver->next_targets == NULL || resolver->queue == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    memset(resolver->table, 0xff, table_size * sizeof(uint32_t));
+
+    collect_names(resolver);
+    for (uint32_t i = 0; i < resolver->entry_count; ++i)
+    {
+        if (resolver->entries[i].state == DNS_QUEUED)
+        {
+            resolver->queue[resolver->queue_length++] = i;
+            ++resolver->unresolved;
+        }
+        else
+        {
+            settle_name(resolver, NULL, i, 0);
+        }
+    }
+    if (!resolver->unresolved)
+    {
+        return resolver;
+    }
+
+    read_name_servers(resolver);
+    read_search_domains(resolver);
+    resolver->socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (resolver->socket < 0)
+    {
+        perror("ping: socket dns");
+        exit(1);
+    }
+    return resolver;
+}
+
+// Sends the query of a name, to the next name server in turn, in a free query slot unless it
+// is a retry. A query the kernel refuses to send counts as a try.
+// @param resolver The resolver.
+// @param index The entry of the name.
+// @param now The current monotonic time, in nanoseconds.
+// @return false if the name cannot be queried.
+static bool send_query(dns_resolver_t *resolver, uint32_t index, uint64_t now)
+{
+    dns_entry_t *entry = &resolver->entries[index];
+    if (entry->state != DNS_PENDING)
+    {
+        uint16_t slot = 0;
+        while (resolver->queries[slot] != UINT32_MAX)
+        {
+            ++slot;
+        }
+        resolver->queries[slot] = index;
+        ++resolver->query_count;
+        entry->query = slot;
+        entry->tries = 0;
+        entry->state = DNS_PENDING;
+    }
+
+    // The low byte of the id gives the slot, the high byte changes with every query. A search
+    // domain too long for the name is skipped.
+    uint16_t id = (uint16_t)(resolver->id_salt++ << 8) | entry->query;
+    unsigned char packet[DNS_PACKET_SIZE];
+    size_t length;
+    while (!(length = build_entry_query(resolver, entry, id, packet)) && !strchr(entry->name, '.') &&
+           entry->search < resolver->search_count)
+    {
+        ++entry->search;
+    }
+    if (!length)
+    {
+        return false;
+    }
+    resolver->query_ids[entry->query] = id;
+    const struct sockaddr_in *server = &resolver->servers[entry->tries % resolver->server_count];
+    sendto(resolver->socket, packet, length, 0, (const struct sockaddr *)server, sizeof(*server));
+    ++resolver->queries_sent;
+    ++entry->tries;
+    entry->sent_time = now;
+    return true;
+}
+
+// Closes the connection of a query over TCP.
+// @param resolver The resolver.
+// @param stream The stream of the query.
+static void close_stream(dns_resolver_t *resolver, dns_stream_t *stream)
+{
+    close(stream->fd);
+    free(stream->message);
+    stream->fd = -1;
+    resolver->entries[stream->entry].stream = -1;
+}
+
+// Settles a name whose query succeeded or definitely failed, and frees its query slot and
+// its stream. A failed refresh keeps the previous address for a while.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param index The entry of the name.
+// @param address The IPv4 address, network order, 0 for an unknown host.
+// @param ttl_ns The lifetime of the address.
+// @param now The current monotonic time, in nanoseconds.
+static void finish_query(dns_resolver_t *resolver, ping_engine_t *engine, uint32_t index, uint32_t address, uint64_t ttl_ns, uint64_t now)
+{
+    dns_entry_t *entry = &resolver->entries[index];
+    if (entry->stream >= 0)
+    {
+        close_stream(resolver, &resolver->streams[entry->stream]);
+    }
+    if (entry->state == DNS_PENDING)
+    {
+        resolver->queries[entry->query] = UINT32_MAX;
+        --resolver->query_count;
+    }
+
+    bool refreshing = entry->address != 0;
+    if (!address && refreshing)
+    {
+        ttl_ns = 0;
+        address = entry->address;
+    }
+    entry->state = address ? DNS_RESOLVED : DNS_FAILED;
+    entry->address = address;
+    entry->expiry = now + (ttl_ns > DNS_MIN_TTL_NS ? ttl_ns : DNS_MIN_TTL_NS);
+    if (address && entry->expiry < resolver->next_expiry)
+    {
+        resolver->next_expiry = entry->expiry;
+    }
+    if (!refreshing)
+    {
+        --resolver->unresolved;
+    }
+    settle_name(resolver, engine, index, now);
+}
+
+// Asks a name again over TCP, to the server whose answer was truncated over UDP. The
+// connection is nonblocking and served by the event loop, or by resolve_all(); the query
+// is not sent again, and fails if no answer arrives within DNS_RETRY_NS. Without a free
+// stream, the query is retried over UDP on its deadline, when one may be free.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param index The entry of the name.
+// @param server The name server.
+// @param now The current monotonic time, in nanoseconds.
+static void open_stream(dns_resolver_t *resolver, ping_engine_t *engine, uint32_t index, const struct sockaddr_in *server, uint64_t now)
+{
+    int i = 0;
+    while (i < DNS_MAX_STREAMS && resolver->streams[i].fd >= 0)
+    {
+        ++i;
+    }
+    if (i == DNS_MAX_STREAMS)
+    {
+        return;
+    }
+
+    dns_stream_t *stream = &resolver->streams[i];
+    dns_entry_t *entry = &resolver->entries[index];
+    stream->message = malloc(2 + UINT16_MAX);
+    stream->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stream->message == NULL || stream->fd < 0)
+    {
+        perror(stream->fd < 0 ? "ping: socket dns" : "ping: malloc");
+        exit(1);
+    }
+    size_t length = build_entry_query(resolver, entry, resolver->query_ids[entry->query], stream->message + 2);
+    stream->message[0] = length >> 8;
+    stream->message[1] = length & 0xff;
+    stream->query_length = 2 + length;
+    stream->sent = stream->received = 0;
+    stream->entry = index;
+    entry->stream = i;
+    entry->tries = DNS_TRIES;
+    entry->sent_time = now;
+
+    if (connect(stream->fd, (const struct sockaddr *)server, sizeof(*server)) < 0 && errno != EINPROGRESS)
+    {
+        finish_query(resolver, engine, index, 0, 0, now);
+        return;
+    }
+    if (engine)
+    {
+        // Edge triggered: notified once connected, then as the answer arrives
+        watch_fd(engine, stream->fd, EPOLLIN | EPOLLOUT | EPOLLET);
+    }
+}
+
+// Asks the next name a name without a dot may stand for, once the previous one is unknown or
+// has no IPv4 address: the next search domain, then the name as given. The query keeps its
+// slot, its tries start over, and it goes over UDP again.
+// @param resolver The resolver.
+// @param index The entry of the name.
+// @param now The current monotonic time, in nanoseconds.
+// @return false once every name was asked.
+static bool ask_next_name(dns_resolver_t *resolver, uint32_t index, uint64_t now)
+{
+    dns_entry_t *entry = &resolver->entries[index];
+    if (strchr(entry->name, '.') || entry->search >= resolver->search_count)
+    {
+        return false;
+    }
+    if (entry->stream >= 0)
+    {
+        close_stream(resolver, &resolver->streams[entry->stream]);
+    }
+    ++entry->search;
+    entry->tries = 0;
+    return send_query(resolver, index, now);
+}
+
+// Reads an answer to one of the queries in flight. An answer to no query in flight, or
+// about another name, is dropped; a failing server is replaced by the next one; an answer
+// truncated to fit in UDP is asked again over TCP; a name without a dot unknown with a
+// search domain is asked with the next one.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param packet The answer.
+// @param length The length of the answer.
+// @param server The name server which sent the answer over UDP, NULL over TCP.
+// @param now The current monotonic time, in nanoseconds.
+static void read_answer(dns_resolver_t *resolver, ping_engine_t *engine, const unsigned char *packet, size_t length, const struct sockaddr_in *server, uint64_t now)
+{
+    if (length < 12)
+    {
+        return;
+    }
+    uint16_t id = packet[0] << 8 | packet[1];
+    uint32_t index = resolver->queries[id & 0xff];
+    if (index == UINT32_MAX || resolver->query_ids[id & 0xff] != id || !(packet[2] & 0x80))
+    {
+        return;
+    }
+
+    // Once asked over TCP, a late answer over UDP is of no use
+    if (server != NULL && resolver->entries[index].stream >= 0)
+    {
+        return;
+    }
+
+    // The question must be the one asked, names compared regardless of the case
+    unsigned char query[DNS_PACKET_SIZE];
+    size_t query_length = build_entry_query(resolver, &resolver->entries[index], id, query);
+    if (length < query_length || packet[4] != 0 || packet[5] != 1)
+    {
+        return;
+    }
+    for (size_t i = 12; i < query_length; ++i)
+    {
+        if (tolower(packet[i]) != tolower(query[i]))
+            return;
+    }
+
+    unsigned int rcode = packet[3] & 0x0f;
+    if (server != NULL && packet[2] & 0x02)
+    {
+        open_stream(resolver, engine, index, server, now);
+        return;
+    }
+    if (rcode != 0 && rcode != 3)
+    {
+        if (resolver->entries[index].tries >= DNS_TRIES || !send_query(resolver, index, now))
+            finish_query(resolver, engine, index, 0, 0, now);
+        return;
+    }
+
+    // The first A record gives the address, it lives as long as the shortest record leading to it
+    const unsigned char *cursor = packet + query_length;
+    const unsigned char *end = packet + length;
+    unsigned int answer_count = packet[6] << 8 | packet[7];
+    uint32_t ttl = UINT32_MAX;
+    for (unsigned int i = 0; rcode == 0 && i < answer_count; ++i)
+    {
+        cursor = skip_name(cursor, end);
+        if (cursor == NULL || cursor + 10 > end)
+        {
+            return;
+        }
+        unsigned int type = cursor[0] << 8 | cursor[1];
+        unsigned int class = cursor[2] << 8 | cursor[3];
+        uint32_t record_ttl = (uint32_t)cursor[4] << 24 | cursor[5] << 16 | cursor[6] << 8 | cursor[7];
+        unsigned int data_length = cursor[8] << 8 | cursor[9];
+        cursor += 10;
+        if (cursor + data_length > end)
+        {
+            return;
+        }
+        ttl = record_ttl < ttl ? record_ttl : ttl;
+        if (type == 1 && class == 1 && data_length == 4)
+        {
+            uint32_t address;
+            memcpy(&address, cursor, sizeof(address));
+            finish_query(resolver, engine, index, address, (uint64_t)ttl * 1000000000, now);
+            return;
+        }
+        cursor += data_length;
+    }
+
+    // No such name, or no IPv4 address for it, unless a name without a dot has another form
+    if (!ask_next_name(resolver, index, now))
+    {
+        finish_query(resolver, engine, index, 0, 0, now);
+    }
+}
+
+// Reads the answers that arrived on the socket of a resolver.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+static void receive_answers(dns_resolver_t *resolver, ping_engine_t *engine)
+{
+    unsigned char packet[DNS_PACKET_SIZE];
+    struct sockaddr_in source;
+    socklen_t source_length = sizeof(source);
+    ssize_t length;
+    while ((length = recvfrom(resolver->socket, packet, sizeof(packet), 0, (struct sockaddr *)&source, &source_length)) >= 0)
+    {
+        // Only the name servers answer
+        bool from_server = false;
+        for (unsigned int i = 0; i < resolver->server_count; ++i)
+        {
+            from_server |= source.sin_addr.s_addr == resolver->servers[i].sin_addr.s_addr && source.sin_port == resolver->servers[i].sin_port;
+        }
+        if (from_server)
+        {
+            read_answer(resolver, engine, packet, length, &source, get_monotonic_time());
+        }
+        source_length = sizeof(source);
+    }
+}
+
+// Sends the query of a stream once connected, then reads the answer until the kernel has
+// no more data, as an edge triggered event requires. A connection which fails or closes
+// before the whole answer fails the name, and so does an answer which cannot be used.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param stream The stream.
+static void serve_stream(dns_resolver_t *resolver, ping_engine_t *engine, dns_stream_t *stream)
+{
+    uint32_t index = stream->entry;
+    while (stream->sent < stream->query_length)
+    {
+        ssize_t length = send(stream->fd, stream->message + stream->sent, stream->query_length - stream->sent, MSG_NOSIGNAL);
+        if (length < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                finish_query(resolver, engine, index, 0, 0, get_monotonic_time());
+            return;
+        }
+        stream->sent += length;
+    }
+
+    for (;;)
+    {
+        uint32_t expected = stream->received < 2 ? 2 : 2 + (stream->message[0] << 8 | stream->message[1]);
+        if (stream->received >= 2 && stream->received == expected)
+        {
+            break;
+        }
+        ssize_t length = recv(stream->fd, stream->message + stream->received, expected - stream->received, 0);
+        if (length <= 0)
+        {
+            if (length == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                finish_query(resolver, engine, index, 0, 0, get_monotonic_time());
+            return;
+        }
+        stream->received += length;
+    }
+
+    uint64_t now = get_monotonic_time();
+    read_answer(resolver, engine, stream->message + 2, stream->received - 2, NULL, now);
+    if (stream->fd >= 0)
+    {
+        finish_query(resolver, engine, index, 0, 0, now);
+    }
+}
+
+// Sends the queries the resolver owes: the retries of the queries unanswered for DNS_RETRY_NS,
+// giving up after DNS_TRIES, the refreshes of the expired addresses, and the queued names as
+// long as query slots are free.
+// @param resolver The resolver.
+// @param engine The engine probing the targets, NULL before the engines start.
+// @param now The current monotonic time, in nanoseconds.
+void run_resolver(dns_resolver_t *resolver, ping_engine_t *engine, uint64_t now)
+{
+    if (resolver->socket < 0)
+    {
+        return;
+    }
+    for (int slot = 0; resolver->query_count && slot < DNS_MAX_QUERIES; ++slot)
+    {
+        uint32_t index = resolver->queries[slot];
+        if (index == UINT32_MAX || resolver->entries[index].sent_time + DNS_RETRY_NS > now)
+        {
+            continue;
+        }
+        if (resolver->entries[index].tries >= DNS_TRIES || !send_query(resolver, index, now))
+        {
+            finish_query(resolver, engine, index, 0, 0, now);
+        }
+    }
+
+    if (resolver->refresh && resolver->next_expiry <= now)
+    {
+        resolver->next_expiry = UINT64_MAX;
+        for (uint32_t i = 0; i < resolver->entry_count; ++i)
+        {
+            dns_entry_t *entry = &resolver->entries[i];
+            if (entry->state != DNS_RESOLVED)
+                continue;
+            if (entry->expiry <= now)
+            {
+                entry->state = DNS_QUEUED;
+                resolver->queue[(resolver->queue_head + resolver->queue_length++) % resolver->entry_count] = i;
+            }
+            else if (entry->expiry < resolver->next_expiry)
+                resolver->next_expiry = entry->expiry;
+        }
+    }
+
+    while (resolver->queue_length && resolver->query_count < DNS_MAX_QUERIES)
+    {
+        uint32_t index = resolver->queue[resolver->queue_head];
+        resolver->queue_head = (resolver->queue_head + 1) % resolver->entry_count;
+        --resolver->queue_length;
+        if (!send_query(resolver, index, now))
+        {
+            finish_query(resolver, engine, index, 0, 0, now);
+        }
+    }
+}
+
+// Gives the time the resolver must run next.
+// @param resolver The resolver.
+// @return The monotonic time in nanoseconds, 0 if it waits for nothing.
+uint64_t resolver_deadline(const dns_resolver_t *resolver)
+{
+    uint64_t deadline = resolver->refresh ? resolver->next_expiry : UINT64_MAX;
+    for (int slot = 0; resolver->query_count && slot < DNS_MAX_QUERIES; ++slot)
+    {
+        uint32_t index = resolver->queries[slot];
+        if (index != UINT32_MAX && resolver->entries[index].sent_time + DNS_RETRY_NS < deadline)
+        {
+            deadline = resolver->entries[index].sent_time + DNS_RETRY_NS;
+        }
+    }
+    return deadline == UINT64_MAX ? 0 : deadline;
+}
+
+// Resolves every queued name before returning, DNS_MAX_QUERIES at a time.
+// @param resolver The resolver.
+void resolve_all(dns_resolver_t *resolver)
+{
+    while (resolver->unresolved)
+    {
+        run_resolver(resolver, NULL, get_monotonic_time());
+        if (!resolver->unresolved)
+        {
+            break;
+        }
+
+        // The socket of the queries over UDP, then the open streams
+        struct pollfd poll_fds[1 + DNS_MAX_STREAMS] = {{.fd = resolver->socket, .events = POLLIN}};
+        dns_stream_t *streams[1 + DNS_MAX_STREAMS];
+        nfds_t count = 1;
+        for (int i = 0; i < DNS_MAX_STREAMS; ++i)
+        {
+            dns_stream_t *stream = &resolver->streams[i];
+            if (stream->fd >= 0)
+            {
+                poll_fds[count] = (struct pollfd){.fd = stream->fd, .events = stream->sent < stream->query_length ? POLLOUT : POLLIN};
+                streams[count++] = stream;
+            }
+        }
+
+        uint64_t deadline = resolver_deadline(resolver);
+        uint64_t now = get_monotonic_time();
+        if (poll(poll_fds, count, deadline > now ? (deadline - now + 999999) / 1000000 : 0) <= 0)
+        {
+            continue;
+        }
+        if (poll_fds[0].revents)
+        {
+            receive_answers(resolver, NULL);
+        }
+        for (nfds_t i = 1; i < count; ++i)
+        {
+            if (poll_fds[i].revents && streams[i]->fd == poll_fds[i].fd)
+            {
+                serve_stream(resolver, NULL, streams[i]);
+            }
+        }
+    }
+}
+
+// Resolves the names of the targets of an engine while it probes, when the targets were
+// loaded without waiting for them. The names known locally are settled before the first
+// probe, the others start their targets as their answers arrive, and are resolved again
+// once their addresses expire.
+// @param engine The engine.
+void start_resolver(ping_engine_t *engine)
+{
+    if (!global_ping.resolve_in_engines)
+    {
+        return;
+    }
+    uint32_t i = 0;
+    while (i < engine->target_count && global_ping.targets[engine->first_target + i].address.sin_family)
+    {
+        ++i;
+    }
+    if (i == engine->target_count)
+    {
+        return;
+    }
+
+    engine->resolver = open_resolver(engine->first_target, engine->target_count);
+    engine->resolver->refresh = true;
+
+    // The unknown hosts among the names settled locally leave nothing to send
+    for (uint32_t index = 0; index < engine->resolver->entry_count && global_ping.packet_count; ++index)
+    {
+        const dns_entry_t *entry = &engine->resolver->entries[index];
+        for (int32_t target = entry->first_target; entry->state == DNS_FAILED && target >= 0;
+             target = engine->resolver->next_targets[target - engine->first_target])
+        {
+            --engine->active_targets;
+        }
+    }
+    if (engine->resolver->socket >= 0)
+    {
+        watch_fd(engine, engine->resolver->socket, EPOLLIN);
+    }
+}
+
+// Tells whether a file descriptor of the event loop belongs to a resolver.
+// @param resolver The resolver.
+// @param fd The file descriptor.
+// @return true for its socket and the connections of its streams.
+bool resolver_owns_fd(const dns_resolver_t *resolver, int fd)
+{
+    if (fd == resolver->socket)
+    {
+        return true;
+    }
+    for (int i = 0; i < DNS_MAX_STREAMS; ++i)
+    {
+        if (resolver->streams[i].fd == fd)
+            return true;
+    }
+    return false;
+}
+
+// Reads the answers for the resolver of an engine, over UDP or over one of its streams.
+// @param engine The engine.
+// @param fd The file descriptor notified.
+void handle_resolver_event(ping_engine_t *engine, int fd)
+{
+    dns_resolver_t *resolver = engine->resolver;
+    if (fd == resolver->socket)
+    {
+        receive_answers(resolver, engine);
+        return;
+    }
+    for (int i = 0; i < DNS_MAX_STREAMS; ++i)
+    {
+        if (resolver->streams[i].fd == fd)
+            serve_stream(resolver, engine, &resolver->streams[i]);
+    }
+}
+
+// Frees a resolver and closes its sockets.
+// @param resolver The resolver.
+void close_resolver(dns_resolver_t *resolver)
+{
+    for (int i = 0; i < DNS_MAX_STREAMS; ++i)
+    {
+        if (resolver->streams[i].fd >= 0)
+            close_stream(resolver, &resolver->streams[i]);
+    }
+    if (resolver->socket >= 0)
+    {
+        close(resolver->socket);
+    }
+    free(resolver->table);
+    free(resolver->entries);
+    free(resolver->next_targets);
+    free(resolver->queue);
+    free(resolver);
+}
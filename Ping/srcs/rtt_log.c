@@ -0,0 +1,369 @@
+#include "ping.h"
+
+// The log file, the offset its next record is written at, and the blocks written since
+// the last index record, shared by the engines
+static int log_fd = -1;
+static uint64_t log_end;
+static uint64_t previous_index;
+static ping_log_index_entry_t pending_entries[RTT_LOG_INDEX_BLOCKS];
+static unsigned int pending_count;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Writes a whole buffer at an offset of the log.
+// @param buffer The bytes to write.
+// @param length The number of bytes.
+// @param offset The offset in the file.
+static void write_at(const void *buffer, size_t length, uint64_t offset)
+{
+    while (length)
+    {
+        ssize_t written = pwrite(log_fd, buffer, length, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("ping: pwrite");
+            exit(1);
+        }
+        buffer = (const char *)buffer + written;
+        length -= written;
+        offset += written;
+    }
+}
+
+// Reads a record header of the log, checking it is whole.
+// @return true if the bytes were read.
+static bool read_at(void *buffer, size_t length, uint64_t offset)
+{
+    return pread(log_fd, buffer, length, offset) == (ssize_t)length;
+}
+
+// Writes the index record of the blocks written since the last one, followed by its
+// footer. Called with the log lock held.
+static void write_index(void)
+{
+    ping_log_index_t index = {
+        .magic = htole32(PING_LOG_INDEX_MAGIC),
+        .count = htole32(pending_count),
+        .previous_offset = htole64(previous_index)};
+    ping_log_footer_t footer = {.index_offset = htole64(log_end), .magic = htole32(PING_LOG_FOOTER_MAGIC), .reserved = 0};
+
+    size_t entries_size = pending_count * sizeof(ping_log_index_entry_t);
+    write_at(&index, sizeof(index), log_end);
+    write_at(pending_entries, entries_size, log_end + sizeof(index));
+    write_at(&footer, sizeof(footer), log_end + sizeof(index) + entries_size);
+
+    previous_index = log_end;
+    log_end += sizeof(index) + entries_size + sizeof(footer);
+    pending_count = 0;
+}
+
+// Finds where a log written by a previous run ends. A log closed cleanly ends with the
+// footer of its last index. Otherwise the run was killed: the record headers are followed
+// from the start, the blocks after the last index are indexed again by this run, and a
+// record cut in the middle is dropped.
+// @param size The size of the file.
+static void recover_rtt_log(uint64_t size)
+{
+    ping_log_header_t header;
+    if (!read_at(&header, sizeof(header), 0) || le32toh(header.magic) != PING_LOG_MAGIC ||
+        le16toh(header.version) != PING_LOG_VERSION || le16toh(header.header_size) != sizeof(header))
+    {
+        fprintf(stderr, "ping: %s is not a ping rtt log\n", global_ping.rtt_log_path);
+        exit(1);
+    }
+
+    ping_log_footer_t footer;
+    if (size >= sizeof(header) + sizeof(ping_log_index_t) + sizeof(footer) &&
+        read_at(&footer, sizeof(footer), size - sizeof(footer)) && le32toh(footer.magic) == PING_LOG_FOOTER_MAGIC)
+    {
+        previous_index = le64toh(footer.index_offset);
+        log_end = size;
+        return;
+    }
+
+    uint64_t offset = sizeof(header);
+    for (;;)
+    {
+        ping_log_block_t block;
+        ping_log_index_t index;
+        if (read_at(&block, sizeof(block), offset) && le32toh(block.magic) == PING_LOG_BLOCK_MAGIC &&
+            offset + sizeof(block) + le32toh(block.length) <= size)
+        {
+            // The index entries since the last index record fill at most one index
+            if (pending_count == RTT_LOG_INDEX_BLOCKS)
+            {
+                log_end = offset;
+                break;
+            }
+            pending_entries[pending_count++] = (ping_log_index_entry_t){
+                .offset = htole64(offset),
+                .address = block.address,
+                .count = block.count,
+                .min_time_us = block.min_time_us,
+                .max_time_us = block.max_time_us};
+            offset += sizeof(block) + le32toh(block.length);
+        }
+        else if (read_at(&index, sizeof(index), offset) && le32toh(index.magic) == PING_LOG_INDEX_MAGIC &&
+                 offset + sizeof(index) + (uint64_t)le32toh(index.count) * sizeof(ping_log_index_entry_t) + sizeof(ping_log_footer_t) <= size)
+        {
+            previous_index = offset;
+            pending_count = 0;
+            offset += sizeof(index) + le32toh(index.count) * sizeof(ping_log_index_entry_t) + sizeof(ping_log_footer_t);
+        }
+        else
+        {
+            log_end = offset;
+            break;
+        }
+    }
+
+    if (log_end < size)
+    {
+        fprintf(stderr, "ping: warning: dropping the last %lu bytes of %s, cut in the middle of a record\n",
+                (unsigned long)(size - log_end), global_ping.rtt_log_path);
+        if (ftruncate(log_fd, log_end) < 0)
+        {
+            perror("ping: ftruncate");
+            exit(1);
+        }
+    }
+}
+
+// Opens the round trip time log of --rtt-log, created with its header when it does not
+// exist, and allocates the series of the targets. Called once the targets are known,
+// before the engines start.
+void open_rtt_log(void)
+{
+    if (global_ping.rtt_log_path == NULL)
+    {
+        return;
+    }
+
+    log_fd = open(global_ping.rtt_log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat file_stat;
+    if (log_fd < 0 || fstat(log_fd, &file_stat) < 0)
+    {
+        perror("ping: open");
+        exit(1);
+    }
+
+    previous_index = 0;
+    pending_count = 0;
+    if (file_stat.st_size == 0)
+    {
+        ping_log_header_t header = {
+            .magic = htole32(PING_LOG_MAGIC),
+            .version = htole16(PING_LOG_VERSION),
+            .header_size = htole16(sizeof(header)),
+            .reserved = 0};
+        write_at(&header, sizeof(header), 0);
+        log_end = sizeof(header);
+    }
+    else
+    {
+        recover_rtt_log(file_stat.st_size);
+    }
+
+    global_ping.rtt_series = calloc(global_ping.target_count, sizeof(rtt_log_series_t));
+    if (global_ping.rtt_series == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+}
+
+// Appends bits to the compressed samples of a series, most significant first.
+// @param series The series.
+// @param value The bits, in the low bits of the value.
+// @param count The number of bits, at most 64.
+static void put_bits(rtt_log_series_t *series, uint64_t value, unsigned int count)
+{
+    while (count)
+    {
+        unsigned int room = 8 - series->bit_length % 8;
+        unsigned int length = count < room ? count : room;
+        uint8_t bits = (value >> (count - length)) & ((1U << length) - 1);
+        series->data[series->bit_length / 8] |= bits << (room - length);
+        series->bit_length += length;
+        count -= length;
+    }
+}
+
+// Writes the block of a series to the log, and the index once it lists RTT_LOG_INDEX_BLOCKS
+// blocks. The series starts a new block afterwards.
+// @param index The index of the target.
+static void write_block(uint32_t index)
+{
+    rtt_log_series_t *series = &global_ping.rtt_series[index];
+    uint32_t length = (series->bit_length + 7) / 8;
+    ping_log_block_t block = {
+        .magic = htole32(PING_LOG_BLOCK_MAGIC),
+        .address = global_ping.targets[index].address.sin_addr.s_addr,
+        .min_time_us = htole64(series->min_time_us),
+        .max_time_us = htole64(series->max_time_us),
+        .count = htole32(series->count),
+        .length = htole32(length)};
+
+    pthread_mutex_lock(&log_lock);
+    write_at(&block, sizeof(block), log_end);
+    write_at(series->data, length, log_end + sizeof(block));
+    pending_entries[pending_count++] = (ping_log_index_entry_t){
+        .offset = htole64(log_end),
+        .address = block.address,
+        .count = block.count,
+        .min_time_us = block.min_time_us,
+        .max_time_us = block.max_time_us};
+    log_end += sizeof(block) + length;
+    if (pending_count == RTT_LOG_INDEX_BLOCKS)
+    {
+        write_index();
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    memset(series->data, 0, length);
+    series->bit_length = 0;
+    series->count = 0;
+}
+
+// Encodes the difference between the delta to the previous send time and the previous delta.
+// @param series The series.
+// @param delta_of_delta The difference, in microseconds.
+static void put_delta_of_delta(rtt_log_series_t *series, int64_t delta_of_delta)
+{
+    if (delta_of_delta == 0)
+    {
+        put_bits(series, 0, 1);
+        return;
+    }
+
+    unsigned int class = 1;
+    while (class < PING_LOG_DOD_CLASSES)
+    {
+        int64_t limit = (int64_t)1 << (ping_log_dod_bits[class] - 1);
+        if (delta_of_delta >= -limit && delta_of_delta < limit)
+        {
+            break;
+        }
+        ++class;
+    }
+
+    // Prefix of class ones, ended by a zero below the last class
+    if (class < PING_LOG_DOD_CLASSES)
+        put_bits(series, ((1U << class) - 1) << 1, class + 1);
+    else
+        put_bits(series, (1U << class) - 1, class);
+    put_bits(series, (uint64_t)delta_of_delta, ping_log_dod_bits[class]);
+}
+
+// Encodes a round trip time XOR-ed with the previous one, reusing the window of meaningful
+// bits of the previous XOR when the new one fits in it.
+// @param series The series.
+// @param rtt_ns The round trip time, in nanoseconds.
+static void put_round_trip(rtt_log_series_t *series, uint64_t rtt_ns)
+{
+    uint64_t xor = rtt_ns ^ series->last_rtt_ns;
+    if (xor == 0)
+    {
+        put_bits(series, 0, 1);
+        return;
+    }
+
+    unsigned int leading = __builtin_clzll(xor);
+    unsigned int trailing = __builtin_ctzll(xor);
+    if (series->window_length && leading >= series->leading && trailing >= 64 - series->leading - series->window_length)
+    {
+        put_bits(series, 2, 2);
+        put_bits(series, xor >> (64 - series->leading - series->window_length), series->window_length);
+        return;
+    }
+
+    unsigned int length = 64 - leading - trailing;
+    put_bits(series, 3, 2);
+    put_bits(series, leading, PING_LOG_LEADING_BITS);
+    put_bits(series, length - 1, PING_LOG_LENGTH_BITS);
+    put_bits(series, xor >> trailing, length);
+    series->leading = leading;
+    series->window_length = length;
+}
+
+// Appends a sample to the series of its target. The block of the series is written out
+// once it may not hold another sample, or once it spans RTT_LOG_BLOCK_US.
+// @param index The index of the target.
+// @param time_us The CLOCK_REALTIME time the probe was sent, in microseconds.
+// @param rtt_ns The round trip time, in nanoseconds.
+void log_sample(uint32_t index, uint64_t time_us, uint64_t rtt_ns)
+{
+    rtt_log_series_t *series = &global_ping.rtt_series[index];
+    if (series->data == NULL && (series->data = calloc(1, RTT_LOG_BLOCK_SIZE)) == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+
+    if (series->count && (series->bit_length + PING_LOG_MAX_SAMPLE_BITS > RTT_LOG_BLOCK_SIZE * 8 ||
+                          time_us - series->min_time_us > RTT_LOG_BLOCK_US))
+    {
+        write_block(index);
+    }
+
+    if (series->count == 0)
+    {
+        put_bits(series, time_us, 64);
+        put_bits(series, rtt_ns, 64);
+        series->min_time_us = series->max_time_us = time_us;
+        series->last_delta = 0;
+        series->window_length = 0;
+    }
+    else
+    {
+        int64_t delta = (int64_t)(time_us - series->last_time_us);
+        put_delta_of_delta(series, delta - series->last_delta);
+        put_round_trip(series, rtt_ns);
+        series->last_delta = delta;
+        series->min_time_us = time_us < series->min_time_us ? time_us : series->min_time_us;
+        series->max_time_us = time_us > series->max_time_us ? time_us : series->max_time_us;
+    }
+    series->last_time_us = time_us;
+    series->last_rtt_ns = rtt_ns;
+    ++series->count;
+}
+
+// Appends the round trip time of a reply to the series of its target, stamped with the
+// CLOCK_REALTIME time its probe was sent.
+// Called by the thread accounting the replies of the target.
+// @param index The index of the target.
+// @param rtt_ns The round trip time, in nanoseconds.
+void log_round_trip(uint32_t index, uint64_t rtt_ns)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    log_sample(index, ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - rtt_ns) / 1000, rtt_ns);
+}
+
+// Writes the blocks of every series and their index, so that the log ends with a footer.
+// Called once the engines are stopped.
+void close_rtt_log(void)
+{
+    if (log_fd < 0)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        if (global_ping.rtt_series[i].count)
+        {
+            write_block(i);
+        }
+        free(global_ping.rtt_series[i].data);
+    }
+    if (pending_count || previous_index == 0)
+    {
+        write_index();
+    }
+    close(log_fd);
+    log_fd = -1;
+}
@@ -0,0 +1,160 @@
+#include "ping.h"
+
+// The histogram is log-linear: values below 2^(RTT_PRECISION_BITS + 1) nanoseconds get one
+// bucket each, every following power of two is split into 2^RTT_PRECISION_BITS buckets.
+#define RTT_LINEAR_BUCKETS (2 << RTT_PRECISION_BITS)
+#define RTT_BUCKETS_PER_OCTAVE (1 << RTT_PRECISION_BITS)
+
+// Finds the histogram bucket of a round trip time.
+// @param rtt_ns The round trip time in nanoseconds.
+// @return The bucket index, values past the range fall in the last bucket.
+static unsigned int rtt_bucket(uint64_t rtt_ns)
+{
+    if (rtt_ns < RTT_LINEAR_BUCKETS)
+    {
+        return rtt_ns;
+    }
+
+    // Keep the RTT_PRECISION_BITS + 1 most significant bits of the value
+    unsigned int shift = 63 - __builtin_clzll(rtt_ns) - RTT_PRECISION_BITS;
+    unsigned int bucket = shift * RTT_BUCKETS_PER_OCTAVE + (rtt_ns >> shift);
+    return bucket < RTT_HISTOGRAM_BUCKETS ? bucket : RTT_HISTOGRAM_BUCKETS - 1;
+}
+
+// Gives the value a histogram bucket stands for, the middle of the range it covers.
+// @param bucket The bucket index.
+// @return The representative round trip time in nanoseconds.
+static uint64_t rtt_bucket_value(unsigned int bucket)
+{
+    if (bucket < RTT_LINEAR_BUCKETS)
+    {
+        return bucket;
+    }
+    unsigned int shift = bucket / RTT_BUCKETS_PER_OCTAVE - 1;
+    uint64_t lowest = (uint64_t)(bucket % RTT_BUCKETS_PER_OCTAVE + RTT_BUCKETS_PER_OCTAVE) << shift;
+    return lowest + ((1UL << shift) >> 1);
+}
+
+// Resets round trip time statistics to hold no sample.
+// @param stats The statistics to reset.
+void initialize_rtt_stats(rtt_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->min_ns = UINT64_MAX;
+}
+
+// Accounts a round trip time in constant memory: Welford's online algorithm keeps the
+// mean and variance numerically stable, the histogram keeps the distribution.
+// @param stats The statistics to update.
+// @param rtt_ns The round trip time in nanoseconds.
+void record_round_trip(rtt_stats_t *stats, uint64_t rtt_ns)
+{
+    // The count, the mean and the histogram are stored whole for the readers of --metrics
+    uint64_t count = stats->count + 1;
+    __atomic_store_n(&stats->count, count, __ATOMIC_RELAXED);
+    stats->min_ns = rtt_ns < stats->min_ns ? rtt_ns : stats->min_ns;
+    stats->max_ns = rtt_ns > stats->max_ns ? rtt_ns : stats->max_ns;
+
+    double delta = (double)rtt_ns - stats->mean_ns;
+    double mean = stats->mean_ns + delta / count;
+    __atomic_store(&stats->mean_ns, &mean, __ATOMIC_RELAXED);
+    stats->m2_ns += delta * ((double)rtt_ns - mean);
+
+    uint32_t *bucket = &stats->histogram[rtt_bucket(rtt_ns)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+// Adds the samples of a set of statistics to another, as if they had been recorded there.
+// The means and variances are combined with the parallel form of Welford's algorithm.
+// @param total The statistics receiving the samples.
+// @param stats The statistics to add.
+void merge_rtt_stats(rtt_stats_t *total, const rtt_stats_t *stats)
+{
+    if (!stats->count)
+    {
+        return;
+    }
+
+    uint64_t count = total->count + stats->count;
+    double delta = stats->mean_ns - total->mean_ns;
+    total->mean_ns += delta * stats->count / count;
+    total->m2_ns += stats->m2_ns + delta * delta * total->count * stats->count / count;
+    total->count = count;
+    total->min_ns = stats->min_ns < total->min_ns ? stats->min_ns : total->min_ns;
+    total->max_ns = stats->max_ns > total->max_ns ? stats->max_ns : total->max_ns;
+
+    for (unsigned int i = 0; i < RTT_HISTOGRAM_BUCKETS; ++i)
+    {
+        total->histogram[i] += stats->histogram[i];
+    }
+}
+
+// Computes the sample standard deviation of the round trip times.
+// @param stats The statistics to read.
+// @return The standard deviation in milliseconds, 0 with less than two samples.
+double rtt_stddev(const rtt_stats_t *stats)
+{
+    if (stats->count < 2)
+    {
+        return 0;
+    }
+    return custom_sqrt(stats->m2_ns / (stats->count - 1) / 1e12);
+}
+
+// Estimates a percentile of the round trip times from the histogram, with the
+// nearest-rank method. The estimate is within half a bucket, about 1.6%, of the
+// exact value, and never outside the observed minimum and maximum.
+// @param stats The statistics to read.
+// @param percentile The percentile, between 0 and 100.
+// @return The percentile in milliseconds, 0 without samples.
+double rtt_percentile(const rtt_stats_t *stats, double percentile)
+{
+    if (!stats->count)
+    {
+        return 0;
+    }
+
+    // Smallest rank covering the requested fraction of the samples
+    uint64_t rank = (uint64_t)(percentile / 100 * stats->count);
+    rank += (double)rank < percentile / 100 * stats->count;
+    rank = rank ? rank : 1;
+    if (rank >= stats->count)
+    {
+        return (double)stats->max_ns / 1000000;
+    }
+
+    uint64_t seen = 0;
+    unsigned int bucket = 0;
+    while (bucket < RTT_HISTOGRAM_BUCKETS - 1 && (seen += stats->histogram[bucket]) < rank)
+    {
+        ++bucket;
+    }
+
+    uint64_t value = rtt_bucket_value(bucket);
+    value = value < stats->min_ns ? stats->min_ns : value;
+    value = value > stats->max_ns ? stats->max_ns : value;
+    return (double)value / 1000000;
+}
+
+// Counts the round trip times up to each bound, as the cumulative buckets of a Prometheus
+// histogram, in a single pass over the histogram. A bucket straddling a bound is counted
+// above it, so each count is exact within the 1.6% precision of the histogram. The buckets
+// are loaded whole, the statistics may be those of a running engine.
+// @param stats The statistics to read.
+// @param bounds_ns The upper bounds in nanoseconds, in increasing order.
+// @param bound_count The number of bounds.
+// @param counts The number of round trip times up to each bound.
+void rtt_cumulative_counts(const rtt_stats_t *stats, const uint64_t *bounds_ns, unsigned int bound_count, uint64_t *counts)
+{
+    uint64_t seen = 0;
+    unsigned int bucket = 0;
+    for (unsigned int i = 0; i < bound_count; ++i)
+    {
+        unsigned int end = rtt_bucket(bounds_ns[i]);
+        while (bucket < end)
+        {
+            seen += __atomic_load_n(&stats->histogram[bucket++], __ATOMIC_RELAXED);
+        }
+        counts[i] = seen;
+    }
+}
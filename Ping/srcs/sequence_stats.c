@@ -0,0 +1,212 @@
+#include "ping.h"
+
+// Gives the bucket of a length in the histograms: 1, 2, 3-4, 5-8, ... up to the last one,
+// which holds everything longer.
+// @param length The burst length or reorder extent, at least 1.
+// @return The index of the bucket.
+static unsigned int histogram_bucket(uint64_t length)
+{
+    unsigned int bucket = length > 1 ? 64 - __builtin_clzll(length - 1) : 0;
+    return bucket < SEQUENCE_HISTOGRAM_BUCKETS ? bucket : SEQUENCE_HISTOGRAM_BUCKETS - 1;
+}
+
+// Resets the loss, reordering and jitter analytics of a target.
+// @param stats The analytics.
+void initialize_sequence_stats(sequence_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Ends the run of losses being counted, if any, and accounts it as a burst.
+// @param stats The analytics.
+static void end_burst(sequence_stats_t *stats)
+{
+    if (!stats->current_burst)
+    {
+        return;
+    }
+    ++stats->bursts;
+    __atomic_store_n(&stats->burst_losses, stats->burst_losses + stats->current_burst, __ATOMIC_RELAXED);
+    stats->max_burst = stats->current_burst > stats->max_burst ? stats->current_burst : stats->max_burst;
+    uint32_t *bucket = &stats->burst_histogram[histogram_bucket(stats->current_burst)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    stats->current_burst = 0;
+}
+
+// Settles the sequences of the window up to an end: a sequence without a reply extends
+// the burst of losses, a reply ends it. Whole words of the bitmap are settled at once.
+// @param stats The analytics.
+// @param end The first sequence left in the window.
+static void slide_window(sequence_stats_t *stats, uint32_t end)
+{
+    while (stats->window_start < end)
+    {
+        uint32_t sequence = stats->window_start;
+        uint64_t *word = &stats->window[(sequence / 64) % SEQUENCE_WINDOW_WORDS];
+        if (sequence % 64 == 0 && end - sequence >= 64 && (*word == 0 || *word == UINT64_MAX))
+        {
+            if (*word == 0)
+            {
+                stats->current_burst += 64;
+            }
+            else
+            {
+                end_burst(stats);
+            }
+            *word = 0;
+            stats->window_start += 64;
+            continue;
+        }
+
+        uint64_t bit = (uint64_t)1 << (sequence % 64);
+        if (*word & bit)
+            end_burst(stats);
+        else
+            ++stats->current_burst;
+        *word &= ~bit;
+        ++stats->window_start;
+    }
+}
+
+// Accounts a reply received in time, in a single pass and constant memory: its sequence
+// is marked in the sliding bitmap, which settles the sequences leaving it, a sequence below
+// the newest one received adds its distance to the reordering extents (RFC 4737), and the
+// change of round trip time from the previous reply updates the interarrival jitter (RFC 3550).
+// @param stats The analytics of the target.
+// @param sequence The sequence number of the probe to the target.
+// @param rtt_ns The round trip time of the reply.
+void record_sequence(sequence_stats_t *stats, uint32_t sequence, uint64_t rtt_ns)
+{
+    // Round trip times stand for the transit times, the send times cancel out
+    if (stats->replies)
+    {
+        double difference = rtt_ns > stats->last_rtt_ns ? rtt_ns - stats->last_rtt_ns : stats->last_rtt_ns - rtt_ns;
+        double jitter = stats->jitter_ns + (difference - stats->jitter_ns) / 16;
+        __atomic_store(&stats->jitter_ns, &jitter, __ATOMIC_RELAXED);
+    }
+    stats->last_rtt_ns = rtt_ns;
+
+    if (stats->replies && sequence < stats->highest)
+    {
+        uint32_t extent = stats->highest - sequence;
+        ++stats->reordered;
+        stats->max_extent = extent > stats->max_extent ? extent : stats->max_extent;
+        __atomic_store_n(&stats->extent_sum, stats->extent_sum + extent, __ATOMIC_RELAXED);
+        uint32_t *bucket = &stats->extent_histogram[histogram_bucket(extent)];
+        __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        stats->highest = sequence;
+    }
+    ++stats->replies;
+
+    // A reply older than the window comes after its probe was settled as lost
+    if (sequence < stats->window_start)
+    {
+        ++stats->overruns;
+        return;
+    }
+    if (sequence >= stats->window_start + SEQUENCE_WINDOW_BITS)
+    {
+        slide_window(stats, sequence - SEQUENCE_WINDOW_BITS + 1);
+    }
+    stats->window[(sequence / 64) % SEQUENCE_WINDOW_WORDS] |= (uint64_t)1 << (sequence % 64);
+}
+
+// Settles the sequences still in the window once the engines are stopped, up to the
+// last probe sent, so that the losses at the end count as a burst.
+// @param stats The analytics of the target.
+// @param packets_sent The number of probes sent to the target.
+void settle_sequences(sequence_stats_t *stats, uint32_t packets_sent)
+{
+    slide_window(stats, packets_sent);
+    end_burst(stats);
+}
+
+// Gives the upper bound of a bucket of the histograms.
+// @param bucket The index of the bucket.
+// @return The longest length the bucket holds, 0 for the last one, which is unbounded.
+uint32_t sequence_bucket_bound(unsigned int bucket)
+{
+    return bucket < SEQUENCE_HISTOGRAM_BUCKETS - 1 ? (uint32_t)1 << bucket : 0;
+}
+
+// Prints a histogram on one line, as "range:count" for each bucket holding something.
+// @param name The name of the histogram.
+// @param histogram The counts of its buckets.
+static void print_histogram(const char *name, const uint64_t *histogram)
+{
+    fprintf(global_ping.report, "  %s", name);
+    for (unsigned int bucket = 0; bucket < SEQUENCE_HISTOGRAM_BUCKETS; ++bucket)
+    {
+        if (!histogram[bucket])
+        {
+            continue;
+        }
+        uint32_t low = bucket ? sequence_bucket_bound(bucket - 1) + 1 : 1;
+        uint32_t high = sequence_bucket_bound(bucket);
+        if (!high)
+            fprintf(global_ping.report, " >%u:%lu", low - 1, (unsigned long)histogram[bucket]);
+        else if (low == high)
+            fprintf(global_ping.report, " %u:%lu", low, (unsigned long)histogram[bucket]);
+        else
+            fprintf(global_ping.report, " %u-%u:%lu", low, high, (unsigned long)histogram[bucket]);
+    }
+    fprintf(global_ping.report, "\n");
+}
+
+// Settles the analytics of every target and prints them merged: the loss bursts and their
+// lengths, the reordering extents, and the jitter averaged over the targets.
+void report_sequence_stats(void)
+{
+    uint64_t bursts = 0, burst_losses = 0, reordered = 0, overruns = 0;
+    uint32_t max_burst = 0, max_extent = 0;
+    uint64_t burst_histogram[SEQUENCE_HISTOGRAM_BUCKETS] = {0};
+    uint64_t extent_histogram[SEQUENCE_HISTOGRAM_BUCKETS] = {0};
+    double jitter_ns = 0;
+    uint32_t jitter_targets = 0;
+
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        sequence_stats_t *stats = &global_ping.sequences[i];
+        settle_sequences(stats, global_ping.targets[i].packets_sent);
+        bursts += stats->bursts;
+        burst_losses += stats->burst_losses;
+        reordered += stats->reordered;
+        overruns += stats->overruns;
+        max_burst = stats->max_burst > max_burst ? stats->max_burst : max_burst;
+        max_extent = stats->max_extent > max_extent ? stats->max_extent : max_extent;
+        for (unsigned int bucket = 0; bucket < SEQUENCE_HISTOGRAM_BUCKETS; ++bucket)
+        {
+            burst_histogram[bucket] += stats->burst_histogram[bucket];
+            extent_histogram[bucket] += stats->extent_histogram[bucket];
+        }
+        if (stats->replies > 1)
+        {
+            jitter_ns += stats->jitter_ns;
+            ++jitter_targets;
+        }
+    }
+
+    if (bursts)
+    {
+        fprintf(global_ping.report, "%lu loss bursts, %.2f probes long on average, %u at most\n",
+                (unsigned long)bursts, (double)burst_losses / bursts, max_burst);
+        print_histogram("burst lengths:", burst_histogram);
+    }
+    if (reordered)
+    {
+        fprintf(global_ping.report, "%lu reordered replies, extent %u at most\n", (unsigned long)reordered, max_extent);
+        print_histogram("reorder extents:", extent_histogram);
+    }
+    if (overruns)
+    {
+        fprintf(global_ping.report, "%lu replies arrived more than %d probes late, counted in the bursts\n",
+                (unsigned long)overruns, SEQUENCE_WINDOW_BITS);
+    }
+    if (jitter_targets)
+    {
+        fprintf(global_ping.report, "jitter (RFC 3550) = %.3f ms\n", jitter_ns / jitter_targets / 1000000);
+    }
+}
@@ -0,0 +1,481 @@
+#include "ping.h"
+
+// Makes room for the checks of the service: each one takes a target of the pool, which
+// holds its address and the sequences of its probes while it runs.
+void initialize_service(void)
+{
+    global_ping.targets = calloc(SERVICE_MAX_CHECKS, sizeof(ping_target_t));
+    if (global_ping.targets == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+    global_ping.target_count = SERVICE_MAX_CHECKS;
+    for (uint32_t i = 0; i < SERVICE_MAX_CHECKS; ++i)
+    {
+        global_ping.targets[i].host = global_ping.targets[i].ip_address;
+        global_ping.targets[i].wheel_next = -1;
+    }
+}
+
+// Opens the UNIX socket of the service, replacing a socket left by a previous run.
+// @return The service, with every check free.
+service_server_t *open_service_server(void)
+{
+    service_server_t *server = malloc(sizeof(service_server_t));
+    if (server == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    for (int i = 0; i < SERVICE_MAX_CLIENTS; ++i)
+    {
+        server->clients[i].fd = -1;
+        server->clients[i].result_count = 0;
+        server->clients[i].pending = false;
+    }
+    server->pending_count = 0;
+    server->clients_served = 0;
+    server->checks_started = 0;
+    server->checks_rejected = 0;
+    server->results_sent = 0;
+
+    server->checks = calloc(SERVICE_MAX_CHECKS, sizeof(service_check_t));
+    server->free_checks = malloc(SERVICE_MAX_CHECKS * sizeof(uint32_t));
+    if (server->checks == NULL || server->free_checks == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
+    // Lowest slots on top, so that the checks of a small service share few cache lines
+    for (uint32_t i = 0; i < SERVICE_MAX_CHECKS; ++i)
+    {
+        server->free_checks[i] = SERVICE_MAX_CHECKS - 1 - i;
+    }
+    server->free_count = SERVICE_MAX_CHECKS;
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(global_ping.service_path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "ping: service socket path too long '%s'\n", global_ping.service_path);
+        exit(1);
+    }
+    strcpy(address.sun_path, global_ping.service_path);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0)
+    {
+        perror("ping: socket service");
+        exit(1);
+    }
+    unlink(global_ping.service_path);
+    if (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("ping: bind service");
+        exit(1);
+    }
+    if (listen(server->listen_fd, SOMAXCONN) < 0)
+    {
+        perror("ping: listen service");
+        exit(1);
+    }
+    return server;
+}
+
+// Prepares the engine running the service: its timing wheel schedules the next probe of
+// each check, or the expiry of the last ones.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_service_engine(ping_engine_t *engine, uint64_t now)
+{
+    // Clients may start thousands of checks in the same tick
+    enlarge_socket_buffer(engine, SO_SNDBUFFORCE, SO_SNDBUF);
+    enlarge_socket_buffer(engine, SO_RCVBUFFORCE, SO_RCVBUF);
+
+    engine->due_targets = malloc(engine->target_count * sizeof(uint32_t));
+    if (engine->due_targets == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    initialize_timing_wheel(&engine->wheel, now);
+}
+
+// Queues a result for a client, sent with the others at the end of the iteration of the
+// event loop, or right away when the message is full.
+// @param engine The engine running the service.
+// @param client The index of the client.
+// @param result The result.
+static void push_result(ping_engine_t *engine, int32_t client, const ping_service_result_t *result);
+
+// Frees a check once all its probes are settled.
+// @param engine The engine running the service.
+// @param index The index of the check.
+static void free_check(ping_engine_t *engine, uint32_t index)
+{
+    service_server_t *server = engine->service;
+    server->checks[index].active = false;
+    unschedule_target(&engine->wheel, index);
+    server->free_checks[server->free_count++] = index;
+}
+
+// Stops a check from sending, its probes in flight drain without results.
+// @param engine The engine running the service.
+// @param index The index of the check.
+static void cancel_check(ping_engine_t *engine, uint32_t index)
+{
+    service_check_t *check = &engine->service->checks[index];
+    check->client = -1;
+    check->count = global_ping.targets[index].packets_sent;
+    if (check->settled == check->count)
+    {
+        free_check(engine, index);
+    }
+}
+
+// Closes a connection and cancels its checks.
+// @param engine The engine running the service.
+// @param client The index of the client.
+static void close_client(ping_engine_t *engine, int32_t client)
+{
+    service_server_t *server = engine->service;
+    close(server->clients[client].fd);
+    server->clients[client].fd = -1;
+    server->clients[client].result_count = 0;
+    for (uint32_t i = 0; i < SERVICE_MAX_CHECKS; ++i)
+    {
+        if (server->checks[i].active && server->checks[i].client == client)
+        {
+            cancel_check(engine, i);
+        }
+    }
+}
+
+// Sends the results a client holds in one message. A client that does not read its results
+// fast enough to leave room in its socket buffer is disconnected, the service never waits.
+// @param engine The engine running the service.
+// @param client The index of the client.
+static void send_results(ping_engine_t *engine, int32_t client)
+{
+    service_client_t *connection = &engine->service->clients[client];
+    if (connection->fd < 0 || !connection->result_count)
+    {
+        return;
+    }
+    size_t length = connection->result_count * sizeof(ping_service_result_t);
+    if (send(connection->fd, connection->results, length, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)length)
+    {
+        close_client(engine, client);
+        return;
+    }
+    engine->service->results_sent += connection->result_count;
+    connection->result_count = 0;
+}
+
+static void push_result(ping_engine_t *engine, int32_t client, const ping_service_result_t *result)
+{
+    service_server_t *server = engine->service;
+    service_client_t *connection = &server->clients[client];
+    if (connection->result_count == PING_SERVICE_MAX_RESULTS)
+    {
+        send_results(engine, client);
+        if (connection->fd < 0)
+        {
+            return;
+        }
+    }
+    // A client is listed once per iteration, even when a full message of its results went early
+    // or its slot went to a new connection, so that the list never outgrows the clients
+    if (!connection->pending)
+    {
+        connection->pending = true;
+        server->pending_clients[server->pending_count++] = client;
+    }
+    connection->results[connection->result_count++] = *result;
+}
+
+// Sends the results the clients got during the iteration of the event loop, a message each.
+// @param engine The engine running the service.
+void flush_service_results(ping_engine_t *engine)
+{
+    service_server_t *server = engine->service;
+    for (uint32_t i = 0; i < server->pending_count; ++i)
+    {
+        server->clients[server->pending_clients[i]].pending = false;
+        send_results(engine, server->pending_clients[i]);
+    }
+    server->pending_count = 0;
+}
+
+// Settles a probe of a check and reports it to the client of the check, if still there.
+// @param engine The engine running the service.
+// @param index The index of the check.
+// @param result The result, its id filled here.
+static void settle_probe(ping_engine_t *engine, uint32_t index, ping_service_result_t *result)
+{
+    service_check_t *check = &engine->service->checks[index];
+    if (!check->active)
+    {
+        return;
+    }
+    if (check->client >= 0)
+    {
+        result->id = check->id;
+        push_result(engine, check->client, result);
+    }
+    if (++check->settled == check->count)
+    {
+        free_check(engine, index);
+    }
+}
+
+// Reports a reply or an ICMP error to the client of its check. Replies to probes already
+// settled, invalid replies and replies from other addresses are left out.
+// @param engine The engine running the service.
+// @param event The reply event.
+void answer_service_event(ping_engine_t *engine, const reply_event_t *event)
+{
+    bool settles = event->status == REPLY_IN_ORDER || event->status == REPLY_OUT_OF_ORDER;
+    if ((event->kind != EVENT_REPLY && event->kind != EVENT_ERROR) || !settles)
+    {
+        return;
+    }
+    ping_service_result_t result = {
+        .sequence = event->target_sequence,
+        .rtt_ns = event->rtt_ns,
+        .source = event->source,
+        .status = event->kind == EVENT_REPLY ? PING_SERVICE_REPLY : PING_SERVICE_ERROR,
+        .type = event->kind == EVENT_REPLY ? ICMP_ECHOREPLY : event->type,
+        .code = event->kind == EVENT_REPLY ? 0 : event->code,
+        .ttl = event->ttl};
+    settle_probe(engine, event->target, &result);
+}
+
+// Reports a probe that expired, or whose slot was recycled, as lost.
+// @param engine The engine running the service.
+// @param slot The slot of the probe.
+void report_service_loss(ping_engine_t *engine, const probe_slot_t *slot)
+{
+    ping_service_result_t result = {
+        .sequence = slot->target_sequence,
+        .rtt_ns = global_ping.timeout_ns,
+        .status = PING_SERVICE_LOST};
+    settle_probe(engine, slot->target, &result);
+}
+
+// Gives the length of the probes of a check, to validate their replies.
+// @param engine The engine running the service.
+// @param target The index of the check.
+// @return The length of their ICMP messages, 0 if the check is over.
+size_t service_probe_length(const ping_engine_t *engine, uint32_t target)
+{
+    const service_check_t *check = &engine->service->checks[target];
+    return check->active ? check->length : 0;
+}
+
+// Starts a check for a client, or cancels its checks carrying the id of the request when
+// its count is 0. A request that cannot be served is answered with a rejection.
+// @param engine The engine running the service.
+// @param client The index of the client.
+// @param request The request.
+// @param now The current monotonic time, in nanoseconds.
+static void start_check(ping_engine_t *engine, int32_t client, const ping_service_request_t *request, uint64_t now)
+{
+    service_server_t *server = engine->service;
+    if (!request->count)
+    {
+        for (uint32_t i = 0; i < SERVICE_MAX_CHECKS; ++i)
+        {
+            if (server->checks[i].active && server->checks[i].client == client && server->checks[i].id == request->id)
+            {
+                cancel_check(engine, i);
+            }
+        }
+        return;
+    }
+
+    // The payload must hold the probe stamp and fit in the packets of the engine, and the
+    // count in the signed probe counter of the target
+    size_t size = request->size ? request->size : global_ping.packet_size;
+    if (!server->free_count || size < sizeof(probe_stamp_t) || size > global_ping.packet_size ||
+        (uint64_t)request->interval_us * 1000 < MIN_INTERVAL_NS || request->count > INT_MAX)
+    {
+        ++server->checks_rejected;
+        ping_service_result_t result = {.id = request->id, .source = request->address, .status = PING_SERVICE_REJECTED};
+        push_result(engine, client, &result);
+        return;
+    }
+
+    uint32_t index = server->free_checks[--server->free_count];
+    service_check_t *check = &server->checks[index];
+    check->client = client;
+    check->id = request->id;
+    check->count = request->count;
+    check->settled = 0;
+    check->interval_ns = (uint64_t)request->interval_us * 1000;
+    check->length = size + sizeof(icmphdr_t);
+    check->active = true;
+    ++server->checks_started;
+
+    // An idle wheel is set to the current time rather than advanced over the idle stretch
+    if (!engine->wheel.scheduled)
+    {
+        initialize_timing_wheel(&engine->wheel, now);
+    }
+
+    // The target of the check starts afresh, the first probe is sent on the next tick
+    ping_target_t *target = &global_ping.targets[index];
+    target->address.sin_family = AF_INET;
+    target->address.sin_addr.s_addr = request->address;
+    target->address.sin_port = 0;
+    inet_ntop(AF_INET, &target->address.sin_addr, target->ip_address, sizeof(target->ip_address));
+    target->packets_sent = 0;
+    target->highest_answered = 0;
+    target->next_send_time = now;
+    schedule_target(&engine->wheel, index);
+}
+
+// Reads the requests of a client, a message at a time, until its socket is drained.
+// A message that is not a whole number of requests ends the connection.
+// @param engine The engine running the service.
+// @param client The index of the client.
+static void read_requests(ping_engine_t *engine, int32_t client)
+{
+    ping_service_request_t requests[PING_SERVICE_MAX_REQUESTS];
+    while (engine->service->clients[client].fd >= 0)
+    {
+        ssize_t length = recv(engine->service->clients[client].fd, requests, sizeof(requests), MSG_DONTWAIT);
+        if (length < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return;
+        }
+        if (length <= 0 || length % sizeof(ping_service_request_t))
+        {
+            close_client(engine, client);
+            return;
+        }
+        uint64_t now = get_monotonic_time();
+        for (size_t i = 0; i < length / sizeof(ping_service_request_t); ++i)
+        {
+            start_check(engine, client, &requests[i], now);
+        }
+    }
+}
+
+// Accepts the pending connections and greets them with the limits of the service.
+// Connections beyond SERVICE_MAX_CLIENTS are refused.
+// @param engine The engine running the service.
+static void accept_clients(ping_engine_t *engine)
+{
+    service_server_t *server = engine->service;
+    ping_service_hello_t hello = {
+        .magic = PING_SERVICE_MAGIC,
+        .version = PING_SERVICE_VERSION,
+        .max_requests = PING_SERVICE_MAX_REQUESTS,
+        .max_results = PING_SERVICE_MAX_RESULTS,
+        .max_size = global_ping.packet_size,
+        .timeout_us = global_ping.timeout_ns / 1000};
+    while (true)
+    {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+                perror("ping: accept service");
+            return;
+        }
+
+        int32_t client = 0;
+        while (client < SERVICE_MAX_CLIENTS && server->clients[client].fd >= 0)
+        {
+            ++client;
+        }
+        if (client == SERVICE_MAX_CLIENTS || send(fd, &hello, sizeof(hello), MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(hello))
+        {
+            close(fd);
+            continue;
+        }
+        server->clients[client].fd = fd;
+        server->clients[client].result_count = 0;
+        ++server->clients_served;
+        watch_fd(engine, fd, EPOLLIN | EPOLLRDHUP);
+    }
+}
+
+// Handles an event on a socket of the service: a connection, a request or a disconnection.
+// @param engine The engine running the service.
+// @param fd The file descriptor.
+// @param events The events reported by epoll.
+void handle_service_event(ping_engine_t *engine, int fd, uint32_t events)
+{
+    service_server_t *server = engine->service;
+    if (fd == server->listen_fd)
+    {
+        accept_clients(engine);
+        return;
+    }
+
+    for (int32_t client = 0; client < SERVICE_MAX_CLIENTS; ++client)
+    {
+        if (server->clients[client].fd != fd)
+            continue;
+
+        // Requests sent before the client hung up are served, their results are not sent
+        read_requests(engine, client);
+        if ((events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) && server->clients[client].fd >= 0)
+            close_client(engine, client);
+        return;
+    }
+}
+
+// Sends the probes of the checks the timing wheel found due, one per elapsed interval.
+// A check that sent its last probe waits on the wheel for the expiry of the probes still
+// in flight, after which it is over.
+// @param engine The engine running the service.
+// @param now The current monotonic time, in nanoseconds.
+void fire_service_checks(ping_engine_t *engine, uint64_t now)
+{
+    service_server_t *server = engine->service;
+    unsigned int due_count = advance_timing_wheel(&engine->wheel, now, engine->due_targets);
+    for (unsigned int i = 0; i < due_count; ++i)
+    {
+        uint32_t index = engine->due_targets[i];
+        service_check_t *check = &server->checks[index];
+        ping_target_t *target = &global_ping.targets[index];
+        if (!check->active)
+        {
+            continue;
+        }
+
+        // Every probe is resized, the slots of the batch are shared by checks of any size
+        while (target->packets_sent < (int)check->count && target->next_send_time <= now &&
+               (unsigned long int)engine->packets_in_flight + engine->batch_length < global_ping.window)
+        {
+            queue_probe(engine, index);
+            resize_queued_probe(engine, check->length + sizeof(struct ip));
+            target->next_send_time += check->interval_ns;
+            if (engine->batch_length == SEND_BATCH_SIZE)
+            {
+                flush_probes(engine);
+            }
+        }
+        if (target->packets_sent == (int)check->count)
+        {
+            target->next_send_time = now + global_ping.timeout_ns + WHEEL_TICK_NS;
+        }
+        schedule_target(&engine->wheel, index);
+    }
+    flush_probes(engine);
+}
+
+// Removes the socket of the service and prints what it served.
+void close_service(void)
+{
+    service_server_t *server = global_ping.engines[0].service;
+    close(server->listen_fd);
+    unlink(global_ping.service_path);
+    fprintf(global_ping.report, "\n--- ft_ping service statistics ---\n");
+    fprintf(global_ping.report, "%lu clients, %lu checks started, %lu rejected, %lu results sent\n",
+            server->clients_served, server->checks_started, server->checks_rejected, server->results_sent);
+}
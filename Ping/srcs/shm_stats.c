@@ -0,0 +1,109 @@
+#include "ping.h"
+
+// Name of the segment as given to shm_open(), with its leading slash
+static char segment_name[NAME_MAX + 1];
+
+// Creates the shared memory segment of the live statistics and writes the address of
+// every target. The magic number is written last, so that readers never see a segment
+// being initialized. Called once the targets are known, before the engines start.
+void open_shared_stats(void)
+{
+    if (global_ping.shm_name == NULL)
+    {
+        return;
+    }
+    snprintf(segment_name, sizeof(segment_name), "/%s", global_ping.shm_name);
+
+    int fd = shm_open(segment_name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        perror("ping: shm_open");
+        exit(1);
+    }
+
+    // Truncating first resets a segment left behind by a previous run
+    size_t size = sizeof(ping_shm_header_t) + global_ping.target_count * sizeof(ping_shm_entry_t);
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)
+    {
+        perror("ping: ftruncate");
+        exit(1);
+    }
+    ping_shm_header_t *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        perror("ping: mmap");
+        exit(1);
+    }
+    close(fd);
+
+    global_ping.shared_stats = (ping_shm_entry_t *)(header + 1);
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        global_ping.shared_stats[i].address = global_ping.targets[i].address.sin_addr.s_addr;
+    }
+
+    header->version = PING_SHM_VERSION;
+    header->entry_size = sizeof(ping_shm_entry_t);
+    header->target_count = global_ping.target_count;
+    header->pid = getpid();
+    header->start_time_ns = get_monotonic_time();
+    header->publish_interval_ns = SHM_PUBLISH_NS;
+    __atomic_store_n(&header->magic, PING_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Writes the statistics of a target to its entry, if they changed since the last time.
+// The sequence is made odd while the entry is written, and even again once it is whole.
+// @param entry The entry of the target, only written by the engine serving it.
+// @param target The target.
+// @param stats The round trip time statistics of the target.
+// @param now The current monotonic time, in nanoseconds.
+static void publish_target(ping_shm_entry_t *entry, const ping_target_t *target, const rtt_stats_t *stats, uint64_t now)
+{
+    if (entry->packets_sent == (uint64_t)target->packets_sent && entry->packets_received == (uint64_t)target->packets_received &&
+        entry->lost_probes == (uint64_t)target->lost_probes && entry->late_replies == (uint64_t)target->late_replies &&
+        entry->duplicate_replies == (uint64_t)target->duplicate_replies && entry->update_time_ns)
+    {
+        return;
+    }
+
+    uint32_t sequence = entry->sequence;
+    __atomic_store_n(&entry->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&entry->update_time_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->packets_sent, target->packets_sent, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->packets_received, target->packets_received, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->lost_probes, target->lost_probes, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->late_replies, target->late_replies, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->duplicate_replies, target->duplicate_replies, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->reordered_replies, target->reordered_replies, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->rtt_min_ns, stats->count ? stats->min_ns : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->rtt_max_ns, stats->max_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->rtt_mean_ns, (uint64_t)stats->mean_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->rtt_stddev_ns, (uint64_t)(rtt_stddev(stats) * 1000000), __ATOMIC_RELAXED);
+
+    __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Publishes the statistics of the targets of an engine that changed. Called from the event
+// loop at most every SHM_PUBLISH_NS, so that its cost does not grow with the probe rate.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void publish_shared_stats(ping_engine_t *engine, uint64_t now)
+{
+    for (uint32_t i = engine->first_target; i < engine->first_target + engine->target_count; ++i)
+    {
+        publish_target(&global_ping.shared_stats[i], &global_ping.targets[i], &global_ping.rtt[i], now);
+    }
+    engine->last_publish = now;
+    engine->unpublished = false;
+}
+
+// Removes the segment of the live statistics, once the engines are stopped.
+void close_shared_stats(void)
+{
+    if (global_ping.shared_stats != NULL)
+    {
+        shm_unlink(segment_name);
+    }
+}
@@ -1,115 +1,240 @@
 #include "ping.h"
 
-// This function is called when the program receives a SIGINT signal.
-// It prints the statistics of the ping.
+// Prints the summary line of a target, in the style of fping.
+// @param target The target.
+// @param stats The round trip time statistics of the target.
+static void print_target_statistics(const ping_target_t *target, const rtt_stats_t *stats)
+{
+    float packet_loss_percentage = target->packets_sent ? 100.0 * (1 - (float)target->packets_received / target->packets_sent) : 0;
+
+    fprintf(global_ping.report, "%s : xmt/rcv/%%loss = %d/%d/%.1f%%",
+            target->host,
+            target->packets_sent,
+            target->packets_received,
+            packet_loss_percentage);
+    if (stats->count)
+    {
+        fprintf(global_ping.report, ", min/avg/max = %.3f/%.3f/%.3f ms",
+                (double)stats->min_ns / 1000000,
+                stats->mean_ns / 1000000,
+                (double)stats->max_ns / 1000000);
+    }
+    fprintf(global_ping.report, "\n");
+}
+
+// This function is called when the program receives a SIGINT signal or when every
+// engine is done. It prints the statistics of the ping, per target first when there are several.
+// The engines must be stopped, their per-target results are only merged here.
 void statistics_signal_handler()
 {
-    printf("\n");
-    printf("--- %s ft_ping statistics ---\n", global_ping.host);
+    // Sum the counters of the targets, leaving out the unknown hosts the engines kept in the
+    // list, as the list is compacted over them when the names are resolved up front
+    ping_target_t total = {0};
+    rtt_stats_t rtt;
+    initialize_rtt_stats(&rtt);
+    bool unanswered_target = false;
+    uint32_t resolved_count = 0;
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        const ping_target_t *target = &global_ping.targets[i];
+        if (!target->address.sin_family)
+        {
+            continue;
+        }
+        ++resolved_count;
+        total.packets_sent += target->packets_sent;
+        total.packets_received += target->packets_received;
+        total.late_replies += target->late_replies;
+        total.duplicate_replies += target->duplicate_replies;
+        total.reordered_replies += target->reordered_replies;
+        total.kernel_timed_replies += target->kernel_timed_replies;
+        total.removed_overhead_ns += target->removed_overhead_ns;
+        merge_rtt_stats(&rtt, &global_ping.rtt[i]);
+        unanswered_target |= !target->packets_received;
+    }
+
+    // Sum the syscalls of the engines, and the replies their pipelines dropped
+    unsigned long int send_calls = 0;
+    unsigned long int receive_calls = 0;
+    unsigned long int dropped_events = 0;
+    for (unsigned int i = 0; i < global_ping.engine_count; ++i)
+    {
+        send_calls += global_ping.engines[i].send_calls;
+        receive_calls += global_ping.engines[i].receive_calls;
+        dropped_events += global_ping.engines[i].pipeline ? global_ping.engines[i].pipeline->dropped : 0;
+    }
+
+    fprintf(global_ping.report, "\n");
+    if (global_ping.multi_target)
+    {
+        fprintf(global_ping.report, "--- %u targets ft_ping statistics ---\n", resolved_count);
+        for (uint32_t i = 0; i < global_ping.target_count; ++i)
+        {
+            if (global_ping.targets[i].address.sin_family)
+            {
+                print_target_statistics(&global_ping.targets[i], &global_ping.rtt[i]);
+            }
+        }
+    }
+    else
+    {
+        fprintf(global_ping.report, "--- %s ft_ping statistics ---\n", global_ping.targets[0].host);
+    }
 
     // Calculate packet loss percentage
-    float packet_loss_percentage = 100.0 * (1 - (float)global_ping.packets_received / global_ping.packets_sent);
+    float packet_loss_percentage = total.packets_sent ? 100.0 * (1 - (float)total.packets_received / total.packets_sent) : 0;
 
-    printf("%d packets transmitted, %d packets received, %.1f%% packet loss\n",
-           global_ping.packets_sent,
-           global_ping.packets_received,
-           packet_loss_percentage);
+    fprintf(global_ping.report, "%d packets transmitted, %d packets received, %.1f%% packet loss\n",
+            total.packets_sent,
+            total.packets_received,
+            packet_loss_percentage);
 
-    // If no packets were received, exit with error
-    if (!global_ping.packets_received)
+    // Report the replies that arrived late, twice or out of order
+    if (total.late_replies || total.duplicate_replies || total.reordered_replies)
     {
-        exit(EXIT_FAILURE);
+        fprintf(global_ping.report, "%d late, %d duplicate, %d out-of-order replies\n",
+                total.late_replies,
+                total.duplicate_replies,
+                total.reordered_replies);
+    }
+
+    // Report the shape of the losses and of the reordering, and the jitter
+    report_sequence_stats();
+    write_summary_records();
+
+    // Replies the consumer could not keep up with are missing from the counts above
+    if (dropped_events)
+    {
+        fprintf(global_ping.report, "%lu replies dropped by the full pipeline, not accounted\n", dropped_events);
     }
 
-    // Calculate the average round trip time
-    double round_trip_time_average = global_ping.total_rtt / global_ping.packets_received;
+    // Report the achieved throughput and the syscall cost of the rate, flood and adaptive modes
+    if (global_ping.rate || global_ping.flood || global_ping.adaptive)
+    {
+        double elapsed = (double)(get_monotonic_time() - global_ping.start_time) / 1000000000;
+        fprintf(global_ping.report, "%.0f packets/s sent, %.0f replies/s received in %.3f s\n",
+                total.packets_sent / elapsed,
+                total.packets_received / elapsed,
+                elapsed);
+        fprintf(global_ping.report, "%.3f send syscalls per packet, %.3f receive syscalls per reply\n",
+                (double)send_calls / (total.packets_sent ? total.packets_sent : 1),
+                (double)receive_calls / (total.packets_received ? total.packets_received : 1));
+    }
 
-    // Calculate the standard deviation of the round trip time using Welford's algorithm
-    double round_trip_time_variance = 0;
-    double round_trip_time_stddev = 0;
-    for (trip_node_t *it = global_ping.trip_list; it != NULL; it = it->next)
+    // Report how much the kernel timestamps took off the user-space measurements
+    if (global_ping.kernel_timestamps)
     {
-        double deviation = it->trip_time - round_trip_time_average;
-        round_trip_time_variance += deviation * deviation * ((double)it->trip_time - 1) / it->trip_time;
+        fprintf(global_ping.report, "kernel timestamps on %d/%d replies, %.3f us of user-space overhead removed per reply\n",
+                total.kernel_timed_replies,
+                total.packets_received,
+                total.kernel_timed_replies ? (double)total.removed_overhead_ns / total.kernel_timed_replies / 1000 : 0.0);
     }
-    if (global_ping.packets_received > 1)
+
+    // Report how regularly the probes were spaced
+    report_send_gaps();
+
+    // Report what the low-latency mode changed
+    report_low_latency();
+
+    // Report the path MTU of the targets
+    report_pmtu();
+
+    // If no packets were received, exit with error
+    if (!total.packets_received)
     {
-        round_trip_time_stddev = custom_sqrt(round_trip_time_variance / (global_ping.packets_received - 1));
+        exit(EXIT_FAILURE);
     }
 
     // Print the minimum, average, maximum, and standard deviation of the round trip time
-    printf("round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n", global_ping.min_rtt, round_trip_time_average, global_ping.max_rtt, round_trip_time_stddev);
+    fprintf(global_ping.report, "round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
+            (double)rtt.min_ns / 1000000,
+            rtt.mean_ns / 1000000,
+            (double)rtt.max_ns / 1000000,
+            rtt_stddev(&rtt));
+
+    // Print the percentiles of the round trip time
+    fprintf(global_ping.report, "round-trip p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f ms\n",
+            rtt_percentile(&rtt, 50),
+            rtt_percentile(&rtt, 90),
+            rtt_percentile(&rtt, 99),
+            rtt_percentile(&rtt, 99.9));
+
+    // Exit with error if a target never answered
+    exit(unanswered_target ? EXIT_FAILURE : EXIT_SUCCESS);
+}
 
-    // Exit successfully
-    exit(EXIT_SUCCESS);
+// Size of the probe stamp at the start of the payload, 0 when the payload is too small to hold one.
+static size_t payload_stamp_size(void)
+{
+    return global_ping.packet_size >= sizeof(probe_stamp_t) ? sizeof(probe_stamp_t) : 0;
 }
 
-// @brief Checks the received ICMP packet against expected values.
+// @brief Checks the received ICMP echo reply against the echo request we sent.
 // @param received_packet Pointer to the received ICMP packet to be checked.
-// @param packet_length The length of the received packet.
-// @param icmp_seq The sequence number of the ICMP packet.
-// @param received_checksum The checksum of the received packet.
-// @param buffer The buffer used to send the ICMP packet.
-// @return Returns true if the received ICMP packet passes all checks, otherwise false.
-bool check_packet(icmphdr_t *received_packet, ssize_t packet_length, unsigned short icmp_seq, unsigned short received_checksum, char *buffer)
+// @param icmp_length The length of the received ICMP message (IP header excluded).
+// @param request_length The length of the echo request, at most data_size.
+// @return PACKET_VALID if the received ICMP packet passes all checks, otherwise the failed check.
+static packet_check_t check_packet(icmphdr_t *received_packet, ssize_t icmp_length, size_t request_length)
 {
-    if (received_checksum != calculate_checksum(received_packet, packet_length - sizeof(struct ip)))
-    {
-        handle_error(icmp_seq, "Invalid checksum");
-        return false;
-    }
-
-    // Check if the received packet is an echo reply
-    if (received_packet->type != ICMP_ECHOREPLY)
+    // A valid checksum folds the whole message, checksum field included, to zero
+    if (calculate_checksum(received_packet, icmp_length) != 0)
     {
-        handle_icmp_error(icmp_seq, received_packet);
-        return false;
+        return PACKET_BAD_CHECKSUM;
     }
 
     // Check if the received packet has a valid code
     if (received_packet->code != 0)
     {
-        handle_error(icmp_seq, "Invalid ICMP code (%d)", received_packet->code);
-        return false;
-    }
-
-    // Check if the received packet has the expected ID
-    if (received_packet->un.echo.id != ((icmphdr_t *)buffer)->un.echo.id)
-    {
-        handle_error(icmp_seq, "Wrong ID (%d)", received_packet->un.echo.id);
-        return false;
+        return PACKET_BAD_CODE;
     }
 
     // Check if the received packet has the expected size
-    if (packet_length < (ssize_t)(sizeof(struct ip) + global_ping.data_size))
+    if (icmp_length < (ssize_t)request_length)
     {
-        handle_error(icmp_seq, "Packet content is missing");
-        return false;
+        return PACKET_TRUNCATED;
     }
 
-    for (size_t i = 0; i < global_ping.packet_size; ++i)
+    // The probe stamp differs from one packet to the other, compare the filler only
+    size_t stamp_size = payload_stamp_size();
+    if (memcmp((char *)received_packet + sizeof(icmphdr_t) + stamp_size,
+               global_ping.packet + sizeof(icmphdr_t) + stamp_size,
+               request_length - sizeof(icmphdr_t) - stamp_size) != 0)
     {
-        if (((char *)received_packet + sizeof(icmphdr_t))[i] != (buffer + sizeof(icmphdr_t))[i])
-        {
-            handle_error(icmp_seq, "Not same content");
-            return false;
-        }
+        return PACKET_MISMATCH;
     }
 
-    return true;
+    return PACKET_VALID;
 }
 
-// Creates an ICMP packet for ping with given sequence number.
+// Reports an echo reply that failed validation.
+// @param target The target the reply comes from.
+// @param icmp_seq The sequence number of the probe, as displayed.
+// @param check The failed check.
+// @param code The ICMP code of the reply.
+static void report_invalid_packet(const ping_target_t *target, unsigned short icmp_seq, packet_check_t check, uint8_t code)
+{
+    if (check == PACKET_BAD_CHECKSUM)
+        handle_error(target, icmp_seq, "Invalid checksum");
+    else if (check == PACKET_BAD_CODE)
+        handle_error(target, icmp_seq, "Invalid ICMP code (%d)", code);
+    else if (check == PACKET_TRUNCATED)
+        handle_error(target, icmp_seq, "Packet content is missing");
+    else
+        handle_error(target, icmp_seq, "Not same content");
+}
+
+// Creates the template of the ICMP packets for ping, with a zero sequence number and stamp.
+// Probes are then sent from copies of the template, only their stamp is updated.
+// @param engine The engine sending the packet, whose id is set in the header, NULL for the reference packet.
 // @param packet A pointer to the packet structure to be filled.
-// @param sequence_number The sequence number to be used in the packet.
-void create_packet(icmphdr_t *packet, unsigned short sequence_number)
+void create_packet(const ping_engine_t *engine, icmphdr_t *packet)
 {
     // Set packet header fields
     packet->type = ICMP_ECHO;
     packet->code = 0;
     packet->checksum = 0;
-    packet->un.echo.id = swap_endianess_16(getpid());
-    packet->un.echo.sequence = swap_endianess_16(sequence_number);
+    packet->un.echo.id = swap_endianess_16(engine ? engine->id : 0);
+    packet->un.echo.sequence = 0;
 
     // Fill packet with data
     for (unsigned long int i = 0; i < global_ping.packet_size; ++i)
@@ -117,141 +242,555 @@ void create_packet(icmphdr_t *packet, unsigned short sequence_number)
         ((char *)packet)[sizeof(icmphdr_t) + i] = 'a' + i % 26;
     }
 
+    // Leave room for the stamp when the payload is large enough
+    memset((char *)packet + sizeof(icmphdr_t), 0, payload_stamp_size());
+
     // Compute and set packet checksum
     packet->checksum = calculate_checksum(packet, global_ping.data_size);
 }
 
-// Calculate round trip time and update statistics
-// @param start: start time of the ping
-// @param end: end time of the ping
-// @return round trip time in ms
-double calculate_round_trip_time(struct timeval start, struct timeval end)
+// Stamps a packet built from the template with the sequence number, target and send time
+// of a probe. The checksum is adjusted for the changed words only, so the cost does not
+// depend on the size of the packet.
+// @param packet The packet, holding a valid checksum.
+// @param sequence The engine-wide sequence number of the probe, truncated to 16 bits in the header.
+// @param target The index of the probed target.
+// @param target_sequence The rank of the probe among those sent to its target.
+// @param send_time The monotonic send time stamped in the payload, in nanoseconds.
+void stamp_packet(icmphdr_t *packet, uint32_t sequence, uint32_t target, uint32_t target_sequence, uint64_t send_time)
 {
-    double time_ms = (double)(end.tv_sec - start.tv_sec) * 1000 + (double)(end.tv_usec - start.tv_usec) / 1000;
+    uint16_t icmp_seq = swap_endianess_16(sequence);
+    uint16_t checksum = update_checksum(packet->checksum, &packet->un.echo.sequence, &icmp_seq, sizeof(icmp_seq));
+    packet->un.echo.sequence = icmp_seq;
 
-    // Update minimum and maximum round trip times
-    global_ping.min_rtt = global_ping.min_rtt < time_ms ? global_ping.min_rtt : time_ms;
-    global_ping.max_rtt = global_ping.max_rtt > time_ms ? global_ping.max_rtt : time_ms;
+    // Stamp the payload with the sequences and send time when it is large enough
+    if (payload_stamp_size())
+    {
+        probe_stamp_t stamp = {
+            .sequence = sequence,
+            .target = target,
+            .target_sequence = target_sequence,
+            .nonce = global_ping.nonce,
+            .send_time = send_time};
+        char *payload = (char *)packet + sizeof(icmphdr_t);
+        checksum = update_checksum(checksum, payload, &stamp, sizeof(stamp));
+        memcpy(payload, &stamp, sizeof(stamp));
+    }
 
-    // Update total round trip time
-    global_ping.total_rtt += time_ms;
+    packet->checksum = checksum;
+}
+
+// Calculate round trip time and update statistics
+// @param stats: round trip time statistics of the target
+// @param start: send time of the probe, in nanoseconds
+// @param end: receive time of the reply, in nanoseconds
+// @return round trip time in ms
+double calculate_round_trip_time(rtt_stats_t *stats, uint64_t start, uint64_t end)
+{
+    // Update the streaming statistics
+    record_round_trip(stats, end - start);
 
     // Return round trip time in ms
-    return time_ms;
+    return (double)(end - start) / 1000000;
 }
 
-// Add round trip time to linked list of trips
-// @param time_ms: round trip time in ms
-void add_trip_to_list(const double time_ms)
+// Stamps the echo request of a target in the next packet of the send batch.
+// The probe is only accounted as sent when the batch is flushed.
+// @param engine The engine.
+// @param target The index of the probed target.
+void queue_probe(ping_engine_t *engine, uint32_t target)
 {
-    trip_node_t *node = malloc(sizeof(trip_node_t));
-    if (node == NULL)
+    // A batch is stamped with the time its first packet is built
+    if (engine->batch_length == 0)
     {
-        handle_error(0, "Failed to allocate memory for trip list");
-        exit(EXIT_FAILURE);
+        engine->batch_time = get_monotonic_time();
     }
-    node->trip_time = time_ms;
-    node->next = global_ping.trip_list;
-    global_ping.trip_list = node;
+
+    unsigned int i = engine->batch_length++;
+    engine->batch_targets[i] = target;
+    engine->batch_sequences[i] = global_ping.targets[target].packets_sent;
+    __atomic_store_n(&global_ping.targets[target].packets_sent, engine->batch_sequences[i] + 1, __ATOMIC_RELAXED);
+    engine->batch_lengths[i] = global_ping.data_size;
+    stamp_packet((icmphdr_t *)(engine->send_batch + i * global_ping.batch_stride),
+                 engine->packets_sent + i, target, engine->batch_sequences[i], engine->batch_time);
 }
 
-// Signal handler function for sending and receiving ICMP packets, and handling their responses.
-// The function sends an ICMP packet, waits for a response, checks if the response is valid,
-// calculates the round trip time, adds it to the list, updates packet statistics, and prints
-// the ping reply if quiet mode is disabled.
-// Define the function `ping_signal_handler()`
-void ping_signal_handler(void)
+// Shortens the probe last queued, for --pmtu and --serve. Its checksum is computed again
+// over the shorter message, which the next stamp of the slot updates incrementally: once
+// shortened, every probe sent from the batch must be resized too.
+// @param engine The engine.
+// @param ip_size The size of the IP packet, header included, at most the size of a full probe.
+void resize_queued_probe(ping_engine_t *engine, size_t ip_size)
 {
-    // Define the ICMP sequence number as the number of packets sent
-    unsigned short icmp_seq = global_ping.packets_sent;
+    unsigned int i = engine->batch_length - 1;
+    icmphdr_t *packet = (icmphdr_t *)(engine->send_batch + i * global_ping.batch_stride);
+    engine->batch_lengths[i] = ip_size - sizeof(struct ip);
+    packet->checksum = 0;
+    packet->checksum = calculate_checksum(packet, engine->batch_lengths[i]);
+}
+
+// Sends the queued probes, each to its own target, with as few sendmmsg() calls as possible.
+// A probe refused by the kernel for its destination is accounted as sent and lost, like a
+// probe dropped on the way. When the socket buffer is full, the rate and flood modes give
+// the remaining probes back to send them again, the interval and adaptive modes account
+// them as lost.
+// @param engine The engine.
+// @return The number of probes accounted as sent.
+unsigned int flush_probes(ping_engine_t *engine)
+{
+    struct mmsghdr messages[SEND_BATCH_SIZE];
+    struct iovec iovecs[SEND_BATCH_SIZE];
+    char controls[SEND_BATCH_SIZE][CMSG_SPACE(sizeof(uint64_t))];
+    unsigned int count = engine->batch_length;
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        iovecs[i].iov_base = engine->send_batch + i * global_ping.batch_stride;
+        iovecs[i].iov_len = engine->batch_lengths[i];
+        memset(&messages[i], 0, sizeof(messages[i]));
+        messages[i].msg_hdr.msg_name = &global_ping.targets[engine->batch_targets[i]].address;
+        messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+
+        // The qdisc holds the probe until its transmit time
+        if (global_ping.pacing == PACING_TXTIME)
+        {
+            messages[i].msg_hdr.msg_control = controls[i];
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&messages[i].msg_hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_TXTIME;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+            memcpy(CMSG_DATA(cmsg), &engine->batch_txtimes[i], sizeof(uint64_t));
+        }
+    }
+
+    unsigned int accounted = 0;
+    while (accounted < count)
+    {
+        int sent = engine->uring ? send_io_uring(engine, messages + accounted, count - accounted)
+                                 : sendmmsg(engine->socket, messages + accounted, count - accounted, 0);
+        ++engine->send_calls;
 
-    // Create a buffer to hold the packet data
-    char buffer[global_ping.data_size];
+        bool buffer_full = sent < 0 && (errno == EAGAIN || errno == ENOBUFS || errno == EINTR);
+        if (buffer_full && (global_ping.rate || global_ping.flood) && !global_ping.adaptive)
+        {
+            break;
+        }
+
+        // The first remaining probe failed, account it as lost and go on with the others
+        if (sent < 0)
+        {
+            uint32_t target = engine->batch_targets[accounted];
+            if (!buffer_full)
+            {
+                handle_error(&global_ping.targets[target], engine->batch_sequences[accounted], "sendmmsg: %s", strerror(errno));
+            }
+            track_probe(engine, engine->packets_sent++, target, engine->batch_sequences[accounted], engine->batch_time);
+
+            // The probe is larger than the interface takes
+            if (global_ping.pmtu && errno == EMSGSIZE)
+            {
+                settle_pmtu_probe(engine, target, engine->batch_sequences[accounted], PMTU_TOO_BIG, 0, 0);
+            }
+            ++accounted;
+            continue;
+        }
+
+        for (int i = 0; i < sent; ++i, ++accounted)
+        {
+            track_probe(engine, engine->packets_sent, engine->batch_targets[accounted], engine->batch_sequences[accounted], engine->batch_time);
+            if (engine->send_gaps && !global_ping.kernel_timestamps)
+            {
+                record_send_gap(engine, engine->packets_sent, engine->batch_time);
+            }
+            record_transmit(engine, engine->packets_sent++);
+        }
+    }
 
-    // Create the packet with the given sequence number
-    create_packet((icmphdr_t *)buffer, icmp_seq);
+    // Give the probes that were not sent back to their targets, newest first
+    for (unsigned int i = count; i-- > accounted;)
+    {
+        ping_target_t *target = &global_ping.targets[engine->batch_targets[i]];
+        if (global_ping.packet_count >= 0 && target->packets_sent == global_ping.packet_count)
+        {
+            ++engine->active_targets;
+        }
+        __atomic_store_n(&target->packets_sent, target->packets_sent - 1, __ATOMIC_RELAXED);
+    }
 
-    // Create a buffer to receive the response
-    char recv_buffer[RECV_BUF_SIZE];
+    engine->batch_length = 0;
+    return accounted;
+}
 
-    // Define a struct iovec that points to the receive buffer and has a size of `RECV_BUF_SIZE`
-    struct iovec iov = {recv_buffer, sizeof(recv_buffer)};
+// Locates the echo request quoted inside an ICMP error message.
+// @param error_packet The received ICMP error message.
+// @param icmp_length The length of the ICMP error message.
+// @return The quoted ICMP echo request, or NULL if the error does not quote one.
+static icmphdr_t *quoted_echo_request(icmphdr_t *error_packet, ssize_t icmp_length)
+{
+    // The error quotes the IP header of the offending packet followed by its first 8 bytes
+    struct ip *quoted_ip = (struct ip *)((char *)error_packet + sizeof(icmphdr_t));
+    if (icmp_length < (ssize_t)(sizeof(icmphdr_t) + sizeof(struct ip)))
+    {
+        return NULL;
+    }
 
-    // Define a struct msghdr with default values
-    struct msghdr msg = {0};
+    size_t quoted_ip_length = quoted_ip->ip_hl << 2;
+    if (icmp_length < (ssize_t)(sizeof(icmphdr_t) + quoted_ip_length + sizeof(icmphdr_t)) || quoted_ip->ip_p != IPPROTO_ICMP)
+    {
+        return NULL;
+    }
 
-    // Set the msg_iov field to point to the iov array and set the length of the array to 1
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
+    icmphdr_t *quoted_packet = (icmphdr_t *)((char *)quoted_ip + quoted_ip_length);
+    return quoted_packet->type == ICMP_ECHO ? quoted_packet : NULL;
+}
 
-    // Define start and end times for measuring the round trip time
-    struct timeval start_time, end_time;
+// Handles one ICMP message read from the socket.
+// A raw socket receives the ICMP packets of the host that pass its filter, so anything that is
+// not an answer to one of our echo requests is silently dropped. Replies are matched to
+// their probe by the sequence number, and to their target by the probe stamp, validated and
+// timed, then handed to account_event() as a reply event.
+// @param engine The engine owning the socket.
+// @param received_packet The received ICMP message, past its IP header.
+// @param icmp_length The length of the ICMP message.
+// @param recv_size The size of the received datagram, as reported on the reply line.
+// @param source The address the message came from.
+// @param ttl The TTL of the message when it arrived, 0 if unknown.
+// @param recv_time The monotonic time the datagram was read, in nanoseconds.
+// @param kernel_recv_time The kernel receive timestamp in nanoseconds, 0 if not available.
+void process_reply(ping_engine_t *engine, icmphdr_t *received_packet, ssize_t icmp_length, ssize_t recv_size,
+                   struct in_addr source, uint8_t ttl, uint64_t recv_time, uint64_t kernel_recv_time)
+{
+    if (icmp_length < (ssize_t)sizeof(icmphdr_t))
+    {
+        return;
+    }
 
-    // Get the current time to use as the start time
-    if (gettimeofday(&start_time, NULL) < 0)
+    // Our own requests are looped back when pinging a local address
+    if (received_packet->type == ICMP_ECHO)
     {
-        // Print an error message and exit if an error occurs
-        perror("ping: gettimeofday");
-        exit(1);
+        return;
     }
 
-    // Send the packet
-    sendto(
-        global_ping.socket,             // socket file descriptor
-        buffer,                         // data buffer containing the packet
-        global_ping.data_size,          // size of the packet data
-        0,                              // flags (none)
-        global_ping.address->ai_addr,   // destination address
-        global_ping.address->ai_addrlen // length of the destination address
-    );
+    reply_event_t event = {
+        .size = recv_size,
+        .source = source.s_addr,
+        .type = received_packet->type,
+        .code = received_packet->code,
+        .ttl = ttl,
+        .low_latency = engine->low_latency_active};
 
-    // Increment the number of packets sent
-    ++global_ping.packets_sent;
+    // Report errors about our probes, identified by the request they quote
+    if (received_packet->type != ICMP_ECHOREPLY)
+    {
+        icmphdr_t *quoted_packet = quoted_echo_request(received_packet, icmp_length);
+        if (quoted_packet == NULL || quoted_packet->un.echo.id != swap_endianess_16(engine->id))
+        {
+            return;
+        }
+
+        // Routers quoting enough of the probe show its stamp, a process sharing our id has another nonce
+        size_t quoted_length = icmp_length - ((char *)quoted_packet - (char *)received_packet);
+        size_t nonce_end = sizeof(icmphdr_t) + offsetof(probe_stamp_t, nonce) + sizeof(uint32_t);
+        uint32_t nonce;
+        if (payload_stamp_size() && quoted_length >= nonce_end)
+        {
+            memcpy(&nonce, (char *)quoted_packet + nonce_end - sizeof(nonce), sizeof(nonce));
+            if (nonce != global_ping.nonce)
+            {
+                return;
+            }
+        }
+        probe_slot_t *slot = find_probe(engine, swap_endianess_16(quoted_packet->un.echo.sequence));
+        if (slot != NULL)
+        {
+            event.status = resolve_probe(engine, slot->sequence, 0);
+            if (global_ping.pmtu)
+            {
+                bool too_big = received_packet->type == ICMP_DEST_UNREACH && received_packet->code == ICMP_FRAG_NEEDED;
+                settle_pmtu_probe(engine, slot->target, slot->target_sequence, too_big ? PMTU_TOO_BIG : PMTU_LOST,
+                                  too_big ? ntohs(received_packet->un.frag.mtu) : 0, 0);
+            }
+            event.kind = EVENT_ERROR;
+            event.target = slot->target;
+            event.target_sequence = slot->target_sequence;
+            event.rtt_ns = recv_time - slot->send_time;
+            dispatch_event(engine, &event);
+        }
+        return;
+    }
 
-    // Receive the response
-    ssize_t recv_size = recvmsg(global_ping.socket, &msg, 0);
+    // Replies to other processes
+    if (received_packet->un.echo.id != swap_endianess_16(engine->id))
+    {
+        return;
+    }
 
-    // Get the current time to use as the end time
-    if (gettimeofday(&end_time, NULL) < 0)
+    // Recover the full sequences, the target and the send time, from the payload when it
+    // carries them, otherwise from the most recent probe sent with this ICMP sequence number
+    unsigned short icmp_seq = swap_endianess_16(received_packet->un.echo.sequence);
+    probe_slot_t *slot = find_probe(engine, icmp_seq);
+    probe_stamp_t stamp;
+    if (payload_stamp_size() && icmp_length >= (ssize_t)(sizeof(icmphdr_t) + sizeof(stamp)))
+    {
+        memcpy(&stamp, (char *)received_packet + sizeof(icmphdr_t), sizeof(stamp));
+        if (stamp.nonce != global_ping.nonce || (unsigned short)stamp.sequence != icmp_seq || stamp.sequence >= engine->packets_sent ||
+            stamp.target - engine->first_target >= engine->target_count)
+        {
+            return;
+        }
+    }
+    else if (slot != NULL)
+    {
+        stamp.sequence = slot->sequence;
+        stamp.target = slot->target;
+        stamp.target_sequence = slot->target_sequence;
+        stamp.send_time = slot->send_time;
+    }
+    else
     {
-        // Print an error message and exit if an error occurs
-        perror("ping: gettimeofday");
-        exit(1);
+        return;
     }
+    event.target = stamp.target;
+    event.target_sequence = stamp.target_sequence;
+    event.rtt_ns = recv_time - stamp.send_time;
 
-    // Print an error message and exit if an error occurs during receiving
-    if (recv_size < 0)
+    // Replies from another address than the one probed are not ours to account
+    if (source.s_addr != global_ping.targets[stamp.target].address.sin_addr.s_addr)
     {
-        perror("ping: recvmsg");
-        exit(1);
+        event.kind = EVENT_UNEXPECTED_SOURCE;
+        dispatch_event(engine, &event);
+        return;
     }
 
-    // Get a pointer to the received ICMP packet
-    icmphdr_t *received_packet = (icmphdr_t *)(recv_buffer + sizeof(struct ip));
+    // Check if the received packet is valid, the probes of --pmtu each have their own size,
+    // and those of the service the size of their check
+    size_t request_length = global_ping.data_size;
+    if (global_ping.pmtu || engine->service)
+    {
+        request_length = engine->service ? service_probe_length(engine, stamp.target)
+                                         : pmtu_probe_length(stamp.target, stamp.target_sequence);
+        request_length = request_length ? request_length : (size_t)icmp_length;
+    }
+    packet_check_t check = check_packet(received_packet, icmp_length, request_length);
+    if (check != PACKET_VALID)
+    {
+        event.kind = EVENT_INVALID;
+        event.status = check;
+        dispatch_event(engine, &event);
+        return;
+    }
 
-    // Get the received checksum
-    unsigned short received_checksum = received_packet->checksum;
+    // Prefer the kernel timestamps, which leave out the scheduling and syscall delays
+    event.kind = EVENT_REPLY;
+    event.status = resolve_probe(engine, stamp.sequence, recv_time);
+    if (kernel_recv_time && slot != NULL && slot->sequence == stamp.sequence && slot->kernel_send_time &&
+        (event.status == REPLY_IN_ORDER || event.status == REPLY_OUT_OF_ORDER))
+    {
+        event.kernel_timed = true;
+        event.rtt_ns = kernel_recv_time - slot->kernel_send_time;
+        event.removed_overhead_ns = (int64_t)(recv_time - stamp.send_time) - (int64_t)event.rtt_ns;
+    }
+    if (global_ping.pmtu && (event.status == REPLY_IN_ORDER || event.status == REPLY_OUT_OF_ORDER))
+    {
+        settle_pmtu_probe(engine, stamp.target, stamp.target_sequence, PMTU_PASSED, 0, event.rtt_ns);
+    }
+    dispatch_event(engine, &event);
+}
 
-    // Set the received checksum to 0 to calculate it later
-    received_packet->checksum = 0;
+// Accounts a reply event in the statistics of its target and writes its output: the reply
+// line or record, or the report of an error. Called by the engine once the reply is
+// processed, or by the consumer thread with --pipeline.
+// @param engine The engine that received the reply.
+// @param event The reply event.
+void account_event(ping_engine_t *engine, const reply_event_t *event)
+{
+    ping_target_t *target = &global_ping.targets[event->target];
+    if (event->kind == EVENT_ERROR)
+    {
+        if (global_ping.format != FORMAT_TEXT)
+        {
+            write_record(engine, event->target, event->target_sequence, event->rtt_ns, event->type, event->code, event->ttl, RECORD_ERROR);
+            return;
+        }
+        icmphdr_t error_packet = {.type = event->type, .code = event->code};
+        handle_icmp_error(target, event->target_sequence, &error_packet);
+        return;
+    }
+    if (event->kind == EVENT_UNEXPECTED_SOURCE)
+    {
+        struct in_addr source = {.s_addr = event->source};
+        handle_error(target, event->target_sequence, "Reply from unexpected address %s", inet_ntoa(source));
+        return;
+    }
+    if (event->kind == EVENT_INVALID)
+    {
+        report_invalid_packet(target, event->target_sequence, event->status, event->code);
+        return;
+    }
 
-    // Check if the received packet is valid
-    const bool is_received = check_packet(received_packet, recv_size, icmp_seq, received_checksum, buffer);
+    // Late and duplicate replies are reported but not accounted in the statistics
+    reply_status_t status = event->status;
+    if ((status == REPLY_LATE || status == REPLY_DUPLICATE) && global_ping.format != FORMAT_TEXT)
+    {
+        write_record(engine, event->target, event->target_sequence, event->rtt_ns, ICMP_ECHOREPLY, 0, event->ttl,
+                     status == REPLY_LATE ? RECORD_LATE : RECORD_DUPLICATE);
+    }
+    if (status == REPLY_LATE)
+    {
+        __atomic_store_n(&target->late_replies, target->late_replies + 1, __ATOMIC_RELAXED);
+        handle_error(target, event->target_sequence, "Late reply (time=%.3f ms)", (double)event->rtt_ns / 1000000);
+        return;
+    }
+    if (status == REPLY_DUPLICATE)
+    {
+        __atomic_store_n(&target->duplicate_replies, target->duplicate_replies + 1, __ATOMIC_RELAXED);
+        handle_error(target, event->target_sequence, "Duplicate reply (time=%.3f ms)", (double)event->rtt_ns / 1000000);
+        return;
+    }
+    if (status == REPLY_OUT_OF_ORDER)
+    {
+        __atomic_store_n(&target->reordered_replies, target->reordered_replies + 1, __ATOMIC_RELAXED);
+    }
+    if (event->kernel_timed)
+    {
+        target->removed_overhead_ns += event->removed_overhead_ns;
+        ++target->kernel_timed_replies;
+    }
 
     // Calculate the round trip time
-    const double trip_time = calculate_round_trip_time(start_time, end_time);
+    const double trip_time = calculate_round_trip_time(&global_ping.rtt[event->target], 0, event->rtt_ns);
+    record_sequence(&global_ping.sequences[event->target], event->target_sequence, event->rtt_ns);
+    if (global_ping.rtt_series)
+    {
+        log_round_trip(event->target, event->rtt_ns);
+    }
+    if (engine->phase_rtt)
+    {
+        record_round_trip(&engine->phase_rtt[event->low_latency], event->rtt_ns);
+    }
+
+    // Increment the number of packets received
+    __atomic_store_n(&target->packets_received, target->packets_received + 1, __ATOMIC_RELAXED);
+
+    // Records are written in every mode, they are the output of the machine-readable formats
+    if (global_ping.format != FORMAT_TEXT)
+    {
+        write_record(engine, event->target, event->target_sequence, event->rtt_ns, ICMP_ECHOREPLY, 0, event->ttl,
+                     status == REPLY_OUT_OF_ORDER ? RECORD_REORDERED : RECORD_REPLY);
+    }
+
+    // Print the ping reply if quiet mode is disabled, floods are summarized at the end
+    else if (!global_ping.quiet && !global_ping.flood)
+    {
+        printf("%u bytes from %s: icmp_seq=%u ttl=%lu time=%.3f ms\n", event->size, target->ip_address, event->target_sequence, global_ping.time_to_live, trip_time);
+    }
+}
+
+// Handles a message read from the socket.
+// Datagram sockets deliver the ICMP message alone, raw sockets behind its IP header.
+// @param engine The engine owning the socket.
+// @param recv_buffer The received message.
+// @param recv_size The size of the received message.
+// @param source The address the message came from.
+// @param recv_time The monotonic time the message was read, in nanoseconds.
+// @param kernel_recv_time The kernel receive timestamp in nanoseconds, 0 if not available.
+void process_message(ping_engine_t *engine, char *recv_buffer, ssize_t recv_size, struct in_addr source,
+                     uint64_t recv_time, uint64_t kernel_recv_time)
+{
+    if (global_ping.datagram)
+    {
+        process_reply(engine, (icmphdr_t *)recv_buffer, recv_size, recv_size, source, 0, recv_time, kernel_recv_time);
+        return;
+    }
 
-    // Add the round trip time to the list
-    add_trip_to_list(trip_time);
+    struct ip *ip_header = (struct ip *)recv_buffer;
+    size_t ip_header_length = ip_header->ip_hl << 2;
+    process_reply(engine, (icmphdr_t *)(recv_buffer + ip_header_length), recv_size - (ssize_t)ip_header_length,
+                  recv_size, source, ip_header->ip_ttl, recv_time, kernel_recv_time);
+}
 
-    // Increment the number of packets received if the packet is valid
-    global_ping.packets_received += is_received;
+// Reads every pending ICMP message from the non-blocking socket, a batch per recvmmsg() call.
+// Called by the event loop when the socket becomes readable.
+// @param engine The engine owning the socket.
+void receive_replies(ping_engine_t *engine)
+{
+    // Create the buffers to receive a batch of responses
+    char controls[RECV_BATCH_SIZE][CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct sockaddr_in sources[RECV_BATCH_SIZE];
+    struct iovec iovecs[RECV_BATCH_SIZE];
+    struct mmsghdr messages[RECV_BATCH_SIZE];
+
+    // Transmit timestamps must be attached to the probes before their replies are timed
+    if (global_ping.kernel_timestamps || global_ping.datagram)
+    {
+        receive_error_queue(engine);
+    }
 
-    // Print the ping reply if quiet mode is disabled
-    if (!global_ping.quiet)
+    // Point each message at its own buffer
+    for (int i = 0; i < RECV_BATCH_SIZE; ++i)
     {
-        printf("%zd bytes from %s: icmp_seq=%d ttl=%lu time=%.3f ms\n", recv_size, global_ping.ip_address, icmp_seq, global_ping.time_to_live, trip_time);
+        iovecs[i].iov_base = engine->recv_batch + i * global_ping.recv_buffer_size;
+        iovecs[i].iov_len = global_ping.recv_buffer_size;
+        memset(&messages[i].msg_hdr, 0, sizeof(messages[i].msg_hdr));
+        messages[i].msg_hdr.msg_name = &sources[i];
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
     }
 
-    next_packet();
-}
\ No newline at end of file
+    while ("draining")
+    {
+        // The kernel shrinks the name and control lengths to what it wrote, restore them on every call
+        for (int i = 0; i < RECV_BATCH_SIZE; ++i)
+        {
+            messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+            messages[i].msg_hdr.msg_control = global_ping.kernel_timestamps ? controls[i] : NULL;
+            messages[i].msg_hdr.msg_controllen = global_ping.kernel_timestamps ? sizeof(controls[i]) : 0;
+        }
+
+        int message_count = recvmmsg(engine->socket, messages, RECV_BATCH_SIZE, 0, NULL);
+        ++engine->receive_calls;
+
+        // Get the current time to use as the end time
+        uint64_t recv_time = get_monotonic_time();
+
+        if (message_count < 0)
+        {
+            // The socket is drained
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // A datagram socket may report a pending ICMP error here, it is read from the error queue
+            if (global_ping.datagram && (errno == EHOSTUNREACH || errno == ENETUNREACH || errno == ECONNREFUSED || errno == EMSGSIZE))
+            {
+                receive_error_queue(engine);
+                continue;
+            }
+            perror("ping: recvmmsg");
+            exit(1);
+        }
+
+        // Probes past their timeout are lost even if the timer has not fired since,
+        // so that their replies are accounted as late
+        expire_probes(engine, recv_time);
+
+        for (int i = 0; i < message_count; ++i)
+        {
+            uint64_t kernel_recv_time = global_ping.kernel_timestamps ? kernel_receive_time(&messages[i].msg_hdr) : 0;
+            process_message(engine, iovecs[i].iov_base, messages[i].msg_len, sources[i].sin_addr, recv_time, kernel_recv_time);
+        }
+
+        // A partial batch means the queue was emptied, spare the call returning EAGAIN
+        if (message_count < RECV_BATCH_SIZE)
+        {
+            return;
+        }
+    }
+}
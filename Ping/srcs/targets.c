@@ -0,0 +1,133 @@
+#include "ping.h"
+
+// Appends a host to the list of targets, growing it as needed.
+// @param host The hostname or IP address of the target.
+// @param capacity A pointer to the number of targets the list can hold.
+static void add_target(const char *host, uint32_t *capacity)
+{
+    if (global_ping.target_count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        global_ping.targets = realloc(global_ping.targets, *capacity * sizeof(ping_target_t));
+        if (global_ping.targets == NULL)
+        {
+            perror("ping: realloc");
+            exit(1);
+        }
+    }
+
+    ping_target_t *target = &global_ping.targets[global_ping.target_count++];
+    memset(target, 0, sizeof(*target));
+    target->host = host;
+    target->wheel_next = -1;
+}
+
+// Reads the targets listed in a file, one per line.
+// Blank lines and lines starting with '#' are skipped.
+// @param capacity A pointer to the number of targets the list can hold.
+static void read_targets_file(uint32_t *capacity)
+{
+    bool from_stdin = strcmp(global_ping.targets_file, "-") == 0;
+    FILE *file = from_stdin ? stdin : fopen(global_ping.targets_file, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "ping: %s: %s\n", global_ping.targets_file, strerror(errno));
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) >= 0)
+    {
+        // Trim the surrounding blanks and the newline
+        char *host = line + strspn(line, " \t");
+        size_t host_length = strcspn(host, " \t\r\n");
+        host[host_length] = '\0';
+        if (host_length == 0 || host[0] == '#')
+        {
+            continue;
+        }
+
+        char *copy = strdup(host);
+        if (copy == NULL)
+        {
+            perror("ping: strdup");
+            exit(1);
+        }
+        add_target(copy, capacity);
+    }
+    free(line);
+
+    if (!from_stdin)
+    {
+        fclose(file);
+    }
+}
+
+// Builds the list of targets from the command line and the targets file, and resolves them.
+// The addresses need no resolution, the names are resolved concurrently. In the interval
+// mode, whose outputs only need the address of a target once it is probed, the engines
+// resolve them while probing the targets already known; otherwise they are resolved here.
+// With a single target an unknown host is fatal, with several it is reported and skipped.
+void load_targets(void)
+{
+    uint32_t capacity = 0;
+    for (unsigned int i = 0; i < global_ping.host_count; ++i)
+    {
+        add_target(global_ping.hosts[i], &capacity);
+    }
+    if (global_ping.targets_file)
+    {
+        read_targets_file(&capacity);
+    }
+    global_ping.multi_target = global_ping.target_count > 1 || global_ping.targets_file;
+
+    uint32_t names = 0;
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        names += !resolve_literal(&global_ping.targets[i]);
+    }
+    global_ping.resolve_in_engines = names && global_ping.multi_target && !global_ping.flood && !global_ping.adaptive &&
+                                     !global_ping.rate && !global_ping.pacing && !global_ping.pmtu && !global_ping.shm_name &&
+                                     global_ping.format != FORMAT_BINARY;
+    if (names && !global_ping.resolve_in_engines)
+    {
+        dns_resolver_t *resolver = open_resolver(0, global_ping.target_count);
+        resolve_all(resolver);
+        close_resolver(resolver);
+    }
+
+    // Compact the list over the unknown hosts, unless the engines resolve them
+    uint32_t resolved = 0;
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        if (global_ping.resolve_in_engines || global_ping.targets[i].address.sin_family)
+        {
+            global_ping.targets[resolved++] = global_ping.targets[i];
+        }
+        else if (!global_ping.multi_target)
+        {
+            exit(1);
+        }
+    }
+    global_ping.target_count = resolved;
+    if (!global_ping.target_count)
+    {
+        fprintf(stderr, "ping: no target to ping\n");
+        exit(1);
+    }
+
+    // The round trip times and the analytics are kept apart, they are only touched by the replies
+    global_ping.rtt = malloc(global_ping.target_count * sizeof(rtt_stats_t));
+    global_ping.sequences = malloc(global_ping.target_count * sizeof(sequence_stats_t));
+    if (global_ping.rtt == NULL || global_ping.sequences == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < global_ping.target_count; ++i)
+    {
+        initialize_rtt_stats(&global_ping.rtt[i]);
+        initialize_sequence_stats(&global_ping.sequences[i]);
+    }
+}
@@ -0,0 +1,211 @@
+#include "ping.h"
+
+// Room for the timestamps and the extended error describing a transmit timestamp
+#define TRANSMIT_CONTROL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in)))
+
+// Converts a timespec structure to nanoseconds.
+// @param ts The timespec to convert.
+// @return The equivalent number of nanoseconds.
+static uint64_t timespec_to_nanoseconds(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000UL + ts->tv_nsec;
+}
+
+// Asks the kernel to timestamp our packets in software when they leave and reach the stack.
+// Transmit timestamps are queued on the error queue with a per-packet key, receive
+// timestamps come with each reply as a control message. Both are on CLOCK_REALTIME.
+// Falls back to user-space CLOCK_MONOTONIC timestamps when the kernel refuses.
+// @param engine The engine owning the socket.
+void enable_kernel_timestamps(ping_engine_t *engine)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE   // timestamp when handed to the device
+                | SOF_TIMESTAMPING_RX_SOFTWARE // timestamp when entering the stack
+                | SOF_TIMESTAMPING_SOFTWARE    // report software timestamps
+                | SOF_TIMESTAMPING_OPT_ID      // key transmit timestamps by packet
+                | SOF_TIMESTAMPING_OPT_TSONLY; // do not loop the packet back with them
+
+    if (setsockopt(engine->socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        perror("ping: setsockopt SO_TIMESTAMPING, using user-space timestamps");
+        global_ping.kernel_timestamps = 0;
+        return;
+    }
+
+    // Keys are assigned by the kernel in send order, remember which probe each one is
+    engine->transmit_keys = calloc(PROBE_RING_SIZE, sizeof(uint32_t));
+    if (engine->transmit_keys == NULL)
+    {
+        perror("ping: calloc");
+        exit(1);
+    }
+    engine->next_transmit_key = 0;
+}
+
+// Remembers the probe the kernel will report the next transmit timestamp key for.
+// Must be called once per packet successfully handed to the kernel, in send order.
+// @param engine The engine.
+// @param sequence The sequence number of the probe just sent.
+void record_transmit(ping_engine_t *engine, uint32_t sequence)
+{
+    if (!global_ping.kernel_timestamps)
+    {
+        return;
+    }
+    engine->transmit_keys[engine->next_transmit_key++ & (PROBE_RING_SIZE - 1)] = sequence;
+}
+
+// Room for the echo request quoted by an ICMP error reported on the error queue
+#define QUOTED_REQUEST_SIZE 64
+
+// Attaches a transmit timestamp read from the error queue to its probe.
+// @param engine The engine.
+// @param timestamps The timestamps of the entry.
+// @param error The extended error of the entry, giving the key.
+static void attach_transmit_timestamp(ping_engine_t *engine, struct scm_timestamping *timestamps, struct sock_extended_err *error)
+{
+    if (timestamps == NULL)
+    {
+        return;
+    }
+
+    // The key is the rank of the packet among those sent since timestamping was enabled
+    uint32_t sequence = engine->transmit_keys[error->ee_data & (PROBE_RING_SIZE - 1)];
+    probe_slot_t *slot = &engine->probe_ring[sequence & (PROBE_RING_SIZE - 1)];
+    if (slot->sequence == sequence && slot->state != PROBE_FREE)
+    {
+        slot->kernel_send_time = timespec_to_nanoseconds(&timestamps->ts[0]);
+        if (engine->send_gaps)
+        {
+            record_send_gap(engine, sequence, slot->kernel_send_time);
+        }
+    }
+}
+
+// Reports an ICMP error the kernel matched to one of our probes on a datagram socket.
+// The entry carries the echo request it is about, the type and code are in the extended error.
+// @param engine The engine.
+// @param error The extended error of the entry.
+// @param quoted_packet The echo request the error quotes.
+// @param quoted_length The length of the quoted request.
+static void report_icmp_error(ping_engine_t *engine, struct sock_extended_err *error, icmphdr_t *quoted_packet, size_t quoted_length)
+{
+    if (quoted_length < sizeof(icmphdr_t) || quoted_packet->type != ICMP_ECHO)
+    {
+        return;
+    }
+
+    probe_slot_t *slot = find_probe(engine, swap_endianess_16(quoted_packet->un.echo.sequence));
+    if (slot != NULL)
+    {
+        reply_status_t status = resolve_probe(engine, slot->sequence, 0);
+        if (global_ping.pmtu)
+        {
+            // The extended error carries the next-hop MTU of a Fragmentation Needed error
+            bool too_big = error->ee_type == ICMP_DEST_UNREACH && error->ee_code == ICMP_FRAG_NEEDED;
+            settle_pmtu_probe(engine, slot->target, slot->target_sequence, too_big ? PMTU_TOO_BIG : PMTU_LOST,
+                              too_big ? error->ee_info : 0, 0);
+        }
+        reply_event_t event = {
+            .kind = EVENT_ERROR,
+            .target = slot->target,
+            .target_sequence = slot->target_sequence,
+            .rtt_ns = get_monotonic_time() - slot->send_time,
+            .status = status,
+            .type = error->ee_type,
+            .code = error->ee_code};
+        dispatch_event(engine, &event);
+    }
+}
+
+// Handles an entry of the error queue: a transmit timestamp, an ICMP error, or a probe
+// the qdisc dropped for missing its transmit time.
+// @param engine The engine.
+// @param msg The message header of the error queue entry.
+// @param length The length of the data of the entry.
+static void process_error_queue_entry(ping_engine_t *engine, struct msghdr *msg, size_t length)
+{
+    struct scm_timestamping *timestamps = NULL;
+    struct sock_extended_err *error = NULL;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+            timestamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+        else if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+            error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+    }
+    if (error == NULL)
+    {
+        return;
+    }
+
+    if (error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && global_ping.kernel_timestamps)
+    {
+        attach_transmit_timestamp(engine, timestamps, error);
+    }
+    else if (error->ee_origin == SO_EE_ORIGIN_ICMP)
+    {
+        report_icmp_error(engine, error, msg->msg_iov->iov_base, length);
+    }
+    else if (error->ee_origin == SO_EE_ORIGIN_TXTIME)
+    {
+        ++engine->txtime_misses;
+    }
+}
+
+// Drains the error queue, a batch per recvmmsg() call: transmit timestamps are attached to
+// their probes, and the ICMP errors a datagram socket queues there are reported.
+// @param engine The engine owning the socket.
+void receive_error_queue(ping_engine_t *engine)
+{
+    char controls[RECV_BATCH_SIZE][TRANSMIT_CONTROL_SIZE];
+    char quoted_requests[RECV_BATCH_SIZE][QUOTED_REQUEST_SIZE];
+    struct iovec iovecs[RECV_BATCH_SIZE];
+    struct mmsghdr messages[RECV_BATCH_SIZE];
+
+    while ("draining")
+    {
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < RECV_BATCH_SIZE; ++i)
+        {
+            iovecs[i].iov_base = quoted_requests[i];
+            iovecs[i].iov_len = QUOTED_REQUEST_SIZE;
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_control = controls[i];
+            messages[i].msg_hdr.msg_controllen = TRANSMIT_CONTROL_SIZE;
+        }
+
+        int message_count = recvmmsg(engine->socket, messages, RECV_BATCH_SIZE, MSG_ERRQUEUE, NULL);
+        ++engine->receive_calls;
+        if (message_count < 0)
+        {
+            return;
+        }
+
+        for (int i = 0; i < message_count; ++i)
+        {
+            process_error_queue_entry(engine, &messages[i].msg_hdr, messages[i].msg_len);
+        }
+
+        if (message_count < RECV_BATCH_SIZE)
+        {
+            return;
+        }
+    }
+}
+
+// Extracts the kernel receive timestamp of a reply from its control messages.
+// @param msg The message header filled by recvmsg() or recvmmsg().
+// @return The receive time on CLOCK_REALTIME in nanoseconds, 0 if the kernel did not provide it.
+uint64_t kernel_receive_time(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct scm_timestamping *timestamps = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            return timespec_to_nanoseconds(&timestamps->ts[0]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include "ping.h"
+
+// Index of a tick in the slots of a level.
+#define WHEEL_INDEX(tick, level) (((tick) >> ((level) * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1))
+
+// Empties the timing wheel and sets its clock.
+// @param wheel The timing wheel.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_timing_wheel(timing_wheel_t *wheel, uint64_t now)
+{
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+    {
+        for (int i = 0; i < WHEEL_SLOTS; ++i)
+        {
+            wheel->slots[level][i] = -1;
+        }
+    }
+
+    // Start one tick behind, so that the targets due right away fire on the first advance
+    wheel->current_tick = now / WHEEL_TICK_NS - 1;
+    wheel->scheduled = 0;
+}
+
+// Links a target in the slot of its due tick.
+// The level is given by the most significant byte in which the due tick differs from the
+// current one, so that each level only holds the targets of the current window of the level above.
+// @param wheel The timing wheel.
+// @param target The index of the target.
+// @param tick The due tick, not before the current one.
+static void insert_target(timing_wheel_t *wheel, uint32_t target, uint64_t tick)
+{
+    // Beyond the last level, wait at its far end and be placed again when cascaded
+    uint64_t horizon = wheel->current_tick | ((1UL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) - 1);
+    tick = tick < horizon ? tick : horizon;
+
+    uint64_t difference = tick ^ wheel->current_tick;
+    int level = difference ? (63 - __builtin_clzll(difference)) / WHEEL_SLOT_BITS : 0;
+
+    int32_t *slot = &wheel->slots[level][WHEEL_INDEX(tick, level)];
+    ping_target_t *entry = &global_ping.targets[target];
+    entry->wheel_next = *slot;
+    entry->wheel_prev = -1;
+    entry->wheel_slot = slot;
+    if (*slot >= 0)
+    {
+        global_ping.targets[*slot].wheel_prev = target;
+    }
+    *slot = target;
+}
+
+// Schedules a target at its next send time.
+// Targets fire on the first tick starting at or after their send time, so never early.
+// @param wheel The timing wheel.
+// @param target The index of the target, whose next_send_time is set.
+void schedule_target(timing_wheel_t *wheel, uint32_t target)
+{
+    uint64_t tick = (global_ping.targets[target].next_send_time + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+    insert_target(wheel, target, tick > wheel->current_tick ? tick : wheel->current_tick + 1);
+    ++wheel->scheduled;
+}
+
+// Takes a target out of the wheel, so that it can be scheduled again at another time.
+// Does nothing if the target is not scheduled.
+// @param wheel The timing wheel.
+// @param target The index of the target.
+void unschedule_target(timing_wheel_t *wheel, uint32_t target)
+{
+    ping_target_t *entry = &global_ping.targets[target];
+    if (entry->wheel_slot == NULL)
+    {
+        return;
+    }
+
+    if (entry->wheel_prev >= 0)
+        global_ping.targets[entry->wheel_prev].wheel_next = entry->wheel_next;
+    else
+        *entry->wheel_slot = entry->wheel_next;
+    if (entry->wheel_next >= 0)
+        global_ping.targets[entry->wheel_next].wheel_prev = entry->wheel_prev;
+    entry->wheel_slot = NULL;
+    --wheel->scheduled;
+}
+
+// Finds the next tick at which a slot has to be processed.
+// @param wheel The timing wheel.
+// @return The tick a level 0 slot fires or a higher level slot cascades, UINT64_MAX if the wheel is empty.
+static uint64_t next_wheel_tick(const timing_wheel_t *wheel)
+{
+    if (!wheel->scheduled)
+    {
+        return UINT64_MAX;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+    {
+        unsigned int shift = level * WHEEL_SLOT_BITS;
+        uint64_t window = wheel->current_tick >> shift >> WHEEL_SLOT_BITS << WHEEL_SLOT_BITS;
+        for (unsigned int i = WHEEL_INDEX(wheel->current_tick, level) + 1; i < WHEEL_SLOTS; ++i)
+        {
+            if (wheel->slots[level][i] >= 0)
+            {
+                return (window | i) << shift;
+            }
+        }
+    }
+    return UINT64_MAX;
+}
+
+// Moves the targets of a slot to the lower levels, now that the current tick entered its range.
+// @param wheel The timing wheel.
+// @param level The level of the slot, at least 1.
+static void cascade_slot(timing_wheel_t *wheel, int level)
+{
+    int32_t *slot = &wheel->slots[level][WHEEL_INDEX(wheel->current_tick, level)];
+    int32_t target = *slot;
+    *slot = -1;
+
+    while (target >= 0)
+    {
+        int32_t next = global_ping.targets[target].wheel_next;
+        uint64_t tick = (global_ping.targets[target].next_send_time + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+        insert_target(wheel, target, tick > wheel->current_tick ? tick : wheel->current_tick);
+        target = next;
+    }
+}
+
+// Advances the wheel to the current time and collects the targets that became due.
+// Empty stretches are skipped at once, so the cost depends on the occupied slots only.
+// @param wheel The timing wheel.
+// @param now The current monotonic time, in nanoseconds.
+// @param due_targets Filled with the due targets, must hold every scheduled target.
+// @return The number of due targets, which are no longer in the wheel.
+unsigned int advance_timing_wheel(timing_wheel_t *wheel, uint64_t now, uint32_t *due_targets)
+{
+    uint64_t now_tick = now / WHEEL_TICK_NS;
+    unsigned int due_count = 0;
+
+    while (wheel->current_tick < now_tick)
+    {
+        uint64_t next_tick = next_wheel_tick(wheel);
+        if (next_tick > now_tick)
+        {
+            wheel->current_tick = now_tick;
+            break;
+        }
+        wheel->current_tick = next_tick;
+
+        // Entering a new window of a level cascades its slot, highest levels first
+        int level = 1;
+        while (level < WHEEL_LEVELS && WHEEL_INDEX(next_tick, level - 1) == 0)
+        {
+            ++level;
+        }
+        while (--level > 0)
+        {
+            cascade_slot(wheel, level);
+        }
+
+        // Collect the targets due on this tick
+        int32_t *slot = &wheel->slots[0][WHEEL_INDEX(next_tick, 0)];
+        for (int32_t target = *slot; target >= 0; target = global_ping.targets[target].wheel_next)
+        {
+            due_targets[due_count++] = target;
+            global_ping.targets[target].wheel_slot = NULL;
+            --wheel->scheduled;
+        }
+        *slot = -1;
+    }
+    return due_count;
+}
+
+// Gives the time the probe timer must fire next.
+// @param wheel The timing wheel.
+// @return The monotonic time in nanoseconds, 0 if no target is scheduled.
+uint64_t next_wheel_deadline(const timing_wheel_t *wheel)
+{
+    uint64_t next_tick = next_wheel_tick(wheel);
+    return next_tick == UINT64_MAX ? 0 : next_tick * WHEEL_TICK_NS;
+}
+
+// Schedules the first probe of each target of the engine.
+// The targets are spread evenly over the first interval rather than all probed at once.
+// The targets still being resolved are scheduled once their address is known.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void initialize_schedule(ping_engine_t *engine, uint64_t now)
+{
+    engine->due_targets = malloc(engine->target_count * sizeof(uint32_t));
+    if (engine->due_targets == NULL)
+    {
+        perror("ping: malloc");
+        exit(1);
+    }
+
+    initialize_timing_wheel(&engine->wheel, now);
+    if (!engine->active_targets)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < engine->target_count; ++i)
+    {
+        uint32_t target = engine->first_target + i;
+        if (!global_ping.targets[target].address.sin_family)
+        {
+            continue;
+        }
+        global_ping.targets[target].next_send_time = now + global_ping.interval_ns * i / engine->target_count;
+        schedule_target(&engine->wheel, target);
+    }
+}
+
+// Sends the probes of the targets that became due, in sendmmsg() batches.
+// A target due for several intervals, after a late wake-up or with an interval shorter
+// than a tick, gets one probe per elapsed interval, so that the rate is kept.
+// Probes that would exceed the window of probes in flight are skipped.
+// @param engine The engine.
+// @param now The current monotonic time, in nanoseconds.
+void schedule_probes(ping_engine_t *engine, uint64_t now)
+{
+    unsigned int due_count = advance_timing_wheel(&engine->wheel, now, engine->due_targets);
+
+    for (unsigned int i = 0; i < due_count; ++i)
+    {
+        uint32_t target_index = engine->due_targets[i];
+        ping_target_t *target = &global_ping.targets[target_index];
+
+        // Intervals elapsed since the probe was due, the probe itself included
+        uint64_t elapsed = now > target->next_send_time ? (now - target->next_send_time) / global_ping.interval_ns + 1 : 1;
+        target->next_send_time += elapsed * global_ping.interval_ns;
+
+        // Stay within the count and the window
+        uint64_t probes = elapsed;
+        if (global_ping.packet_count >= 0)
+        {
+            uint64_t remaining = global_ping.packet_count - target->packets_sent;
+            probes = probes < remaining ? probes : remaining;
+        }
+        unsigned long int in_flight = engine->packets_in_flight + engine->batch_length;
+        unsigned long int window_room = in_flight < global_ping.window ? global_ping.window - in_flight : 0;
+        probes = probes < window_room ? probes : window_room;
+
+        while (probes--)
+        {
+            queue_probe(engine, target_index);
+            if (engine->batch_length == SEND_BATCH_SIZE)
+            {
+                flush_probes(engine);
+            }
+        }
+
+        // Targets done with their count leave the wheel
+        if (global_ping.packet_count >= 0 && target->packets_sent >= global_ping.packet_count)
+        {
+            --engine->active_targets;
+        }
+        else
+        {
+            schedule_target(&engine->wheel, target_index);
+        }
+    }
+    flush_probes(engine);
+}
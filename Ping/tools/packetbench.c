@@ -0,0 +1,187 @@
+#include "ping.h"
+
+// Microbenchmarks of the probe packets: the checksum of libft.c against the former 16-bit
+// loop, stamping a packet built from the template against rebuilding it whole, and the
+// memcmp() payload verification against the former byte loop. The former functions are
+// kept here as they were, and every result is checked against them before it is timed.
+
+// Time spent on each measurement
+#define BENCH_DURATION_NS 200000000UL
+
+// Payload sizes measured: the default, a full Ethernet frame, a jumbo frame, the largest
+#define BENCH_SIZES {56, 1472, 8972, 65507}
+
+// Keeps the results alive, so that the compiler cannot drop the work measured
+static volatile uint64_t sink;
+
+// The checksum before the templates, 16 bits at a time.
+static uint16_t former_checksum(void *data_ptr, size_t data_size)
+{
+    uint16_t *data = data_ptr;
+    uint64_t sum = 0;
+    while (data_size >= sizeof(*data))
+    {
+        sum += *data++;
+        data_size -= sizeof(*data);
+    }
+    if (data_size)
+    {
+        sum += *(uint8_t *)data;
+    }
+    while (sum & ~0xffff)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (~sum);
+}
+
+// The probe before the templates, filled byte by byte and checksummed whole.
+static void former_create_packet(icmphdr_t *packet, uint32_t sequence, uint32_t target, uint32_t target_sequence, uint64_t send_time)
+{
+    packet->type = ICMP_ECHO;
+    packet->code = 0;
+    packet->checksum = 0;
+    packet->un.echo.id = 0;
+    packet->un.echo.sequence = swap_endianess_16(sequence);
+    for (unsigned long int i = 0; i < global_ping.packet_size; ++i)
+    {
+        ((char *)packet)[sizeof(icmphdr_t) + i] = 'a' + i % 26;
+    }
+    probe_stamp_t stamp = {
+        .sequence = sequence,
+        .target = target,
+        .target_sequence = target_sequence,
+        .nonce = global_ping.nonce,
+        .send_time = send_time};
+    memcpy((char *)packet + sizeof(icmphdr_t), &stamp, sizeof(stamp));
+    packet->checksum = former_checksum(packet, global_ping.data_size);
+}
+
+// The payload verification before memcmp(), a byte at a time.
+static bool former_same_payload(const char *received, const char *reference, size_t length)
+{
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (received[i] != reference[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// What is measured: the work of an iteration on a packet
+typedef enum
+{
+    BENCH_FORMER_CHECKSUM,
+    BENCH_CHECKSUM,
+    BENCH_FORMER_CREATE,
+    BENCH_STAMP,
+    BENCH_FORMER_VERIFY,
+    BENCH_VERIFY
+} bench_kind_t;
+
+// Runs a kind of work for BENCH_DURATION_NS.
+// @param kind The work.
+// @param packet A packet built from the template.
+// @param reply A copy of the packet, as a reply.
+// @return The average time of an iteration in nanoseconds.
+static double measure(bench_kind_t kind, icmphdr_t *packet, icmphdr_t *reply)
+{
+    size_t stamp_size = sizeof(probe_stamp_t);
+    size_t filler = global_ping.packet_size - stamp_size;
+    char *reply_filler = (char *)reply + sizeof(icmphdr_t) + stamp_size;
+    char *reference_filler = global_ping.packet + sizeof(icmphdr_t) + stamp_size;
+    uint64_t iterations = 0, start = get_monotonic_time(), elapsed;
+    do
+    {
+        for (int i = 0; i < 64; ++i, ++iterations)
+        {
+            if (kind == BENCH_FORMER_CHECKSUM)
+                sink += former_checksum(reply, global_ping.data_size);
+            else if (kind == BENCH_CHECKSUM)
+                sink += calculate_checksum(reply, global_ping.data_size);
+            else if (kind == BENCH_FORMER_CREATE)
+                former_create_packet(packet, iterations, 0, iterations, iterations);
+            else if (kind == BENCH_STAMP)
+                stamp_packet(packet, iterations, 0, iterations, iterations);
+            else if (kind == BENCH_FORMER_VERIFY)
+                sink += former_same_payload(reply_filler, reference_filler, filler);
+            else
+                sink += memcmp(reply_filler, reference_filler, filler) == 0;
+            sink += packet->checksum;
+        }
+        elapsed = get_monotonic_time() - start;
+    } while (elapsed < BENCH_DURATION_NS);
+    return (double)elapsed / iterations;
+}
+
+// Checks the new functions give the results of the former ones.
+// @param packet Room for a packet.
+// @param former Room for a packet.
+// @return true if they agree.
+static bool check_agreement(icmphdr_t *packet, icmphdr_t *former)
+{
+    // Checksums of every length and alignment of the start, over a probe
+    former_create_packet(former, 70000, 3, 69999, 123456789);
+    for (size_t offset = 0; offset < 8; ++offset)
+    {
+        for (size_t length = 0; length + offset <= global_ping.data_size; length += length < 256 ? 1 : 97)
+        {
+            if (calculate_checksum((char *)former + offset, length) != former_checksum((char *)former + offset, length))
+            {
+                fprintf(stderr, "packetbench: checksums differ on %zu bytes at offset %zu\n", length, offset);
+                return false;
+            }
+        }
+    }
+
+    // A stamped template is the packet built whole, with a valid checksum
+    create_packet(NULL, packet);
+    stamp_packet(packet, 70000, 3, 69999, 123456789);
+    if (memcmp(packet, former, global_ping.data_size) != 0 || calculate_checksum(packet, global_ping.data_size) != 0)
+    {
+        fprintf(stderr, "packetbench: the stamped template differs from the packet built whole\n");
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    static const size_t sizes[] = BENCH_SIZES;
+    bool agreed = true;
+    global_ping.nonce = 0x5eed;
+
+    printf("%8s %22s %22s %22s\n", "payload", "checksum (ns)", "probe (ns)", "verify (ns)");
+    printf("%8s %11s %10s %11s %10s %11s %10s\n", "bytes", "former", "new", "rebuild", "stamp", "bytes", "memcmp");
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i)
+    {
+        global_ping.packet_size = sizes[i];
+        global_ping.data_size = sizeof(icmphdr_t) + sizes[i];
+        global_ping.packet = malloc(global_ping.data_size);
+        icmphdr_t *packet = malloc(global_ping.data_size);
+        icmphdr_t *reply = malloc(global_ping.data_size);
+        if (global_ping.packet == NULL || packet == NULL || reply == NULL)
+        {
+            perror("packetbench: malloc");
+            return 1;
+        }
+        create_packet(NULL, (icmphdr_t *)global_ping.packet);
+        agreed &= check_agreement(packet, reply);
+
+        // The reply is a stamped copy of the template, as the engines send it
+        create_packet(NULL, packet);
+        stamp_packet(packet, 1, 0, 1, 1);
+        memcpy(reply, packet, global_ping.data_size);
+
+        printf("%8zu %11.1f %10.1f %11.1f %10.1f %11.1f %10.1f\n", sizes[i],
+               measure(BENCH_FORMER_CHECKSUM, packet, reply), measure(BENCH_CHECKSUM, packet, reply),
+               measure(BENCH_FORMER_CREATE, packet, reply), measure(BENCH_STAMP, packet, reply),
+               measure(BENCH_FORMER_VERIFY, packet, reply), measure(BENCH_VERIFY, packet, reply));
+        free(global_ping.packet);
+        free(packet);
+        free(reply);
+    }
+    return !agreed;
+}
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ping_client.h"
+
+struct ping_client
+{
+    int fd;                                                  // connected socket
+    ping_service_hello_t hello;                              // limits of the service
+    ping_service_result_t buffer[PING_SERVICE_MAX_RESULTS];  // results received, not returned yet
+    size_t buffered;                                         // results in the buffer
+    size_t next;                                             // next result of the buffer to return
+};
+
+// Connects to the ping service and reads its hello.
+// @param path The UNIX socket of the service.
+// @return The connection, or NULL with errno set, EPROTO if the service speaks another protocol.
+ping_client_t *ping_client_open(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, path);
+
+    ping_client_t *client = malloc(sizeof(ping_client_t));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    client->buffered = client->next = 0;
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        ping_client_close(client);
+        return NULL;
+    }
+
+    ssize_t length = recv(client->fd, &client->hello, sizeof(client->hello), 0);
+    if (length != sizeof(client->hello) || client->hello.magic != PING_SERVICE_MAGIC ||
+        client->hello.version != PING_SERVICE_VERSION)
+    {
+        int error = length < 0 ? errno : EPROTO;
+        ping_client_close(client);
+        errno = error;
+        return NULL;
+    }
+    return client;
+}
+
+// Gives the socket of a connection, to wait for results in an event loop of the caller.
+// @param client The connection.
+// @return The file descriptor, readable when results arrived.
+int ping_client_fd(const ping_client_t *client)
+{
+    return client->fd;
+}
+
+// Gives the limits the service announced on connection.
+// @param client The connection.
+// @return The hello of the service.
+const ping_service_hello_t *ping_client_hello(const ping_client_t *client)
+{
+    return &client->hello;
+}
+
+// Submits checks, as many messages as the service takes requests per message.
+// @param client The connection.
+// @param requests The requests.
+// @param count The number of requests.
+// @return 0, or -1 with errno set if the service is gone.
+int ping_client_submit(ping_client_t *client, const ping_service_request_t *requests, size_t count)
+{
+    while (count)
+    {
+        size_t chunk = count < client->hello.max_requests ? count : client->hello.max_requests;
+        if (send(client->fd, requests, chunk * sizeof(*requests), MSG_NOSIGNAL) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        requests += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+// Returns the results received, waiting for the first one at most a given time.
+// @param client The connection.
+// @param results Filled with the results.
+// @param capacity The number of results it holds.
+// @param timeout_ms The longest wait in milliseconds, -1 to wait until a result comes.
+// @return The number of results, 0 on timeout, -1 with errno set if the service is gone.
+int ping_client_results(ping_client_t *client, ping_service_result_t *results, size_t capacity, int timeout_ms)
+{
+    if (client->next == client->buffered)
+    {
+        struct pollfd poll_fd = {.fd = client->fd, .events = POLLIN};
+        int ready = poll(&poll_fd, 1, timeout_ms);
+        if (ready <= 0)
+        {
+            return ready < 0 && errno != EINTR ? -1 : 0;
+        }
+        ssize_t length = recv(client->fd, client->buffer, sizeof(client->buffer), MSG_DONTWAIT);
+        if (length < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            return 0;
+        }
+        if (length <= 0 || length % sizeof(ping_service_result_t))
+        {
+            errno = length < 0 ? errno : ECONNRESET;
+            return -1;
+        }
+        client->buffered = length / sizeof(ping_service_result_t);
+        client->next = 0;
+    }
+
+    size_t count = client->buffered - client->next;
+    count = count < capacity ? count : capacity;
+    memcpy(results, client->buffer + client->next, count * sizeof(*results));
+    client->next += count;
+    return count;
+}
+
+// Closes a connection, the service cancels the checks still running.
+// @param client The connection.
+void ping_client_close(ping_client_t *client)
+{
+    if (client->fd >= 0)
+    {
+        close(client->fd);
+    }
+    free(client);
+}
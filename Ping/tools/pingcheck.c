@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ping_client.h"
+
+// Results of the checks of an address
+typedef struct
+{
+    const char *name;
+    uint32_t address;
+    unsigned long int replies;
+    unsigned long int lost;
+    unsigned long int errors;
+    unsigned long int rejected;
+    uint64_t rtt_min_ns;
+    uint64_t rtt_max_ns;
+    uint64_t rtt_sum_ns;
+} check_summary_t;
+
+// Gives the current monotonic time.
+// @return The time in nanoseconds.
+static uint64_t monotonic_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Accounts a result in the summary of its address, and prints it with -v.
+// @param summary The summary of the address of the check.
+// @param result The result.
+// @param verbose Print the result.
+static void account_result(check_summary_t *summary, const ping_service_result_t *result, int verbose)
+{
+    static const char *statuses[] = {"reply", "lost", "error", "rejected"};
+    if (result->status == PING_SERVICE_REPLY)
+    {
+        ++summary->replies;
+        summary->rtt_sum_ns += result->rtt_ns;
+        summary->rtt_min_ns = result->rtt_ns < summary->rtt_min_ns ? result->rtt_ns : summary->rtt_min_ns;
+        summary->rtt_max_ns = result->rtt_ns > summary->rtt_max_ns ? result->rtt_ns : summary->rtt_max_ns;
+    }
+    else if (result->status == PING_SERVICE_LOST)
+        ++summary->lost;
+    else if (result->status == PING_SERVICE_ERROR)
+        ++summary->errors;
+    else
+        ++summary->rejected;
+
+    if (verbose)
+    {
+        char source[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &result->source, source, sizeof(source));
+        printf("check %u seq %u %s from %s", result->id, result->sequence,
+               result->status <= PING_SERVICE_REJECTED ? statuses[result->status] : "unknown", source);
+        if (result->status == PING_SERVICE_REPLY)
+            printf(" ttl %u time %.3f ms", result->ttl, result->rtt_ns / 1e6);
+        else if (result->status == PING_SERVICE_ERROR)
+            printf(" type %u code %u", result->type, result->code);
+        printf("\n");
+    }
+}
+
+static int usage(void)
+{
+    fprintf(stderr, "Usage: pingcheck [-v] [-c COUNT] [-i SECS] [-n CHECKS] [-s SIZE] SOCKET ADDRESS...\n");
+    fprintf(stderr, "Runs CHECKS checks of COUNT probes per address on the ping service listening on SOCKET\n");
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long int count = 1, checks = 1, size = 0;
+    double interval = 1;
+    int verbose = 0, option;
+    while ((option = getopt(argc, argv, "vc:i:n:s:")) != -1)
+    {
+        if (option == 'v')
+            verbose = 1;
+        else if (option == 'c')
+            count = strtoul(optarg, NULL, 10);
+        else if (option == 'i')
+            interval = strtod(optarg, NULL);
+        else if (option == 'n')
+            checks = strtoul(optarg, NULL, 10);
+        else if (option == 's')
+            size = strtoul(optarg, NULL, 10);
+        else
+            return usage();
+    }
+    if (argc - optind < 2 || !count || !checks || interval <= 0 || size > UINT16_MAX)
+        return usage();
+
+    size_t address_count = argc - optind - 1;
+    check_summary_t *summaries = calloc(address_count, sizeof(check_summary_t));
+    ping_service_request_t *requests = calloc(address_count * checks, sizeof(ping_service_request_t));
+    if (summaries == NULL || requests == NULL)
+    {
+        perror("pingcheck: calloc");
+        return 1;
+    }
+
+    // The id of a check gives its address
+    for (size_t i = 0; i < address_count; ++i)
+    {
+        summaries[i].name = argv[optind + 1 + i];
+        summaries[i].rtt_min_ns = UINT64_MAX;
+        if (inet_pton(AF_INET, summaries[i].name, &summaries[i].address) != 1)
+        {
+            fprintf(stderr, "pingcheck: invalid IPv4 address '%s'\n", summaries[i].name);
+            return 1;
+        }
+        for (size_t j = 0; j < checks; ++j)
+        {
+            ping_service_request_t *request = &requests[i * checks + j];
+            request->id = i;
+            request->address = summaries[i].address;
+            request->count = count;
+            request->interval_us = interval * 1e6;
+            request->size = size;
+        }
+    }
+
+    ping_client_t *client = ping_client_open(argv[optind]);
+    if (client == NULL)
+    {
+        fprintf(stderr, "pingcheck: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    // Every check settles its probes, at the latest a timeout after its last one
+    uint64_t start = monotonic_time();
+    if (ping_client_submit(client, requests, address_count * checks) < 0)
+    {
+        perror("pingcheck: submit");
+        return 1;
+    }
+    unsigned long int expected = address_count * checks * count, settled = 0;
+    ping_service_result_t results[PING_SERVICE_MAX_RESULTS];
+    while (settled < expected)
+    {
+        int received = ping_client_results(client, results, PING_SERVICE_MAX_RESULTS, -1);
+        if (received < 0)
+        {
+            perror("pingcheck: results");
+            return 1;
+        }
+        for (int i = 0; i < received; ++i)
+        {
+            if (results[i].id >= address_count)
+                continue;
+            account_result(&summaries[results[i].id], &results[i], verbose);
+
+            // A rejected check sends nothing, it stands for all its probes
+            settled += results[i].status == PING_SERVICE_REJECTED ? count : 1;
+        }
+    }
+    double elapsed_ms = (monotonic_time() - start) / 1e6;
+    ping_client_close(client);
+
+    int failed = 0;
+    for (size_t i = 0; i < address_count; ++i)
+    {
+        check_summary_t *summary = &summaries[i];
+        printf("%s: %lu replies, %lu lost, %lu errors, %lu checks rejected", summary->name, summary->replies,
+               summary->lost, summary->errors, summary->rejected);
+        if (summary->replies)
+            printf(", rtt min/avg/max = %.3f/%.3f/%.3f ms", summary->rtt_min_ns / 1e6,
+                   summary->rtt_sum_ns / 1e6 / summary->replies, summary->rtt_max_ns / 1e6);
+        printf("\n");
+        failed |= !summary->replies;
+    }
+    printf("%lu checks of %lu probes settled in %.3f ms\n", address_count * checks, count, elapsed_ms);
+    free(summaries);
+    free(requests);
+    return failed;
+}
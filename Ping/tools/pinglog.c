@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ping_log.h"
+
+// Size of a sample before compression: a send time and a round trip time of 8 bytes each
+#define RAW_SAMPLE_SIZE 16
+
+// Reads the compressed samples of a block, most significant bit first
+typedef struct
+{
+    const uint8_t *data;
+    uint64_t position; // bits read
+    uint64_t length;   // bits in the block
+} bit_reader_t;
+
+// Reads bits from a block.
+// @param reader The reader.
+// @param count The number of bits, at most 64.
+// @return The bits, in the low bits of the value.
+static uint64_t get_bits(bit_reader_t *reader, unsigned int count)
+{
+    if (reader->position + count > reader->length)
+    {
+        fprintf(stderr, "pinglog: corrupted block\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t value = 0;
+    while (count)
+    {
+        unsigned int room = 8 - reader->position % 8;
+        unsigned int length = count < room ? count : room;
+        uint8_t byte = reader->data[reader->position / 8];
+        value = (value << length) | ((byte >> (room - length)) & ((1U << length) - 1));
+        reader->position += length;
+        count -= length;
+    }
+    return value;
+}
+
+// Reads a delta-of-delta: a prefix of up to PING_LOG_DOD_CLASSES one bits, then a signed
+// integer of the width of its class.
+// @param reader The reader.
+// @return The delta-of-delta, in microseconds.
+static int64_t get_delta_of_delta(bit_reader_t *reader)
+{
+    unsigned int class = 0;
+    while (class < PING_LOG_DOD_CLASSES && get_bits(reader, 1))
+    {
+        ++class;
+    }
+    unsigned int width = ping_log_dod_bits[class];
+    if (width == 0)
+    {
+        return 0;
+    }
+
+    // Sign extension of the width bits
+    uint64_t value = get_bits(reader, width);
+    if (width < 64 && (value >> (width - 1)) & 1)
+    {
+        value |= ~(uint64_t)0 << width;
+    }
+    return (int64_t)value;
+}
+
+// Options of the reader: the target and the CLOCK_REALTIME range of the samples to print
+typedef struct
+{
+    bool filter_address;
+    uint32_t address;
+    uint64_t from_us;
+    uint64_t until_us;
+    bool summary;
+} options_t;
+
+// Totals of the --summary
+typedef struct
+{
+    uint64_t blocks;
+    uint64_t samples;
+    uint64_t compressed_bytes;
+} totals_t;
+
+// Decodes a block and prints the samples within the range, one line each.
+// @param block The block header, followed by its samples, in the mapped file.
+// @param options The options.
+// @param totals Where to count the block and its samples.
+static void read_block(const ping_log_block_t *block, const options_t *options, totals_t *totals)
+{
+    uint32_t count = le32toh(block->count);
+    bit_reader_t reader = {.data = (const uint8_t *)(block + 1), .position = 0, .length = (uint64_t)le32toh(block->length) * 8};
+    struct in_addr address = {.s_addr = block->address};
+    const char *name = inet_ntoa(address);
+
+    ++totals->blocks;
+    totals->samples += count;
+    totals->compressed_bytes += sizeof(*block) + le32toh(block->length);
+    if (options->summary || count == 0)
+    {
+        return;
+    }
+
+    uint64_t time_us = get_bits(&reader, 64);
+    uint64_t rtt_ns = get_bits(&reader, 64);
+    int64_t delta = 0;
+    unsigned int leading = 0;
+    unsigned int window_length = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (i)
+        {
+            delta += get_delta_of_delta(&reader);
+            time_us += delta;
+
+            if (get_bits(&reader, 1))
+            {
+                if (get_bits(&reader, 1))
+                {
+                    leading = get_bits(&reader, PING_LOG_LEADING_BITS);
+                    window_length = get_bits(&reader, PING_LOG_LENGTH_BITS) + 1;
+                    if (leading + window_length > 64)
+                    {
+                        fprintf(stderr, "pinglog: corrupted block\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                else if (window_length == 0)
+                {
+                    fprintf(stderr, "pinglog: corrupted block\n");
+                    exit(EXIT_FAILURE);
+                }
+                rtt_ns ^= get_bits(&reader, window_length) << (64 - leading - window_length);
+            }
+        }
+
+        if (time_us >= options->from_us && time_us < options->until_us)
+        {
+            printf("%lu.%06lu %s rtt_ns=%lu\n", (unsigned long)(time_us / 1000000), (unsigned long)(time_us % 1000000),
+                   name, (unsigned long)rtt_ns);
+        }
+    }
+}
+
+// Tells if a block may hold samples of the options.
+static bool block_selected(uint32_t address, uint64_t min_time_us, uint64_t max_time_us, const options_t *options)
+{
+    return (!options->filter_address || address == options->address) &&
+           max_time_us >= options->from_us && min_time_us < options->until_us;
+}
+
+// Collects the offsets of the selected blocks by following the index records backwards
+// from the footer at the end of the file, without touching the blocks themselves.
+// @param file The mapped file.
+// @param size The size of the file.
+// @param options The options.
+// @param offsets Where to store the offsets, in the order the blocks were written.
+// @return The number of blocks selected, -1 if the index is missing or damaged.
+static long collect_indexed_blocks(const uint8_t *file, size_t size, const options_t *options, uint64_t **offsets)
+{
+    const ping_log_footer_t *footer = (const ping_log_footer_t *)(file + size - sizeof(*footer));
+    if (size < sizeof(ping_log_header_t) + sizeof(*footer) || le32toh(footer->magic) != PING_LOG_FOOTER_MAGIC)
+    {
+        return -1;
+    }
+
+    long count = 0;
+    long capacity = 0;
+    *offsets = NULL;
+    uint64_t index_offset = le64toh(footer->index_offset);
+    while (index_offset)
+    {
+        const ping_log_index_t *index = (const ping_log_index_t *)(file + index_offset);
+        if (index_offset < sizeof(ping_log_header_t) || index_offset + sizeof(*index) > size ||
+            le32toh(index->magic) != PING_LOG_INDEX_MAGIC ||
+            index_offset + sizeof(*index) + (uint64_t)le32toh(index->count) * sizeof(ping_log_index_entry_t) > size)
+        {
+            free(*offsets);
+            return -1;
+        }
+
+        // Entries are walked from the last one, the list is reversed at the end
+        const ping_log_index_entry_t *entries = (const ping_log_index_entry_t *)(index + 1);
+        for (uint32_t i = le32toh(index->count); i-- > 0;)
+        {
+            if (!block_selected(entries[i].address, le64toh(entries[i].min_time_us), le64toh(entries[i].max_time_us), options))
+            {
+                continue;
+            }
+            if (count == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 64;
+                if ((*offsets = realloc(*offsets, capacity * sizeof(uint64_t))) == NULL)
+                {
+                    perror("pinglog: realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            (*offsets)[count++] = le64toh(entries[i].offset);
+        }
+
+        uint64_t previous = le64toh(index->previous_offset);
+        if (previous >= index_offset)
+        {
+            free(*offsets);
+            return -1;
+        }
+        index_offset = previous;
+    }
+
+    for (long i = 0; i < count / 2; ++i)
+    {
+        uint64_t offset = (*offsets)[i];
+        (*offsets)[i] = (*offsets)[count - 1 - i];
+        (*offsets)[count - 1 - i] = offset;
+    }
+    return count;
+}
+
+// Tells if a whole block starts at an offset of the file.
+static bool valid_block(size_t size, uint64_t offset, const ping_log_block_t *block)
+{
+    return offset + sizeof(*block) <= size && le32toh(block->magic) == PING_LOG_BLOCK_MAGIC &&
+           offset + sizeof(*block) + le32toh(block->length) <= size;
+}
+
+// Reads the selected blocks of a log whose index is missing, as when ping was killed, by
+// following the record headers from the start of the file.
+static void scan_blocks(const uint8_t *file, size_t size, const options_t *options, totals_t *totals)
+{
+    uint64_t offset = sizeof(ping_log_header_t);
+    while (offset < size)
+    {
+        const ping_log_block_t *block = (const ping_log_block_t *)(file + offset);
+        const ping_log_index_t *index = (const ping_log_index_t *)(file + offset);
+        if (valid_block(size, offset, block))
+        {
+            if (block_selected(block->address, le64toh(block->min_time_us), le64toh(block->max_time_us), options))
+            {
+                read_block(block, options, totals);
+            }
+            offset += sizeof(*block) + le32toh(block->length);
+        }
+        else if (offset + sizeof(*index) <= size && le32toh(index->magic) == PING_LOG_INDEX_MAGIC)
+        {
+            offset += sizeof(*index) + (uint64_t)le32toh(index->count) * sizeof(ping_log_index_entry_t) + sizeof(ping_log_footer_t);
+        }
+        else
+        {
+            fprintf(stderr, "pinglog: %lu bytes cut in the middle of a record at the end\n", (unsigned long)(size - offset));
+            return;
+        }
+    }
+}
+
+// Parses a CLOCK_REALTIME time in seconds, fractional values allowed.
+// @return The time in microseconds.
+static uint64_t parse_time(const char *value)
+{
+    char *end;
+    double seconds = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || seconds < 0)
+    {
+        fprintf(stderr, "pinglog: invalid time '%s'\n", value);
+        exit(EXIT_FAILURE);
+    }
+    return seconds * 1000000;
+}
+
+// Prints the round trip times of a log written by ping --rtt-log, one line per sample:
+// the send time in seconds, the target and the round trip time in nanoseconds. Only the
+// blocks of the target and of the time range asked for are decoded.
+int main(int argc, char **argv)
+{
+    options_t options = {.filter_address = false, .from_us = 0, .until_us = UINT64_MAX, .summary = false};
+    int option;
+    while ((option = getopt(argc, argv, "a:f:u:s")) != -1)
+    {
+        if (option == 'a')
+        {
+            struct in_addr address;
+            if (inet_pton(AF_INET, optarg, &address) != 1)
+            {
+                fprintf(stderr, "pinglog: invalid address '%s'\n", optarg);
+                return (EXIT_FAILURE);
+            }
+            options.filter_address = true;
+            options.address = address.s_addr;
+        }
+        else if (option == 'f')
+            options.from_us = parse_time(optarg);
+        else if (option == 'u')
+            options.until_us = parse_time(optarg);
+        else if (option == 's')
+            options.summary = true;
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: pinglog [-a ADDRESS] [-f FROM] [-u UNTIL] [-s] FILE\n");
+        fprintf(stderr, "    -a ADDRESS     Only print the samples of the target ADDRESS\n");
+        fprintf(stderr, "    -f FROM        Only print the samples sent from FROM, in seconds since the epoch\n");
+        fprintf(stderr, "    -u UNTIL       Only print the samples sent before UNTIL, in seconds since the epoch\n");
+        fprintf(stderr, "    -s             Print the size of the selected samples instead\n");
+        return (EXIT_FAILURE);
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0)
+    {
+        perror("pinglog: open");
+        return (EXIT_FAILURE);
+    }
+    size_t size = file_stat.st_size;
+    const ping_log_header_t *header = NULL;
+    if (size >= sizeof(*header) && (header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        perror("pinglog: mmap");
+        return (EXIT_FAILURE);
+    }
+    close(fd);
+    if (header == NULL || le32toh(header->magic) != PING_LOG_MAGIC)
+    {
+        fprintf(stderr, "pinglog: not a ping rtt log\n");
+        return (EXIT_FAILURE);
+    }
+    if (le16toh(header->version) != PING_LOG_VERSION || le16toh(header->header_size) != sizeof(*header))
+    {
+        fprintf(stderr, "pinglog: unsupported log version %u\n", le16toh(header->version));
+        return (EXIT_FAILURE);
+    }
+
+    const uint8_t *file = (const uint8_t *)header;
+    totals_t totals = {0, 0, 0};
+    uint64_t *offsets;
+    long count = collect_indexed_blocks(file, size, &options, &offsets);
+    if (count < 0)
+    {
+        fprintf(stderr, "pinglog: no index at the end of the log, reading every block header\n");
+        scan_blocks(file, size, &options, &totals);
+    }
+    else
+    {
+        for (long i = 0; i < count; ++i)
+        {
+            const ping_log_block_t *block = (const ping_log_block_t *)(file + offsets[i]);
+            if (!valid_block(size, offsets[i], block))
+            {
+                fprintf(stderr, "pinglog: index points past a block\n");
+                return (EXIT_FAILURE);
+            }
+            read_block(block, &options, &totals);
+        }
+        free(offsets);
+    }
+
+    if (options.summary)
+    {
+        printf("%lu samples in %lu blocks, %lu bytes: %.2f bytes per sample, %.1fx smaller than %d-byte samples\n",
+               (unsigned long)totals.samples, (unsigned long)totals.blocks, (unsigned long)totals.compressed_bytes,
+               totals.samples ? (double)totals.compressed_bytes / totals.samples : 0.0,
+               totals.compressed_bytes ? (double)totals.samples * RAW_SAMPLE_SIZE / totals.compressed_bytes : 0.0,
+               RAW_SAMPLE_SIZE);
+    }
+    munmap((void *)header, size);
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,88 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ping_record.h"
+
+// Names of the record statuses
+static const char *status_names[] = {"reply", "reordered", "late", "duplicate", "error"};
+
+// Reads exactly one item, or nothing at the end of the stream.
+// @param buffer Where to read the item.
+// @param size The size of the item.
+// @param stream The stream.
+// @return 1 if the item was read, 0 at the end of the stream.
+static int read_item(void *buffer, size_t size, FILE *stream)
+{
+    size_t count = fread(buffer, size, 1, stream);
+    if (count == 0 && ferror(stream))
+    {
+        perror("pingread: fread");
+        exit(1);
+    }
+    return count;
+}
+
+// Prints the binary records written by ping --format=binary, one line per record.
+// Reads the file given as argument, or the standard input.
+int main(int argc, char **argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: pingread [FILE]\n");
+        return (EXIT_FAILURE);
+    }
+
+    FILE *stream = stdin;
+    if (argc == 2 && (stream = fopen(argv[1], "rb")) == NULL)
+    {
+        perror("pingread: fopen");
+        return (EXIT_FAILURE);
+    }
+
+    ping_record_header_t header;
+    if (!read_item(&header, sizeof(header), stream) || le32toh(header.magic) != PING_RECORD_MAGIC)
+    {
+        fprintf(stderr, "pingread: not a ping record stream\n");
+        return (EXIT_FAILURE);
+    }
+    if (le16toh(header.version) != PING_RECORD_VERSION || le16toh(header.record_size) != sizeof(ping_record_t))
+    {
+        fprintf(stderr, "pingread: unsupported record version %u\n", le16toh(header.version));
+        return (EXIT_FAILURE);
+    }
+
+    // Addresses of the targets, the records refer to them by index
+    uint32_t target_count = le32toh(header.target_count);
+    struct in_addr *addresses = malloc(target_count * sizeof(struct in_addr) + 1);
+    if (addresses == NULL)
+    {
+        perror("pingread: malloc");
+        return (EXIT_FAILURE);
+    }
+    if (target_count && !read_item(addresses, target_count * sizeof(struct in_addr), stream))
+    {
+        fprintf(stderr, "pingread: truncated target table\n");
+        return (EXIT_FAILURE);
+    }
+
+    ping_record_t record;
+    while (read_item(&record, sizeof(record), stream))
+    {
+        uint32_t target = le32toh(record.target);
+        if (target >= target_count || record.status > RECORD_ERROR)
+        {
+            fprintf(stderr, "pingread: corrupted record\n");
+            return (EXIT_FAILURE);
+        }
+        printf("%s seq=%u time=%.3f ms type=%u code=%u ttl=%u %s\n",
+               inet_ntoa(addresses[target]), le32toh(record.sequence), (double)le64toh(record.rtt_ns) / 1000000,
+               record.type, record.code, record.ttl, status_names[record.status]);
+    }
+
+    free(addresses);
+    if (stream != stdin)
+        fclose(stream);
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ping_shm.h"
+
+// Reads an entry whole: the entry is copied while its sequence is even and unchanged,
+// otherwise the copy is retried. Lock-free, a slow reader never delays ping.
+// @param entry The entry in the segment.
+// @param snapshot Where to copy the entry.
+static void read_entry(const ping_shm_entry_t *entry, ping_shm_entry_t *snapshot)
+{
+    uint32_t sequence;
+    do
+    {
+        sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+
+        snapshot->address = entry->address;
+        snapshot->update_time_ns = __atomic_load_n(&entry->update_time_ns, __ATOMIC_RELAXED);
+        snapshot->packets_sent = __atomic_load_n(&entry->packets_sent, __ATOMIC_RELAXED);
+        snapshot->packets_received = __atomic_load_n(&entry->packets_received, __ATOMIC_RELAXED);
+        snapshot->lost_probes = __atomic_load_n(&entry->lost_probes, __ATOMIC_RELAXED);
+        snapshot->late_replies = __atomic_load_n(&entry->late_replies, __ATOMIC_RELAXED);
+        snapshot->duplicate_replies = __atomic_load_n(&entry->duplicate_replies, __ATOMIC_RELAXED);
+        snapshot->reordered_replies = __atomic_load_n(&entry->reordered_replies, __ATOMIC_RELAXED);
+        snapshot->rtt_min_ns = __atomic_load_n(&entry->rtt_min_ns, __ATOMIC_RELAXED);
+        snapshot->rtt_max_ns = __atomic_load_n(&entry->rtt_max_ns, __ATOMIC_RELAXED);
+        snapshot->rtt_mean_ns = __atomic_load_n(&entry->rtt_mean_ns, __ATOMIC_RELAXED);
+        snapshot->rtt_stddev_ns = __atomic_load_n(&entry->rtt_stddev_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || sequence != __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED));
+}
+
+// Gives the current monotonic time, the clock of the update times.
+// @return The time in nanoseconds.
+static uint64_t monotonic_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Prints a snapshot of every target, one line each.
+// @param header The header of the segment.
+// @param entries The entries of the segment.
+static void print_snapshot(const ping_shm_header_t *header, const ping_shm_entry_t *entries)
+{
+    uint64_t now = monotonic_time();
+    printf("%-15s %10s %10s %8s %7s %9s %9s %9s %9s %8s\n",
+           "target", "sent", "received", "lost", "loss", "min ms", "avg ms", "max ms", "mdev ms", "age s");
+    for (uint32_t i = 0; i < header->target_count; ++i)
+    {
+        ping_shm_entry_t entry;
+        read_entry(&entries[i], &entry);
+
+        struct in_addr address = {.s_addr = entry.address};
+        uint64_t settled = entry.lost_probes + entry.packets_received;
+        printf("%-15s %10lu %10lu %8lu %6.2f%% %9.3f %9.3f %9.3f %9.3f",
+               inet_ntoa(address), entry.packets_sent, entry.packets_received, entry.lost_probes,
+               settled ? 100.0 * entry.lost_probes / settled : 0,
+               entry.rtt_min_ns / 1e6, entry.rtt_mean_ns / 1e6, entry.rtt_max_ns / 1e6, entry.rtt_stddev_ns / 1e6);
+        if (entry.update_time_ns)
+            printf(" %8.1f\n", (now - entry.update_time_ns) / 1e9);
+        else
+            printf(" %8s\n", "-");
+    }
+}
+
+// Prints the live statistics ping --shm NAME publishes, once or every INTERVAL seconds.
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3 || strchr(argv[1], '/'))
+    {
+        fprintf(stderr, "Usage: pingstat NAME [INTERVAL]\n");
+        return (EXIT_FAILURE);
+    }
+    double interval = argc == 3 ? atof(argv[2]) : 0;
+
+    char name[NAME_MAX + 1];
+    snprintf(name, sizeof(name), "/%s", argv[1]);
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        perror("pingstat: shm_open");
+        return (EXIT_FAILURE);
+    }
+    struct stat status;
+    if (fstat(fd, &status) < 0)
+    {
+        perror("pingstat: fstat");
+        return (EXIT_FAILURE);
+    }
+    if ((size_t)status.st_size < sizeof(ping_shm_header_t))
+    {
+        fprintf(stderr, "pingstat: not a ping statistics segment\n");
+        return (EXIT_FAILURE);
+    }
+    const ping_shm_header_t *header = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED)
+    {
+        perror("pingstat: mmap");
+        return (EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != PING_SHM_MAGIC)
+    {
+        fprintf(stderr, "pingstat: not a ping statistics segment\n");
+        return (EXIT_FAILURE);
+    }
+    if (header->version != PING_SHM_VERSION || header->entry_size != sizeof(ping_shm_entry_t) ||
+        (size_t)status.st_size < sizeof(ping_shm_header_t) + (size_t)header->target_count * sizeof(ping_shm_entry_t))
+    {
+        fprintf(stderr, "pingstat: unsupported statistics version %u\n", header->version);
+        return (EXIT_FAILURE);
+    }
+
+    const ping_shm_entry_t *entries = (const ping_shm_entry_t *)(header + 1);
+    print_snapshot(header, entries);
+    while (interval > 0)
+    {
+        usleep(interval * 1000000);
+        printf("\n");
+        print_snapshot(header, entries);
+    }
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+#include "ping.h"
+
+// Checks the streaming round trip time statistics of rtt_stats.c against the exact values
+// of generated distributions: the percentiles must be within the half-bucket precision
+// of the histogram, the maximum, mean and standard deviation exact.
+
+// Number of samples of each distribution
+#define SAMPLE_COUNT 1000000
+
+// Largest relative error of a percentile, half a bucket of 2^-RTT_PRECISION_BITS
+#define PERCENTILE_TOLERANCE (1.0 / (2 << RTT_PRECISION_BITS))
+
+// Deterministic generator, so that a failure can be reproduced (xorshift64*)
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+// Gives a random value in [0, 1).
+static double random_unit(void)
+{
+    return (next_random() >> 11) * (1.0 / (1ULL << 53));
+}
+
+// Round trip times spread evenly from 10 us to 10 ms
+static uint64_t uniform_rtt(void)
+{
+    return 10000 + next_random() % 9990000;
+}
+
+// A path at 2 ms with a slow tail: the product of uniform values skews towards the minimum
+static uint64_t long_tail_rtt(void)
+{
+    double tail = random_unit() * random_unit() * random_unit();
+    return 2000000 + (uint64_t)(tail * tail * 3e9);
+}
+
+// Two paths, at about 300 us and 80 ms
+static uint64_t bimodal_rtt(void)
+{
+    return next_random() % 4 ? 300000 + next_random() % 50000 : 80000000 + next_random() % 2000000;
+}
+
+// Loopback round trip times of a few tens of nanoseconds, in the linear buckets
+static uint64_t tiny_rtt(void)
+{
+    return 1 + next_random() % 200;
+}
+
+static int compare_rtt(const void *first, const void *second)
+{
+    uint64_t a = *(const uint64_t *)first;
+    uint64_t b = *(const uint64_t *)second;
+    return (a > b) - (a < b);
+}
+
+// Gives the exact percentile of sorted samples, with the nearest-rank method of rtt_percentile().
+// @param sorted The samples, in increasing order.
+// @param count The number of samples.
+// @param percentile The percentile, between 0 and 100.
+// @return The percentile in milliseconds.
+static double exact_percentile(const uint64_t *sorted, size_t count, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile / 100 * count);
+    rank += (double)rank < percentile / 100 * count;
+    rank = rank ? rank : 1;
+    return (double)sorted[rank - 1] / 1000000;
+}
+
+// Compares an estimate with the exact value, and prints both.
+// @param name The name of the value.
+// @param estimate The value read from the statistics.
+// @param exact The exact value.
+// @param tolerance The largest relative error accepted.
+// @return true if the estimate is close enough.
+static bool check_value(const char *name, double estimate, double exact, double tolerance)
+{
+    double error = exact ? (estimate - exact) / exact : estimate;
+    bool passed = error <= tolerance && -error <= tolerance;
+    printf("  %-6s %12.6f ms, exact %12.6f ms, error %+.4f%%%s\n", name, estimate, exact, error * 100,
+           passed ? "" : "  FAILED");
+    return passed;
+}
+
+// Records a generated distribution in two halves which are merged, as the summary of several
+// engines is, and compares its statistics with the exact ones of the sorted samples.
+// @param name The name of the distribution.
+// @param generate The generator of a round trip time.
+// @param samples Room for SAMPLE_COUNT samples.
+// @return true if every value is within its tolerance.
+static bool check_distribution(const char *name, uint64_t (*generate)(void), uint64_t *samples)
+{
+    static rtt_stats_t halves[2];
+    initialize_rtt_stats(&halves[0]);
+    initialize_rtt_stats(&halves[1]);
+    double sum = 0;
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i)
+    {
+        samples[i] = generate();
+        record_round_trip(&halves[i & 1], samples[i]);
+        sum += samples[i];
+    }
+    merge_rtt_stats(&halves[0], &halves[1]);
+    rtt_stats_t *stats = &halves[0];
+
+    // Exact statistics, with a second pass for the variance
+    qsort(samples, SAMPLE_COUNT, sizeof(*samples), compare_rtt);
+    double mean = sum / SAMPLE_COUNT;
+    double squares = 0;
+    for (size_t i = 0; i < SAMPLE_COUNT; ++i)
+    {
+        squares += (samples[i] - mean) * (samples[i] - mean);
+    }
+    double stddev = custom_sqrt(squares / (SAMPLE_COUNT - 1) / 1e12);
+
+    printf("%s, %d samples\n", name, SAMPLE_COUNT);
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    static const char *names[] = {"p50", "p90", "p99", "p99.9"};
+    bool passed = stats->count == SAMPLE_COUNT;
+    for (unsigned int i = 0; i < sizeof(percentiles) / sizeof(*percentiles); ++i)
+    {
+        passed &= check_value(names[i], rtt_percentile(stats, percentiles[i]),
+                              exact_percentile(samples, SAMPLE_COUNT, percentiles[i]), PERCENTILE_TOLERANCE);
+    }
+    passed &= check_value("max", (double)stats->max_ns / 1000000, (double)samples[SAMPLE_COUNT - 1] / 1000000, 0);
+    passed &= check_value("min", (double)stats->min_ns / 1000000, (double)samples[0] / 1000000, 0);
+    passed &= check_value("mean", stats->mean_ns / 1000000, mean / 1000000, 1e-9);
+    passed &= check_value("stddev", rtt_stddev(stats), stddev, 1e-6);
+    return passed;
+}
+
+int main(void)
+{
+    uint64_t *samples = malloc(SAMPLE_COUNT * sizeof(uint64_t));
+    if (samples == NULL)
+    {
+        perror("rttcheck: malloc");
+        return 1;
+    }
+
+    bool passed = check_distribution("uniform 10 us - 10 ms", uniform_rtt, samples);
+    passed &= check_distribution("2 ms with a tail to 3 s", long_tail_rtt, samples);
+    passed &= check_distribution("bimodal 300 us / 80 ms", bimodal_rtt, samples);
+    passed &= check_distribution("1 - 200 ns", tiny_rtt, samples);
+    free(samples);
+
+    printf(passed ? "percentiles within %.2f%% of the exact values\n" : "FAILED: percentiles off by more than %.2f%%\n",
+           PERCENTILE_TOLERANCE * 100);
+    return !passed;
+}
@@ -0,0 +1,290 @@
+#include "ping.h"
+
+// Checks the round trip time log of rtt_log.c against generated series: each one is written
+// with the encoder of ping, then decoded by pinglog through the block index, and every send
+// time and round trip time must come back exactly, in order, for each target and for a time
+// range; the log must also stay within a number of bytes per sample, headers and indexes
+// included. The last series is read again with its index cut off, as after a killed run.
+
+// Reader of the logs, built along with ping
+#define DEFAULT_PINGLOG "./pinglog"
+
+// Log written and read back by each check
+#define CHECK_LOG_PATH "rttlogcheck.log"
+
+// First send time of the series, in microseconds since the epoch
+#define START_TIME_US 1760000000000000UL
+
+// Targets of the multi-target series
+#define MAX_TARGETS 8
+
+// A sample as logged: the target, its send time and its round trip time
+typedef struct
+{
+    uint32_t target;
+    uint64_t time_us;
+    uint64_t rtt_ns;
+} sample_t;
+
+// A generated series: its samples, in the order they are logged
+typedef struct series
+{
+    const char *name;
+    sample_t *samples;
+    size_t count;
+    uint32_t target_count;
+    double max_bytes_per_sample;             // bound on the size of the log, headers and indexes included
+    void (*generate)(struct series *series); // fills the samples
+} series_t;
+
+// Deterministic generator, so that a failure can be reproduced (xorshift64*)
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+// One probe per millisecond, exactly, and a stable round trip time within 512 ns, as on a
+// quiet link: the send times take one bit each, the round trip times a short XOR window
+static void generate_regular(series_t *series)
+{
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        series->samples[i] = (sample_t){0, START_TIME_US + i * 1000, 40000 + next_random() % 512};
+    }
+}
+
+// One probe per millisecond sent up to 200 us late, and round trip times spread over 1 to
+// 5 ms, as on a loaded host and a busy path
+static void generate_jittered(series_t *series)
+{
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        series->samples[i] = (sample_t){0, START_TIME_US + i * 1000 + next_random() % 200, 1000000 + next_random() % 4000000};
+    }
+}
+
+// Bursts of probes a millisecond apart, separated by gaps of a second to several hours, as
+// across runs appended to the same log, and round trip times from nanoseconds to seconds:
+// every delta-of-delta class and every XOR window, and blocks ended by their time span
+static void generate_gappy(series_t *series)
+{
+    uint64_t time_us = START_TIME_US;
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        uint64_t choice = next_random() % 100;
+        if (choice < 2)
+            time_us += 1000000 * (1 + next_random() % 36000);
+        else if (choice < 10)
+            time_us += 1000000 + next_random() % 1000000;
+        else
+            time_us += 1000;
+        uint64_t rtt_ns = next_random() % 4 ? 200000 + next_random() % 100000 : next_random() >> (next_random() % 64 | 30);
+        series->samples[i] = (sample_t){0, time_us, rtt_ns};
+    }
+}
+
+// Targets probed in turn every 10 ms, each at its own distance, their samples interleaved
+// as the engines log them
+static void generate_multi_target(series_t *series)
+{
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        uint32_t target = i % series->target_count;
+        uint64_t round = i / series->target_count;
+        series->samples[i] = (sample_t){target, START_TIME_US + round * 10000 + target * 37,
+                                        (target + 1) * 1000000 + next_random() % (1000 << target)};
+    }
+}
+
+// Writes a series to a new log with the encoder of ping.
+// @param series The series.
+static void write_log(const series_t *series)
+{
+    static ping_target_t targets[MAX_TARGETS];
+    for (uint32_t i = 0; i < series->target_count; ++i)
+    {
+        targets[i].address.sin_family = AF_INET;
+        targets[i].address.sin_addr.s_addr = htonl(0x0a000001 + i);
+    }
+    global_ping.targets = targets;
+    global_ping.target_count = series->target_count;
+    global_ping.rtt_log_path = CHECK_LOG_PATH;
+
+    unlink(CHECK_LOG_PATH);
+    open_rtt_log();
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        log_sample(series->samples[i].target, series->samples[i].time_us, series->samples[i].rtt_ns);
+    }
+    close_rtt_log();
+    free(global_ping.rtt_series);
+    global_ping.rtt_series = NULL;
+}
+
+// Decodes the samples of a target with pinglog, within a time range, and compares them with
+// the samples of the series.
+// @param series The series.
+// @param target The target.
+// @param from_s The start of the range, in whole seconds, 0 for the whole log.
+// @param until_s The end of the range, excluded.
+// @return true if the samples come back exactly, in order.
+static bool check_decoded(const series_t *series, uint32_t target, uint64_t from_s, uint64_t until_s)
+{
+    const char *reader = getenv("PINGLOG") ? getenv("PINGLOG") : DEFAULT_PINGLOG;
+    char command[256];
+    struct in_addr address = {.s_addr = htonl(0x0a000001 + target)};
+    int length = snprintf(command, sizeof(command), "%s -a %s", reader, inet_ntoa(address));
+    if (from_s)
+    {
+        length += snprintf(command + length, sizeof(command) - length, " -f %lu -u %lu",
+                           (unsigned long)from_s, (unsigned long)until_s);
+    }
+    snprintf(command + length, sizeof(command) - length, " %s 2>/dev/null", CHECK_LOG_PATH);
+    FILE *output = popen(command, "r");
+    if (output == NULL)
+    {
+        perror("rttlogcheck: popen");
+        exit(1);
+    }
+
+    size_t next = 0;
+    size_t decoded = 0;
+    bool exact = true;
+    unsigned long seconds, microseconds, rtt_ns;
+    while (fscanf(output, "%lu.%lu %*s rtt_ns=%lu", &seconds, &microseconds, &rtt_ns) == 3)
+    {
+        // The next sample of the target within the range
+        while (next < series->count && (series->samples[next].target != target ||
+                                        (from_s && (series->samples[next].time_us < from_s * 1000000 ||
+                                                    series->samples[next].time_us >= until_s * 1000000))))
+        {
+            ++next;
+        }
+        uint64_t time_us = (uint64_t)seconds * 1000000 + microseconds;
+        if (exact && (next == series->count || series->samples[next].time_us != time_us || series->samples[next].rtt_ns != rtt_ns))
+        {
+            fprintf(stderr, "rttlogcheck: sample %zu of target %u decodes to %lu.%06lu rtt_ns=%lu\n",
+                    decoded, target, seconds, microseconds, rtt_ns);
+            exact = false;
+        }
+        ++next;
+        ++decoded;
+    }
+    if (pclose(output) != 0)
+    {
+        fprintf(stderr, "rttlogcheck: %s failed\n", command);
+        return false;
+    }
+
+    // No sample of the target within the range may be missing
+    size_t expected = 0;
+    for (size_t i = 0; i < series->count; ++i)
+    {
+        expected += series->samples[i].target == target &&
+                    (!from_s || (series->samples[i].time_us >= from_s * 1000000 && series->samples[i].time_us < until_s * 1000000));
+    }
+    if (decoded != expected)
+    {
+        fprintf(stderr, "rttlogcheck: %zu samples of target %u decoded, %zu logged\n", decoded, target, expected);
+        exact = false;
+    }
+    return exact;
+}
+
+// Writes a series, reads it back whole and within a range for every target, and checks
+// the size of the log.
+// @param series The series.
+// @return true if the series decodes exactly within its size bound.
+static bool check_series(series_t *series)
+{
+    write_log(series);
+    struct stat file_stat;
+    if (stat(CHECK_LOG_PATH, &file_stat) < 0)
+    {
+        perror("rttlogcheck: stat");
+        exit(1);
+    }
+
+    // A range starting and ending within the series, on whole seconds
+    uint64_t first_us = series->samples[0].time_us;
+    uint64_t last_us = series->samples[series->count - 1].time_us;
+    uint64_t from_s = (first_us + (last_us - first_us) / 3) / 1000000;
+    uint64_t until_s = (first_us + (last_us - first_us) * 2 / 3) / 1000000 + 1;
+
+    bool passed = true;
+    for (uint32_t target = 0; target < series->target_count; ++target)
+    {
+        passed &= check_decoded(series, target, 0, 0);
+        passed &= check_decoded(series, target, from_s, until_s);
+    }
+
+    double bytes_per_sample = (double)file_stat.st_size / series->count;
+    bool small_enough = bytes_per_sample <= series->max_bytes_per_sample;
+    printf("%-13s %8zu samples, %2u target%s, %9ld bytes, %5.2f bytes per sample (at most %.2f), %s%s\n",
+           series->name, series->count, series->target_count, series->target_count > 1 ? "s" : " ",
+           (long)file_stat.st_size, bytes_per_sample, series->max_bytes_per_sample,
+           passed ? "exact" : "NOT EXACT", small_enough ? "" : "  FAILED");
+    return passed && small_enough;
+}
+
+// Cuts the last index record and its footer off the log, as when ping is killed before
+// writing them, and checks that the blocks are still read exactly without the index.
+// @param series The series last written.
+// @return true if the series decodes exactly.
+static bool check_without_index(const series_t *series)
+{
+    int fd = open(CHECK_LOG_PATH, O_RDWR);
+    struct stat file_stat;
+    ping_log_footer_t footer;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 ||
+        pread(fd, &footer, sizeof(footer), file_stat.st_size - sizeof(footer)) != sizeof(footer) ||
+        ftruncate(fd, le64toh(footer.index_offset)) < 0)
+    {
+        perror("rttlogcheck: cutting the index");
+        exit(1);
+    }
+    close(fd);
+
+    bool passed = true;
+    for (uint32_t target = 0; target < series->target_count; ++target)
+    {
+        passed &= check_decoded(series, target, 0, 0);
+    }
+    printf("%-13s the last index cut off, %s\n", series->name, passed ? "exact" : "NOT EXACT");
+    return passed;
+}
+
+int main(void)
+{
+    series_t series[] = {
+        {"regular", NULL, 200000, 1, 2.0, generate_regular},
+        {"jittered", NULL, 200000, 1, 5.5, generate_jittered},
+        {"gappy", NULL, 200000, 1, 8.0, generate_gappy},
+        {"multi-target", NULL, 400000, MAX_TARGETS, 3.0, generate_multi_target}};
+    bool passed = true;
+    for (unsigned int i = 0; i < sizeof(series) / sizeof(*series); ++i)
+    {
+        series[i].samples = malloc(series[i].count * sizeof(sample_t));
+        if (series[i].samples == NULL)
+        {
+            perror("rttlogcheck: malloc");
+            return 1;
+        }
+        series[i].generate(&series[i]);
+        passed &= check_series(&series[i]);
+    }
+    passed &= check_without_index(&series[sizeof(series) / sizeof(*series) - 1]);
+    for (unsigned int i = 0; i < sizeof(series) / sizeof(*series); ++i)
+    {
+        free(series[i].samples);
+    }
+    unlink(CHECK_LOG_PATH);
+
+    printf(passed ? "every sample decodes exactly within its size bound\n" : "FAILED\n");
+    return !passed;
+}
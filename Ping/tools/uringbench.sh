@@ -0,0 +1,45 @@
+#!/bin/bash
+# Compares the io_uring backend (--io-uring) with the default epoll, sendmmsg() and
+# recvmmsg() path, on the same workloads, a few runs each to show the run-to-run noise:
+# a flood of one target, and many targets at a fixed rate.
+# Reports the replies per second, the CPU time per reply and the p99 round trip time.
+#
+# Usage: uringbench.sh [RUNS]   (as root, from the Ping directory)
+
+PING=${PING:-./ping}
+RUNS=${1:-3}
+FLOOD_COUNT=100000
+TARGET_COUNT=5000
+
+TIMEFORMAT='%R %U %S'
+
+# Runs ping once and prints a line of results.
+# $1: the name of the workload, $2: the number of replies expected, then the ping arguments
+run() {
+	local name=$1 expected=$2
+	shift 2
+	local output times
+	output=$(mktemp)
+	times=$( { time "$PING" "$@" >"$output" 2>/dev/null; } 2>&1)
+	local received p99
+	received=$(sed -n 's/.* transmitted, \([0-9]*\) packets received.*/\1/p' "$output" | tail -n 1)
+	p99=$(sed -n 's/^round-trip p50\/p90\/p99\/p99.9 = [^/]*\/[^/]*\/\([^/]*\)\/.*/\1/p' "$output" | tail -n 1)
+	rm -f "$output"
+	echo "$times ${received:-0} $expected" | awk -v name="$name" -v p99="${p99:-?}" '{
+		printf "%-26s %9.0f replies/s %7.2f us CPU/reply  p99 %s ms  (%d/%d replies)\n",
+			name, $4 / $1, ($2 + $3) * 1e6 / ($4 ? $4 : 1), p99, $4, $5 }'
+}
+
+targets=$(mktemp)
+for ((i = 0; i < TARGET_COUNT; ++i)); do
+	echo "127.1.$((i / 250)).$((i % 250 + 1))"
+done >"$targets"
+
+for ((r = 1; r <= RUNS; ++r)); do
+	echo "run $r"
+	run "flood, epoll" "$FLOOD_COUNT" -f -q -c "$FLOOD_COUNT" 127.0.0.1
+	run "flood, io_uring" "$FLOOD_COUNT" -f -q -c "$FLOOD_COUNT" --io-uring 127.0.0.1
+	run "$TARGET_COUNT targets, epoll" $((TARGET_COUNT * 3)) -q -c 3 --rate 50000 --targets "$targets"
+	run "$TARGET_COUNT targets, io_uring" $((TARGET_COUNT * 3)) -q -c 3 --rate 50000 --io-uring --targets "$targets"
+done
+rm -f "$targets"
@@ -0,0 +1,65 @@
+#!/bin/bash
+# Counts how often idle pingers wake up while another one floods the host with ICMP.
+# Without the reply filter, every raw ICMP socket gets a copy of each packet of the flood;
+# with it, or with datagram sockets, an idle pinger only wakes up for its own probe.
+#
+# Usage: wakeupbench.sh [INSTANCES] [SECONDS]   (as root, from the Ping directory)
+# PING_UNFILTERED names a build without the reply filter (make bench_wakeups builds one),
+# measured too when set.
+
+PING=${PING:-./ping}
+INSTANCES=${1:-20}
+DURATION=${2:-5}
+
+# Voluntary context switches of a process, summed over its threads
+context_switches() {
+	cat /proc/"$1"/task/*/status 2>/dev/null | awk '/^voluntary_ctxt_switches/ { sum += $2 } END { print sum + 0 }'
+}
+
+# Runs idle instances of a build with the given backend options next to a flood
+measure() {
+	local name=$1 ping=$2
+	shift 2
+	local pids=() before=() i
+
+	for ((i = 0; i < INSTANCES; ++i)); do
+		"$ping" "$@" -q -i 1 127.0.0.1 >/dev/null 2>&1 &
+		pids+=($!)
+	done
+	sleep 1
+	for pid in "${pids[@]}"; do
+		before+=("$(context_switches "$pid")")
+	done
+
+	local flood_output
+	flood_output=$(mktemp)
+	"$ping" "$@" -f -q 127.0.0.2 >"$flood_output" 2>&1 &
+	local flood=$!
+	sleep "$DURATION"
+	kill -INT "$flood"
+	wait "$flood"
+
+	local total=0
+	for ((i = 0; i < INSTANCES; ++i)); do
+		total=$((total + $(context_switches "${pids[$i]}") - before[i]))
+	done
+	kill -INT "${pids[@]}"
+	wait "${pids[@]}" 2>/dev/null
+
+	local received
+	received=$(sed -n 's/.* transmitted, \([0-9]*\) packets received.*/\1/p' "$flood_output")
+	rm -f "$flood_output"
+	printf "%-10s flood %8d replies/s   idle instance %8.1f wakeups/s\n" "$name" \
+		$((${received:-0} / DURATION)) "$(echo "$total $INSTANCES $DURATION" | awk '{ print $1 / $2 / $3 }')"
+}
+
+echo "$INSTANCES idle instances at -i 1 on 127.0.0.1, a flood of 127.0.0.2 for $DURATION s"
+if [ -n "$PING_UNFILTERED" ]; then
+	measure unfiltered "$PING_UNFILTERED"
+fi
+measure raw "$PING"
+if "$PING" --datagram -c 1 -q 127.0.0.1 >/dev/null 2>&1; then
+	measure datagram "$PING" --datagram
+else
+	echo "datagram   skipped, net.ipv4.ping_group_range does not allow ICMP datagram sockets"
+fi
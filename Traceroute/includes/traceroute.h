@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -13,12 +14,43 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "icmphdr.h"
 
 #define PACKET_SIZE 40
 #define PACKET_DATA_SIZE (PACKET_SIZE - sizeof(struct icmphdr))
 #define RECV_BUFSIZE 1024
+#define RECV_TIMEOUT_SEC 1
+
+// Limits of the options, bounding the probes of a trace
+#define MAX_HOPS 255
+#define MAX_PROBES_PER_TTL 10
+
+// Parallel trace: probes leave in batches of mixed TTLs, one sendmmsg() each
+#define SEND_BATCH_SIZE 128
+
+// Parallel trace: software timestamps of the probes as they leave, keyed by send order,
+// and of their answers as they reach the stack
+#define TRANSMIT_TIMESTAMPS (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
+#define RECEIVE_TIMESTAMPS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE)
+#define TIMESTAMP_DELAY_US 1000
+
+// io_uring backend: a probe is a chain of a send, a receive and a timeout
+#define URING_ENTRIES 8
+#define URING_CHAIN_LENGTH 3
+#define URING_SEND 0
+#define URING_RECEIVE 1
+#define URING_TIMEOUT 2
 
 // Default values for options
 #define DEBUG false
@@ -26,6 +58,10 @@
 #define DEFAULT_MAX_TTL 30
 #define DEFAULT_PROBES_PER_TTL 3
 #define DEFAULT_PACKET_TYPE 8
+#define PARALLEL false
+#define DEFAULT_METHOD IPPROTO_ICMP
+#define DEFAULT_UDP_PORT 33434
+#define DEFAULT_TCP_PORT 80
 
 typedef struct
 {
@@ -35,18 +71,67 @@ typedef struct
 	unsigned long max_ttl;		  // the maximum time-to-live value for packets
 	unsigned long probes_per_ttl; // the number of probes sent per time-to-live value
 	unsigned long packet_type;	  // the type of ICMP packet to send
+	int parallel;				  // flag to send the probes of all hops at once
+	int method;					  // the protocol of the probes: ICMP, UDP or TCP
+	unsigned long port;			  // the first UDP destination port, or the TCP destination port
 } traceroute_options;
 
+// A probe of a parallel trace, and the answer it got
+typedef struct
+{
+	struct timespec sent;		// when the probe left, on CLOCK_REALTIME
+	struct timespec received;	// when its answer reached the stack, on CLOCK_REALTIME
+	struct sockaddr_in from;	// the host that answered
+	unsigned char type;			// the ICMP type of the answer, 0 for a TCP answer
+	unsigned char code;			// the ICMP code of the answer
+	bool answered;				// whether an answer came before the deadline
+	bool reached;				// whether the answer ends the trace
+} traceroute_probe;
+
+// The sockets of a parallel trace, besides the ICMP socket receiving the errors
+typedef struct
+{
+	int send_sock;				// sends the probes, the ICMP socket for ICMP probes
+	int tcp_sock;				// receives the answers of TCP probes, -1 otherwise
+	int port_sock;				// holds the source port of TCP probes, -1 otherwise
+	struct sockaddr_in source;	// the source address and port of the probes
+} traceroute_prober;
+
+// An io_uring instance, driven with the raw system calls
+typedef struct
+{
+	int fd;							// io_uring file descriptor
+	unsigned int *sq_tail;			// submission queue, shared with the kernel
+	unsigned int sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;			// completion queue, shared with the kernel
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+} traceroute_uring;
+
 // Traceroute
 void parse_options(int argc, char **argv, traceroute_options *options);
 struct addrinfo *resolve_address(char *target_host);
 int create_socket(struct addrinfo *addr, traceroute_options *options);
+size_t probe_length(const traceroute_options *options);
+void open_prober(int sock, struct addrinfo *addr, const traceroute_options *options, traceroute_prober *prober);
+void close_prober(int sock, traceroute_prober *prober);
+void create_packet(icmphdr_t *packet, const traceroute_options *options, unsigned short sequence);
 void trace_route(int sock, struct addrinfo *addr, const traceroute_options *options);
 
+// Parallel trace
+void trace_route_parallel(int sock, struct addrinfo *addr, const traceroute_options *options);
+
+// io_uring
+bool open_io_uring(traceroute_uring *uring);
+ssize_t probe_io_uring(traceroute_uring *uring, int sock, struct msghdr *probe, struct msghdr *answer, struct __kernel_timespec *timeout);
+
 // Print utils
 void print_help_text();
 void handle_error(const char *error);
-void print_trace_header(const char *target_host, const char *target_ip, unsigned long max_ttl);
+void print_trace_header(const char *target_host, const char *target_ip, unsigned long max_ttl, size_t packet_size);
 
 // Utilities functions
 struct timeval get_current_time();
@@ -0,0 +1,139 @@
+#include "traceroute.h"
+
+// Maps a region of the io_uring instance.
+// @param fd the io_uring file descriptor
+// @param size the size of the region
+// @param offset the offset identifying the region
+// @return the mapped region, or NULL if the mapping fails
+static void *map_io_uring(int fd, size_t size, off_t offset)
+{
+	void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return region == MAP_FAILED ? NULL : region;
+}
+
+// Sets up an io_uring instance, if the kernel supports it.
+// Probes are then sent and received with a single system call each.
+// @param uring the io_uring instance to set up
+// @return true on success, false if the kernel does not support io_uring
+bool open_io_uring(traceroute_uring *uring)
+{
+	// Completions are posted within io_uring_enter(), older kernels post them from task work
+	struct io_uring_params params = {.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN};
+	uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (uring->fd < 0 && errno == EINVAL)
+	{
+		memset(&params, 0, sizeof(params));
+		uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	}
+	if (uring->fd < 0)
+	{
+		return false;
+	}
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(uring->fd);
+		return false;
+	}
+
+	// The submission and completion queues share one mapping
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	char *rings = map_io_uring(uring->fd, sq_size > cq_size ? sq_size : cq_size, IORING_OFF_SQ_RING);
+	uring->sqes = map_io_uring(uring->fd, params.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+	if (rings == NULL || uring->sqes == NULL)
+	{
+		close(uring->fd);
+		return false;
+	}
+	uring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+	uring->sq_mask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)(rings + params.sq_off.array);
+	uring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+	uring->cq_mask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	return true;
+}
+
+// Queues a submission queue entry, cleared.
+// @param uring the io_uring instance
+// @return the entry, submitted with the next io_uring_enter()
+static struct io_uring_sqe *queue_sqe(traceroute_uring *uring)
+{
+	unsigned int tail = *uring->sq_tail;
+	unsigned int index = tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Sends a probe and waits for the answer with a single system call: the send, the
+// receive and a timeout are submitted as a linked chain. The timeout cancels the
+// receive when no answer comes in time, and a failed send cancels both.
+// @param uring the io_uring instance
+// @param sock the raw socket
+// @param probe the message holding the probe and its destination
+// @param answer the message receiving the answer and its source
+// @param timeout the time to wait for the answer
+// @return the size of the answer, or -1 if none came in time
+ssize_t probe_io_uring(traceroute_uring *uring, int sock, struct msghdr *probe, struct msghdr *answer, struct __kernel_timespec *timeout)
+{
+	struct io_uring_sqe *sqe = queue_sqe(uring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t)probe;
+	sqe->len = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = URING_SEND;
+
+	sqe = queue_sqe(uring);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sock;
+	sqe->addr = (uintptr_t)answer;
+	sqe->len = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = URING_RECEIVE;
+
+	sqe = queue_sqe(uring);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (uintptr_t)timeout;
+	sqe->len = 1;
+	sqe->user_data = URING_TIMEOUT;
+
+	// Every entry of the chain completes, successfully or cancelled
+	unsigned int completed = 0;
+	int results[URING_CHAIN_LENGTH];
+	unsigned int to_submit = URING_CHAIN_LENGTH;
+	while (completed < URING_CHAIN_LENGTH)
+	{
+		if (syscall(__NR_io_uring_enter, uring->fd, to_submit, URING_CHAIN_LENGTH - completed, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			perror("traceroute: io_uring_enter");
+			exit(EXIT_FAILURE);
+		}
+		to_submit = 0;
+
+		unsigned int head = *uring->cq_head;
+		unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head, ++completed)
+		{
+			struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+			results[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (results[URING_SEND] < 0)
+	{
+		errno = -results[URING_SEND];
+		perror("traceroute: sendmsg");
+		exit(EXIT_FAILURE);
+	}
+	return results[URING_RECEIVE] < 0 ? -1 : results[URING_RECEIVE];
+}
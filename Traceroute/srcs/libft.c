@@ -35,25 +35,47 @@ unsigned short swap_endianess_16(unsigned short value)
 }
 
 // Calculates the checksum of a given data buffer using the Internet checksum algorithm.
+// The one's complement sum does not depend on the word size it is computed with (RFC 1071),
+// so the data is summed 64 bits at a time, as two 32-bit halves accumulated in 64 bits
+// which cannot overflow, and only folded to 16 bits at the end.
 // @param data_ptr: pointer to the start of the data buffer
 // @param data_size: size of the data buffer
 // @return the calculated checksum as an unsigned short
 uint16_t calculate_checksum(void *data_ptr, size_t data_size)
 {
-    uint16_t *data = data_ptr;
+    const uint8_t *data = data_ptr;
     uint64_t sum = 0;
 
-    // Sum up the uint16_t values in the data block
-    while (data_size >= sizeof(*data))
+    // Sum up the 64-bit words in the data block, with four independent accumulators
+    uint64_t partial_sums[4] = {0};
+    while (data_size >= 4 * sizeof(uint64_t))
     {
-        sum += *data++;
-        data_size -= sizeof(*data);
+        for (int i = 0; i < 4; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, data + i * sizeof(word), sizeof(word));
+            partial_sums[i] += (word & 0xffffffff) + (word >> 32);
+        }
+        data += 4 * sizeof(uint64_t);
+        data_size -= 4 * sizeof(uint64_t);
+    }
+    sum = (partial_sums[0] & 0xffffffff) + (partial_sums[0] >> 32) + (partial_sums[1] & 0xffffffff) + (partial_sums[1] >> 32) +
+          (partial_sums[2] & 0xffffffff) + (partial_sums[2] >> 32) + (partial_sums[3] & 0xffffffff) + (partial_sums[3] >> 32);
+
+    // Sum up the remaining uint16_t values
+    while (data_size >= sizeof(uint16_t))
+    {
+        uint16_t word;
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        data += sizeof(word);
+        data_size -= sizeof(word);
     }
 
     // If there is any remaining data, add it to the sum as a uint8_t value
     if (data_size)
     {
-        sum += *(uint8_t *)data;
+        sum += *data;
     }
 
     // Fold the sum into a 16-bit value
@@ -9,7 +9,10 @@ int main(int argc, char **argv)
         .first_ttl = DEFAULT_FIRST_TTL,
         .max_ttl = DEFAULT_MAX_TTL,
         .probes_per_ttl = DEFAULT_PROBES_PER_TTL,
-        .packet_type = DEFAULT_PACKET_TYPE
+        .packet_type = DEFAULT_PACKET_TYPE,
+        .parallel = PARALLEL,
+        .method = DEFAULT_METHOD,
+        .port = 0
     };
 
     // Parse command line arguments
@@ -26,10 +29,17 @@ int main(int argc, char **argv)
     inet_ntop(addr->ai_family, &((struct sockaddr_in *)addr->ai_addr)->sin_addr, hostip_s, INET6_ADDRSTRLEN);
 
     // Print the trace header
-    print_trace_header(options.target_host, hostip_s, options.max_ttl);
-
-    // Start the trace route
-    trace_route(sock, addr, &options);
+    print_trace_header(options.target_host, hostip_s, options.max_ttl, probe_length(&options) + sizeof(struct ip));
+
+    // Start the trace route, probing all hops at once with -P
+    if (options.parallel)
+    {
+        trace_route_parallel(sock, addr, &options);
+    }
+    else
+    {
+        trace_route(sock, addr, &options);
+    }
 
     // Clean up
     freeaddrinfo(addr);
@@ -24,6 +24,66 @@ struct addrinfo *resolve_address(char *target_host)
 	return addr;
 }
 
+// Number of instructions of the reply filter
+#define REPLY_FILTER_LENGTH 22
+
+// Attaches a classic BPF program to the raw socket, so that the kernel only queues the
+// echo replies carrying our id and the ICMP errors quoting one of our probes: an echo request
+// with our id, or a UDP or TCP segment from our source port.
+// Without it, any ICMP packet reaching the host would be taken for the answer of a hop.
+// @param sock the raw socket
+// @param method the protocol of the probes
+// @param port the source port of UDP and TCP probes
+static void attach_reply_filter(int sock, int method, unsigned short port)
+{
+	// The quoted header starts with the echo type and has the id at offset 4, or starts with the source port
+	bool icmp = method == IPPROTO_ICMP;
+	unsigned int first_byte = icmp ? ICMP_ECHO : port >> 8;
+	unsigned int key_offset = icmp ? offsetof(icmphdr_t, un.echo.id) : 0;
+	unsigned int key = icmp ? (getpid() & 0xffff) : port;
+
+	struct sock_filter code[REPLY_FILTER_LENGTH] = {
+		// X = length of the IP header, A = ICMP type
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+
+		// Echo replies have their id checked, errors the probe they quote, the rest is dropped
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, icmp ? 15 : 18, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 4, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_SOURCE_QUENCH, 3, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_REDIRECT, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_PARAMETERPROB, 0, 13),
+
+		// The error quotes an IP header carrying our protocol, X = offset of the quoted header after it
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, sizeof(icmphdr_t) + offsetof(struct ip, ip_p)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, method, 0, 11),
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, sizeof(icmphdr_t)),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf),
+		BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, sizeof(icmphdr_t)),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+
+		// The quoted packet is an echo request, or comes from our port
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, first_byte, 0, 3),
+
+		// The echo id or the source port is ours, loads past the end of the packet drop it too
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, key_offset),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, key, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog program = {.len = REPLY_FILTER_LENGTH, .filter = code};
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0)
+	{
+		perror("traceroute: setsockopt SO_ATTACH_FILTER");
+		exit(EXIT_FAILURE);
+	}
+}
+
 // Creates a raw socket for sending and receiving ICMP packets.
 // @param addr a pointer to the addrinfo structure containing the destination IP address and port
 // @param options a pointer to the traceroute_options struct containing program options
@@ -38,8 +98,11 @@ int create_socket(struct addrinfo *addr, traceroute_options *options)
 		exit(EXIT_FAILURE);
 	}
 
+	// Only wake up for the answers to our own probes
+	attach_reply_filter(sock, IPPROTO_ICMP, 0);
+
 	// Set socket timeout for receiving packets
-	struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+	struct timeval timeout = {.tv_sec = RECV_TIMEOUT_SEC, .tv_usec = 0};
 	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0)
 	{
 		perror("traceroute: setsockopt SO_RCVTIMEO");
@@ -55,3 +118,154 @@ int create_socket(struct addrinfo *addr, traceroute_options *options)
 
 	return sock;
 }
+
+// Gives the length of the probes of a method, without the IP header.
+// @param options the traceroute options, giving the method
+// @return the length of the ICMP or UDP packet, or of the TCP header
+size_t probe_length(const traceroute_options *options)
+{
+	return options->method == IPPROTO_TCP ? sizeof(struct tcphdr) : PACKET_SIZE;
+}
+
+// Number of instructions of the TCP answer filter
+#define TCP_FILTER_LENGTH 5
+
+// Attaches a classic BPF program to the raw TCP socket, so that the kernel only queues the
+// segments sent to our source port, out of all the TCP traffic of the host.
+// @param sock the raw TCP socket
+// @param port the source port of the probes
+static void attach_tcp_filter(int sock, unsigned short port)
+{
+	struct sock_filter code[TCP_FILTER_LENGTH] = {
+		// X = length of the IP header, A = destination port
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct tcphdr, th_dport)),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog program = {.len = TCP_FILTER_LENGTH, .filter = code};
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0)
+	{
+		perror("traceroute: setsockopt SO_ATTACH_FILTER");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Opens a socket, exiting on failure.
+// @param type the type of the socket
+// @param protocol the protocol of the socket
+// @return the file descriptor of the socket
+static int open_socket(int type, int protocol)
+{
+	int sock = socket(AF_INET, type, protocol);
+	if (sock < 0)
+	{
+		perror("traceroute: could not create socket");
+		exit(EXIT_FAILURE);
+	}
+	return sock;
+}
+
+// Binds a socket to an address, and gives the port the kernel picked if it was 0.
+// @param sock the socket
+// @param address the address, updated with the port
+static void bind_socket(int sock, struct sockaddr_in *address)
+{
+	socklen_t length = sizeof(*address);
+	if (bind(sock, (struct sockaddr *)address, length) < 0 || getsockname(sock, (struct sockaddr *)address, &length) < 0)
+	{
+		perror("traceroute: bind");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Asks the kernel to timestamp packets in software on a socket, on CLOCK_REALTIME. Transmit
+// timestamps are queued on the error queue, keyed by the send order of the packets, receive
+// timestamps come with each packet as a control message. The trace falls back to the times
+// read in user space when the kernel refuses.
+// @param sock the socket
+// @param flags the timestamps to take, TRANSMIT_TIMESTAMPS and RECEIVE_TIMESTAMPS
+static void enable_timestamps(int sock, int flags)
+{
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+	{
+		perror("traceroute: setsockopt SO_TIMESTAMPING, using user-space timestamps");
+	}
+}
+
+// Opens the sockets sending the probes of a parallel trace and receiving their answers.
+// ICMP probes leave from the ICMP socket. UDP probes leave from a UDP socket, whose port the
+// ICMP errors are then filtered on. TCP probes are SYN segments crafted on a raw TCP socket,
+// which also receives the SYN-ACK or RST of the destination: their source port is held by
+// a TCP socket which is never connected, so that the kernel resets the connections answered.
+// @param sock the ICMP socket
+// @param addr the destination
+// @param options the traceroute options, giving the method
+// @param prober filled with the sockets
+void open_prober(int sock, struct addrinfo *addr, const traceroute_options *options, traceroute_prober *prober)
+{
+	prober->send_sock = sock;
+	prober->tcp_sock = -1;
+	prober->port_sock = -1;
+	prober->source = (struct sockaddr_in){.sin_family = AF_INET};
+
+	if (options->method == IPPROTO_UDP)
+	{
+		prober->send_sock = open_socket(SOCK_DGRAM, IPPROTO_UDP);
+		bind_socket(prober->send_sock, &prober->source);
+	}
+	else if (options->method == IPPROTO_TCP)
+	{
+		// The TCP checksum covers the source address, the one of the route to the destination
+		int route_sock = open_socket(SOCK_DGRAM, IPPROTO_UDP);
+		socklen_t length = sizeof(prober->source);
+		if (connect(route_sock, addr->ai_addr, addr->ai_addrlen) < 0 ||
+			getsockname(route_sock, (struct sockaddr *)&prober->source, &length) < 0)
+		{
+			perror("traceroute: connect");
+			exit(EXIT_FAILURE);
+		}
+		close(route_sock);
+
+		prober->source.sin_port = 0;
+		prober->port_sock = open_socket(SOCK_STREAM, IPPROTO_TCP);
+		bind_socket(prober->port_sock, &prober->source);
+		prober->tcp_sock = open_socket(SOCK_RAW, IPPROTO_TCP);
+		attach_tcp_filter(prober->tcp_sock, ntohs(prober->source.sin_port));
+		prober->send_sock = prober->tcp_sock;
+	}
+
+	// The ICMP errors quote the probes of the method
+	if (options->method != IPPROTO_ICMP)
+	{
+		attach_reply_filter(sock, options->method, ntohs(prober->source.sin_port));
+	}
+
+	// The probes are timestamped as they leave, the answers as they reach the stack
+	enable_timestamps(prober->send_sock, TRANSMIT_TIMESTAMPS | RECEIVE_TIMESTAMPS);
+	if (sock != prober->send_sock)
+	{
+		enable_timestamps(sock, RECEIVE_TIMESTAMPS);
+	}
+
+	// The kernel turns receive timestamps on from a work queue, the first answers would come
+	// without them if the probes left at once
+	usleep(TIMESTAMP_DELAY_US);
+}
+
+// Closes the sockets opened for a parallel trace, the ICMP socket is left open.
+// @param sock the ICMP socket
+// @param prober the sockets
+void close_prober(int sock, traceroute_prober *prober)
+{
+	if (prober->send_sock != sock)
+	{
+		close(prober->send_sock);
+	}
+	if (prober->port_sock >= 0)
+	{
+		close(prober->port_sock);
+	}
+}
@@ -0,0 +1,526 @@
+#define _GNU_SOURCE
+
+#include "traceroute.h"
+
+// Number of bytes of the probe an ICMP error quotes at least, after its IP header
+#define QUOTED_LENGTH 8
+
+// Room for the timestamps and the extended error describing a transmit timestamp
+#define TRANSMIT_CONTROL_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in)))
+
+// Reads the wall clock, the one of the kernel timestamps.
+// @return the time
+static struct timespec get_real_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now;
+}
+
+// Finds the software timestamp among the control messages of a packet.
+// @param msg the message header filled by recvmsg()
+// @param time filled with the timestamp
+// @return true if the kernel gave one
+static bool find_timestamp(struct msghdr *msg, struct timespec *time)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            *time = ((struct scm_timestamping *)CMSG_DATA(cmsg))->ts[0];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drains the transmit timestamps of the probes from the error queue of the sending socket.
+// The kernel keys them in send order, the key of a probe is its index.
+// @param sock the socket sending the probes
+// @param probes the probes, their send time replaced with the one of the kernel
+// @param probe_count the number of probes
+static void receive_send_times(int sock, traceroute_probe *probes, unsigned long probe_count)
+{
+    char control[TRANSMIT_CONTROL_SIZE];
+    struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+
+    while (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+    {
+        struct timespec sent;
+        const struct sock_extended_err *error = NULL;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+            {
+                error = (const struct sock_extended_err *)CMSG_DATA(cmsg);
+            }
+        }
+        if (error != NULL && error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && error->ee_data < probe_count &&
+            find_timestamp(&msg, &sent))
+        {
+            probes[error->ee_data].sent = sent;
+        }
+        msg.msg_controllen = sizeof(control);
+    }
+}
+
+// Gives the TCP sequence of the first probe, the probes that follow count up from it.
+// @return the sequence number
+static uint32_t tcp_sequence_base(void)
+{
+    return (uint32_t)(getpid() & 0xffff) << 16;
+}
+
+// Builds a TCP SYN segment, its checksum covering the source and destination addresses.
+// @param segment the segment to fill
+// @param sequence the sequence number of the segment
+// @param options the traceroute options, giving the destination port
+// @param prober the sockets, giving the source address and port
+// @param destination the destination
+static void create_syn(struct tcphdr *segment, uint32_t sequence, const traceroute_options *options, const traceroute_prober *prober, const struct sockaddr_in *destination)
+{
+    struct
+    {
+        uint32_t source;
+        uint32_t destination;
+        uint8_t zero;
+        uint8_t protocol;
+        uint16_t length;
+        struct tcphdr segment;
+    } pseudo = {
+        .source = prober->source.sin_addr.s_addr,
+        .destination = destination->sin_addr.s_addr,
+        .protocol = IPPROTO_TCP,
+        .length = htons(sizeof(struct tcphdr)),
+        .segment = {
+            .th_sport = prober->source.sin_port,
+            .th_dport = htons(options->port),
+            .th_seq = htonl(sequence),
+            .th_off = sizeof(struct tcphdr) / 4,
+            .th_flags = TH_SYN,
+            .th_win = htons(UINT16_MAX),
+        },
+    };
+    pseudo.segment.th_sum = calculate_checksum(&pseudo, sizeof(pseudo));
+    *segment = pseudo.segment;
+}
+
+// Builds the probe of an index. ICMP probes carry the index as echo sequence, UDP probes
+// go to the first port plus the index, and TCP probes carry it in their sequence number.
+// @param packet the packet to fill
+// @param name filled with the address the probe is sent to
+// @param index the index of the probe
+// @param addr the destination
+// @param options the traceroute options
+// @param prober the sockets
+// @return the length of the probe
+static size_t create_probe(char *packet, struct sockaddr_in *name, unsigned long index, struct addrinfo *addr, const traceroute_options *options, const traceroute_prober *prober)
+{
+    *name = *(struct sockaddr_in *)addr->ai_addr;
+    if (options->method == IPPROTO_UDP)
+    {
+        // The kernel adds the UDP header
+        name->sin_port = htons(options->port + index);
+        for (unsigned long i = 0; i < PACKET_SIZE - sizeof(struct udphdr); ++i)
+        {
+            packet[i] = 'a' + i % 26;
+        }
+        return PACKET_SIZE - sizeof(struct udphdr);
+    }
+    if (options->method == IPPROTO_TCP)
+    {
+        create_syn((struct tcphdr *)packet, tcp_sequence_base() + index, options, prober, name);
+        return sizeof(struct tcphdr);
+    }
+    create_packet((icmphdr_t *)packet, options, index);
+    return PACKET_SIZE;
+}
+
+// Sends the probes of all hops back to back, in batches of one sendmmsg() each. The TTL of
+// every probe is given by an IP_TTL control message, so a batch mixes the probes of many hops;
+// the hop of a probe is its index divided by the number of probes per hop.
+// @param prober the sockets
+// @param addr the destination
+// @param options the traceroute options
+// @param probes the probes, timestamped as they are sent: before their sendmmsg() call, then
+// by the kernel as they leave
+// @param probe_count the number of probes
+static void send_all_probes(const traceroute_prober *prober, struct addrinfo *addr, const traceroute_options *options, traceroute_probe *probes, unsigned long probe_count)
+{
+    char packets[SEND_BATCH_SIZE][PACKET_SIZE];
+    struct sockaddr_in names[SEND_BATCH_SIZE];
+    struct iovec iovs[SEND_BATCH_SIZE];
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } controls[SEND_BATCH_SIZE];
+    struct mmsghdr messages[SEND_BATCH_SIZE];
+
+    for (unsigned long first = 0; first < probe_count; first += SEND_BATCH_SIZE)
+    {
+        unsigned long batch = probe_count - first < SEND_BATCH_SIZE ? probe_count - first : SEND_BATCH_SIZE;
+        for (unsigned long i = 0; i < batch; ++i)
+        {
+            unsigned long index = first + i;
+            iovs[i] = (struct iovec){.iov_base = packets[i], .iov_len = create_probe(packets[i], &names[i], index, addr, options, prober)};
+
+            // The probe leaves with the TTL of its hop
+            int ttl = options->first_ttl + index / options->probes_per_ttl;
+            struct cmsghdr *control = &controls[i].header;
+            control->cmsg_level = IPPROTO_IP;
+            control->cmsg_type = IP_TTL;
+            control->cmsg_len = CMSG_LEN(sizeof(ttl));
+            memcpy(CMSG_DATA(control), &ttl, sizeof(ttl));
+
+            messages[i].msg_hdr = (struct msghdr){
+                .msg_name = &names[i],
+                .msg_namelen = sizeof(names[i]),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1,
+                .msg_control = controls[i].buffer,
+                .msg_controllen = sizeof(controls[i].buffer),
+            };
+        }
+
+        // sendmmsg() may stop short of the batch, the rest is sent again
+        for (unsigned long done = 0; done < batch;)
+        {
+            struct timespec sent = get_real_time();
+            for (unsigned long i = done; i < batch; ++i)
+            {
+                probes[first + i].sent = sent;
+            }
+            int count = sendmmsg(prober->send_sock, messages + done, batch - done, 0);
+            if (count < 0 && errno != EINTR)
+            {
+                perror("traceroute: sendmmsg");
+                exit(EXIT_FAILURE);
+            }
+            done += count > 0 ? count : 0;
+        }
+
+        // The timestamps are read batch by batch, so that the error queue holds them all
+        receive_send_times(prober->send_sock, probes, probe_count);
+    }
+}
+
+// Finds the probe the header quoted by an ICMP error is the one of.
+// @param quoted the quoted header, following the quoted IP header
+// @param options the traceroute options, giving the method
+// @param prober the sockets, giving the source port
+// @return the index of the probe, maybe past the probes sent
+static uint32_t match_quoted(const char *quoted, const traceroute_options *options, const traceroute_prober *prober)
+{
+    if (options->method == IPPROTO_UDP)
+    {
+        const struct udphdr *datagram = (const struct udphdr *)quoted;
+        if (datagram->uh_sport != prober->source.sin_port)
+        {
+            return UINT32_MAX;
+        }
+        return ntohs(datagram->uh_dport) - options->port;
+    }
+    if (options->method == IPPROTO_TCP)
+    {
+        const struct tcphdr *segment = (const struct tcphdr *)quoted;
+        if (segment->th_sport != prober->source.sin_port || segment->th_dport != htons(options->port))
+        {
+            return UINT32_MAX;
+        }
+        return ntohl(segment->th_seq) - tcp_sequence_base();
+    }
+    const icmphdr_t *icmp = (const icmphdr_t *)quoted;
+    if (icmp->type != ICMP_ECHO || icmp->un.echo.id != swap_endianess_16(getpid()))
+    {
+        return UINT32_MAX;
+    }
+    return swap_endianess_16(icmp->un.echo.sequence);
+}
+
+// Finds the probe an answer is about. An echo reply carries the sequence of the probe, a SYN-ACK
+// or RST acknowledges its sequence, and a time exceeded or unreachable error quotes the IP
+// header and the first bytes of the probe.
+// @param reply the answer, starting with its IP header
+// @param length the length of the answer
+// @param addr the destination, which the probe was sent to
+// @param options the traceroute options, giving the method
+// @param prober the sockets, giving the source port
+// @param probe_count the number of probes sent
+// @return the index of the probe, or -1 if the answer is about none of ours
+static long match_reply(const char *reply, size_t length, struct addrinfo *addr, const traceroute_options *options, const traceroute_prober *prober, unsigned long probe_count)
+{
+    const struct ip *ip = (const struct ip *)reply;
+    in_addr_t destination = ((struct sockaddr_in *)addr->ai_addr)->sin_addr.s_addr;
+    size_t offset = ip->ip_hl << 2;
+    uint32_t index;
+
+    if (ip->ip_p == IPPROTO_TCP)
+    {
+        // The destination accepts the connection, or refuses it
+        const struct tcphdr *segment = (const struct tcphdr *)(reply + offset);
+        if (length < offset + sizeof(struct tcphdr) || ip->ip_src.s_addr != destination ||
+            segment->th_sport != htons(options->port) || segment->th_dport != prober->source.sin_port ||
+            !((segment->th_flags & TH_RST) || (segment->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)))
+        {
+            return -1;
+        }
+        index = ntohl(segment->th_ack) - 1 - tcp_sequence_base();
+        return index < probe_count ? (long)index : -1;
+    }
+
+    if (length < offset + sizeof(icmphdr_t))
+    {
+        return -1;
+    }
+    const icmphdr_t *icmp = (const icmphdr_t *)(reply + offset);
+    if (icmp->type == ICMP_ECHOREPLY && options->method == IPPROTO_ICMP)
+    {
+        if (icmp->un.echo.id != swap_endianess_16(getpid()))
+        {
+            return -1;
+        }
+        index = swap_endianess_16(icmp->un.echo.sequence);
+        return index < probe_count ? (long)index : -1;
+    }
+    if (icmp->type != ICMP_TIME_EXCEEDED && icmp->type != ICMP_DEST_UNREACH)
+    {
+        return -1;
+    }
+
+    // The quoted header is the one of a probe to the destination
+    offset += sizeof(icmphdr_t);
+    if (length < offset + sizeof(struct ip))
+    {
+        return -1;
+    }
+    const struct ip *quoted = (const struct ip *)(reply + offset);
+    if (quoted->ip_p != options->method || quoted->ip_dst.s_addr != destination)
+    {
+        return -1;
+    }
+    offset += quoted->ip_hl << 2;
+    if (length < offset + QUOTED_LENGTH)
+    {
+        return -1;
+    }
+    index = match_quoted(reply + offset, options, prober);
+    return index < probe_count ? (long)index : -1;
+}
+
+// Receives the answers queued on a socket and settles the probes they are about, with the
+// time the kernel got each answer.
+// @param sock the socket, the ICMP one or the TCP one
+// @param addr the destination
+// @param options the traceroute options
+// @param prober the sockets
+// @param probes the probes
+// @param probe_count the number of probes sent
+// @param last_hop the number of hops to print, lowered when the destination answers
+static void receive_answers(int sock, struct addrinfo *addr, const traceroute_options *options, const traceroute_prober *prober, traceroute_probe *probes, unsigned long probe_count, unsigned long *last_hop)
+{
+    char recvbuf[RECV_BUFSIZE];
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct sockaddr_in r_addr;
+    struct iovec iov = {.iov_base = recvbuf, .iov_len = RECV_BUFSIZE};
+    struct msghdr msg = {.msg_name = &r_addr, .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control};
+    ssize_t received;
+
+    for (;;)
+    {
+        msg.msg_namelen = sizeof(r_addr);
+        msg.msg_controllen = sizeof(control);
+        if ((received = recvmsg(sock, &msg, MSG_DONTWAIT)) < 0)
+        {
+            break;
+        }
+        long index = match_reply(recvbuf, received, addr, options, prober, probe_count);
+        if (index < 0 || probes[index].answered)
+        {
+            continue;
+        }
+
+        traceroute_probe *probe = &probes[index];
+        probe->answered = true;
+        probe->from = r_addr;
+        if (!find_timestamp(&msg, &probe->received))
+        {
+            probe->received = get_real_time();
+        }
+
+        // Anything but a time exceeded comes from the end of the path: an echo reply, a SYN-ACK
+        // or RST of the destination, or an unreachable error, port unreachable for UDP probes
+        if (((struct ip *)recvbuf)->ip_p == IPPROTO_ICMP)
+        {
+            const icmphdr_t *icmp = (const icmphdr_t *)(recvbuf + (((struct ip *)recvbuf)->ip_hl << 2));
+            probe->type = icmp->type;
+            probe->code = icmp->code;
+        }
+        probe->reached = probe->type != ICMP_TIME_EXCEEDED;
+
+        // The first hop reached ends the trace, the probes past it went there too
+        unsigned long hop = index / options->probes_per_ttl;
+        if (probe->reached && hop < *last_hop)
+        {
+            *last_hop = hop + 1;
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        perror("traceroute: recvmsg");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Tells whether every probe of a hop has been answered.
+// @param probes the probes of the hop
+// @param count the number of probes per hop
+// @return true if the hop can be printed before the deadline
+static bool hop_answered(const traceroute_probe *probes, unsigned long count)
+{
+    for (unsigned long i = 0; i < count; ++i)
+    {
+        if (!probes[i].answered)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Prints the mark of an unreachable error, none for the port unreachable of the destination.
+// @param code the ICMP code of the error
+static void print_unreachable(unsigned char code)
+{
+    if (code == ICMP_NET_UNREACH)
+        printf(" !N");
+    else if (code == ICMP_HOST_UNREACH)
+        printf(" !H");
+    else if (code == ICMP_PROT_UNREACH)
+        printf(" !P");
+    else if (code == ICMP_FRAG_NEEDED)
+        printf(" !F");
+    else if (code == ICMP_SR_FAILED)
+        printf(" !S");
+    else if (code == ICMP_PKT_FILTERED)
+        printf(" !X");
+    else if (code != ICMP_PORT_UNREACH)
+        printf(" !<%u>", code);
+}
+
+// Prints the line of a hop, like a sequential trace does, a * standing for a lost probe.
+// @param ttl the TTL of the hop
+// @param probes the probes of the hop
+// @param count the number of probes per hop
+static void print_hop(unsigned long ttl, const traceroute_probe *probes, unsigned long count)
+{
+    const struct sockaddr_in *prev_addr = NULL;
+
+    printf("%2ld", ttl);
+    for (unsigned long i = 0; i < count; ++i)
+    {
+        const traceroute_probe *probe = &probes[i];
+        if (!probe->answered)
+        {
+            printf("  *");
+            continue;
+        }
+
+        // Print the responding host if it differs from the previous one of the hop
+        if (prev_addr == NULL || prev_addr->sin_addr.s_addr != probe->from.sin_addr.s_addr)
+        {
+            char ipbuf[INET6_ADDRSTRLEN];
+            char hostname[NI_MAXHOST];
+            inet_ntop(probe->from.sin_family, &probe->from.sin_addr, ipbuf, sizeof(ipbuf));
+            (getnameinfo((struct sockaddr *)&probe->from, sizeof(probe->from), hostname, NI_MAXHOST, NULL, 0, 0) == 0)
+                ? printf(" %s (%s) ", hostname, ipbuf)
+                : printf(" %s", ipbuf);
+        }
+        printf(" %.3f ms", (double)(probe->received.tv_sec - probe->sent.tv_sec) * 1000 +
+                               (double)(probe->received.tv_nsec - probe->sent.tv_nsec) / 1000000);
+        if (probe->type == ICMP_DEST_UNREACH)
+        {
+            print_unreachable(probe->code);
+        }
+        prev_addr = &probe->from;
+    }
+    printf("\n");
+
+    // Hops show up as they complete, even when the output is a pipe
+    fflush(stdout);
+}
+
+// Traces the route with the probes of all hops sent at once. Answers are matched to their
+// probe whatever the order they come in, and the hops are printed in order as soon as all
+// their probes are answered. The trace takes one round trip to the farthest hop, the hops
+// with lost probes waiting for the deadline of one timeout after the last probe.
+// @param sock the ICMP socket
+// @param addr the destination
+// @param options the traceroute options
+void trace_route_parallel(int sock, struct addrinfo *addr, const traceroute_options *options)
+{
+    unsigned long count = options->probes_per_ttl;
+    unsigned long hop_count = options->max_ttl - options->first_ttl + 1;
+    unsigned long probe_count = hop_count * count;
+    traceroute_probe *probes = calloc(probe_count, sizeof(traceroute_probe));
+    if (probes == NULL)
+    {
+        perror("traceroute: calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    traceroute_prober prober;
+    open_prober(sock, addr, options, &prober);
+    send_all_probes(&prober, addr, options, probes, probe_count);
+    struct timeval deadline = get_current_time();
+    deadline.tv_sec += RECV_TIMEOUT_SEC;
+
+    unsigned long printed = 0;
+    unsigned long last_hop = hop_count;
+    while (printed < last_hop)
+    {
+        // Transmit timestamps the kernel queued late, before the hops they belong to are printed
+        receive_send_times(prober.send_sock, probes, probe_count);
+
+        // Print the hops completed, in order
+        while (printed < last_hop && hop_answered(&probes[printed * count], count))
+        {
+            print_hop(options->first_ttl + printed, &probes[printed * count], count);
+            ++printed;
+        }
+        if (printed == last_hop)
+        {
+            break;
+        }
+
+        // Wait for more answers until the deadline
+        struct timeval now = get_current_time();
+        long remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_usec - now.tv_usec + 999) / 1000;
+        if (remaining_ms <= 0)
+        {
+            break;
+        }
+        struct pollfd poll_fds[2] = {{.fd = sock, .events = POLLIN}, {.fd = prober.tcp_sock, .events = POLLIN}};
+        int ready = poll(poll_fds, prober.tcp_sock >= 0 ? 2 : 1, remaining_ms);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("traceroute: poll");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; ready > 0 && i < 2; ++i)
+        {
+            if (poll_fds[i].revents)
+            {
+                receive_answers(poll_fds[i].fd, addr, options, &prober, probes, probe_count, &last_hop);
+            }
+        }
+    }
+
+    // The hops left lost probes, the deadline is past
+    for (; printed < last_hop; ++printed)
+    {
+        print_hop(options->first_ttl + printed, &probes[printed * count], count);
+    }
+    close_prober(sock, &prober);
+    free(probes);
+}
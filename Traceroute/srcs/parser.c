@@ -25,8 +25,34 @@ void parse_options(int argc, char **argv, traceroute_options *options)
         }
         else if (strings_equal(arg, "-I"))
         {
+            options->method = IPPROTO_ICMP;
             options->packet_type = ICMP_ECHO;
         }
+        else if (strings_equal(arg, "-U"))
+        {
+            options->method = IPPROTO_UDP;
+        }
+        else if (strings_equal(arg, "-T"))
+        {
+            options->method = IPPROTO_TCP;
+        }
+        else if (strings_equal(arg, "-p"))
+        {
+            if (i == argc - 1)
+            {
+                handle_error("missing argument to -p");
+            }
+            i++;
+            options->port = atoull(argv[i]);
+            if (options->port == 0 || options->port > UINT16_MAX)
+            {
+                handle_error("port out of range");
+            }
+        }
+        else if (strings_equal(arg, "-P"))
+        {
+            options->parallel = true;
+        }
         else if (strings_equal(arg, "-f"))
         {
             if (i == argc - 1)
@@ -52,7 +78,7 @@ void parse_options(int argc, char **argv, traceroute_options *options)
             {
                 handle_error("max_ttl should not be 0!");
             }
-            if (options->max_ttl > 255)
+            if (options->max_ttl > MAX_HOPS)
             {
                 handle_error("max hops cannot be more than 255");
             }
@@ -65,7 +91,7 @@ void parse_options(int argc, char **argv, traceroute_options *options)
             }
             i++;
             options->probes_per_ttl = atoull(argv[i]);
-            if (options->probes_per_ttl <= 0 || options->probes_per_ttl > 10)
+            if (options->probes_per_ttl <= 0 || options->probes_per_ttl > MAX_PROBES_PER_TTL)
             {
                 handle_error("use a valid probes number");
             }
@@ -93,4 +119,20 @@ void parse_options(int argc, char **argv, traceroute_options *options)
     {
         handle_error("first hop already out of range");
     }
+
+    // UDP and TCP probes set their TTL per message, they always leave in batches of all hops
+    if (options->method != IPPROTO_ICMP)
+    {
+        options->parallel = true;
+    }
+    if (options->port == 0)
+    {
+        options->port = options->method == IPPROTO_TCP ? DEFAULT_TCP_PORT : DEFAULT_UDP_PORT;
+    }
+
+    // Every UDP probe has its own destination port
+    if (options->method == IPPROTO_UDP && options->port + (options->max_ttl - options->first_ttl + 1) * options->probes_per_ttl > UINT16_MAX + 1)
+    {
+        handle_error("port out of range for that many probes");
+    }
 }
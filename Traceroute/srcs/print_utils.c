@@ -4,11 +4,12 @@
 // @param target_host The target host name or IP address.
 // @param hostip_s The IP address of the target host.
 // @param max_hops The maximum number of hops to reach the target.
-void print_trace_header(const char *target_host, const char *hostip_s, unsigned long max_hops)
+// @param packet_size The size of the probes, IP header included.
+void print_trace_header(const char *target_host, const char *hostip_s, unsigned long max_hops, size_t packet_size)
 {
     printf("traceroute to %s (%s), %ld hops max, %ld byte packets\n",
            target_host, hostip_s,
-           max_hops, PACKET_SIZE + sizeof(struct ip));
+           max_hops, packet_size);
 }
 
 // @brief Print an error message and exit.
@@ -31,7 +32,12 @@ void print_help_text()
     printf("  -4          Use IPv4.\n");
     printf("Bonus Options:\n");
     printf("  -I          Use ICMP ECHO for tracerouting.\n");
+    printf("  -U          Use UDP to incrementing ports for tracerouting, probing all hops at once.\n");
+    printf("  -T          Use TCP SYN for tracerouting, probing all hops at once.\n");
+    printf("  -p port\n");
+    printf("      Set the first UDP port (default 33434) or the TCP port (default 80).\n");
     printf("  -d          Enable socket level debugging.\n");
+    printf("  -P          Send the probes of all hops at once, the trace takes one round trip.\n");
     printf("  -q nqueries\n");
     printf("      Set the number of probes per hop. Default is 3.\n");
     printf("  -f first_ttl\n");
@@ -1,16 +1,17 @@
 #include "traceroute.h"
 
-// Creates an ICMP packet for ping with given sequence number.
+// Creates the ICMP packet sent as probe. Every probe of a sequential trace is the same, so it is built once.
 // @param packet A pointer to the packet structure to be filled.
-// @param sequence_number The sequence number to be used in the packet.
-static void create_packet(icmphdr_t *packet, const traceroute_options *options)
+// @param options The traceroute options, giving the packet type.
+// @param sequence The echo sequence number, telling the probes of a parallel trace apart.
+void create_packet(icmphdr_t *packet, const traceroute_options *options, unsigned short sequence)
 {
     // Set packet header fields
     packet->type = options->packet_type;
     packet->code = 0;
     packet->checksum = 0;
     packet->un.echo.id = swap_endianess_16(getpid());
-    packet->un.echo.sequence = swap_endianess_16(1);
+    packet->un.echo.sequence = swap_endianess_16(sequence);
 
     // Fill packet with data
     for (unsigned long int i = 0; i < PACKET_DATA_SIZE; ++i)
@@ -22,7 +23,7 @@ static void create_packet(icmphdr_t *packet, const traceroute_options *options)
     packet->checksum = calculate_checksum(packet, PACKET_SIZE);
 }
 
-static bool send_probes(int sock, struct addrinfo *addr, const traceroute_options *options)
+static bool send_probes(int sock, traceroute_uring *uring, struct addrinfo *addr, const char *packet, const traceroute_options *options)
 {
     // Initialize a flag to indicate if the destination has been reached
     bool reached = true;
@@ -33,28 +34,37 @@ static bool send_probes(int sock, struct addrinfo *addr, const traceroute_option
     // Loop for the specified number of probes per hop
     for (unsigned long i = 0; i < options->probes_per_ttl; ++i)
     {
-        // Create a buffer to hold the traceroute packet
-        char buf[PACKET_SIZE];
-
-        // Craft a traceroute packet and store it in the buffer
-        create_packet((icmphdr_t *)buf, options);
-
         // Get the current time for measuring round-trip time
         struct timeval start = get_current_time();
 
-        // Send the packet to the destination host
-        if (sendto(sock, buf, PACKET_SIZE, 0, addr->ai_addr, addr->ai_addrlen) < 0)
-        {
-            // Print an error message and exit if the call fails
-            perror("traceroute: sendto");
-            exit(EXIT_FAILURE);
-        }
-
-        // Receive a response from the destination host
         char recvbuf[RECV_BUFSIZE];
         struct sockaddr_in r_addr;
-        unsigned int addr_len = sizeof(r_addr);
-        if (recvfrom(sock, &recvbuf, RECV_BUFSIZE, 0, (struct sockaddr *)&r_addr, &addr_len) < 0)
+        ssize_t received;
+        if (uring)
+        {
+            // Send the packet and receive the response with a single system call
+            struct iovec probe_iov = {.iov_base = (void *)packet, .iov_len = PACKET_SIZE};
+            struct msghdr probe = {.msg_name = addr->ai_addr, .msg_namelen = addr->ai_addrlen, .msg_iov = &probe_iov, .msg_iovlen = 1};
+            struct iovec answer_iov = {.iov_base = recvbuf, .iov_len = RECV_BUFSIZE};
+            struct msghdr answer = {.msg_name = &r_addr, .msg_namelen = sizeof(r_addr), .msg_iov = &answer_iov, .msg_iovlen = 1};
+            struct __kernel_timespec timeout = {.tv_sec = RECV_TIMEOUT_SEC};
+            received = probe_io_uring(uring, sock, &probe, &answer, &timeout);
+        }
+        else
+        {
+            // Send the packet to the destination host
+            if (sendto(sock, packet, PACKET_SIZE, 0, addr->ai_addr, addr->ai_addrlen) < 0)
+            {
+                // Print an error message and exit if the call fails
+                perror("traceroute: sendto");
+                exit(EXIT_FAILURE);
+            }
+
+            // Receive a response from the destination host
+            unsigned int addr_len = sizeof(r_addr);
+            received = recvfrom(sock, &recvbuf, RECV_BUFSIZE, 0, (struct sockaddr *)&r_addr, &addr_len);
+        }
+        if (received < 0)
         {
             // Print a * to indicate that no response was received
             printf("  *");
@@ -106,6 +116,14 @@ void trace_route(int sock, struct addrinfo *addr, const traceroute_options *opti
     // Initialize the number of hops to the first TTL value
     unsigned long hops = options->first_ttl;
 
+    // Craft the traceroute packet once, it is sent unchanged as every probe
+    char packet[PACKET_SIZE];
+    create_packet((icmphdr_t *)packet, options, 1);
+
+    // Probe with io_uring when the kernel supports it, with sendto() and recvfrom() otherwise
+    traceroute_uring uring;
+    traceroute_uring *probe_uring = open_io_uring(&uring) ? &uring : NULL;
+
     // Loop until the maximum TTL value is reached
     while (hops <= options->max_ttl)
     {
@@ -121,7 +139,7 @@ void trace_route(int sock, struct addrinfo *addr, const traceroute_options *opti
         printf("%2ld", hops);
 
         // Send probes
-        bool reached = send_probes(sock, addr, options);
+        bool reached = send_probes(sock, probe_uring, addr, packet, options);
 
         // Print a newline character to the console after all probes for this hop have been sent
         printf("\n");